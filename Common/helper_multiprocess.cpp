@@ -26,6 +26,7 @@
  */
 
 #include "helper_multiprocess.h"
+#include <algorithm>
 #include <cstdlib>
 #include <string>
 
@@ -386,14 +387,123 @@ int ipcSendShareableHandle(ipcHandle *handle,
   return 0;
 }
 
+int ipcSendFds(int socket, const int *fds, size_t count,
+               const struct sockaddr_un *addr) {
+  union {
+    struct cmsghdr cm;
+    char control[CMSG_SPACE(sizeof(int) * IPC_SCM_MAX_FD)];
+  } control_un;
+
+  for (size_t first = 0; first < count; first += IPC_SCM_MAX_FD) {
+    size_t n = std::min<size_t>(IPC_SCM_MAX_FD, count - first);
+
+    struct msghdr msg = {0};
+    struct iovec iov[1];
+    msg.msg_control = control_un.control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+    struct cmsghdr *cmptr = CMSG_FIRSTHDR(&msg);
+    cmptr->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    cmptr->cmsg_level = SOL_SOCKET;
+    cmptr->cmsg_type = SCM_RIGHTS;
+    memmove(CMSG_DATA(cmptr), fds + first, sizeof(int) * n);
+
+    if (addr != NULL) {
+      msg.msg_name = (void *)addr;
+      msg.msg_namelen = sizeof(struct sockaddr_un);
+    }
+
+    iov[0].iov_base = (void *)"";
+    iov[0].iov_len = 1;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+
+    if (sendmsg(socket, &msg, MSG_NOSIGNAL) <= 0) {
+      perror("IPC failure: Sending data over socket failed");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// ipcCloseCmsgFds() closes the file descriptors the kernel installed with msg.
+static void ipcCloseCmsgFds(struct msghdr *msg) {
+  for (struct cmsghdr *cmptr = CMSG_FIRSTHDR(msg); cmptr != NULL;
+       cmptr = CMSG_NXTHDR(msg, cmptr)) {
+    if (cmptr->cmsg_level != SOL_SOCKET || cmptr->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    size_t count = (cmptr->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < count; i++) {
+      int fd;
+      memmove(&fd, CMSG_DATA(cmptr) + i * sizeof(int), sizeof(int));
+      close(fd);
+    }
+  }
+}
+
+int ipcRecvFds(int socket, int *fds, size_t count) {
+  union {
+    struct cmsghdr cm;
+    char control[CMSG_SPACE(sizeof(int) * IPC_SCM_MAX_FD)];
+  } control_un;
+  char dummy_buffer[1];
+
+  for (size_t received = 0; received < count;) {
+    struct msghdr msg = {0};
+    struct iovec iov[1];
+    msg.msg_control = control_un.control;
+    msg.msg_controllen = sizeof(control_un.control);
+    iov[0].iov_base = (void *)dummy_buffer;
+    iov[0].iov_len = sizeof(dummy_buffer);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+
+    bool ok = true;
+    if (recvmsg(socket, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+      perror("IPC failure: Receiving data over socket failed");
+      msg.msg_controllen = 0;
+      ok = false;
+    }
+    struct cmsghdr *cmptr = ok ? CMSG_FIRSTHDR(&msg) : NULL;
+    size_t n = 0;
+    if (ok && (cmptr == NULL || cmptr->cmsg_level != SOL_SOCKET ||
+               cmptr->cmsg_type != SCM_RIGHTS ||
+               (msg.msg_flags & MSG_CTRUNC))) {
+      ok = false;
+    } else if (ok) {
+      n = (cmptr->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      ok = (received + n <= count);
+    }
+    if (!ok) {
+      // Nothing received stays open: neither the descriptors collected so
+      // far, nor those of the bad message.
+      ipcCloseCmsgFds(&msg);
+      for (size_t i = 0; i < received; i++) {
+        close(fds[i]);
+      }
+      return -1;
+    }
+    memmove(fds + received, CMSG_DATA(cmptr), sizeof(int) * n);
+    received += n;
+  }
+  return 0;
+}
+
 int ipcSendShareableHandles(
     ipcHandle *handle, const std::vector<ShareableHandle> &shareableHandles,
     const std::vector<Process> &processes) {
-  // Send all shareable handles to every single process.
-  for (int i = 0; i < shareableHandles.size(); i++) {
-    for (int j = 0; j < processes.size(); j++) {
-      checkIpcErrors(
-          ipcSendShareableHandle(handle, shareableHandles, processes[j], i));
+  // Send all shareable handles to every single process, packing up to
+  // IPC_SCM_MAX_FD of them per message.
+  for (int j = 0; j < processes.size(); j++) {
+    struct sockaddr_un cliaddr;
+    bzero(&cliaddr, sizeof(cliaddr));
+    cliaddr.sun_family = AF_UNIX;
+    sprintf(cliaddr.sun_path, "%u", processes[j]);
+
+    if (ipcSendFds(handle->socket, shareableHandles.data(),
+                   shareableHandles.size(), &cliaddr) < 0) {
+      return -1;
     }
   }
   return 0;
@@ -401,10 +511,8 @@ int ipcSendShareableHandles(
 
 int ipcRecvShareableHandles(ipcHandle *handle,
                             std::vector<ShareableHandle> &shareableHandles) {
-  for (int i = 0; i < shareableHandles.size(); i++) {
-    checkIpcErrors(ipcRecvShareableHandle(handle, &shareableHandles[i]));
-  }
-  return 0;
+  return ipcRecvFds(handle->socket, shareableHandles.data(),
+                    shareableHandles.size());
 }
 
 int ipcCloseShareableHandle(ShareableHandle shHandle) {
@@ -117,4 +117,19 @@ ipcSendShareableHandles(ipcHandle *handle, const std::vector<ShareableHandle>& s
 int
 ipcCloseShareableHandle(ShareableHandle shHandle);
 
+#if defined(__linux__)
+// Maximum number of file descriptors in a single SCM_RIGHTS message (SCM_MAX_FD of the Linux kernel).
+#define IPC_SCM_MAX_FD 253
+
+// ipcSendFds() sends count file descriptors over socket, packing up to IPC_SCM_MAX_FD of them per message,
+// to addr unless it is NULL (connected sockets).
+int
+ipcSendFds(int socket, const int *fds, size_t count, const struct sockaddr_un *addr);
+
+// ipcRecvFds() receives count file descriptors sent by ipcSendFds() into fds.
+// Messages carrying more descriptors than expected are refused, and on failure every descriptor received is closed.
+int
+ipcRecvFds(int socket, int *fds, size_t count);
+#endif
+
 #endif // HELPER_MULTIPROCESS_H
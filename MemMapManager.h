@@ -9,10 +9,16 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <map>
+#include <unordered_set>
 #include <algorithm>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
@@ -20,19 +26,440 @@
 #include <sys/un.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <signal.h>
 #include <atomic>
-#include <semaphore.h>
+#include <memory>
+#include <type_traits>
+#ifdef M3_HOST_STUB
+#include "cuhoststub.h"
+#else
 #include "cuda.h"
+#endif
 #include "cuutils.h"
+#include "Common/helper_multiprocess.h"
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
 
 typedef uintptr_t shareable_handle_t;
 
+// MemoryRegion is a physical chunk of a region.
+// base is the offset of the chunk in the region, and size is the size of the chunk.
+// Sub-allocated regions live at offset in a backing page shared with other regions;
+// pageId identifies that page, and is 0 for chunks owning their physical allocation.
+// generation is the server generation at the creation of the region (see MemMapManager::generation_).
+// device is the GPU holding the chunk, chosen by the placement policy of the request.
+// numaNode is the NUMA node the host backend placed the chunk on, -1 if left to the first touch.
+// sparse is set on the chunks of sparse regions (M3_FLAG_SPARSE): they are pages of the region, sorted by base,
+// and only cover its committed ranges, the first page always included.
+// resizable is set on the chunks of regions created with M3_FLAG_RESIZABLE, the only ones CMD_RESIZE grows.
 typedef struct MemoryRegionSt {
     shareable_handle_t shareableHandle;
     uintptr_t base;
     size_t size;
+    uint64_t pageId;
+    size_t offset;
+    uint64_t generation;
+    CUdevice device;
+    int numaNode;
+    bool sparse;
+    bool resizable;
 } MemoryRegion;
 
+// MemMapHandoverState is the state of a server handed over to its successor (see MemMapManager::HandOver()):
+// plain values in a flat buffer, in the order they were put, and the file descriptors they refer to.
+// A file descriptor is put as its index in fds, once however many times it is referred to,
+// and read back as the descriptor received at that index.
+// Get*() return false past the end of the buffer.
+class MemMapHandoverState {
+    public:
+        MemMapHandoverState() : pos_(0) {}
+
+        template <typename T>
+        void Put(const T &value) {
+            static_assert(std::is_trivially_copyable<T>::value, "handover state holds plain values only");
+            const char *p = (const char *)&value;
+            data.insert(data.end(), p, p + sizeof(T));
+        }
+        void PutString(const std::string &str);
+        void PutFd(shareable_handle_t fd);
+
+        template <typename T>
+        bool Get(T *value) {
+            static_assert(std::is_trivially_copyable<T>::value, "handover state holds plain values only");
+            if (data.size() - pos_ < sizeof(T)) {
+                return false;
+            }
+            memcpy((void *)value, data.data() + pos_, sizeof(T));
+            pos_ += sizeof(T);
+            return true;
+        }
+        bool GetString(std::string *str);
+        bool GetFd(shareable_handle_t *fd);
+
+        std::vector<char> data;
+        std::vector<shareable_handle_t> fds;
+
+    private:
+        size_t pos_;
+        std::unordered_map<shareable_handle_t, uint32_t> fdIndex_;
+};
+
+// MemoryRegionIndex finds the chunks of a region by (memId, size, device) in O(1) expected time.
+// memId strings are interned into a flat open-addressing table, so that a lookup hashes the memId once,
+// probes a few contiguous slots and compares a single string, whatever the number of regions.
+// Regions sharing a memId (different sizes or devices) are kept in a short list per memId.
+// A region is keyed by the size it was created with, even once grown (see Append()).
+// Every region also gets a 64-bit token: the index of its slot in a flat table, and a nonce of the slot.
+// Lookups by token are a bounds check and a compare. A slot gets a new nonce when its region is removed,
+// so that tokens of removed regions never resolve again, even once the slot is reused.
+// MemoryRegionIndex is not thread-safe.
+class MemoryRegionIndex {
+    public:
+        MemoryRegionIndex() : slots_(16), numSlotsUsed_(0), numRegions_(0) {}
+
+        // Find() returns the chunks of the region created of size bytes, or nullptr.
+        // The token of the region is stored to token if not null.
+        const std::vector<MemoryRegion> * Find(const char *memId, size_t size, CUdevice device, uint64_t *token = nullptr) const;
+        // Find() by token also stores the current size of the region to size if not null.
+        const std::vector<MemoryRegion> * Find(uint64_t token, size_t *size = nullptr) const;
+
+        // Insert() registers the chunks of a new region, and stores its token to token if not null.
+        // Returns false, leaving the index untouched, if the region already exists.
+        bool Insert(const char *memId, size_t size, CUdevice device, const std::vector<MemoryRegion> &chunks, uint64_t *token = nullptr);
+
+        // Append() grows the region of token, of size bytes, with chunks. The region is still found by the size it was created with.
+        // Returns false, leaving the index untouched, if token is stale or the region is no longer of size bytes.
+        bool Append(uint64_t token, size_t size, const std::vector<MemoryRegion> &chunks);
+
+        // Commit() adds chunks, sorted by base, to the sparse region of token. Returns false if token is stale.
+        // Chunks at a base already committed are left in chunks, for the caller to recycle; the others are moved out.
+        bool Commit(uint64_t token, std::vector<MemoryRegion> &chunks);
+
+        // AddRef() takes a reference on the region for the client pid. Returns false if the region does not exist.
+        bool AddRef(uint64_t token, pid_t pid);
+
+        // Release() drops a reference of the client pid on the region.
+        // Returns -1 if pid holds no reference on it, 0 if the region is still referenced,
+        // and 1 if that was the last reference: the region is then removed, and its chunks moved to chunks.
+        int Release(uint64_t token, pid_t pid, std::vector<MemoryRegion> *chunks);
+
+        // ReleaseAll() drops every reference of the client pid, e.g. when the process is gone.
+        // Regions left without references are removed, and their chunks appended to removed.
+        void ReleaseAll(pid_t pid, std::vector<std::vector<MemoryRegion>> *removed);
+
+        // FindByShareableHandle() returns the token of the region owning shHandle, or 0.
+        // Backing pages of sub-allocated regions are shared, thus not indexed.
+        uint64_t FindByShareableHandle(shareable_handle_t shHandle) const;
+
+        // MemId() returns the interned string of the region of a valid token.
+        const std::string & MemId(uint64_t token) const { return memIds_[regions_[(uint32_t)token].memIdx].name; }
+
+        size_t Size(void) const { return numRegions_; }
+
+        // Save() puts every slot of the index to state, free ones included,
+        // and Load() rebuilds an empty index from it, so that tokens keep resolving (or not) in a successor server.
+        // Load() returns false if state is malformed.
+        void Save(MemMapHandoverState &state) const;
+        bool Load(MemMapHandoverState &state);
+
+    private:
+        typedef struct RegionSlotSt {
+            uint32_t memIdx;
+            // Nonce of the slot, never 0, part of the token.
+            uint32_t nonce;
+            bool used;
+            CUdevice device;
+            // Current size of the region, and the size it was created with: its key among the regions of its memId.
+            size_t size;
+            size_t createdSize;
+            std::vector<MemoryRegion> chunks;
+            // References per client process.
+            std::unordered_map<pid_t, uint32_t> refs;
+        } RegionSlot;
+
+        typedef struct MemIdEntrySt {
+            std::string name;
+            uint64_t hash;
+            // Slots of the regions of this memId, in regions_.
+            std::vector<uint32_t> regions;
+        } MemIdEntry;
+
+        // A slot of the intern table holds the hash of a memId and its index in memIds_ plus one (0 is empty).
+        typedef struct InternSlotSt {
+            uint64_t hash;
+            uint32_t memIdxPlusOne;
+        } InternSlot;
+
+        static uint64_t Hash(const char *memId, size_t len);
+        static uint64_t Token(uint32_t regionIdx, const RegionSlot &region) { return ((uint64_t)region.nonce << 32) | regionIdx; }
+        // FindSlot() returns the index in regions_ of the region (memId, size, device), or -1, size being its created size.
+        int64_t FindSlot(const char *memId, size_t size, CUdevice device) const;
+        // FindSlot() by token returns the region, or nullptr if token is stale.
+        const RegionSlot * FindSlot(uint64_t token) const;
+        // Remove() frees the slot of a region left without references, moving its chunks to chunks.
+        void Remove(uint32_t regionIdx, std::vector<MemoryRegion> *chunks);
+        // Intern() returns the index of memId in memIds_, or -1 if absent and create is false.
+        int64_t Intern(const char *memId, bool create);
+        int64_t Lookup(const char *memId, size_t len, uint64_t hash) const;
+        void Grow(void);
+
+        std::vector<InternSlot> slots_;
+        size_t numSlotsUsed_;
+        std::vector<MemIdEntry> memIds_;
+        // Region slots, indexed by the low 32 bits of tokens, and the free ones.
+        std::vector<RegionSlot> regions_;
+        std::vector<uint32_t> freeRegions_;
+        size_t numRegions_;
+        std::unordered_map<shareable_handle_t, uint64_t> shHandleToToken_;
+};
+
+// MemMapPool caches exported physical chunks, so that the common allocate path never calls cuMemCreate().
+// Chunks are pooled by (device, size): sizes are already rounded to the device granularity,
+// so every rounded size is its own size class.
+// A recycled chunk keeps the content of its previous region.
+// MemMapPool is thread-safe.
+class MemMapPool {
+    public:
+        MemMapPool() : hits(0), misses(0), idleBytes_(0), maxIdleBytes_(0) {}
+        ~MemMapPool();
+
+        // Get() pops an idle chunk of (device, size). Returns false on a pool miss.
+        bool Get(CUdevice device, size_t size, shareable_handle_t *shHandle);
+
+        // Put() returns a chunk to the pool.
+        // Returns false if the pool already holds maxIdleBytes: the caller still owns the chunk then.
+        bool Put(CUdevice device, size_t size, shareable_handle_t shHandle);
+
+        void SetMaxIdleBytes(size_t maxIdleBytes);
+        size_t IdleBytes(void);
+        size_t IdleChunks(void);
+
+        std::atomic<uint64_t> hits, misses;
+
+    private:
+        std::mutex mtx_;
+        std::map<std::pair<CUdevice, size_t>, std::vector<shareable_handle_t>> idle_;
+        size_t idleBytes_, maxIdleBytes_;
+};
+
+// MemMapSlot is a slot of a backing page, handed out by MemMapSlabAllocator.
+typedef struct MemMapSlotSt {
+    uint64_t pageId;
+    shareable_handle_t shareableHandle;
+    size_t offset;
+    size_t size;
+} MemMapSlot;
+
+// Smallest slot of the sub-allocator.
+#define M3_SLAB_MIN_SLOT 256
+
+// MemMapSlabAllocator packs small regions into shared backing pages.
+// Every page is cut into slots of a single power-of-two size class,
+// so that slots are naturally aligned and freeing a slot is O(1).
+// MemMapSlabAllocator owns the file descriptors of its pages.
+// MemMapSlabAllocator is thread-safe.
+class MemMapSlabAllocator {
+    public:
+        MemMapSlabAllocator() : nextPageId_(1), numPages_(0) {}
+        ~MemMapSlabAllocator();
+
+        // SizeClass() returns the slot size serving size bytes.
+        static size_t SizeClass(size_t size);
+
+        // Allocate() takes a free slot of slotSize bytes on device.
+        // Returns false if every page of that class is full: the caller adds one with AddPage() and retries.
+        bool Allocate(CUdevice device, size_t slotSize, MemMapSlot *slot);
+
+        // AddPage() cuts a new page of pageSize bytes into slots of slotSize bytes.
+        void AddPage(CUdevice device, size_t slotSize, shareable_handle_t shHandle, size_t pageSize);
+
+        // Free() returns a slot taken by Allocate(). Returns true if that was the last slot in use on its page:
+        // the page is then dropped, and its handle and size are stored to page for the caller to recycle.
+        bool Free(CUdevice device, const MemMapSlot &slot, MemMapSlot *page);
+
+        size_t NumPages(void);
+
+        // SetFirstPageId() must be called before the first AddPage().
+        void SetFirstPageId(uint64_t pageId) { nextPageId_ = pageId; }
+
+        // Save() puts every page to state, and Load() adds them back, with their ids and free slots.
+        // Load() returns false if state is malformed.
+        void Save(MemMapHandoverState &state);
+        bool Load(MemMapHandoverState &state);
+
+    private:
+        typedef struct PageSt {
+            uint64_t pageId;
+            shareable_handle_t shareableHandle;
+            size_t slotSize;
+            size_t pageSize;
+            std::vector<uint32_t> freeSlots;
+        } Page;
+
+        typedef struct SizeClassSt {
+            std::vector<std::unique_ptr<Page>> pages;
+            // Pages with at least one free slot.
+            std::vector<Page *> partial;
+        } SizeClassPages;
+
+        std::mutex mtx_;
+        std::map<std::pair<CUdevice, size_t>, SizeClassPages> classes_;
+        std::unordered_map<uint64_t, Page *> pagesById_;
+        uint64_t nextPageId_;
+        size_t numPages_;
+};
+
+// Physical memory backends.
+// A backend creates the physical memory of regions on the server, exported as file descriptors,
+// and maps those descriptors into address ranges it reserved on the client side.
+// M3_BACKEND_CUDA allocates device memory with the VMM API (cuMemCreate(), cuMemMap()).
+// M3_BACKEND_HOST allocates host memory with memfd_create(), mapped with mmap(): CPU processes share it
+// without any copy, and the server runs on machines without GPU.
+// The backend is chosen by the server (MemMapServerOptions::backend), and every response carries it.
+enum MemMapBackendKind {
+    M3_BACKEND_CUDA,
+    M3_BACKEND_HOST,
+    M3_BACKEND_COUNT
+};
+
+// Huge page size of the host backend: its granularity, so that regions can be backed by huge pages.
+#define M3_HOST_PAGE_SIZE ((size_t)2 << 20)
+// memfd_create() flags, which older C libraries do not define.
+#define M3_MFD_CLOEXEC 0x0001U
+#define M3_MFD_HUGETLB 0x0004U
+// NUMA memory policies (mbind(), set_mempolicy(), get_mempolicy()), without depending on libnuma.
+#define M3_MPOL_DEFAULT 0
+#define M3_MPOL_PREFERRED 1
+#define M3_MPOL_F_NODE 0x1
+#define M3_MPOL_F_ADDR 0x2
+// Highest NUMA node id + 1 that M3 places memory on and reports.
+#define M3_MAX_NUMA_NODES 16
+
+// MemMapBackend is the interface of a backend. Backends have no state of their own, and are thread-safe.
+class MemMapBackend {
+    public:
+        virtual ~MemMapBackend() {}
+
+        // Get() returns the backend of kind.
+        static const MemMapBackend &Get(MemMapBackendKind kind);
+
+        virtual const char *Name(void) const = 0;
+
+        // Server side.
+        // GetGranularity() returns the minimum or recommended size of the physical allocations on device,
+        // GetTotalMem() the size of the memory they are taken from.
+        virtual CUresult GetGranularity(CUdevice device, bool recommended, size_t *granularity) const = 0;
+        virtual CUresult GetTotalMem(CUdevice device, size_t *bytes) const = 0;
+        // Create() creates size bytes of physical memory for device, exported as *shHandle, owned by the caller.
+        // Host memory is placed on numaNode, unless it is -1.
+        virtual CUresult Create(CUdevice device, int numaNode, size_t size, shareable_handle_t *shHandle) const = 0;
+
+        // Client side.
+        // Reserve() and Free() reserve and release address ranges. Map() maps shHandle at ptr, which must be reserved,
+        // SetAccess() makes the range accessible from device, or from every device if allDevices,
+        // and Unmap() takes the mapping down, keeping the range reserved.
+        virtual CUresult Reserve(CUdeviceptr *ptr, size_t size, size_t alignment) const = 0;
+        virtual CUresult Free(CUdeviceptr ptr, size_t size) const = 0;
+        virtual CUresult Map(CUdeviceptr ptr, size_t size, shareable_handle_t shHandle) const = 0;
+        virtual CUresult SetAccess(CUdeviceptr ptr, size_t size, CUdevice device, bool allDevices) const = 0;
+        virtual CUresult Unmap(CUdeviceptr ptr, size_t size) const = 0;
+};
+
+class MemMapCudaBackend : public MemMapBackend {
+    public:
+        const char *Name(void) const { return "cuda"; }
+        CUresult GetGranularity(CUdevice device, bool recommended, size_t *granularity) const;
+        CUresult GetTotalMem(CUdevice device, size_t *bytes) const;
+        CUresult Create(CUdevice device, int numaNode, size_t size, shareable_handle_t *shHandle) const;
+        CUresult Reserve(CUdeviceptr *ptr, size_t size, size_t alignment) const;
+        CUresult Free(CUdeviceptr ptr, size_t size) const;
+        CUresult Map(CUdeviceptr ptr, size_t size, shareable_handle_t shHandle) const;
+        CUresult SetAccess(CUdeviceptr ptr, size_t size, CUdevice device, bool allDevices) const;
+        CUresult Unmap(CUdeviceptr ptr, size_t size) const;
+};
+
+// MemMapHostBackend backs every chunk with a memfd of hugetlbfs when huge pages are available,
+// and with a regular memfd otherwise (which transparent huge pages may still back, see Map()).
+// Once hugetlbfs runs out of pages, it stops trying.
+// Chunks placed on a NUMA node prefer that node (MPOL_PREFERRED): hugetlbfs pages are populated under that policy,
+// and regular memfds keep it as the shared policy of the file, which applies to pages faulted by any process.
+class MemMapHostBackend : public MemMapBackend {
+    public:
+        MemMapHostBackend() : hugePages_(true) {}
+
+        const char *Name(void) const { return "host"; }
+        CUresult GetGranularity(CUdevice device, bool recommended, size_t *granularity) const;
+        CUresult GetTotalMem(CUdevice device, size_t *bytes) const;
+        CUresult Create(CUdevice device, int numaNode, size_t size, shareable_handle_t *shHandle) const;
+        CUresult Reserve(CUdeviceptr *ptr, size_t size, size_t alignment) const;
+        CUresult Free(CUdeviceptr ptr, size_t size) const;
+        CUresult Map(CUdeviceptr ptr, size_t size, shareable_handle_t shHandle) const;
+        CUresult SetAccess(CUdeviceptr ptr, size_t size, CUdevice device, bool allDevices) const;
+        CUresult Unmap(CUdeviceptr ptr, size_t size) const;
+
+    private:
+        mutable std::atomic<bool> hugePages_;
+};
+
+// Default size of the virtual address ranges reserved by the client library.
+#define M3_DEFAULT_ARENA_SIZE ((size_t)64 << 30)
+
+// MemMapVAArena hands out the virtual address ranges regions are mapped into, on the client side,
+// so that an import does not call cuMemAddressReserve().
+// Address space is reserved from the backend arenaSize bytes at a time and carved with a bump pointer.
+// Freed ranges are kept in free lists by size, and reused first.
+// An arenaSize of 0 reserves (and frees) every range from the backend directly.
+// MemMapVAArena is not thread-safe.
+class MemMapVAArena {
+    public:
+        MemMapVAArena(MemMapBackendKind backend)
+            : backend_(backend), arenaSize_(M3_DEFAULT_ARENA_SIZE), next_(0), end_(0), numReservations_(0) {}
+
+        CUdeviceptr Allocate(size_t size, size_t alignment);
+        void Free(CUdeviceptr ptr, size_t size);
+
+        // Reset() forgets every range without freeing them, e.g. in a forked child.
+        void Reset(void);
+
+        void SetArenaSize(size_t arenaSize) { arenaSize_ = arenaSize; }
+        size_t NumReservations(void) const { return numReservations_; }
+
+    private:
+        MemMapBackendKind backend_;
+        size_t arenaSize_;
+        CUdeviceptr next_, end_;
+        std::unordered_map<size_t, std::vector<CUdeviceptr>> freeLists_;
+        size_t numReservations_;
+};
+
+// MemMapClientMapping is a region mapped by the client library.
+// A mapping is shared by every RequestAllocate() of the same import, and unmapped with its last reference.
+typedef struct MemMapClientMappingSt {
+    // Bytes mapped, and bytes of address space reserved for the region to grow into.
+    size_t size;
+    size_t reserved;
+    MemMapBackendKind backend;
+    // Sparse regions: page size, and the pages mapped by this process. Empty for other regions.
+    size_t commitSize;
+    std::vector<bool> committed;
+    // Backing page of a sub-allocated region, 0 otherwise.
+    uint64_t backingId;
+    uint32_t refs;
+    // Key of the mapping in the import cache, empty if not cached.
+    std::string importKey;
+    // The region on the server, and the number of references this process holds on it there.
+    std::string memId;
+    uint64_t token;
+    uint32_t serverRefs;
+} MemMapClientMapping;
+
 
 enum M3InternalErrorType {
     M3INTERNAL_INVALIDCODE,
@@ -40,6 +467,10 @@ enum M3InternalErrorType {
     M3INTERNAL_OK,
     M3INTERNAL_DUPLICATE_REGISTER,
     M3INTERNAL_ENTRY_NOT_FOUND,
+    // The memory backend could not create the memory.
+    M3INTERNAL_ALLOC_FAILED,
+    // The request asked for something the server cannot have, e.g. a NUMA node out of range.
+    M3INTERNAL_INVALID_ARGUMENT,
 };
 
 class ProcessInfo {
@@ -53,6 +484,9 @@ class ProcessInfo {
 
         ProcessInfo(int _device_ordinal) {
             pid = getpid();
+            device_ordinal = _device_ordinal;
+            device = (CUdevice)_device_ordinal;
+            ctx = nullptr;
         }
 
         ProcessInfo(const ProcessInfo& pInfo) {
@@ -106,7 +540,17 @@ enum MemMapCmd {
     CMD_ALLOCATE,
     CMD_DEALLOCATE,
     CMD_IMPORT,
-    CMD_GETROUNDEDALLOCATIONSIZE
+    CMD_GETROUNDEDALLOCATIONSIZE,
+    CMD_OPENRING,
+    CMD_ALLOCATE_BATCH,
+    CMD_GETSTATS,
+    CMD_VALIDATE,
+    CMD_STAT,
+    CMD_HANDOVER,
+    CMD_RESIZE,
+    CMD_COMMIT,
+    // Number of commands, not a command.
+    CMD_COUNT
 };
 
 enum MemMapStatusCode {
@@ -115,11 +559,76 @@ enum MemMapStatusCode {
     STATUSCODE_NYI,
     STATUSCODE_SOCKERR,
     STATUSCODE_DUPLICATE_REGISTER,
-    STATUSCODE_UNKNOWN_ERR
+    STATUSCODE_UNKNOWN_ERR,
+    STATUSCODE_STALE,
+    // The server is out of memory for the request.
+    STATUSCODE_ALLOC_FAILED,
+    // Number of status codes, not a status code.
+    STATUSCODE_COUNT
 };
 
 #define MAX_MEMID_LEN 256
 
+// Placement policies, choosing the device of new regions.
+// M3_PLACEMENT_DEFAULT stands for the policy of the server (MemMapServerOptions::placement).
+// M3_PLACEMENT_LOCAL places regions on the device of the requester,
+// M3_PLACEMENT_LEAST_USED on the device with the most free memory, M3_PLACEMENT_ROUND_ROBIN on every device in turn,
+// and M3_PLACEMENT_EXPLICIT on the device set with M3_FLAG_DEVICE().
+enum MemMapPlacement {
+    M3_PLACEMENT_DEFAULT,
+    M3_PLACEMENT_LOCAL,
+    M3_PLACEMENT_LEAST_USED,
+    M3_PLACEMENT_ROUND_ROBIN,
+    M3_PLACEMENT_EXPLICIT
+};
+
+// Request flags. The bits of flags are laid out once for all, so that the same bits always mean the same on the wire:
+//   bit 0       M3_FLAG_RECOMMENDED_GRANULARITY
+//   bits 1-5    NUMA node + 1 (M3_FLAG_NUMA_NODE()), 0 for none: nodes 0 to 30, of which M3 serves M3_MAX_NUMA_NODES
+//   bit 6       M3_FLAG_SPARSE
+//   bit 7       M3_FLAG_RESIZABLE
+//   bits 8-15   placement policy (M3_FLAG_PLACEMENT())
+//   bits 16-23  explicit device (M3_FLAG_DEVICE())
+//   bits 24-31  stripes (M3_FLAG_STRIPES())
+// M3_FLAG_RECOMMENDED_GRANULARITY rounds allocations up to the recommended granularity of the device
+// rather than the minimum one.
+#define M3_FLAG_RECOMMENDED_GRANULARITY 0x1
+// M3_FLAG_NUMA_NODE() places the host memory of new regions on a NUMA node (M3_BACKEND_HOST),
+// e.g. the node of the consumer (MemMapManager::CurrentNumaNode()).
+// Otherwise, host regions go to the node of their device (its PCI locality), or to the node of the first process
+// touching them if it is unknown. Such regions are neither pooled nor sub-allocated.
+#define M3_FLAG_NUMA_NODE_MASK 0x1f
+#define M3_FLAG_NUMA_NODE(node) ((uint32_t)((node) + 1) << 1)
+#define M3_FLAG_NUMA_NODE_OF(flags) ((int)(((flags) >> 1) & M3_FLAG_NUMA_NODE_MASK) - 1)
+static_assert(M3_MAX_NUMA_NODES < M3_FLAG_NUMA_NODE_MASK, "NUMA nodes must fit in their flag bits");
+// M3_FLAG_SPARSE allocates a sparse region: its num_bytes are only reserved, and its pages get physical memory
+// when committed with CMD_COMMIT, the first one excepted. Sparse regions are neither sub-allocated, striped nor resized.
+#define M3_FLAG_SPARSE 0x40
+// M3_FLAG_RESIZABLE marks regions which may grow with CMD_RESIZE: they are never sub-allocated.
+#define M3_FLAG_RESIZABLE 0x80
+// M3_FLAG_PLACEMENT() selects the placement policy of new regions, M3_FLAG_DEVICE() an explicit device.
+// Placement only applies when a region is created: existing regions are found wherever they are.
+#define M3_FLAG_PLACEMENT(policy) ((uint32_t)(policy) << 8)
+#define M3_FLAG_PLACEMENT_OF(flags) ((MemMapPlacement)(((flags) >> 8) & 0xff))
+#define M3_FLAG_DEVICE(device) (M3_FLAG_PLACEMENT(M3_PLACEMENT_EXPLICIT) | ((uint32_t)(device) << 16))
+#define M3_FLAG_DEVICE_OF(flags) ((CUdevice)(((flags) >> 16) & 0xff))
+// M3_FLAG_STRIPES() splits new regions into n chunks of equal size, placed on consecutive devices
+// starting from the device chosen by the placement policy, and mapped contiguously by the client.
+// The size of a striped region is rounded to n times the granularity.
+#define M3_FLAG_STRIPES(n) ((uint32_t)(n) << 24)
+#define M3_FLAG_STRIPES_OF(flags) ((uint32_t)(flags) >> 24)
+
+// Priority classes of requests queued to worker threads (CMD_ALLOCATE, CMD_ALLOCATE_BATCH, CMD_DEALLOCATE).
+// Each worker keeps a queue per class, and serves them by weighted fair queuing
+// (MemMapServerOptions::priorityWeights): bulk allocations do not hold latency-sensitive requests back.
+// Inline commands (CMD_ECHO, CMD_GETROUNDEDALLOCATIONSIZE, CMD_STAT, ...) are never queued.
+enum MemMapPriority {
+    M3_PRIORITY_NORMAL,
+    M3_PRIORITY_HIGH,
+    M3_PRIORITY_BULK,
+    M3_PRIORITY_COUNT
+};
+
 class MemMapRequest {
     public:
         MemMapRequest() : MemMapRequest(CMD_INVALID) {}
@@ -127,6 +636,13 @@ class MemMapRequest {
             cmd = _cmd;
             size = 0;
             alignment = 0;
+            flags = 0;
+            generation = 0;
+            token = 0;
+            priority = M3_PRIORITY_NORMAL;
+            offset = 0;
+            limit = 0;
+            memId[0] = '\0';
         }
 
         MemMapCmd cmd;
@@ -134,6 +650,18 @@ class MemMapRequest {
         shareable_handle_t shareableHandle;
         char memId[MAX_MEMID_LEN];
         size_t size, alignment;
+        uint32_t flags;
+        // CMD_VALIDATE: generation of the region to validate.
+        uint64_t generation;
+        // Token of the region (see MemMapResponse::token), if known.
+        // CMD_ALLOCATE, CMD_DEALLOCATE, CMD_VALIDATE and CMD_STAT then ignore memId and size.
+        uint64_t token;
+        MemMapPriority priority;
+        // CMD_RESIZE: bytes of the region the client already maps.
+        // CMD_COMMIT: start of the range to commit (of size bytes), or to list only if size is 0.
+        size_t offset;
+        // CMD_RESIZE: size the region may not grow beyond, the address space the client reserved for it; 0 for none.
+        size_t limit;
         ProcessInfo importSrc;
 };
 
@@ -145,6 +673,17 @@ class MemMapResponse {
             shareableHandle = (shareable_handle_t)nullptr;
             roundedSize = 0;
             d_ptr = (CUdeviceptr)nullptr;
+            numShareableHandles = 0;
+            offset = 0;
+            backingId = 0;
+            backingSize = 0;
+            generation = 0;
+            serverGeneration = 0;
+            device = 0;
+            token = 0;
+            backend = M3_BACKEND_CUDA;
+            commitSize = 0;
+            memId[0] = '\0';
         }
 
         MemMapStatusCode status;
@@ -154,6 +693,22 @@ class MemMapResponse {
         size_t roundedSize;
         CUdeviceptr d_ptr;
         uint32_t numShareableHandles;
+        // Sub-allocated regions: the region lives at offset in the backing page backingId of backingSize bytes.
+        // backingId is 0 if the region owns its physical memory.
+        size_t offset;
+        uint64_t backingId;
+        size_t backingSize;
+        // generation of the region, and current generation of the server.
+        uint64_t generation;
+        uint64_t serverGeneration;
+        // Device holding the region.
+        CUdevice device;
+        // Token of the region: a stable 64-bit name of the region on this server, until it is removed.
+        uint64_t token;
+        // Backend of the physical memory of the region, to map it with.
+        MemMapBackendKind backend;
+        // Page size of a sparse region, whose pages are committed one by one; 0 for other regions.
+        size_t commitSize;
 
         std::string DebugString() {
             char buf[1024];
@@ -170,6 +725,485 @@ class MemMapResponse {
         }
 };
 
+// MemMapImport is an entry of the import cache of the client library.
+typedef struct MemMapImportSt {
+    // Response of the import, returned again by cache hits.
+    MemMapResponse res;
+    // Server generation when the import was last known to be valid.
+    uint64_t serverGeneration;
+} MemMapImport;
+
+// MemMapServerOptions configures the M3 server.
+// Options must be set with MemMapManager::SetServerOptions() before the first call of Instance().
+class MemMapServerOptions {
+    public:
+        MemMapServerOptions() {
+            numWorkersPerDevice = 2;
+            poolEnabled = true;
+            poolPrefillChunks = 16;
+            poolRefillChunks = 4;
+            poolMaxIdleBytes = (size_t)1 << 30;
+            subAllocMaxSize = 64 * 1024;
+            reclaimDelayMs = 10;
+            reclaimBatch = 64;
+            placement = M3_PLACEMENT_LOCAL;
+            maxBurst = 32;
+            busyPollCpu = -1;
+            priorityWeights[M3_PRIORITY_NORMAL] = 4;
+            priorityWeights[M3_PRIORITY_HIGH] = 16;
+            priorityWeights[M3_PRIORITY_BULK] = 1;
+            handover = false;
+            acceptHandover = false;
+            backend = M3_BACKEND_CUDA;
+        }
+
+        // Number of worker threads per GPU device serving CUDA-heavy commands (CMD_ALLOCATE, CMD_DEALLOCATE).
+        // Cheap commands (CMD_ECHO, CMD_GETROUNDEDALLOCATIONSIZE, ...) are served inline by the event loop.
+        int numWorkersPerDevice;
+
+        // Physical memory pool (see MemMapPool).
+        // poolPrefillChunks chunks of the minimum granularity are created per device at startup.
+        // On a pool miss, poolRefillChunks - 1 more chunks of the missed size are created once the reply is sent,
+        // as long as the idle chunks of the pool stay under poolMaxIdleBytes.
+        bool poolEnabled;
+        int poolPrefillChunks;
+        int poolRefillChunks;
+        size_t poolMaxIdleBytes;
+
+        // CMD_ALLOCATE requests up to subAllocMaxSize bytes are packed into shared backing pages
+        // (see MemMapSlabAllocator). 0 disables sub-allocation.
+        size_t subAllocMaxSize;
+
+        // Regions released by their last client are reclaimed by a background thread,
+        // in batches of up to reclaimBatch regions, reclaimDelayMs after the first of them was released.
+        int reclaimDelayMs;
+        int reclaimBatch;
+
+        // Placement policy of requests which do not set one.
+        MemMapPlacement placement;
+
+        // The server loop receives up to maxBurst queued requests of a ready connection per wakeup, in one system call (recvmmsg()),
+        // and sends the replies of the inline commands among them together (sendmmsg()).
+        // Identical lookups of a burst are served once.
+        int maxBurst;
+
+        // With busyPollCpu >= 0, the server loop is pinned to that CPU and polls its sockets without blocking,
+        // trading a busy core for the wakeup latency of every request. Other server threads stay off that CPU.
+        // -1 blocks in epoll_wait() as usual.
+        int busyPollCpu;
+
+        // Share of the worker time of each priority class while several classes have requests queued.
+        int priorityWeights[M3_PRIORITY_COUNT];
+
+        // With handover, the new server takes over the server running on the endpoint instead of starting afresh
+        // (see MemMapManager::HandOver()). Without a running server, it starts afresh.
+        bool handover;
+        // With acceptHandover, the server hands itself over to a successor asking for it (CMD_HANDOVER),
+        // as long as the successor runs as the same user. Other servers refuse CMD_HANDOVER.
+        bool acceptHandover;
+
+        // Backend of the physical memory of every region (see MemMapBackend).
+        MemMapBackendKind backend;
+};
+
+// Hot handover.
+// A server started with MemMapServerOptions::handover sends CMD_HANDOVER (req.size = M3_HANDOVER_VERSION,
+// req.flags = its MemMapServerOptions::backend, req.alignment = its number of devices) to the server running on the endpoint.
+// The running server finishes queued requests and reclamation, then replies
+// with the size of its state (res.roundedSize) and its number of file descriptors (res.numShareableHandles),
+// followed by the state (MemMapHandoverState) in messages of up to M3_HANDOVER_CHUNK bytes,
+// and the file descriptors packed by ipcSendShareableHandles(): the listening socket, client connections,
+// regions and backing pages. Once it has loaded the state, the successor confirms with another CMD_HANDOVER
+// (req.size = the size of the state), and the running server acknowledges it and exits, leaving the endpoint to its successor.
+// Without a confirmation within M3_HANDOVER_TIMEOUT_MS, the running server drops the successor and keeps serving.
+// Clients keep their connections, mappings and tokens; rings opened with CMD_OPENRING are closed.
+// A server refuses CMD_HANDOVER of another version, backend or number of devices with STATUSCODE_INVALID, and keeps running.
+// So does a server without MemMapServerOptions::acceptHandover, or for a peer of another user (SO_PEERCRED) than its own.
+#define M3_HANDOVER_VERSION 7
+#define M3_HANDOVER_CHUNK (64 * 1024)
+#define M3_HANDOVER_TIMEOUT_MS 10000
+
+// Maximum number of devices reported by CMD_GETSTATS.
+#define M3_MAX_DEVICES 16
+
+// MemMapStats is the payload of the CMD_GETSTATS response.
+typedef struct MemMapStatsSt {
+    uint64_t numRegions;
+    uint64_t poolHits;
+    uint64_t poolMisses;
+    uint64_t poolIdleChunks;
+    uint64_t poolIdleBytes;
+    uint64_t slabPages;
+    uint64_t reclaimPendingBytes;
+    uint64_t reclaimedBytes;
+    uint64_t liveClients;
+    uint64_t reapedClients;
+    // rxBursts counts the system calls receiving requests, rxMessages the requests received.
+    uint64_t rxBursts;
+    // Messages and bytes exchanged through client sockets, shareable handles left out.
+    uint64_t rxMessages;
+    uint64_t rxBytes;
+    uint64_t txMessages;
+    uint64_t txBytes;
+    // Worker queues, per priority class: requests queued now, requests served so far,
+    // and the total and longest time they waited in the queue, in nanoseconds.
+    uint64_t queueDepth[M3_PRIORITY_COUNT];
+    uint64_t queueServed[M3_PRIORITY_COUNT];
+    uint64_t queueWaitNs[M3_PRIORITY_COUNT];
+    uint64_t queueMaxWaitNs[M3_PRIORITY_COUNT];
+    // Bytes of physical memory held by regions and backing pages, per device.
+    uint64_t numDevices;
+    uint64_t deviceUsedBytes[M3_MAX_DEVICES];
+    // NUMA node of each device (PCI locality), -1 if unknown.
+    int64_t deviceNumaNode[M3_MAX_DEVICES];
+    // Occupancy of the NUMA nodes with an id below numNodes: bytes of host memory placed there by M3,
+    // and the total and free memory of the node according to the kernel.
+    uint64_t numNodes;
+    uint64_t nodeUsedBytes[M3_MAX_NUMA_NODES];
+    uint64_t nodeTotalBytes[M3_MAX_NUMA_NODES];
+    uint64_t nodeFreeBytes[M3_MAX_NUMA_NODES];
+} MemMapStats;
+
+// Batched allocation.
+// A CMD_ALLOCATE_BATCH request carries req.size MemMapBatchEntry right after the MemMapRequest header,
+// in the same message. The response carries as many MemMapBatchResult after the MemMapResponse header,
+// followed by res.numShareableHandles shareable handles, packed into as few messages as possible.
+#define M3_MAX_BATCH 256
+
+typedef struct MemMapBatchEntrySt {
+    char memId[MAX_MEMID_LEN];
+    size_t size;
+    size_t alignment;
+} MemMapBatchEntry;
+
+typedef struct MemMapBatchResultSt {
+    MemMapStatusCode status;
+    size_t roundedSize;
+    // Number of shareable handles of this entry, in order, among the handles of the batch.
+    // Zero for entries naming the same region as an earlier entry, duplicateOf.
+    uint32_t numShareableHandles;
+    uint32_t duplicateOf;
+    CUdevice device;
+    uint64_t token;
+    // Sub-allocated regions, as in MemMapResponse. The handle of the backing page is only sent once per connection.
+    size_t offset;
+    uint64_t backingId;
+    size_t backingSize;
+} MemMapBatchResult;
+
+// Wire format.
+// Requests and responses go through the socket encoded, so that a message is only as long as what it carries.
+// A message starts with a fixed header:
+//   byte 0     M3_WIRE_VERSION
+//   byte 1     command of a request, or status of a response
+//   bytes 2-3  little-endian mask of the fields which follow, in the order of the mask bits
+// Integer fields are LEB128 varints, and memId is a varint length followed by as many bytes, without terminator.
+// Fields left at their default value (0, or an empty memId) are not sent.
+// Process-local fields (contexts, pointers, shareable handles) are never sent.
+// The payload of the message, if any, follows: encoded MemMapBatchEntry / MemMapBatchResult
+// (every field, in declaration order), the pages of a CMD_COMMIT response, or a raw MemMapStats.
+// Messages of another version, with unknown fields or cut short are rejected.
+#define M3_WIRE_VERSION 10
+#define M3_WIRE_HEADER_SIZE 4
+#define M3_WIRE_MAX_VARINT 10
+// Upper bounds of an encoded MemMapRequest / MemMapResponse, MemMapBatchEntry and MemMapBatchResult.
+#define M3_WIRE_MAX_SIZE (M3_WIRE_HEADER_SIZE + 16 * M3_WIRE_MAX_VARINT + MAX_MEMID_LEN)
+#define M3_WIRE_MAX_BATCH_ENTRY_SIZE (3 * M3_WIRE_MAX_VARINT + MAX_MEMID_LEN)
+#define M3_WIRE_MAX_BATCH_RESULT_SIZE (9 * M3_WIRE_MAX_VARINT)
+
+// Pages listed by a CMD_COMMIT response at most: the client asks again from res.offset for the others.
+#define M3_MAX_COMMIT_PAGES 256
+
+// Largest message exchanged with the server.
+#define M3_MAX_MESSAGE_SIZE (M3_WIRE_MAX_SIZE + M3_MAX_BATCH * M3_WIRE_MAX_BATCH_ENTRY_SIZE)
+
+// MemMapWire encodes and decodes messages.
+// Encode*() write at most the matching M3_WIRE_MAX_* bytes to buf, and return the encoded size.
+// Decode*() return the number of bytes consumed from buf, or 0 if the message is malformed.
+// Decoding reads straight from buf: only the bytes of memId are copied out.
+class MemMapWire {
+    public:
+        static size_t EncodeRequest(const MemMapRequest &req, char *buf);
+        static size_t DecodeRequest(const char *buf, size_t len, MemMapRequest *req);
+        static size_t EncodeResponse(const MemMapResponse &res, char *buf);
+        static size_t DecodeResponse(const char *buf, size_t len, MemMapResponse *res);
+        static size_t EncodeBatchEntry(const MemMapBatchEntry &entry, char *buf);
+        static size_t DecodeBatchEntry(const char *buf, size_t len, MemMapBatchEntry *entry);
+        static size_t EncodeBatchResult(const MemMapBatchResult &result, char *buf);
+        static size_t DecodeBatchResult(const char *buf, size_t len, MemMapBatchResult *result);
+        // The payload of a CMD_COMMIT response is the page index of every shareable handle sent,
+        // in increasing order, each as the varint of its distance to the previous one.
+        // It spans at most M3_MAX_COMMIT_PAGES * M3_WIRE_MAX_VARINT bytes.
+        static size_t EncodeCommitPages(const std::vector<uint64_t> &pages, char *buf);
+        static size_t DecodeCommitPages(const char *buf, size_t len, uint32_t count, std::vector<uint64_t> *pages);
+
+    private:
+        static char *PutVarint(char *p, uint64_t v);
+        static const char *GetVarint(const char *p, const char *end, uint64_t *v);
+        static char *PutMemId(char *p, const char *memId, size_t len);
+        static const char *GetMemId(const char *p, const char *end, char *memId);
+};
+
+// Shared-memory request / response rings.
+// A client may ask for a pair of single-producer single-consumer rings with CMD_OPENRING.
+// Commands which do not pass shareable handles can then be sent through the rings,
+// without any system call as long as both sides are awake.
+// The connected socket stays in use for CMD_ALLOCATE, which needs SCM_RIGHTS.
+#define M3_RING_SLOTS 64
+// Upper bound of the adaptive spin budget before a ring consumer goes to sleep on the futex.
+#define M3_RING_MAX_SPIN 16384
+#define M3_RING_MIN_SPIN 16
+
+template <typename T>
+struct MemMapRingQueue {
+    // head is written by the producer only, and doubles as the futex word consumers sleep on.
+    alignas(64) std::atomic<uint32_t> head;
+    // tail is written by the consumer only.
+    alignas(64) std::atomic<uint32_t> tail;
+    // sleeping is set by the consumer before waiting on head, so that the producer knows to wake it up.
+    alignas(64) std::atomic<uint32_t> sleeping;
+    alignas(64) T slots[M3_RING_SLOTS];
+};
+
+typedef struct MemMapRingSegmentSt {
+    MemMapRingQueue<MemMapRequest> requests;
+    MemMapRingQueue<MemMapResponse> responses;
+    // Set by either side to tear the ring pair down.
+    std::atomic<uint32_t> closed;
+} MemMapRingSegment;
+
+// MemMapRing is the client side of a ring pair.
+typedef struct MemMapRingSt {
+    MemMapRingSegment *segment;
+    size_t size;
+    uint32_t spinLimit;
+} MemMapRing;
+
+// MemMapRingServer is the server side of a ring pair, served by a dedicated thread.
+typedef struct MemMapRingServerSt {
+    sharedMemoryInfo shm;
+    MemMapRingSegment *segment;
+    std::thread thread;
+} MemMapRingServer;
+
+static inline void cpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    std::this_thread::yield();
+#endif
+}
+
+// Busy polling (MemMapServerOptions::busyPollCpu, MemMapManager::SetClientBusyPoll()) retries an empty poll
+// after a number of pauses doubling up to M3_BUSY_POLL_MAX_PAUSE, then yields the CPU between polls,
+// so that a busy poller does not starve the other side sharing its CPU.
+// On a single CPU, the other side can only run if we yield: there is no point in pausing.
+#define M3_BUSY_POLL_MAX_PAUSE 1024
+
+static inline void busyPollBackoff(uint32_t &pause) {
+    static const uint32_t maxPause = std::thread::hardware_concurrency() > 1 ? M3_BUSY_POLL_MAX_PAUSE : 0;
+    if (pause >= maxPause) {
+        std::this_thread::yield();
+        return;
+    }
+    for (uint32_t i = 0; i < pause; ++i) {
+        cpuRelax();
+    }
+    pause = pause ? pause * 2 : 1;
+}
+
+static inline void futexWait(std::atomic<uint32_t> *addr, uint32_t expected) {
+    // Wake up periodically, so that a closed ring is noticed even if nobody wakes us.
+    struct timespec timeout = {0, 100 * 1000 * 1000};
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT, expected, &timeout, NULL, 0);
+}
+
+static inline void futexWake(std::atomic<uint32_t> *addr) {
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// ringPush() never blocks: a ring holds at most one request in flight per client.
+template <typename T>
+bool ringPush(MemMapRingQueue<T> *q, const T &item) {
+    uint32_t head = q->head.load(std::memory_order_relaxed);
+    if (head - q->tail.load(std::memory_order_acquire) >= M3_RING_SLOTS) {
+        return false;
+    }
+    q->slots[head % M3_RING_SLOTS] = item;
+    q->head.store(head + 1);
+    if (q->sleeping.load()) {
+        futexWake(&q->head);
+    }
+    return true;
+}
+
+// ringPop() spins up to spinLimit iterations, then sleeps on the futex.
+// The spin budget adapts: it grows when data arrives while spinning and shrinks after every sleep.
+// ringPop() returns false once closed is set.
+template <typename T>
+bool ringPop(MemMapRingQueue<T> *q, T *item, uint32_t &spinLimit, std::atomic<uint32_t> *closed) {
+    uint32_t tail = q->tail.load(std::memory_order_relaxed);
+    uint32_t head;
+    uint32_t spin = 0;
+    while ((head = q->head.load(std::memory_order_acquire)) == tail) {
+        if (closed->load(std::memory_order_relaxed)) {
+            return false;
+        }
+        if (spin++ < spinLimit) {
+            cpuRelax();
+            continue;
+        }
+        q->sleeping.store(1);
+        if (q->head.load() == tail) {
+            futexWait(&q->head, tail);
+        }
+        q->sleeping.store(0);
+        spinLimit = std::max<uint32_t>(spinLimit / 2, M3_RING_MIN_SPIN);
+        spin = 0;
+    }
+    if (spin > 0 && spin < spinLimit) {
+        spinLimit = std::min<uint32_t>(spinLimit * 2, M3_RING_MAX_SPIN);
+    }
+    *item = q->slots[tail % M3_RING_SLOTS];
+    q->tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+// MemMapDevice caches the properties of a device queried once at startup,
+// and accounts the physical memory held by regions on it.
+typedef struct MemMapDeviceSt {
+    CUdevice device;
+    size_t minGranularity;
+    size_t recommendedGranularity;
+    size_t totalBytes;
+    // NUMA node closest to the device, -1 if unknown.
+    int numaNode;
+    // Guarded by MemMapManager::placementMutex_.
+    size_t usedBytes;
+} MemMapDevice;
+
+// MemMapConnection is the server side of a connected client socket.
+// Connections are reference counted, so that a worker still holding a job of a client
+// never replies to an unrelated client which got the same fd number after a hangup.
+class MemMapConnection {
+    public:
+        MemMapConnection(int _sock_fd) : sock_fd(_sock_fd) {}
+        ~MemMapConnection();
+
+        int sock_fd;
+        // sendMutex serializes replies, so that a response and its shareable handles are never interleaved.
+        std::mutex sendMutex;
+        // Ring pair opened by CMD_OPENRING, if any.
+        std::unique_ptr<MemMapRingServer> ring;
+        // Backing pages whose shareable handle was already sent through this connection.
+        // Guarded by sendMutex.
+        std::unordered_set<uint64_t> backingsSent;
+        // Peer process and its user, from the credentials of the socket.
+        pid_t pid;
+        uid_t uid;
+};
+
+// MemMapClient tracks the liveness of a client process, in the server loop.
+typedef struct MemMapClientSt {
+    // pidfd of the process, polled by the server loop, or -1 if pidfd_open() is not supported.
+    int pidfd;
+    int numConnections;
+    bool exited;
+} MemMapClient;
+
+// MemMapReclaim is a removed region waiting for reclamation.
+typedef struct MemMapReclaimSt {
+    std::vector<MemoryRegion> chunks;
+} MemMapReclaim;
+
+// RequestBurst() keeps at most M3_BURST_WINDOW requests in flight. UNIX datagram sockets queue
+// net.unix.max_dgram_qlen (10 by default) messages: staying under it, neither side blocks on a full queue.
+#define M3_BURST_WINDOW 8
+
+// MemMapBurst holds the buffers of the server loop: the requests received from a connection by one recvmmsg(),
+// and the replies of the inline commands among them, sent by one sendmmsg().
+class MemMapBurst {
+    public:
+        MemMapBurst(int _size);
+
+        int size;
+        std::vector<char> recvBuf;
+        std::vector<struct iovec> recvIov;
+        std::vector<struct mmsghdr> recvMsgs;
+
+        // Queued replies, and the requests they answer.
+        int numReplies;
+        size_t replyBytes;
+        std::vector<MemMapRequest> reqs;
+        std::vector<MemMapResponse> ress;
+        std::vector<char> replyBuf;
+        std::vector<struct iovec> replyIov;
+        std::vector<struct mmsghdr> replyMsgs;
+};
+
+// MemMapJob is a request queued by the event loop for a worker thread,
+// together with the connection to reply to.
+// A job without connection is a pool refill of req.size bytes chunks on req.src.device,
+// or, with a barrier, the release of the references of the dead process req.src.pid (see ReapClient()).
+typedef struct MemMapJobSt {
+    MemMapRequest req;
+    // Variable-length part of the request, if any.
+    std::vector<char> payload;
+    std::shared_ptr<MemMapConnection> conn;
+    // Number of workers yet to reach the job.
+    std::shared_ptr<std::atomic<int>> barrier;
+    // Set by MemMapJobQueue::Push().
+    MemMapPriority priority;
+    uint64_t seq;
+    std::chrono::steady_clock::time_point queued;
+} MemMapJob;
+
+// Virtual time of MemMapJobQueue: a job of a class of weight w costs M3_WFQ_STRIDE / w.
+#define M3_WFQ_STRIDE (1 << 20)
+
+// MemMapJobQueue holds the jobs of a worker, in a FIFO per priority class (job.priority).
+// Pop() serves the class with the earliest virtual start time (start-time fair queuing):
+// while several classes are backlogged, each one gets a share of the jobs proportional to its weight,
+// and a class becoming backlogged starts at the current virtual time, without credit for its idle time.
+// Barrier jobs (see ReapClient()) must run after every job queued before them:
+// while one is at the front of a queue, jobs are served in arrival order instead.
+// MemMapJobQueue is not thread-safe: it is guarded by the mutex of its worker.
+class MemMapJobQueue {
+    public:
+        MemMapJobQueue();
+
+        void SetWeights(const int *weights);
+        void Push(const MemMapJob &job);
+        // Pop() returns false if the queue is empty.
+        bool Pop(MemMapJob *job);
+        bool Empty(void) const { return size_ == 0; }
+        size_t Depth(MemMapPriority priority) const { return queues_[priority].size(); }
+
+        // Jobs popped per class, and their total and longest wait in the queue, in nanoseconds.
+        uint64_t served[M3_PRIORITY_COUNT];
+        uint64_t waitNs[M3_PRIORITY_COUNT];
+        uint64_t maxWaitNs[M3_PRIORITY_COUNT];
+
+    private:
+        std::deque<MemMapJob> queues_[M3_PRIORITY_COUNT];
+        uint64_t stride_[M3_PRIORITY_COUNT];
+        // Virtual start time of the next job of each class.
+        uint64_t start_[M3_PRIORITY_COUNT];
+        uint64_t vtime_;
+        uint64_t seq_;
+        size_t size_;
+};
+
+// MemMapWorker is a worker thread bound to a single GPU device.
+typedef struct MemMapWorkerSt {
+    CUdevice device;
+    std::thread thread;
+    std::mutex mtx;
+    std::condition_variable cv;
+    MemMapJobQueue jobs;
+    bool halt;
+} MemMapWorker;
+
 class MemMapManager {
     public:
         ~MemMapManager();
@@ -182,17 +1216,105 @@ class MemMapManager {
 
         // Request() is a generic Request method provided to client.
         // All requests except RequestAllocate uses Request() internally.
-        // Request() uses sendto() / recvfrom() system call to send and receive messages.
-        static MemMapResponse Request(int sock_fd, MemMapRequest req, struct sockaddr_un * remote_addr);
+        // sock_fd is a socket connected to the server by ipcConnect().
+        // A connected socket must not be used by multiple threads at the same time.
+        static MemMapResponse Request(int sock_fd, MemMapRequest req);
         static MemMapResponse RequestRegister(ProcessInfo &pInfo, int sock_fd);
-        static MemMapResponse RequestDeAllocate(ProcessInfo &pInfo, int sock_fd, shareable_handle_t shHandle);
-        static MemMapResponse RequestRoundedAllocationSize(ProcessInfo &pInfo, int sock_fd, size_t num_bytes);
+        // RequestDeAllocate() drops a reference of this process on the region mapped at d_ptr.
+        // With the last reference, the region is unmapped and released on the server,
+        // which reclaims it once no client references it anymore.
+        static MemMapResponse RequestDeAllocate(ProcessInfo &pInfo, int sock_fd, CUdeviceptr d_ptr);
+        static MemMapResponse RequestRoundedAllocationSize(ProcessInfo &pInfo, int sock_fd, size_t num_bytes, uint32_t flags = 0);
 
         // RequestAllocate() is a dedicate method to request Allocate() function.
         // Since shareable handles are UNIX file descriptors of separate process,
         // we must receive ancillary messages using sendmsg() and recvmsg().
         // To allocate anonymous memory region (without memId), pass nullptr to memId.
-        static MemMapResponse RequestAllocate(ProcessInfo &pInfo, int sock_fd, char * memId, size_t alignment, size_t num_bytes);
+        // num_bytes is rounded up by the server; the mapped size is returned in res.roundedSize.
+        // A max_bytes larger than num_bytes makes the region resizable (M3_FLAG_RESIZABLE),
+        // and reserves max_bytes of address space for it to grow into with RequestResize().
+        static MemMapResponse RequestAllocate(ProcessInfo &pInfo, int sock_fd, char * memId, size_t alignment, size_t num_bytes, uint32_t flags = 0, size_t max_bytes = 0);
+
+        // RequestImport() maps the existing region named by token (see MemMapResponse::token),
+        // as RequestAllocate() would, without looking its memId up, reserving max_bytes of address space if larger.
+        // The token may come from another process. A stale token gets STATUSCODE_STALE.
+        static MemMapResponse RequestImport(ProcessInfo &pInfo, int sock_fd, uint64_t token, size_t alignment = 0, size_t max_bytes = 0);
+
+        // RequestResize() grows the resizable region mapped at d_ptr to at least num_bytes, in place:
+        // the server appends chunks of the size of the first one, and the new chunks are mapped behind the mapped ones,
+        // without copying anything. Chunks added by other processes are mapped as well, so that importers
+        // catch up on growth with a num_bytes of 0. Regions never shrink.
+        // The server does not grow the region beyond the address space reserved for the mapping (STATUSCODE_INVALID).
+        // Chunks other processes added beyond it are left out: res.roundedSize is the mapped size,
+        // and the status is STATUSCODE_INVALID if it is below num_bytes. A removed region gets STATUSCODE_STALE.
+        // Regions of several chunks are made accessible from every device, like striped ones.
+        static MemMapResponse RequestResize(ProcessInfo &pInfo, int sock_fd, CUdeviceptr d_ptr, size_t num_bytes);
+
+        // RequestCommit() commits the pages of [offset, offset + num_bytes) of the sparse region mapped at d_ptr
+        // (see M3_FLAG_SPARSE), and maps every committed page of the range, whoever committed it.
+        // A num_bytes of 0 commits nothing, and maps the pages committed from offset to the end of the region,
+        // e.g. by other processes. res.roundedSize is the number of bytes of the region mapped by this process.
+        // The status is STATUSCODE_INVALID if the region is not sparse, or the range lies beyond it.
+        static MemMapResponse RequestCommit(ProcessInfo &pInfo, int sock_fd, CUdeviceptr d_ptr, size_t offset, size_t num_bytes);
+
+        // RequestStat() returns the size (res.roundedSize), device and generation of the region named by token,
+        // or STATUSCODE_STALE if it is gone.
+        static MemMapResponse RequestStat(ProcessInfo &pInfo, int sock_fd, uint64_t token);
+
+        // RequestAllocateBatch() allocates (or looks up) every region of entries in a single round trip.
+        // Sizes are rounded by the server, so no RequestRoundedAllocationSize() is needed beforehand.
+        // All regions are mapped into one virtual address range.
+        // The i-th response tells the status, roundedSize and d_ptr of entries[i].
+        // Entries naming the same region (same memId and rounded size) get the same d_ptr.
+        static std::vector<MemMapResponse> RequestAllocateBatch(ProcessInfo &pInfo, int sock_fd, std::vector<MemMapBatchEntry> &entries, uint32_t flags = 0);
+
+        // RequestRing() opens a shared-memory ring pair bound to the connection sock_fd.
+        // The segment is passed as a file descriptor, so it disappears with the last process mapping it.
+        // Returns nullptr on failure.
+        static MemMapRing * RequestRing(ProcessInfo &pInfo, int sock_fd);
+
+        // Request() through a ring pair. Commands passing shareable handles (CMD_ALLOCATE)
+        // and CMD_HALT must still be sent through the socket; they are answered with STATUSCODE_NYI.
+        static MemMapResponse Request(MemMapRing *ring, MemMapRequest req);
+
+        // RequestBurst() sends every request of reqs without waiting for the previous responses,
+        // up to M3_BURST_WINDOW at a time, and returns the responses in order.
+        // Like rings, bursts are meant for commands answered without payload nor shareable handles
+        // (CMD_ECHO, CMD_GETROUNDEDALLOCATIONSIZE, CMD_VALIDATE, CMD_STAT).
+        static std::vector<MemMapResponse> RequestBurst(int sock_fd, std::vector<MemMapRequest> &reqs);
+
+        // CloseRing() tears the ring pair down and unmaps it.
+        static void CloseRing(MemMapRing *ring);
+
+        // Unmap() unmaps a region mapped by RequestAllocate() or RequestAllocateBatch(),
+        // and gives its virtual address range back to the arena of the process.
+        // The region stays referenced on the server: use RequestDeAllocate() to release it as well.
+        // Backing pages of small regions stay mapped, since the server sends them only once per connection.
+        // Returns STATUSCODE_INVALID if d_ptr is not a mapped region.
+        static MemMapStatusCode Unmap(CUdeviceptr d_ptr);
+
+        // SetClientArenaSize() sets how much virtual address space the client library reserves at a time.
+        // 0 reserves a range per region.
+        static void SetClientArenaSize(size_t arenaSize);
+
+        // SetClientBusyPoll() makes Request() spin on a nonblocking receive while waiting for a response,
+        // instead of sleeping in recv(). Meant for clients with a core of their own.
+        static void SetClientBusyPoll(bool busyPoll);
+
+        // SetClientPriority() sets the priority class of the requests sent by the calling thread
+        // which do not set one themselves. Bulk loaders should use M3_PRIORITY_BULK,
+        // and latency-sensitive clients M3_PRIORITY_HIGH.
+        static void SetClientPriority(MemMapPriority priority);
+
+        // RequestStats() fetches the counters of the server into stats.
+        static MemMapResponse RequestStats(ProcessInfo &pInfo, int sock_fd, MemMapStats *stats);
+
+        // CurrentNumaNode() returns the NUMA node of the CPU the calling thread runs on, or -1.
+        static int CurrentNumaNode(void);
+
+        // SetServerOptions() must be called before Instance() to take effect.
+        static void SetServerOptions(const MemMapServerOptions &options) { options_ = options; }
+        static const MemMapServerOptions& ServerOptions() { return options_; }
 
         // Trivial Getter / Setters.
         std::string DebugString() const;
@@ -204,50 +1326,301 @@ class MemMapManager {
         static const char name[128];
         // Name of the endpoint file.
         static const char endpointName[128];
-        // Name of the semaphore file.
-        static const char barrierName[128];
 
     private:
         // Keep constructor private in order to implement singleton pattern.
         MemMapManager();
 
         // Sever loop.
+        // Server() waits on the listening socket and every client connection with epoll,
+        // reads a single burst of up to MemMapServerOptions::maxBurst requests from each ready connection per wakeup
+        // (connections with more queued are reported again by epoll),
+        // serves cheap commands inline and hands CUDA-heavy commands over to the worker pool.
         void Server();
+        // PinServerThread() pins the server loop to MemMapServerOptions::busyPollCpu,
+        // and moves the workers, the reclaimer and ring threads started later to the other CPUs of the process (otherCpus_).
+        void PinServerThread();
+
+        // Hot handover.
+        // HandOver() serves CMD_HANDOVER once workers and the reclaimer are stopped, sending the state of the server to conn.
+        // Returns true once the successor confirmed it loaded the state. Otherwise, the state could not be sent
+        // or the successor failed to take it over, and the server keeps running.
+        // TakeOver() is the other end, run by a server started with MemMapServerOptions::handover:
+        // it takes the state and the endpoint over, or starts afresh without a running server.
+        // SaveState() and LoadState() put and get everything but conn, the connection of the successor.
+        bool HandOver(MemMapRequest &req, MemMapConnection &conn);
+        void TakeOver();
+        void SaveState(MemMapHandoverState &state, MemMapConnection &conn);
+        bool LoadState(MemMapHandoverState &state);
+
+        // Connection management of the server loop.
+        // AddConnection() watches a connected socket, accepted or taken over, and its peer process.
+        void AcceptConnections();
+        std::shared_ptr<MemMapConnection> AddConnection(int sock_fd);
+        void CloseConnection(int sock_fd);
+
+        // Liveness of client processes.
+        // Every process with a connection is watched through a pidfd. Once it exited and its last connection
+        // is drained, ReapClient() queues the release of its references behind the jobs already queued to the workers,
+        // and ReleaseClient() releases them. Stale pid_* endpoint files are removed as well.
+        void WatchClient(pid_t pid);
+        void ClientExited(int pidfd);
+        void ReapClient(pid_t pid);
+        void ReleaseClient(pid_t pid);
+        static void RemoveStaleEndpoints(void);
+
+        // HandleRequest() serves a single request and fills the response.
+        // Shareable handles to be passed to the client are returned through shHandles.
+        void HandleRequest(MemMapRequest &req, MemMapResponse &res, std::vector<shareable_handle_t> &shHandles);
+
+        // Reply() sends the response and its optional payload in one message,
+        // followed by the shareable handles in shHandles, if any.
+        void Reply(MemMapRequest &req, MemMapResponse &res, std::vector<shareable_handle_t> &shHandles, MemMapConnection &conn, const void *payload = nullptr, size_t payloadSize = 0);
+        // ReplyLocked() is Reply() with conn.sendMutex held.
+        void ReplyLocked(MemMapRequest &req, MemMapResponse &res, std::vector<shareable_handle_t> &shHandles, MemMapConnection &conn, const void *payload, size_t payloadSize);
+
+        // AllocateRegion() looks up the region (memId, num_bytes), and allocates it if it does not exist yet.
+        // New regions are placed according to flags (see M3_FLAG_PLACEMENT()).
+        // The chunks of the region are returned in chunks, its token in token, and its current size, larger once grown, in size if not null.
+        M3InternalErrorType AllocateRegion(ProcessInfo &pInfo, const char *memId, size_t alignment, size_t num_bytes, uint32_t flags, std::vector<MemoryRegion> &chunks, uint64_t *token, size_t *size = nullptr);
+
+        // SubAllocateRegion() looks up the small region (memId, num_bytes), and carves it out of a backing page
+        // if it does not exist yet.
+        M3InternalErrorType SubAllocateRegion(ProcessInfo &pInfo, const char *memId, size_t num_bytes, uint32_t flags, MemoryRegion *chunk, uint64_t *token);
+        // SubAllocatable() tells whether a new region of num_bytes requested with flags is sub-allocated,
+        // whichever request (CMD_ALLOCATE or CMD_ALLOCATE_BATCH) asks for it, so that a memId always names the same region.
+        bool SubAllocatable(size_t num_bytes, uint32_t flags) const;
+        // FreeSlot() returns a slot to the sub-allocator, and recycles its backing page once the page is empty.
+        void FreeSlot(CUdevice device, const MemMapSlot &slot);
+
+        // ImportRegion() takes a reference of pInfo on the existing region of token,
+        // and returns its chunks and size.
+        M3InternalErrorType ImportRegion(ProcessInfo &pInfo, uint64_t token, std::vector<MemoryRegion> &chunks, size_t *size);
+
+        // ResizeRegion() grows the region of token to num_bytes at least, appending chunks of the size of its first one,
+        // and returns its chunks and size. Regions never shrink, and only those created with M3_FLAG_RESIZABLE grow:
+        // others, sub-allocated or sparse ones included, are refused with M3INTERNAL_NYI.
+        // Growth beyond limit bytes, unless limit is 0, is refused with M3INTERNAL_INVALID_ARGUMENT before any memory is created.
+        M3InternalErrorType ResizeRegion(uint64_t token, size_t num_bytes, size_t limit, std::vector<MemoryRegion> &chunks, size_t *size);
+
+        // CommitRegion() commits the missing pages of [offset, offset + num_bytes) in the sparse region of token,
+        // and returns the size of the region and its committed pages from offset on, up to M3_MAX_COMMIT_PAGES of them
+        // and to the end of the range (of the region if num_bytes is 0). next is where the listing stopped.
+        // Regions which are not sparse get M3INTERNAL_NYI.
+        M3InternalErrorType CommitRegion(uint64_t token, size_t offset, size_t num_bytes, std::vector<MemoryRegion> &chunks, size_t *size, size_t *next);
+
+        // ReplyChunks() adds the shareable handles of chunks to res: every chunk, or the first page of a sparse region.
+        static void ReplyChunks(const std::vector<MemoryRegion> &chunks, MemMapResponse &res, std::vector<shareable_handle_t> &shHandles);
+        // AllocationStatus() returns the status answering a failed allocation of memory, by its internal error.
+        static MemMapStatusCode AllocationStatus(M3InternalErrorType m3Err);
+
+        // FindRegionLocked() finds the region of a request, by token if set, by (memId, size) otherwise,
+        // and stores its token and size. regionsMutex_ must be held.
+        const std::vector<MemoryRegion> * FindRegionLocked(const MemMapRequest &req, uint64_t *token, size_t *size);
+
+        // PlaceRegion() chooses the device of a new region of num_bytes requested by pInfo.
+        CUdevice PlaceRegion(const ProcessInfo &pInfo, uint32_t flags, size_t num_bytes);
+        // AccountDevice() adds bytes (possibly negative) to the memory used on device, and on numaNode unless it is -1.
+        void AccountDevice(CUdevice device, int numaNode, int64_t bytes);
+        // RegionNumaNode() returns the NUMA node of the new chunks of a request on device: the node set by flags,
+        // or the node of the device. Nodes set by flags are checked by AllocateRegion().
+        int RegionNumaNode(CUdevice device, uint32_t flags) const;
+        // DeviceNumaNode() finds the NUMA node of device from its PCI bus id, -1 if unknown.
+        static int DeviceNumaNode(CUdevice device);
+        // RecycleChunk() returns the physical memory of chunk to the pool, or closes it.
+        void RecycleChunk(const MemoryRegion &chunk);
+
+        // MapBacking() is the client side of SubAllocateRegion():
+        // it maps the backing page of res once per process, and points res.d_ptr at the region.
+        static void MapBacking(ProcessInfo &pInfo, int sock_fd, MemMapResponse &res, const std::string &importKey);
+        // MapBackingLocked() maps the backing page of res with shHandle, unless this process maps it already,
+        // and points res.d_ptr at the region. shHandle is nullptr if the page was not sent. clientMutex_ must be held.
+        static void MapBackingLocked(ProcessInfo &pInfo, MemMapResponse &res, const shareable_handle_t *shHandle, const std::string &importKey);
+
+        // Import() sends a CMD_ALLOCATE request, and maps the region it returns into at least reserve bytes of address space.
+        static MemMapResponse Import(ProcessInfo &pInfo, int sock_fd, MemMapRequest &req, size_t alignment, const std::string &importKey, size_t reserve = 0);
+
+        // SendRequest() sends req, encoded, followed by an already encoded payload.
+        // RecvResponse() receives and decodes a response, and copies its payload to payload if not null.
+        static bool SendRequest(int sock_fd, const MemMapRequest &req, const void *payload = nullptr, size_t payloadSize = 0);
+        static bool RecvResponse(int sock_fd, MemMapResponse *res, std::vector<char> *payload = nullptr);
+
+        // Import cache of the client library. LookupImport() returns the cached response of key,
+        // revalidating it with CMD_VALIDATE if the server generation moved since it was cached.
+        // AddMappingLocked() registers (or references again) a mapping; clientMutex_ must be held.
+        static bool LookupImport(ProcessInfo &pInfo, int sock_fd, const std::string &key, MemMapResponse *res);
+        // serverRef tells whether res comes with a new reference on the server.
+        static void AddMappingLocked(MemMapResponse &res, const std::string &importKey, bool serverRef = true);
+        // ReleaseMappingLocked() drops a reference on the mapping at d_ptr, and unmaps it with the last one.
+        // Returns -1 if d_ptr is not mapped, 0 if the mapping is still referenced, and 1 if it was unmapped,
+        // in which case the mapping is copied to released.
+        static int ReleaseMappingLocked(CUdeviceptr d_ptr, MemMapClientMapping *released);
+        // MapChunks() maps the chunks of a region received as shHandles at d_ptr with the backend of res,
+        // accessible from the device of pInfo, or from every device for striped regions.
+        static void MapChunks(const ProcessInfo &pInfo, const MemMapResponse &res, CUdeviceptr d_ptr, const shareable_handle_t *shHandles);
+        // SeenServerGeneration() records the server generation carried by any response.
+        static void SeenServerGeneration(uint64_t serverGeneration);
+
+        // ClientStateLocked() resets the client side state if this process was forked since its last use.
+        // clientMutex_ must be held.
+        static void ClientStateLocked(void);
+
+        // CreateChunks() fills shHandles with chunks of chunkSize bytes on device, placed on numaNode.
+        // Chunks on the node of the device are taken from the pool first.
+        M3InternalErrorType CreateChunks(CUdevice device, int numaNode, size_t alignment, size_t chunkSize, std::vector<shareable_handle_t> &shHandles);
+
+        // FillPool() creates count chunks of chunkSize bytes on device and puts them into the pool.
+        void FillPool(CUdevice device, size_t chunkSize, int count);
+
+        // SendStats() serves CMD_GETSTATS.
+        void SendStats(MemMapRequest &req, MemMapConnection &conn);
+
+        // ServeInline() serves an inline command of a burst, and queues its reply.
+        // FlushReplies() sends the queued replies of the burst to conn.
+        void ServeInline(MemMapBurst &burst, MemMapRequest &req);
+        void FlushReplies(MemMapBurst &burst, MemMapConnection &conn);
+        // IsLookup() tells whether a command only reads the state of the server.
+        // Identical lookups of a burst get the same response.
+        static bool IsLookup(MemMapCmd cmd);
+
+        // AllocateBatch() serves CMD_ALLOCATE_BATCH and replies by itself.
+        void AllocateBatch(MemMapJob &job);
+        // Commit() serves CMD_COMMIT and replies by itself.
+        void Commit(MemMapJob &job);
+
+        // IsInlineCommand() tells whether a command is cheap enough to be served by the event loop itself.
+        static bool IsInlineCommand(MemMapCmd cmd);
+
+        // Worker pool management.
+        // Requests of a device are sharded over its workers by connection,
+        // so that the requests of a connection are always served in order by the same worker.
+        // Requests of different connections for the same region may run concurrently, on different workers.
+        void StartWorkers();
+        void StopWorkers();
+        void Dispatch(MemMapJob &job);
+        void Worker(MemMapWorker *worker);
+
+        // OpenRing() serves CMD_OPENRING: creates the ring pair of conn and starts its serving thread.
+        void OpenRing(MemMapRequest &req, MemMapConnection &conn);
+        void RingServer(MemMapRingServer *ring);
 
         // Register() registers ProcessInfo of new client process in M3 server.
         // If duplicate subscription is detected, Register() does nothing but returns STATUSCODE_DUPLICATE_REGISTER.
         M3InternalErrorType Register(ProcessInfo &pInfo);
 
-        // Allocate() allocates physical memory in GPU using cuMemCreate(), and export shareable handlers.
+        // Allocate() allocates physical memory with the backend of the server, and export shareable handlers.
         // Allocate() will NOT be called if memory ID is already registered in M3 server.
-        // We assume that client request CMD_GETROUNDEDALLOCATIONSIZE before CMD_ALLOCATE.
-        // Thus, no size rounding is provided in Allocate().
-        M3InternalErrorType Allocate(ProcessInfo &pInfo, size_t alignment, size_t num_bytes, std::vector<shareable_handle_t> &shHandle, std::vector<CUmemGenericAllocationHandle> &allocHandle);
+        // num_bytes must already be rounded by GetRoundedAllocationSize(). Host memory is placed on numaNode, unless it is -1.
+        // Chunks created before a failure are closed.
+        M3InternalErrorType Allocate(ProcessInfo &pInfo, int numaNode, size_t alignment, size_t num_bytes, std::vector<shareable_handle_t> &shHandle);
+
+        // DeAllocate() drops a reference of req.src on the region of req.
+        // The last reference removes the region, and queues it for reclamation.
+        M3InternalErrorType DeAllocate(MemMapRequest &req);
+
+        // Deferred reclamation of removed regions.
+        void StartReclaimer();
+        void StopReclaimer();
+        void Reclaimer();
+        void Reclaim(MemMapReclaim &reclaim);
+        void QueueReclaim(MemMapReclaim &reclaim);
 
-        // DeAllocate(): To Be Implemented.
-        M3InternalErrorType DeAllocate(ProcessInfo &pInfo, shareable_handle_t shHandle);
+        // GetRoundedAllocationSize() rounds num_bytes to the granularity of the GPU device,
+        // using the table built at startup. flags may select the recommended granularity.
+        size_t GetRoundedAllocationSize(size_t num_bytes, CUdevice device, uint32_t flags = 0);
 
-        // GetRoundedAllocationSize() rounds num_bytes to the minimum granularity of the GPU device.
-        // User MUST get rounded size using this method.
-        // Otherwise, the behavior of Allocate() is undefined.
-        size_t GetRoundedAllocationSize(size_t num_bytes);
+        // ServingDevice() returns the device serving requests of pInfo.
+        CUdevice ServingDevice(const ProcessInfo &pInfo) const { return ServingDevice(pInfo.device); }
+        CUdevice ServingDevice(CUdevice device) const;
 
         // Singleton members
         static MemMapManager * instance_;
         static std::once_flag singletonFlag_;
+        static MemMapServerOptions options_;
 
         // Cuda settings
         CUcontext ctx_;
         std::vector<CUdevice> devices_;
         int device_count_;
+        // Granularity of each device, indexed like devices_.
+        std::vector<MemMapDevice> deviceTable_;
 
         // IPC settings
         int ipc_sock_fd_;
+        int epoll_fd_;
+        // Connected clients, indexed by socket. Only accessed by the server loop.
+        std::unordered_map<int, std::shared_ptr<MemMapConnection>> connections_;
+        // Client processes by pid, and their pidfds. Only accessed by the server loop.
+        std::unordered_map<pid_t, MemMapClient> clients_;
+        std::unordered_map<int, pid_t> pidfds_;
+        uint64_t reapedClients_;
+        // Traffic of client sockets (see MemMapStats). Received messages are counted by the server loop only.
+        uint64_t rxBursts_;
+        uint64_t rxMessages_;
+        uint64_t rxBytes_;
+        std::atomic<uint64_t> txMessages_;
+        std::atomic<uint64_t> txBytes_;
+        // CPUs of the threads other than a busy-polling server loop.
+        cpu_set_t otherCpus_;
+        // Set once the state went to a successor: the endpoint is not ours anymore.
+        bool handedOver_;
         std::vector<ProcessInfo> subscribers_;
+        std::mutex subscribersMutex_;
+
+        // Worker pool. workers_[device * numWorkersPerDevice + i] is the i-th worker of device.
+        // workers_ only changes while no worker runs; workersStopping_ stops workers from dispatching pool refills
+        // once StopWorkers() has begun.
+        std::vector<MemMapWorker *> workers_;
+        std::atomic<bool> workersStopping_;
+
+        // Find shareable handles using memory ID, and vice versa.
+        // Guarded by regionsMutex_.
+        MemoryRegionIndex regions_;
+        std::mutex regionsMutex_;
+        // generation_ moves forward whenever a region may be removed or changed,
+        // so that clients know when their cached imports must be revalidated.
+        // It starts from the boot time of the server, so that a restarted server never reuses a generation.
+        std::atomic<uint64_t> generation_;
+
+        // Idle physical chunks, ready to back new regions.
+        MemMapPool pool_;
 
-        // Find shareable handle using memory ID, and vice versa.
-        std::unordered_map<std::string, MemoryRegion> memIdToMemoryRegion_;
-        std::unordered_map<shareable_handle_t, std::string> shHandletoMemId_;        
+        // Placement state: the usedBytes of deviceTable_, the host memory placed on each NUMA node,
+        // and the next device of M3_PLACEMENT_ROUND_ROBIN.
+        std::mutex placementMutex_;
+        size_t nodeUsedBytes_[M3_MAX_NUMA_NODES];
+        std::atomic<uint32_t> nextDevice_;
+
+        // Backing pages of small regions.
+        MemMapSlabAllocator slabs_;
+
+        // Removed regions waiting for the reclaimer thread.
+        std::thread reclaimer_;
+        std::mutex reclaimMutex_;
+        std::condition_variable reclaimCv_;
+        std::vector<MemMapReclaim> reclaimQueue_;
+        bool reclaimHalt_;
+        std::atomic<uint64_t> reclaimPendingBytes_;
+        std::atomic<uint64_t> reclaimedBytes_;
+
+        // Client side state, guarded by clientMutex_.
+        // It is reset in forked children, since mappings do not survive fork().
+        // clientBackings_ holds the backing pages mapped by this process, by backingId,
+        // and clientMappings_ the regions mapped by this process, by d_ptr.
+        static std::unordered_map<uint64_t, CUdeviceptr> clientBackings_;
+        static std::unordered_map<CUdeviceptr, MemMapClientMapping> clientMappings_;
+        // clientImports_ caches imports by (memId, size, flags, device),
+        // and clientServerGeneration_ is the latest server generation seen by this process.
+        static std::unordered_map<std::string, MemMapImport> clientImports_;
+        static uint64_t clientServerGeneration_;
+        // Address ranges of each backend.
+        static MemMapVAArena clientArenas_[M3_BACKEND_COUNT];
+        static pid_t clientPid_;
+        static std::atomic<bool> clientBusyPoll_;
+        static thread_local MemMapPriority clientPriority_;
+        // WithClientPriority() returns req with the priority of the calling thread, unless it sets one.
+        static MemMapRequest WithClientPriority(const MemMapRequest &req);
+        static std::mutex clientMutex_;
 
 
 };
@@ -263,21 +1636,26 @@ void panic(const char * msg);
 
 // Helper functions for IPC features.
 
-// Semaphore locking / unlocking helper functions.
+// Every client holds its own SOCK_SEQPACKET connection to the server.
+// Replies are routed by connection, so no cross-process lock is needed around a round trip.
 
-int ipcLockGeneric(int initialValue);
-int ipcLock(void);
-int ipcUnlock(void);
+// ipcListen() opens the server socket, binds it to local_addr and listens for clients.
+int ipcListen(struct sockaddr_un * local_addr);
 
-// ipcLockPrivileged() is used only by server, 
-// just to protect server initialization process done in MemMapManager::MemMapManager().
-int ipcLockPrivileged(void);
+// ipcConnect() opens a client socket and connects it to the server listening on remote_addr.
+// ipcConnect() retries for a while if the server is not up yet.
+int ipcConnect(struct sockaddr_un * remote_addr);
 
-int ipcOpenAndBindSocket(struct sockaddr_un * local_addr);
-
-// ipcSendShareableHandle() sends multiple shareable handles (UNIX file descriptors) using sendmsg().
+// ipcSendShareableHandle() sends a shareable handle (UNIX file descriptor) using sendmsg().
 // this function is used by RequestAllocate().
-int ipcSendShareableHandle(int sock_fd, struct sockaddr_un * client_addr, shareable_handle_t shHandle);
+int ipcSendShareableHandle(int sock_fd, shareable_handle_t shHandle);
+
+// ipcSendShareableHandles() sends shareable handles packing up to IPC_SCM_MAX_FD of them per message (ipcSendFds()).
+int ipcSendShareableHandles(int sock_fd, const std::vector<shareable_handle_t> &shHandles);
+
+// ipcRecvShareableHandles() receives count shareable handles sent by ipcSendShareableHandles().
+// Messages carrying more handles than expected are refused. On failure, every handle received is closed.
+int ipcRecvShareableHandles(int sock_fd, std::vector<shareable_handle_t> &shHandles, uint32_t count);
 
 // ipcRecvShareableHandle() receives multiple shareable handles (UNIX file descriptors) using recvmsg()
 // this function is used by RequestAllocate().
@@ -0,0 +1,330 @@
+#pragma once
+// cuhoststub.h is a host-memory stand-in for the subset of the CUDA driver API used by M3.
+// Build with -DM3_HOST_STUB to run the server and the tests on a machine without any GPU.
+//
+// Physical allocations are memfd files, shareable handles are dup()ed file descriptors,
+// and "device" virtual addresses are plain host mappings, so the whole
+// reserve / map / export / import path of the VMM API keeps working across processes.
+// The number of emulated devices can be set with CUHOSTSTUB_DEVICE_COUNT (default 1).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+typedef enum cudaError_enum {
+    CUDA_SUCCESS = 0,
+    CUDA_ERROR_INVALID_VALUE = 1,
+    CUDA_ERROR_OUT_OF_MEMORY = 2,
+    CUDA_ERROR_NOT_INITIALIZED = 3,
+    CUDA_ERROR_INVALID_DEVICE = 101,
+    CUDA_ERROR_INVALID_CONTEXT = 201,
+    CUDA_ERROR_NOT_SUPPORTED = 801,
+    CUDA_ERROR_UNKNOWN = 999
+} CUresult;
+
+typedef int CUdevice;
+typedef unsigned long long CUdeviceptr;
+typedef unsigned long long CUmemGenericAllocationHandle;
+typedef struct CUctx_st * CUcontext;
+typedef struct CUstream_st * CUstream;
+
+typedef enum CUmemAllocationType_enum {
+    CU_MEM_ALLOCATION_TYPE_INVALID = 0,
+    CU_MEM_ALLOCATION_TYPE_PINNED = 1
+} CUmemAllocationType;
+
+typedef enum CUmemAllocationHandleType_enum {
+    CU_MEM_HANDLE_TYPE_NONE = 0,
+    CU_MEM_HANDLE_TYPE_POSIX_FILE_DESCRIPTOR = 1
+} CUmemAllocationHandleType;
+
+typedef enum CUmemLocationType_enum {
+    CU_MEM_LOCATION_TYPE_INVALID = 0,
+    CU_MEM_LOCATION_TYPE_DEVICE = 1
+} CUmemLocationType;
+
+typedef enum CUmemAccess_flags_enum {
+    CU_MEM_ACCESS_FLAGS_PROT_NONE = 0,
+    CU_MEM_ACCESS_FLAGS_PROT_READ = 1,
+    CU_MEM_ACCESS_FLAGS_PROT_READWRITE = 3
+} CUmemAccess_flags;
+
+typedef enum CUmemAllocationGranularity_flags_enum {
+    CU_MEM_ALLOC_GRANULARITY_MINIMUM = 0,
+    CU_MEM_ALLOC_GRANULARITY_RECOMMENDED = 1
+} CUmemAllocationGranularity_flags;
+
+typedef enum CUstream_flags_enum {
+    CU_STREAM_DEFAULT = 0,
+    CU_STREAM_NON_BLOCKING = 1
+} CUstream_flags;
+
+typedef struct CUmemLocation_st {
+    CUmemLocationType type;
+    int id;
+} CUmemLocation;
+
+typedef struct CUmemAllocationProp_st {
+    CUmemAllocationType type;
+    CUmemAllocationHandleType requestedHandleTypes;
+    CUmemLocation location;
+    void *win32HandleMetaData;
+    struct {
+        unsigned char compressionType;
+        unsigned char gpuDirectRDMACapable;
+        unsigned short usage;
+        unsigned char reserved[4];
+    } allocFlags;
+} CUmemAllocationProp;
+
+typedef struct CUmemAccessDesc_st {
+    CUmemLocation location;
+    CUmemAccess_flags flags;
+} CUmemAccessDesc;
+
+#define CUHOSTSTUB_GRANULARITY_MINIMUM ((size_t)2 << 20)
+#define CUHOSTSTUB_GRANULARITY_RECOMMENDED ((size_t)2 << 20)
+#define CUHOSTSTUB_DEVICE_MEMORY ((size_t)16 << 30)
+
+// Physical allocation: a memfd holding the bytes, and its size.
+typedef struct CUhostStubAllocationSt {
+    int fd;
+    size_t size;
+    int device;
+} CUhostStubAllocation;
+
+struct CUctx_st {
+    CUdevice device;
+};
+
+static inline CUcontext *cuHostStubCurrent(void) {
+    static __thread CUcontext current = nullptr;
+    return &current;
+}
+
+static inline int cuHostStubDeviceCount(void) {
+    const char *env = getenv("CUHOSTSTUB_DEVICE_COUNT");
+    int count = env ? atoi(env) : 1;
+    return count > 0 ? count : 1;
+}
+
+static inline CUresult cuInit(unsigned int flags) {
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuDeviceGetCount(int *count) {
+    *count = cuHostStubDeviceCount();
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuDeviceGet(CUdevice *device, int ordinal) {
+    if (ordinal < 0 || ordinal >= cuHostStubDeviceCount()) {
+        return CUDA_ERROR_INVALID_DEVICE;
+    }
+    *device = ordinal;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuDeviceGetName(char *name, int len, CUdevice dev) {
+    snprintf(name, len, "M3 Host Stub Device %d", dev);
+    return CUDA_SUCCESS;
+}
+
+// Emulated devices sit on no PCI bus, so their NUMA locality is unknown.
+static inline CUresult cuDeviceGetPCIBusId(char *pciBusId, int len, CUdevice dev) {
+    return CUDA_ERROR_NOT_SUPPORTED;
+}
+
+static inline CUresult cuDeviceCanAccessPeer(int *canAccessPeer, CUdevice dev, CUdevice peerDev) {
+    *canAccessPeer = 1;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuCtxCreate(CUcontext *pctx, unsigned int flags, CUdevice dev) {
+    if (dev < 0 || dev >= cuHostStubDeviceCount()) {
+        return CUDA_ERROR_INVALID_DEVICE;
+    }
+    *pctx = new CUctx_st;
+    (*pctx)->device = dev;
+    *cuHostStubCurrent() = *pctx;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuCtxDestroy(CUcontext ctx) {
+    if (*cuHostStubCurrent() == ctx) {
+        *cuHostStubCurrent() = nullptr;
+    }
+    delete ctx;
+    return CUDA_SUCCESS;
+}
+
+// Contexts received from other processes are dangling pointers, so they are only stored, never dereferenced.
+static inline CUresult cuCtxSetCurrent(CUcontext ctx) {
+    *cuHostStubCurrent() = ctx;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuCtxGetDevice(CUdevice *device) {
+    if (*cuHostStubCurrent() == nullptr) {
+        return CUDA_ERROR_INVALID_CONTEXT;
+    }
+    *device = (*cuHostStubCurrent())->device;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuCtxEnablePeerAccess(CUcontext peerContext, unsigned int flags) {
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuStreamCreate(CUstream *stream, unsigned int flags) {
+    *stream = nullptr;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemGetAllocationGranularity(size_t *granularity, const CUmemAllocationProp *prop, CUmemAllocationGranularity_flags option) {
+    if (prop->location.id < 0 || prop->location.id >= cuHostStubDeviceCount()) {
+        return CUDA_ERROR_INVALID_DEVICE;
+    }
+    *granularity = option == CU_MEM_ALLOC_GRANULARITY_RECOMMENDED ?
+        CUHOSTSTUB_GRANULARITY_RECOMMENDED : CUHOSTSTUB_GRANULARITY_MINIMUM;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuDeviceTotalMem(size_t *bytes, CUdevice dev) {
+    if (dev < 0 || dev >= cuHostStubDeviceCount()) {
+        return CUDA_ERROR_INVALID_DEVICE;
+    }
+    *bytes = CUHOSTSTUB_DEVICE_MEMORY;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemGetInfo(size_t *free, size_t *total) {
+    *free = CUHOSTSTUB_DEVICE_MEMORY;
+    *total = CUHOSTSTUB_DEVICE_MEMORY;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemCreate(CUmemGenericAllocationHandle *handle, size_t size, const CUmemAllocationProp *prop, unsigned long long flags) {
+    if (size == 0 || size % CUHOSTSTUB_GRANULARITY_MINIMUM) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    int fd = (int)syscall(SYS_memfd_create, "cuhoststub", 0);
+    if (fd < 0) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+    CUhostStubAllocation *alloc = new CUhostStubAllocation;
+    alloc->fd = fd;
+    alloc->size = size;
+    alloc->device = prop->location.id;
+    *handle = (CUmemGenericAllocationHandle)(uintptr_t)alloc;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemRelease(CUmemGenericAllocationHandle handle) {
+    CUhostStubAllocation *alloc = (CUhostStubAllocation *)(uintptr_t)handle;
+    if (alloc == nullptr) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    close(alloc->fd);
+    delete alloc;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemExportToShareableHandle(void *shareableHandle, CUmemGenericAllocationHandle handle, CUmemAllocationHandleType handleType, unsigned long long flags) {
+    CUhostStubAllocation *alloc = (CUhostStubAllocation *)(uintptr_t)handle;
+    if (handleType != CU_MEM_HANDLE_TYPE_POSIX_FILE_DESCRIPTOR) {
+        return CUDA_ERROR_NOT_SUPPORTED;
+    }
+    int fd = dup(alloc->fd);
+    if (fd < 0) {
+        return CUDA_ERROR_UNKNOWN;
+    }
+    *(int *)shareableHandle = fd;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemImportFromShareableHandle(CUmemGenericAllocationHandle *handle, void *osHandle, CUmemAllocationHandleType shHandleType) {
+    if (shHandleType != CU_MEM_HANDLE_TYPE_POSIX_FILE_DESCRIPTOR) {
+        return CUDA_ERROR_NOT_SUPPORTED;
+    }
+    struct stat st;
+    int fd = dup((int)(uintptr_t)osHandle);
+    if (fd < 0) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    CUhostStubAllocation *alloc = new CUhostStubAllocation;
+    alloc->fd = fd;
+    alloc->size = st.st_size;
+    alloc->device = 0;
+    *handle = (CUmemGenericAllocationHandle)(uintptr_t)alloc;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemAddressReserve(CUdeviceptr *ptr, size_t size, size_t alignment, CUdeviceptr addr, unsigned long long flags) {
+    void *p = mmap((void *)(uintptr_t)addr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+    *ptr = (CUdeviceptr)(uintptr_t)p;
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemAddressFree(CUdeviceptr ptr, size_t size) {
+    return munmap((void *)(uintptr_t)ptr, size) == 0 ? CUDA_SUCCESS : CUDA_ERROR_INVALID_VALUE;
+}
+
+static inline CUresult cuMemMap(CUdeviceptr ptr, size_t size, size_t offset, CUmemGenericAllocationHandle handle, unsigned long long flags) {
+    CUhostStubAllocation *alloc = (CUhostStubAllocation *)(uintptr_t)handle;
+    if (alloc == nullptr || offset + size > alloc->size) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    // Pages stay inaccessible until cuMemSetAccess(), as on a real device.
+    void *p = mmap((void *)(uintptr_t)ptr, size, PROT_NONE, MAP_SHARED | MAP_FIXED, alloc->fd, offset);
+    return p == MAP_FAILED ? CUDA_ERROR_INVALID_VALUE : CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemUnmap(CUdeviceptr ptr, size_t size) {
+    void *p = mmap((void *)(uintptr_t)ptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    return p == MAP_FAILED ? CUDA_ERROR_INVALID_VALUE : CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemSetAccess(CUdeviceptr ptr, size_t size, const CUmemAccessDesc *desc, size_t count) {
+    int prot = PROT_NONE;
+    for (size_t i = 0; i < count; ++i) {
+        if (desc[i].flags == CU_MEM_ACCESS_FLAGS_PROT_READWRITE) {
+            prot = PROT_READ | PROT_WRITE;
+        } else if (desc[i].flags == CU_MEM_ACCESS_FLAGS_PROT_READ && prot == PROT_NONE) {
+            prot = PROT_READ;
+        }
+    }
+    return mprotect((void *)(uintptr_t)ptr, size, prot) == 0 ? CUDA_SUCCESS : CUDA_ERROR_INVALID_VALUE;
+}
+
+static inline CUresult cuMemcpyHtoD(CUdeviceptr dst, const void *src, size_t size) {
+    memcpy((void *)(uintptr_t)dst, src, size);
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemcpyDtoH(void *dst, CUdeviceptr src, size_t size) {
+    memcpy(dst, (const void *)(uintptr_t)src, size);
+    return CUDA_SUCCESS;
+}
+
+static inline CUresult cuMemcpyDtoD(CUdeviceptr dst, CUdeviceptr src, size_t size) {
+    memcpy((void *)(uintptr_t)dst, (const void *)(uintptr_t)src, size);
+    return CUDA_SUCCESS;
+}
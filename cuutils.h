@@ -1,5 +1,9 @@
 #pragma once
+#ifdef M3_HOST_STUB
+#include "cuhoststub.h"
+#else
 #include "cuda.h"
+#endif
 #include "stdio.h"
 #ifndef CUUTIL_SILENCE
 #define CUUTIL_ERRCHK(x) do { \
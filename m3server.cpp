@@ -1,6 +1,68 @@
 #include "MemMapManager.h"
+#include <getopt.h>
 
-int main() {
+static void usage(const char *prog) {
+    printf("Usage: %s [-w <workers per device>] [-P] [-p local|least-used|round-robin] [-b <burst>] [-c <cpu>] [-H] [-A] [-m cuda|host]\n", prog);
+    printf("  -P: disable the physical memory pool\n");
+    printf("  -p: placement policy of new regions (default: local)\n");
+    printf("  -b: requests received per system call (default: 32)\n");
+    printf("  -c: busy poll on a CPU instead of blocking (default: off)\n");
+    printf("  -H: take the regions and clients of the running server over\n");
+    printf("  -A: let a server of the same user take this one over (default: off)\n");
+    printf("  -m: memory of the regions, GPU memory (cuda) or shared host memory (host) (default: cuda)\n");
+}
+
+int main(int argc, char *argv[]) {
+    MemMapServerOptions options;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:Pp:b:c:HAm:h")) != -1) {
+        switch (opt) {
+            case 'w':
+                options.numWorkersPerDevice = atoi(optarg);
+                break;
+            case 'P':
+                options.poolEnabled = false;
+                break;
+            case 'p':
+                if (!strcmp(optarg, "local")) {
+                    options.placement = M3_PLACEMENT_LOCAL;
+                } else if (!strcmp(optarg, "least-used")) {
+                    options.placement = M3_PLACEMENT_LEAST_USED;
+                } else if (!strcmp(optarg, "round-robin")) {
+                    options.placement = M3_PLACEMENT_ROUND_ROBIN;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'b':
+                options.maxBurst = atoi(optarg);
+                break;
+            case 'c':
+                options.busyPollCpu = atoi(optarg);
+                break;
+            case 'H':
+                options.handover = true;
+                break;
+            case 'A':
+                options.acceptHandover = true;
+                break;
+            case 'm':
+                if (!strcmp(optarg, "cuda")) {
+                    options.backend = M3_BACKEND_CUDA;
+                } else if (!strcmp(optarg, "host")) {
+                    options.backend = M3_BACKEND_HOST;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    MemMapManager::SetServerOptions(options);
     MemMapManager * m3Server = MemMapManager::Instance();
     return 0;
-}
\ No newline at end of file
+}
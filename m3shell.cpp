@@ -40,10 +40,6 @@ int main(int argc, char **argv) {
     memMapGetDeviceFunction(argv);
 
 
-    struct sockaddr_un client_addr;
-    client_addr.sun_family = AF_UNIX;
-    strncpy(client_addr.sun_path, "m3shell_ipc", sizeof(client_addr.sun_path));
-
     std::vector<std::string> d_memId;
     std::vector<uintptr_t> d_ptr;
     std::vector<size_t> d_size;
@@ -52,7 +48,6 @@ int main(int argc, char **argv) {
     MemMapResponse res;
     char cmd[128];
     while (true) {
-        unlink("m3shell_ipc");
         printf("> ");
         scanf("%s", cmd);
 
@@ -73,7 +68,7 @@ int main(int argc, char **argv) {
         }
 
         if(!strcmp(cmd, "halt")) {
-            int sock_fd = ipcOpenAndBindSocket(&client_addr);
+            int sock_fd = ipcConnect(&server_addr);
             ipcHaltM3Server(sock_fd, pInfo);
             close(sock_fd);
         }
@@ -82,11 +77,11 @@ int main(int argc, char **argv) {
             int rep;
             scanf("%d", &rep);
             
-            int sock_fd = ipcOpenAndBindSocket(&client_addr);
+            int sock_fd = ipcConnect(&server_addr);
             req.src = pInfo;
             req.cmd = CMD_ECHO;
             for(int i = 0; i < rep; ++i) {
-                res = MemMapManager::Request(sock_fd, req, &server_addr);
+                res = MemMapManager::Request(sock_fd, req);
                 if(res.status != STATUSCODE_ACK) {
                     printf("Failed to Echo\n");
                     continue;
@@ -119,21 +114,13 @@ int main(int argc, char **argv) {
                     printf("Invalid unit %s!\n", unit);
                     continue;
             }
-            struct sockaddr_un client_addr;
-            client_addr.sun_family = AF_UNIX;
-            strncpy(client_addr.sun_path, "m3shell_ipc", 108);
-            int sock_fd = ipcOpenAndBindSocket(&client_addr);
-            res = MemMapManager::RequestRoundedAllocationSize(pInfo, sock_fd, num_bytes);
-            if(res.status != STATUSCODE_ACK) {
-                printf("Failed to round %lu bytes.\n", num_bytes);
-                continue;
-            }
-            num_bytes = res.roundedSize;
+            int sock_fd = ipcConnect(&server_addr);
             res = MemMapManager::RequestAllocate(pInfo, sock_fd, memId, 1024, num_bytes);
             if(res.status != STATUSCODE_ACK) {
                 printf("Failed to allocate %lu bytes.\n", num_bytes);
                 continue;
             }
+            num_bytes = res.roundedSize;
             printf("Allocated %lu bytes @ [%p : %p].\n", num_bytes, (char *)res.d_ptr, (char *)res.d_ptr + num_bytes -1);
             close(sock_fd);
 
@@ -2,44 +2,521 @@
 
 MemMapManager * MemMapManager::instance_ = nullptr;
 std::once_flag MemMapManager::singletonFlag_;
+MemMapServerOptions MemMapManager::options_;
+std::unordered_map<uint64_t, CUdeviceptr> MemMapManager::clientBackings_;
+std::unordered_map<CUdeviceptr, MemMapClientMapping> MemMapManager::clientMappings_;
+std::unordered_map<std::string, MemMapImport> MemMapManager::clientImports_;
+uint64_t MemMapManager::clientServerGeneration_ = 0;
+MemMapVAArena MemMapManager::clientArenas_[M3_BACKEND_COUNT] = {
+    MemMapVAArena(M3_BACKEND_CUDA), MemMapVAArena(M3_BACKEND_HOST)
+};
+pid_t MemMapManager::clientPid_ = 0;
+std::atomic<bool> MemMapManager::clientBusyPoll_(false);
+thread_local MemMapPriority MemMapManager::clientPriority_ = M3_PRIORITY_NORMAL;
+std::mutex MemMapManager::clientMutex_;
 const char MemMapManager::name[128] = "MemMapManager";
 const char MemMapManager::endpointName[128] = "MemMapManager_Server_EndPoint";
-const char MemMapManager::barrierName[128] = "MemMapManager_Server_Barrier";
 MemoryRegion MemoryRegionInitializer = {
-    (shareable_handle_t)nullptr, (uintptr_t)nullptr, (size_t)0
+    (shareable_handle_t)nullptr, (uintptr_t)nullptr, (size_t)0, (uint64_t)0, (size_t)0, (uint64_t)0, (CUdevice)0, -1, false, false
 };
 
-MemMapManager::MemMapManager() {
+uint64_t MemoryRegionIndex::Hash(const char *memId, size_t len) {
+
+    // FNV-1a
+    uint64_t h = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (unsigned char)memId[i];
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+
+}
+
+int64_t MemoryRegionIndex::Lookup(const char *memId, size_t len, uint64_t hash) const {
+
+    size_t mask = slots_.size() - 1;
+    for (size_t pos = hash & mask; slots_[pos].memIdxPlusOne != 0; pos = (pos + 1) & mask) {
+        if (slots_[pos].hash != hash) {
+            continue;
+        }
+        const std::string &name = memIds_[slots_[pos].memIdxPlusOne - 1].name;
+        if (name.size() == len && !memcmp(name.data(), memId, len)) {
+            return slots_[pos].memIdxPlusOne - 1;
+        }
+    }
+    return -1;
+
+}
+
+void MemoryRegionIndex::Grow(void) {
+
+    std::vector<InternSlot> slots(slots_.size() * 2);
+    size_t mask = slots.size() - 1;
+    for (auto& slot : slots_) {
+        if (slot.memIdxPlusOne == 0) {
+            continue;
+        }
+        size_t pos = slot.hash & mask;
+        while (slots[pos].memIdxPlusOne != 0) {
+            pos = (pos + 1) & mask;
+        }
+        slots[pos] = slot;
+    }
+    slots_.swap(slots);
+
+}
+
+int64_t MemoryRegionIndex::Intern(const char *memId, bool create) {
+
+    size_t len = strnlen(memId, MAX_MEMID_LEN);
+    uint64_t hash = Hash(memId, len);
+    int64_t memIdx = Lookup(memId, len, hash);
+    if (memIdx >= 0 || !create) {
+        return memIdx;
+    }
+
+    // Keep the load factor under 1/2, so that probe sequences stay short.
+    if ((numSlotsUsed_ + 1) * 2 > slots_.size()) {
+        Grow();
+    }
+    memIdx = memIds_.size();
+    MemIdEntry entry;
+    entry.name.assign(memId, len);
+    entry.hash = hash;
+    memIds_.push_back(entry);
+
+    size_t mask = slots_.size() - 1;
+    size_t pos = hash & mask;
+    while (slots_[pos].memIdxPlusOne != 0) {
+        pos = (pos + 1) & mask;
+    }
+    slots_[pos].hash = hash;
+    slots_[pos].memIdxPlusOne = (uint32_t)memIdx + 1;
+    numSlotsUsed_++;
+    return memIdx;
+
+}
+
+int64_t MemoryRegionIndex::FindSlot(const char *memId, size_t size, CUdevice device) const {
+
+    size_t len = strnlen(memId, MAX_MEMID_LEN);
+    int64_t memIdx = Lookup(memId, len, Hash(memId, len));
+    if (memIdx < 0) {
+        return -1;
+    }
+    for (uint32_t regionIdx : memIds_[memIdx].regions) {
+        if (regions_[regionIdx].createdSize == size && regions_[regionIdx].device == device) {
+            return regionIdx;
+        }
+    }
+    return -1;
+
+}
+
+const MemoryRegionIndex::RegionSlot * MemoryRegionIndex::FindSlot(uint64_t token) const {
+
+    uint32_t regionIdx = (uint32_t)token;
+    if (regionIdx >= regions_.size()) {
+        return nullptr;
+    }
+    const RegionSlot &region = regions_[regionIdx];
+    if (!region.used || region.nonce != (uint32_t)(token >> 32)) {
+        return nullptr;
+    }
+    return &region;
+
+}
+
+const std::vector<MemoryRegion> * MemoryRegionIndex::Find(const char *memId, size_t size, CUdevice device, uint64_t *token) const {
+
+    int64_t regionIdx = FindSlot(memId, size, device);
+    if (regionIdx < 0) {
+        return nullptr;
+    }
+    if (token) {
+        *token = Token((uint32_t)regionIdx, regions_[regionIdx]);
+    }
+    return &regions_[regionIdx].chunks;
+
+}
+
+const std::vector<MemoryRegion> * MemoryRegionIndex::Find(uint64_t token, size_t *size) const {
+
+    const RegionSlot *region = FindSlot(token);
+    if (region == nullptr) {
+        return nullptr;
+    }
+    if (size) {
+        *size = region->size;
+    }
+    return &region->chunks;
+
+}
+
+bool MemoryRegionIndex::AddRef(uint64_t token, pid_t pid) {
+
+    RegionSlot *region = const_cast<RegionSlot *>(FindSlot(token));
+    if (region == nullptr) {
+        return false;
+    }
+    region->refs[pid]++;
+    return true;
+
+}
+
+int MemoryRegionIndex::Release(uint64_t token, pid_t pid, std::vector<MemoryRegion> *chunks) {
+
+    RegionSlot *region = const_cast<RegionSlot *>(FindSlot(token));
+    if (region == nullptr) {
+        return -1;
+    }
+    auto ref = region->refs.find(pid);
+    if (ref == region->refs.end()) {
+        return -1;
+    }
+    if (--ref->second == 0) {
+        region->refs.erase(ref);
+    }
+    if (!region->refs.empty()) {
+        return 0;
+    }
+
+    // The last reference is gone: remove the region.
+    Remove((uint32_t)token, chunks);
+    return 1;
+
+}
+
+void MemoryRegionIndex::Remove(uint32_t regionIdx, std::vector<MemoryRegion> *chunks) {
+
+    RegionSlot &region = regions_[regionIdx];
+    for (auto& chunk : region.chunks) {
+        if (chunk.pageId == 0) {
+            shHandleToToken_.erase(chunk.shareableHandle);
+        }
+    }
+    *chunks = std::move(region.chunks);
+    region.chunks.clear();
+    region.refs.clear();
+
+    // The memId stays interned, since names are usually allocated again.
+    std::vector<uint32_t> &regions = memIds_[region.memIdx].regions;
+    *std::find(regions.begin(), regions.end(), regionIdx) = regions.back();
+    regions.pop_back();
+
+    region.used = false;
+    if (++region.nonce == 0) {
+        region.nonce = 1;
+    }
+    freeRegions_.push_back(regionIdx);
+    numRegions_--;
+
+}
+
+bool MemoryRegionIndex::Insert(const char *memId, size_t size, CUdevice device, const std::vector<MemoryRegion> &chunks, uint64_t *token) {
+
+    if (FindSlot(memId, size, device) >= 0) {
+        return false;
+    }
+    uint32_t memIdx = (uint32_t)Intern(memId, true);
+    uint32_t regionIdx;
+    if (!freeRegions_.empty()) {
+        regionIdx = freeRegions_.back();
+        freeRegions_.pop_back();
+    } else {
+        regionIdx = regions_.size();
+        regions_.emplace_back();
+        regions_.back().nonce = 1;
+    }
+    RegionSlot &region = regions_[regionIdx];
+    region.memIdx = memIdx;
+    region.used = true;
+    region.device = device;
+    region.size = size;
+    region.createdSize = size;
+    region.chunks = chunks;
+    memIds_[memIdx].regions.push_back(regionIdx);
+    numRegions_++;
+
+    uint64_t regionToken = Token(regionIdx, region);
+    for (auto& chunk : chunks) {
+        if (chunk.pageId == 0) {
+            shHandleToToken_[chunk.shareableHandle] = regionToken;
+        }
+    }
+    if (token) {
+        *token = regionToken;
+    }
+    return true;
+
+}
+
+bool MemoryRegionIndex::Commit(uint64_t token, std::vector<MemoryRegion> &chunks) {
+
+    RegionSlot *region = const_cast<RegionSlot *>(FindSlot(token));
+    if (region == nullptr) {
+        return false;
+    }
+    // Both lists are sorted by base: merge them.
+    std::vector<MemoryRegion> merged;
+    std::vector<MemoryRegion> left;
+    merged.reserve(region->chunks.size() + chunks.size());
+    auto it = region->chunks.begin();
+    for (auto& chunk : chunks) {
+        while (it != region->chunks.end() && it->base < chunk.base) {
+            merged.push_back(*it++);
+        }
+        if (it != region->chunks.end() && it->base == chunk.base) {
+            left.push_back(chunk);
+            continue;
+        }
+        merged.push_back(chunk);
+        shHandleToToken_[chunk.shareableHandle] = token;
+    }
+    merged.insert(merged.end(), it, region->chunks.end());
+    region->chunks.swap(merged);
+    chunks.swap(left);
+    return true;
+
+}
+
+bool MemoryRegionIndex::Append(uint64_t token, size_t size, const std::vector<MemoryRegion> &chunks) {
+
+    RegionSlot *region = const_cast<RegionSlot *>(FindSlot(token));
+    if (region == nullptr || region->size != size) {
+        return false;
+    }
+    size_t newSize = size;
+    for (auto& chunk : chunks) {
+        newSize += chunk.size;
+    }
+    region->size = newSize;
+    for (auto& chunk : chunks) {
+        region->chunks.push_back(chunk);
+        shHandleToToken_[chunk.shareableHandle] = token;
+    }
+    return true;
+
+}
+
+void MemoryRegionIndex::ReleaseAll(pid_t pid, std::vector<std::vector<MemoryRegion>> *removed) {
+
+    for (uint32_t regionIdx = 0; regionIdx < regions_.size(); ++regionIdx) {
+        RegionSlot &region = regions_[regionIdx];
+        if (!region.used || region.refs.erase(pid) == 0 || !region.refs.empty()) {
+            continue;
+        }
+        removed->emplace_back();
+        Remove(regionIdx, &removed->back());
+    }
+
+}
+
+void MemMapHandoverState::PutString(const std::string &str) {
+
+    Put<uint32_t>(str.size());
+    data.insert(data.end(), str.begin(), str.end());
+
+}
+
+void MemMapHandoverState::PutFd(shareable_handle_t fd) {
+
+    auto it = fdIndex_.find(fd);
+    if (it == fdIndex_.end()) {
+        it = fdIndex_.insert(std::make_pair(fd, (uint32_t)fds.size())).first;
+        fds.push_back(fd);
+    }
+    Put<uint32_t>(it->second);
+
+}
+
+bool MemMapHandoverState::GetString(std::string *str) {
+
+    uint32_t len;
+    if (!Get(&len) || data.size() - pos_ < len) {
+        return false;
+    }
+    str->assign(data.data() + pos_, len);
+    pos_ += len;
+    return true;
+
+}
 
-    // Delete the semaphore file generated by previous execution.
-    char barrierToRemove[128] = "/dev/shm/sem.";
-    strcat(barrierToRemove, MemMapManager::barrierName);
-    unlink(barrierToRemove);
+bool MemMapHandoverState::GetFd(shareable_handle_t *fd) {
 
-    // Critical section begins: Server initialization
-    ipcLockPrivileged();
-    printf("M3Server: Entered critical section\n");
+    uint32_t index;
+    if (!Get(&index) || index >= fds.size()) {
+        return false;
+    }
+    *fd = fds[index];
+    return true;
+
+}
+
+void MemoryRegionIndex::Save(MemMapHandoverState &state) const {
+
+    state.Put<uint32_t>(regions_.size());
+    for (auto& region : regions_) {
+        state.Put<uint32_t>(region.nonce);
+        state.Put<uint8_t>(region.used);
+        if (!region.used) {
+            continue;
+        }
+        state.PutString(memIds_[region.memIdx].name);
+        state.Put<uint64_t>(region.size);
+        state.Put<uint64_t>(region.createdSize);
+        state.Put<int32_t>(region.device);
+        state.Put<uint32_t>(region.chunks.size());
+        for (auto& chunk : region.chunks) {
+            MemoryRegion plain = chunk;
+            plain.shareableHandle = 0;
+            state.PutFd(chunk.shareableHandle);
+            state.Put(plain);
+        }
+        state.Put<uint32_t>(region.refs.size());
+        for (auto& ref : region.refs) {
+            state.Put<int32_t>(ref.first);
+            state.Put<uint32_t>(ref.second);
+        }
+    }
+
+}
+
+bool MemoryRegionIndex::Load(MemMapHandoverState &state) {
+
+    uint32_t numSlots;
+    if (!state.Get(&numSlots)) {
+        return false;
+    }
+    regions_.resize(numSlots);
+    for (uint32_t regionIdx = 0; regionIdx < numSlots; ++regionIdx) {
+        RegionSlot &region = regions_[regionIdx];
+        uint8_t used;
+        if (!state.Get(&region.nonce) || !state.Get(&used) || region.nonce == 0) {
+            return false;
+        }
+        region.used = used;
+        if (!region.used) {
+            freeRegions_.push_back(regionIdx);
+            continue;
+        }
+        std::string memId;
+        uint64_t size, createdSize;
+        int32_t device;
+        uint32_t numChunks, numRefs;
+        if (!state.GetString(&memId) || memId.size() >= MAX_MEMID_LEN ||
+            !state.Get(&size) || !state.Get(&createdSize) || !state.Get(&device) || !state.Get(&numChunks)) {
+            return false;
+        }
+        region.memIdx = (uint32_t)Intern(memId.c_str(), true);
+        region.size = size;
+        region.createdSize = createdSize;
+        region.device = device;
+        region.chunks.resize(numChunks);
+        for (auto& chunk : region.chunks) {
+            shareable_handle_t fd;
+            if (!state.GetFd(&fd) || !state.Get(&chunk)) {
+                return false;
+            }
+            chunk.shareableHandle = fd;
+        }
+        if (!state.Get(&numRefs)) {
+            return false;
+        }
+        for (uint32_t r = 0; r < numRefs; ++r) {
+            int32_t pid;
+            uint32_t count;
+            if (!state.Get(&pid) || !state.Get(&count)) {
+                return false;
+            }
+            region.refs[pid] = count;
+        }
+
+        memIds_[region.memIdx].regions.push_back(regionIdx);
+        numRegions_++;
+        for (auto& chunk : region.chunks) {
+            if (chunk.pageId == 0) {
+                shHandleToToken_[chunk.shareableHandle] = Token(regionIdx, region);
+            }
+        }
+    }
+    return true;
+
+}
+
+uint64_t MemoryRegionIndex::FindByShareableHandle(shareable_handle_t shHandle) const {
+
+    auto it = shHandleToToken_.find(shHandle);
+    return it == shHandleToToken_.end() ? 0 : it->second;
+
+}
 
-    // Delete the endpoint file generated by previous execution.
-    unlink(MemMapManager::endpointName);
+
+MemMapManager::MemMapManager() {
+
+    // Delete the endpoint file generated by previous execution, unless we take it over.
+    if (!options_.handover) {
+        unlink(MemMapManager::endpointName);
+        RemoveStaleEndpoints();
+    }
+    handedOver_ = false;
+    reapedClients_ = 0;
+    rxBursts_ = 0;
+    rxMessages_ = 0;
+    rxBytes_ = 0;
+    txMessages_ = 0;
+    txBytes_ = 0;
+    reclaimPendingBytes_ = 0;
+    workersStopping_ = false;
+    reclaimedBytes_ = 0;
+    nextDevice_ = 0;
+    std::fill(nodeUsedBytes_, nodeUsedBytes_ + M3_MAX_NUMA_NODES, 0);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    generation_ = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+    // Clients keep backing pages mapped by id: ids must not be reused by a restarted server either.
+    slabs_.SetFirstPageId(generation_.load());
 
     // Set up CUDA environment.
     CUUTIL_ERRCHK(cuInit(0));
     CUUTIL_ERRCHK(cuDeviceGetCount(&device_count_));
     std::cout << "MemMapManager Server detected " << device_count_ << " GPU(s)" << std::endl;
     devices_.resize(device_count_);
+    deviceTable_.resize(device_count_);
+    const MemMapBackend &backend = MemMapBackend::Get(options_.backend);
+    std::cout << "MemMapManager Server allocates " << backend.Name() << " memory" << std::endl;
     char gpuName[128];
     for(int i = 0; i < device_count_; ++i) {
         CUUTIL_ERRCHK(cuDeviceGet(&devices_[i], i));
         CUUTIL_ERRCHK(cuDeviceGetName(gpuName, 128, devices_[i]));
-        std::cout << "* Device " << devices_[i] << ": " << gpuName << std::endl;
+        deviceTable_[i].numaNode = DeviceNumaNode(devices_[i]);
+        std::cout << "* Device " << devices_[i] << ": " << gpuName;
+        if (deviceTable_[i].numaNode >= 0) {
+            std::cout << " (NUMA node " << deviceTable_[i].numaNode << ")";
+        }
+        std::cout << std::endl;
+
+        // Granularity never changes, so query it once instead of on every allocation.
+        deviceTable_[i].device = devices_[i];
+        CUUTIL_ERRCHK(backend.GetGranularity(devices_[i], false, &deviceTable_[i].minGranularity));
+        CUUTIL_ERRCHK(backend.GetGranularity(devices_[i], true, &deviceTable_[i].recommendedGranularity));
+        CUUTIL_ERRCHK(backend.GetTotalMem(devices_[i], &deviceTable_[i].totalBytes));
+        deviceTable_[i].usedBytes = 0;
+        assert(deviceTable_[i].minGranularity > 0);
+        assert(deviceTable_[i].recommendedGranularity % deviceTable_[i].minGranularity == 0);
     }
     // For now, we use Device 0 for M3 server.
     CUUTIL_ERRCHK(cuCtxCreate(&ctx_, 0, devices_[0]));
 
-    // Create and bind server IPC socket.
-    ipc_sock_fd_ = ipcOpenAndBindSocket(&server_addr);
-    
+    // Prefill the physical memory pool with chunks of the minimum granularity.
+    pool_.SetMaxIdleBytes(options_.poolMaxIdleBytes);
+    if (options_.poolEnabled) {
+        for (int i = 0; i < device_count_; ++i) {
+            FillPool(devices_[i], deviceTable_[i].minGranularity, options_.poolPrefillChunks);
+        }
+    }
+
     // Register server process itself.
     ProcessInfo serverProcess;
     serverProcess.SetContext(ctx_);
@@ -47,360 +524,3863 @@ MemMapManager::MemMapManager() {
         panic("Server process failed to register itself\n");
     }
 
-    // Critical section ends: Server initialization
-    ipcUnlock();
-    printf("M3Server: Exited critical section\n");
+    // Create the server IPC socket last: clients keep retrying to connect until the server is ready.
+    // A successor takes the socket of the running server over in Server() instead.
+    if (!options_.handover) {
+        ipc_sock_fd_ = ipcListen(&server_addr);
+        printf("M3Server: Listening on %s\n", MemMapManager::endpointName);
+    }
+
+    // Now run the server loop.                                                                           
+    Server();
+    
+}
+
+
+void MemMapManager::Server() {
+
+    struct epoll_event ev, events[64];
+
+    if ((epoll_fd_ = epoll_create1(0)) < 0) {
+        panic("MemMapManager::Server: failed to create epoll instance");
+    }
+    // Connections and clients taken over are watched like accepted ones.
+    if (options_.handover) {
+        TakeOver();
+    }
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = ipc_sock_fd_;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, ipc_sock_fd_, &ev) < 0) {
+        panic("MemMapManager::Server: failed to add server socket to epoll");
+    }
+
+    StartWorkers();
+    StartReclaimer();
+    if (options_.busyPollCpu >= 0) {
+        PinServerThread();
+    }
+    int timeout = options_.busyPollCpu >= 0 ? 0 : -1;
+    uint32_t pause = 0;
+
+    MemMapJob job;
+    MemMapResponse res;
+    std::vector<shareable_handle_t> shHandles;
+    MemMapBurst burst(std::max(1, options_.maxBurst));
+
+    for(bool halt = false; !halt; ) {
+
+        int numEvents = epoll_wait(epoll_fd_, events, 64, timeout);
+        if (numEvents < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            panic("MemMapManager::Server: epoll_wait failed");
+        }
+        if (numEvents == 0) {
+            busyPollBackoff(pause);
+            continue;
+        }
+        pause = 0;
+
+        for (int e = 0; e < numEvents && !halt; ++e) {
+            int sock_fd = events[e].data.fd;
+            if (sock_fd == ipc_sock_fd_) {
+                AcceptConnections();
+                continue;
+            }
+            if (pidfds_.count(sock_fd)) {
+                ClientExited(sock_fd);
+                continue;
+            }
+
+            auto it = connections_.find(sock_fd);
+            if (it == connections_.end()) {
+                continue;
+            }
+            job.conn = it->second;
+
+            // A single burst of this connection per wakeup, so that a client keeping its queue full
+            // does not hold the other ready connections back: epoll reports the connection again while requests are left.
+            bool hangup = false;
+            int count = recvmmsg(sock_fd, burst.recvMsgs.data(), burst.size, MSG_DONTWAIT, NULL);
+            if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                count = 0;
+            } else if (count <= 0) {
+                hangup = true;
+            } else {
+                rxBursts_++;
+            }
+
+            for (int i = 0; i < count && !halt; ++i) {
+                size_t n = burst.recvMsgs[i].msg_len;
+                if (n == 0) {
+                    // The client hung up (or the connection broke).
+                    hangup = true;
+                    break;
+                }
+                rxMessages_++;
+                rxBytes_ += n;
+                const char *buf = burst.recvBuf.data() + (size_t)i * M3_MAX_MESSAGE_SIZE;
+                size_t headerSize = MemMapWire::DecodeRequest(buf, n, &job.req);
+                if (headerSize == 0) {
+                    printf("MemMapManager::Server: dropped a malformed request of %ld bytes\n", (long)n);
+                    continue;
+                }
+                // References are held by the process on the other end of the socket, whatever it claims to be.
+                if (job.conn->pid > 0) {
+                    job.req.src.pid = job.conn->pid;
+                }
+
+                if (!IsInlineCommand(job.req.cmd)) {
+                    // Requests may carry a variable-length payload after the header (CMD_ALLOCATE_BATCH).
+                    job.payload.assign(buf + headerSize, buf + n);
+                    Dispatch(job);
+                    continue;
+                }
+                if (job.req.cmd != CMD_OPENRING && job.req.cmd != CMD_GETSTATS && job.req.cmd != CMD_HALT &&
+                    job.req.cmd != CMD_HANDOVER) {
+                    ServeInline(burst, job.req);
+                    continue;
+                }
+
+                // Commands replying by themselves go after the replies already queued.
+                FlushReplies(burst, *job.conn);
+                if (job.req.cmd == CMD_OPENRING) {
+                    OpenRing(job.req, *job.conn);
+                } else if (job.req.cmd == CMD_GETSTATS) {
+                    SendStats(job.req, *job.conn);
+                } else if (job.req.cmd == CMD_HANDOVER && (!options_.acceptHandover || job.conn->uid != geteuid())) {
+                    // Only a process of the user of the server takes it over, and only if the server accepts handovers.
+                    printf("MemMapManager::Server: refused a handover to process %d of uid %d\n", job.conn->pid, (int)job.conn->uid);
+                    res = MemMapResponse(STATUSCODE_INVALID);
+                    res.dst = job.req.src;
+                    shHandles.clear();
+                    Reply(job.req, res, shHandles, *job.conn);
+                } else if (job.req.cmd == CMD_HANDOVER) {
+                    // Regions must not change while they are handed over.
+                    StopWorkers();
+                    StopReclaimer();
+                    halt = handedOver_ = HandOver(job.req, *job.conn);
+                    if (!halt) {
+                        StartWorkers();
+                        StartReclaimer();
+                    }
+                } else {
+                    shHandles.clear();
+                    HandleRequest(job.req, res, shHandles);
+                    Reply(job.req, res, shHandles, *job.conn);
+                    halt = true;
+                }
+            }
+            FlushReplies(burst, *job.conn);
+            if (hangup) {
+                CloseConnection(sock_fd);
+            }
+            job.conn.reset();
+        }
+
+    }
+
+    // Let workers finish queued requests before the server goes down.
+    StopWorkers();
+    StopReclaimer();
+    connections_.clear();
+    for (auto& pidfd : pidfds_) {
+        close(pidfd.first);
+    }
+    pidfds_.clear();
+    clients_.clear();
+    close(epoll_fd_);
+
+}
+
+
+void MemMapManager::PinServerThread() {
+
+    cpu_set_t cpus;
+    CPU_ZERO(&otherCpus_);
+    if (sched_getaffinity(0, sizeof(otherCpus_), &otherCpus_) < 0) {
+        perror("MemMapManager::PinServerThread: sched_getaffinity");
+        return;
+    }
+    // Leave the CPU of the loop to the loop, unless it is the only one.
+    CPU_ZERO(&cpus);
+    CPU_SET(options_.busyPollCpu, &cpus);
+    if (CPU_COUNT(&otherCpus_) > 1) {
+        CPU_CLR(options_.busyPollCpu, &otherCpus_);
+    }
+
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err != 0) {
+        printf("MemMapManager::PinServerThread: cannot pin the server loop to CPU %d: %s\n",
+            options_.busyPollCpu, strerror(err));
+        return;
+    }
+    for (auto worker : workers_) {
+        pthread_setaffinity_np(worker->thread.native_handle(), sizeof(otherCpus_), &otherCpus_);
+    }
+    pthread_setaffinity_np(reclaimer_.native_handle(), sizeof(otherCpus_), &otherCpus_);
+    printf("M3Server: busy polling on CPU %d\n", options_.busyPollCpu);
+
+}
+
+
+void MemMapManager::AcceptConnections() {
+
+    int sock_fd;
+
+    while ((sock_fd = accept4(ipc_sock_fd_, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+        // Replies are sent with blocking calls, only receives are non-blocking.
+        fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) & ~O_NONBLOCK);
+        AddConnection(sock_fd);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("MemMapManager::AcceptConnections: accept failed");
+    }
+
+}
+
+
+std::shared_ptr<MemMapConnection> MemMapManager::AddConnection(int sock_fd) {
+
+    struct epoll_event ev;
+    bzero(&ev, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.fd = sock_fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, sock_fd, &ev) < 0) {
+        perror("MemMapManager::AddConnection: failed to add client socket to epoll");
+        close(sock_fd);
+        return nullptr;
+    }
+    std::shared_ptr<MemMapConnection> conn = std::make_shared<MemMapConnection>(sock_fd);
+    struct ucred cred;
+    socklen_t credLen = sizeof(cred);
+    conn->pid = 0;
+    conn->uid = (uid_t)-1;
+    if (getsockopt(sock_fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) == 0) {
+        conn->pid = cred.pid;
+        conn->uid = cred.uid;
+        WatchClient(cred.pid);
+        clients_[cred.pid].numConnections++;
+    }
+    connections_[sock_fd] = conn;
+    return conn;
+
+}
+
+
+void MemMapManager::CloseConnection(int sock_fd) {
+
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, sock_fd, NULL);
+    auto it = connections_.find(sock_fd);
+    if (it == connections_.end()) {
+        return;
+    }
+    pid_t pid = it->second->pid;
+    // The socket itself is closed when the last job holding the connection is done.
+    connections_.erase(it);
+
+    auto client = clients_.find(pid);
+    if (client == clients_.end() || --client->second.numConnections > 0) {
+        return;
+    }
+    // Without pidfd, a process is considered gone with its last connection.
+    if (client->second.exited || client->second.pidfd < 0) {
+        ReapClient(pid);
+    }
+
+}
+
+
+void MemMapManager::WatchClient(pid_t pid) {
+
+    if (clients_.count(pid)) {
+        return;
+    }
+    MemMapClient client;
+    client.numConnections = 0;
+    client.exited = false;
+    client.pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (client.pidfd >= 0) {
+        struct epoll_event ev;
+        bzero(&ev, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = client.pidfd;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, client.pidfd, &ev) < 0) {
+            perror("MemMapManager::WatchClient: failed to add pidfd to epoll");
+            close(client.pidfd);
+            client.pidfd = -1;
+        } else {
+            pidfds_[client.pidfd] = pid;
+        }
+    }
+    clients_[pid] = client;
+
+}
+
+
+void MemMapManager::ClientExited(int pidfd) {
+
+    pid_t pid = pidfds_[pidfd];
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, pidfd, NULL);
+    close(pidfd);
+    pidfds_.erase(pidfd);
+
+    MemMapClient &client = clients_[pid];
+    client.pidfd = -1;
+    client.exited = true;
+    // Requests still queued in its sockets are served first: the last CloseConnection() reaps it.
+    if (client.numConnections == 0) {
+        ReapClient(pid);
+    }
+
+}
+
+
+void MemMapManager::ReapClient(pid_t pid) {
+
+    clients_.erase(pid);
+    reapedClients_++;
+
+    // Endpoint file of the process, if any.
+    struct stat st;
+    std::string endpoint = "pid_" + std::to_string(pid);
+    if (lstat(endpoint.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(endpoint.c_str());
+    }
+
+    if (workers_.empty()) {
+        ReleaseClient(pid);
+        return;
+    }
+    // Workers may still serve requests of the process: the last worker to reach the job releases its references.
+    MemMapJob job;
+    job.req.src.pid = pid;
+    job.req.memId[0] = '\0';
+    job.barrier = std::make_shared<std::atomic<int>>((int)workers_.size());
+    job.priority = M3_PRIORITY_NORMAL;
+    for (auto worker : workers_) {
+        {
+            std::lock_guard<std::mutex> lock(worker->mtx);
+            worker->jobs.Push(job);
+        }
+        worker->cv.notify_one();
+    }
+
+}
+
+
+void MemMapManager::ReleaseClient(pid_t pid) {
+
+    std::vector<std::vector<MemoryRegion>> removed;
+    {
+        std::lock_guard<std::mutex> lock(regionsMutex_);
+        regions_.ReleaseAll(pid, &removed);
+        if (!removed.empty()) {
+            generation_++;
+        }
+    }
+    for (auto& chunks : removed) {
+        MemMapReclaim reclaim;
+        reclaim.chunks = std::move(chunks);
+        QueueReclaim(reclaim);
+    }
+
+    // The pid may be reused by a new process, which has to register again.
+    std::lock_guard<std::mutex> lock(subscribersMutex_);
+    for (auto it = subscribers_.begin(); it != subscribers_.end(); ) {
+        it = (it->pid == pid) ? subscribers_.erase(it) : it + 1;
+    }
+
+}
+
+
+void MemMapManager::RemoveStaleEndpoints(void) {
+
+    // Clients used to bind their own pid_<pid> endpoint, which is left behind when they crash.
+    DIR *dir = opendir(".");
+    if (dir == nullptr) {
+        return;
+    }
+    struct dirent *entry;
+    struct stat st;
+    while ((entry = readdir(dir)) != nullptr) {
+        int pid;
+        char trailing;
+        if (sscanf(entry->d_name, "pid_%d%c", &pid, &trailing) != 1 || pid <= 0) {
+            continue;
+        }
+        if (lstat(entry->d_name, &st) == 0 && S_ISSOCK(st.st_mode) && kill(pid, 0) < 0 && errno == ESRCH) {
+            unlink(entry->d_name);
+        }
+    }
+    closedir(dir);
+
+}
+
+
+bool MemMapManager::IsInlineCommand(MemMapCmd cmd) {
+    switch (cmd) {
+        case CMD_ALLOCATE:
+        case CMD_ALLOCATE_BATCH:
+        case CMD_DEALLOCATE:
+        case CMD_RESIZE:
+        case CMD_COMMIT:
+            return false;
+        default:
+            return true;
+    }
+}
+
+
+void MemMapManager::HandleRequest(MemMapRequest &req, MemMapResponse &res, std::vector<shareable_handle_t> &shHandles) {
+
+    M3InternalErrorType m3Err;
+
+    // Responses are reused across requests: start from a clean one.
+    res = MemMapResponse(STATUSCODE_ACK);
+    res.dst = req.src;
+    res.serverGeneration = generation_.load();
+    res.backend = options_.backend;
+
+    switch (req.cmd) {
+        case CMD_ECHO:
+            break;
+        case CMD_HALT:
+            break;
+        case CMD_REGISTER:
+            m3Err = Register(res.dst);
+            if (m3Err == M3INTERNAL_DUPLICATE_REGISTER) {
+                res.status = STATUSCODE_DUPLICATE_REGISTER;
+            } else if (m3Err != M3INTERNAL_OK) {
+                res.status = STATUSCODE_UNKNOWN_ERR;
+            }
+            break;
+        case CMD_ALLOCATE:
+            if (req.token != 0) {
+                // Import of a known region: no name lookup.
+                std::vector<MemoryRegion> chunks;
+                if (ImportRegion(req.src, req.token, chunks, &res.roundedSize) != M3INTERNAL_OK) {
+                    res.status = STATUSCODE_STALE;
+                    break;
+                }
+                if (chunks[0].pageId != 0) {
+                    res.offset = chunks[0].offset;
+                    res.backingId = chunks[0].pageId;
+                    res.backingSize = deviceTable_[chunks[0].device].minGranularity;
+                }
+                ReplyChunks(chunks, res, shHandles);
+                res.generation = chunks[0].generation;
+                res.device = chunks[0].device;
+                res.token = req.token;
+                res.numShareableHandles = shHandles.size();
+                break;
+            }
+            if (SubAllocatable(req.size, req.flags)) {
+                MemoryRegion chunk;
+                m3Err = SubAllocateRegion(req.src, req.memId, req.size, req.flags, &chunk, &res.token);
+                if (m3Err != M3INTERNAL_OK) {
+                    res.status = AllocationStatus(m3Err);
+                    break;
+                }
+                res.roundedSize = chunk.size;
+                res.offset = chunk.offset;
+                res.backingId = chunk.pageId;
+                res.backingSize = deviceTable_[chunk.device].minGranularity;
+                res.generation = chunk.generation;
+                res.device = chunk.device;
+                shHandles.push_back(chunk.shareableHandle);
+                res.numShareableHandles = 1;
+                break;
+            }
+            res.roundedSize = GetRoundedAllocationSize(req.size, ServingDevice(req.src), req.flags);
+            {
+                std::vector<MemoryRegion> chunks;
+                m3Err = AllocateRegion(req.src, req.memId, req.alignment, res.roundedSize, req.flags, chunks, &res.token, &res.roundedSize);
+                if (m3Err != M3INTERNAL_OK) {
+                    res.status = AllocationStatus(m3Err);
+                    break;
+                }
+                ReplyChunks(chunks, res, shHandles);
+                res.generation = chunks[0].generation;
+                res.device = chunks[0].device;
+            }
+            res.numShareableHandles = shHandles.size();
+            break;
+        case CMD_DEALLOCATE:
+            m3Err = DeAllocate(req);
+            if (m3Err == M3INTERNAL_ENTRY_NOT_FOUND) {
+                res.status = STATUSCODE_INVALID;
+            } else if (m3Err != M3INTERNAL_OK) {
+                res.status = STATUSCODE_UNKNOWN_ERR;
+            }
+            // The client may drop its cached imports of the region right away.
+            res.serverGeneration = generation_.load();
+            break;
+        case CMD_VALIDATE:
+            {
+                // A region is still valid if it exists with the same generation.
+                std::lock_guard<std::mutex> lock(regionsMutex_);
+                const std::vector<MemoryRegion> *found = FindRegionLocked(req, &res.token, nullptr);
+                if (found == nullptr || (*found)[0].generation != req.generation) {
+                    res.status = STATUSCODE_STALE;
+                }
+            }
+            break;
+        case CMD_STAT:
+            {
+                std::lock_guard<std::mutex> lock(regionsMutex_);
+                const std::vector<MemoryRegion> *found = FindRegionLocked(req, &res.token, &res.roundedSize);
+                if (found == nullptr) {
+                    res.status = STATUSCODE_STALE;
+                    break;
+                }
+                res.generation = (*found)[0].generation;
+                res.device = (*found)[0].device;
+            }
+            break;
+        case CMD_RESIZE:
+            {
+                std::vector<MemoryRegion> chunks;
+                m3Err = ResizeRegion(req.token, req.size, req.limit, chunks, &res.roundedSize);
+                if (m3Err == M3INTERNAL_ENTRY_NOT_FOUND) {
+                    res.status = STATUSCODE_STALE;
+                    break;
+                } else if (m3Err == M3INTERNAL_NYI) {
+                    res.status = STATUSCODE_INVALID;
+                    break;
+                } else if (m3Err != M3INTERNAL_OK) {
+                    res.status = AllocationStatus(m3Err);
+                    break;
+                }
+                // Only the chunks the client does not map yet are sent, from res.offset on.
+                size_t chunkSize = chunks[0].size;
+                size_t firstChunk = std::min<size_t>(req.offset / chunkSize, chunks.size());
+                for (size_t i = firstChunk; i < chunks.size(); ++i) {
+                    shHandles.push_back(chunks[i].shareableHandle);
+                }
+                res.offset = firstChunk * chunkSize;
+                res.generation = chunks[0].generation;
+                res.device = chunks[0].device;
+                res.token = req.token;
+                res.numShareableHandles = shHandles.size();
+            }
+            break;
+        case CMD_GETROUNDEDALLOCATIONSIZE:
+            res.status = STATUSCODE_ACK;
+            res.roundedSize = GetRoundedAllocationSize(req.size, ServingDevice(req.src), req.flags);
+            break;
+        default:
+            res.status = STATUSCODE_NYI;
+            break;
+    }
+
+}
+
+
+M3InternalErrorType MemMapManager::AllocateRegion(ProcessInfo &pInfo, const char *memId, size_t alignment, size_t num_bytes, uint32_t flags, std::vector<MemoryRegion> &chunks, uint64_t *token, size_t *size) {
+
+    M3InternalErrorType m3Err;
+    const std::vector<MemoryRegion> *found;
+
+    chunks.clear();
+    if (M3_FLAG_NUMA_NODE_OF(flags) >= M3_MAX_NUMA_NODES) {
+        return M3INTERNAL_INVALID_ARGUMENT;
+    }
+    {
+        std::lock_guard<std::mutex> lock(regionsMutex_);
+        if ((found = regions_.Find(memId, num_bytes, pInfo.device, token)) != nullptr) {
+            regions_.AddRef(*token, pInfo.pid);
+            regions_.Find(*token, size);
+            chunks = *found;
+            return M3INTERNAL_OK;
+        }
+    }
+
+    // Striped regions are cut into numChunks chunks, on consecutive devices.
+    uint32_t numChunks = std::max<uint32_t>(1, M3_FLAG_STRIPES_OF(flags));
+    size_t chunkSize = num_bytes / numChunks;
+    CUdevice first = PlaceRegion(pInfo, flags, chunkSize);
+    // Sparse regions only get their first page up front.
+    bool sparse = flags & M3_FLAG_SPARSE;
+    if (sparse) {
+        numChunks = 1;
+        chunkSize = deviceTable_[first].minGranularity;
+    }
+    for (uint32_t i = 0; i < numChunks; ++i) {
+        MemoryRegion chunk = MemoryRegionInitializer;
+        chunk.device = (first + i) % device_count_;
+        if (chunkSize % deviceTable_[chunk.device].minGranularity != 0) {
+            chunk.device = first;
+        }
+        chunk.numaNode = RegionNumaNode(chunk.device, flags);
+        std::vector<shareable_handle_t> shHandle(1);
+        m3Err = CreateChunks(chunk.device, chunk.numaNode, alignment, chunkSize, shHandle);
+        if (m3Err != M3INTERNAL_OK) {
+            printf("M3 Internal Error Code %d\n", m3Err);
+            for (auto& created : chunks) {
+                RecycleChunk(created);
+            }
+            chunks.clear();
+            return m3Err;
+        }
+        chunk.shareableHandle = shHandle[0];
+        chunk.base = i * chunkSize;
+        chunk.size = chunkSize;
+        chunk.generation = generation_.load();
+        chunk.sparse = sparse;
+        chunk.resizable = flags & M3_FLAG_RESIZABLE;
+        chunks.push_back(chunk);
+    }
+
+    // Requests of other connections for the same region may be served by other workers meanwhile.
+    // The first one to register wins.
+    std::lock_guard<std::mutex> lock(regionsMutex_);
+    if (!regions_.Insert(memId, num_bytes, pInfo.device, chunks, token)) {
+        for (auto& chunk : chunks) {
+            RecycleChunk(chunk);
+        }
+        chunks = *regions_.Find(memId, num_bytes, pInfo.device, token);
+        regions_.Find(*token, size);
+    } else {
+        if (size) {
+            *size = num_bytes;
+        }
+        for (auto& chunk : chunks) {
+            AccountDevice(chunk.device, chunk.numaNode, chunkSize);
+        }
+    }
+    regions_.AddRef(*token, pInfo.pid);
+    return M3INTERNAL_OK;
+
+}
+
+
+bool MemMapManager::SubAllocatable(size_t num_bytes, uint32_t flags) const {
+
+    return num_bytes > 0 && num_bytes <= options_.subAllocMaxSize &&
+        !(flags & (M3_FLAG_RECOMMENDED_GRANULARITY | M3_FLAG_RESIZABLE | M3_FLAG_SPARSE)) &&
+        M3_FLAG_STRIPES_OF(flags) <= 1 && M3_FLAG_NUMA_NODE_OF(flags) < 0;
+
+}
+
+
+M3InternalErrorType MemMapManager::SubAllocateRegion(ProcessInfo &pInfo, const char *memId, size_t num_bytes, uint32_t flags, MemoryRegion *chunk, uint64_t *token) {
+
+    size_t slotSize = MemMapSlabAllocator::SizeClass(num_bytes);
+    const std::vector<MemoryRegion> *found;
+    MemMapSlot slot;
+
+    {
+        std::lock_guard<std::mutex> lock(regionsMutex_);
+        if ((found = regions_.Find(memId, slotSize, pInfo.device, token)) != nullptr) {
+            regions_.AddRef(*token, pInfo.pid);
+            *chunk = (*found)[0];
+            return M3INTERNAL_OK;
+        }
+    }
+
+    CUdevice device = PlaceRegion(pInfo, flags, 0);
+    size_t pageSize = deviceTable_[device].minGranularity;
+    while (!slabs_.Allocate(device, slotSize, &slot)) {
+        // Backing pages come from the pool like any other chunk.
+        std::vector<shareable_handle_t> page(1);
+        M3InternalErrorType m3Err = CreateChunks(device, deviceTable_[device].numaNode, 0, pageSize, page);
+        if (m3Err != M3INTERNAL_OK) {
+            return m3Err;
+        }
+        slabs_.AddPage(device, slotSize, page[0], pageSize);
+        AccountDevice(device, deviceTable_[device].numaNode, pageSize);
+    }
+
+    *chunk = MemoryRegionInitializer;
+    chunk->shareableHandle = slot.shareableHandle;
+    chunk->size = slot.size;
+    chunk->pageId = slot.pageId;
+    chunk->offset = slot.offset;
+    chunk->generation = generation_.load();
+    chunk->device = device;
+    chunk->numaNode = deviceTable_[device].numaNode;
+
+    std::lock_guard<std::mutex> lock(regionsMutex_);
+    if (!regions_.Insert(memId, slotSize, pInfo.device, std::vector<MemoryRegion>(1, *chunk), token)) {
+        // Another worker registered the region first.
+        FreeSlot(device, slot);
+        *chunk = (*regions_.Find(memId, slotSize, pInfo.device, token))[0];
+    }
+    regions_.AddRef(*token, pInfo.pid);
+    return M3INTERNAL_OK;
+
+}
+
+
+void MemMapManager::FreeSlot(CUdevice device, const MemMapSlot &slot) {
+
+    MemMapSlot released;
+    if (!slabs_.Free(device, slot, &released)) {
+        return;
+    }
+    // Backing pages are created on the node of their device (see SubAllocateRegion()).
+    MemoryRegion page = MemoryRegionInitializer;
+    page.shareableHandle = released.shareableHandle;
+    page.size = released.size;
+    page.device = device;
+    page.numaNode = deviceTable_[device].numaNode;
+    RecycleChunk(page);
+    AccountDevice(device, page.numaNode, -(int64_t)page.size);
+
+}
+
+
+M3InternalErrorType MemMapManager::ImportRegion(ProcessInfo &pInfo, uint64_t token, std::vector<MemoryRegion> &chunks, size_t *size) {
+
+    std::lock_guard<std::mutex> lock(regionsMutex_);
+    const std::vector<MemoryRegion> *found = regions_.Find(token, size);
+    if (found == nullptr) {
+        return M3INTERNAL_ENTRY_NOT_FOUND;
+    }
+    regions_.AddRef(token, pInfo.pid);
+    chunks = *found;
+    return M3INTERNAL_OK;
+
+}
+
+
+M3InternalErrorType MemMapManager::ResizeRegion(uint64_t token, size_t num_bytes, size_t limit, std::vector<MemoryRegion> &chunks, size_t *size) {
+
+    M3InternalErrorType m3Err;
+    const std::vector<MemoryRegion> *found;
+
+    {
+        std::lock_guard<std::mutex> lock(regionsMutex_);
+        if ((found = regions_.Find(token, size)) == nullptr) {
+            return M3INTERNAL_ENTRY_NOT_FOUND;
+        }
+        chunks = *found;
+    }
+    // Only regions created resizable grow. Sub-allocated regions share their backing page, and sparse ones are only committed.
+    if (!chunks[0].resizable || chunks[0].pageId != 0 || chunks[0].sparse) {
+        return M3INTERNAL_NYI;
+    }
+
+    // Another worker may grow the region meanwhile: the growth is then made again against its new size.
+    for (;;) {
+        if (num_bytes <= *size) {
+            return M3INTERNAL_OK;
+        }
+
+        // New chunks are of the size of the existing ones, so that clients map the region in equal chunks,
+        // and go round their devices and nodes: the new chunks following chunk j are created in one go.
+        size_t chunkSize = chunks[0].size;
+        size_t numChunks = chunks.size();
+        size_t numAdded = (num_bytes - *size + chunkSize - 1) / chunkSize;
+        if (limit != 0 && *size + numAdded * chunkSize > limit) {
+            return M3INTERNAL_INVALID_ARGUMENT;
+        }
+        std::vector<MemoryRegion> added(numAdded);
+        for (size_t j = 0; j < std::min(numChunks, numAdded); ++j) {
+            std::vector<shareable_handle_t> shHandles((numAdded - j + numChunks - 1) / numChunks);
+            m3Err = CreateChunks(chunks[j].device, chunks[j].numaNode, 0, chunkSize, shHandles);
+            if (m3Err != M3INTERNAL_OK) {
+                printf("M3 Internal Error Code %d\n", m3Err);
+                for (size_t k = 0; k < numAdded; ++k) {
+                    if (k % numChunks < j) {
+                        RecycleChunk(added[k]);
+                    }
+                }
+                return m3Err;
+            }
+            for (size_t n = 0; n < shHandles.size(); ++n) {
+                size_t k = j + n * numChunks;
+                added[k] = chunks[j];
+                added[k].shareableHandle = shHandles[n];
+                added[k].base = *size + k * chunkSize;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(regionsMutex_);
+        if (regions_.Append(token, *size, added)) {
+            for (auto& chunk : added) {
+                AccountDevice(chunk.device, chunk.numaNode, chunkSize);
+            }
+            chunks.insert(chunks.end(), added.begin(), added.end());
+            *size += numAdded * chunkSize;
+            return M3INTERNAL_OK;
+        }
+        for (auto& chunk : added) {
+            RecycleChunk(chunk);
+        }
+        if ((found = regions_.Find(token, size)) == nullptr) {
+            return M3INTERNAL_ENTRY_NOT_FOUND;
+        }
+        chunks = *found;
+    }
+
+}
+
+
+M3InternalErrorType MemMapManager::CommitRegion(uint64_t token, size_t offset, size_t num_bytes, std::vector<MemoryRegion> &chunks, size_t *size, size_t *next) {
+
+    M3InternalErrorType m3Err;
+    const std::vector<MemoryRegion> *found;
+    MemoryRegion first;
+    std::vector<MemoryRegion> added;
+    auto beforeBase = [](const MemoryRegion &chunk, uintptr_t base) { return chunk.base < base; };
+
+    chunks.clear();
+    {
+        std::lock_guard<std::mutex> lock(regionsMutex_);
+        if ((found = regions_.Find(token, size)) == nullptr) {
+            return M3INTERNAL_ENTRY_NOT_FOUND;
+        }
+        first = (*found)[0];
+        if (!first.sparse) {
+            return M3INTERNAL_NYI;
+        }
+        // Pages of the range missing from the region, which is sorted by base.
+        offset = std::min(offset, *size) / first.size * first.size;
+        size_t end = std::min(*size, offset + std::min(num_bytes, *size));
+        auto it = std::lower_bound(found->begin(), found->end(), offset, beforeBase);
+        for (size_t base = offset; base < end; base += first.size) {
+            if (it != found->end() && it->base == base) {
+                ++it;
+                continue;
+            }
+            MemoryRegion chunk = first;
+            chunk.base = base;
+            added.push_back(chunk);
+        }
+    }
+
+    if (!added.empty()) {
+        std::vector<shareable_handle_t> shHandles(added.size());
+        m3Err = CreateChunks(first.device, first.numaNode, 0, first.size, shHandles);
+        if (m3Err != M3INTERNAL_OK) {
+            printf("M3 Internal Error Code %d\n", m3Err);
+            return m3Err;
+        }
+        for (size_t i = 0; i < added.size(); ++i) {
+            added[i].shareableHandle = shHandles[i];
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(regionsMutex_);
+    if (!added.empty()) {
+        size_t numAdded = added.size();
+        if (!regions_.Commit(token, added)) {
+            for (auto& chunk : added) {
+                RecycleChunk(chunk);
+            }
+            return M3INTERNAL_ENTRY_NOT_FOUND;
+        }
+        // Pages committed meanwhile by another worker are left in added.
+        for (auto& chunk : added) {
+            RecycleChunk(chunk);
+        }
+        AccountDevice(first.device, first.numaNode, (numAdded - added.size()) * first.size);
+    }
+    if ((found = regions_.Find(token, size)) == nullptr) {
+        return M3INTERNAL_ENTRY_NOT_FOUND;
+    }
+
+    // List the committed pages of the range, or up to the end of the region.
+    size_t end = num_bytes ? std::min(*size, offset + std::min(num_bytes, *size)) : *size;
+    auto it = std::lower_bound(found->begin(), found->end(), offset, beforeBase);
+    for (; it != found->end() && it->base < end && chunks.size() < M3_MAX_COMMIT_PAGES; ++it) {
+        chunks.push_back(*it);
+    }
+    *next = (it != found->end() && it->base < end) ? it->base : end;
+    return M3INTERNAL_OK;
+
+}
+
+
+void MemMapManager::Commit(MemMapJob &job) {
+
+    MemMapRequest &req = job.req;
+    MemMapResponse res(STATUSCODE_ACK);
+    std::vector<shareable_handle_t> shHandles;
+    std::vector<MemoryRegion> chunks;
+    std::vector<uint64_t> pages;
+    std::vector<char> payload;
+
+    res.dst = req.src;
+    res.serverGeneration = generation_.load();
+    res.backend = options_.backend;
+    res.token = req.token;
+
+    size_t next = 0;
+    M3InternalErrorType m3Err = CommitRegion(req.token, req.offset, req.size, chunks, &res.roundedSize, &next);
+    if (m3Err == M3INTERNAL_ENTRY_NOT_FOUND) {
+        res.status = STATUSCODE_STALE;
+    } else if (m3Err == M3INTERNAL_NYI) {
+        res.status = STATUSCODE_INVALID;
+    } else if (m3Err != M3INTERNAL_OK) {
+        res.status = AllocationStatus(m3Err);
+    } else {
+        for (auto& chunk : chunks) {
+            shHandles.push_back(chunk.shareableHandle);
+            pages.push_back(chunk.base / chunk.size);
+        }
+        if (!chunks.empty()) {
+            res.commitSize = chunks[0].size;
+            res.generation = chunks[0].generation;
+            res.device = chunks[0].device;
+        }
+        res.offset = next;
+        res.numShareableHandles = shHandles.size();
+        payload.resize(pages.size() * M3_WIRE_MAX_VARINT);
+        payload.resize(MemMapWire::EncodeCommitPages(pages, payload.data()));
+    }
+    Reply(req, res, shHandles, *job.conn, payload.data(), payload.size());
+
+}
+
+
+void MemMapManager::ReplyChunks(const std::vector<MemoryRegion> &chunks, MemMapResponse &res, std::vector<shareable_handle_t> &shHandles) {
+
+    // The other pages of a sparse region are listed by CMD_COMMIT.
+    if (chunks[0].sparse) {
+        shHandles.push_back(chunks[0].shareableHandle);
+        res.commitSize = chunks[0].size;
+        return;
+    }
+    for (auto& chunk : chunks) {
+        shHandles.push_back(chunk.shareableHandle);
+    }
+
+}
+
+
+MemMapStatusCode MemMapManager::AllocationStatus(M3InternalErrorType m3Err) {
+
+    if (m3Err == M3INTERNAL_ALLOC_FAILED) {
+        return STATUSCODE_ALLOC_FAILED;
+    }
+    if (m3Err == M3INTERNAL_INVALID_ARGUMENT) {
+        return STATUSCODE_INVALID;
+    }
+    return STATUSCODE_UNKNOWN_ERR;
+
+}
+
+
+const std::vector<MemoryRegion> * MemMapManager::FindRegionLocked(const MemMapRequest &req, uint64_t *token, size_t *size) {
+
+    if (req.token != 0) {
+        *token = req.token;
+        return regions_.Find(req.token, size);
+    }
+    const std::vector<MemoryRegion> *found = regions_.Find(req.memId, req.size, req.src.device, token);
+    if (found && size) {
+        regions_.Find(*token, size);
+    }
+    return found;
+
+}
+
+
+CUdevice MemMapManager::PlaceRegion(const ProcessInfo &pInfo, uint32_t flags, size_t num_bytes) {
+
+    CUdevice local = ServingDevice(pInfo);
+    CUdevice device = local;
+    MemMapPlacement policy = M3_FLAG_PLACEMENT_OF(flags);
+    if (policy == M3_PLACEMENT_DEFAULT) {
+        policy = options_.placement;
+    }
+
+    switch (policy) {
+        case M3_PLACEMENT_EXPLICIT:
+            device = M3_FLAG_DEVICE_OF(flags);
+            if (device < 0 || device >= device_count_) {
+                device = local;
+            }
+            break;
+        case M3_PLACEMENT_ROUND_ROBIN:
+            device = nextDevice_++ % device_count_;
+            break;
+        case M3_PLACEMENT_LEAST_USED:
+            {
+                // Ties go to the requester.
+                std::lock_guard<std::mutex> lock(placementMutex_);
+                size_t mostFree = deviceTable_[local].totalBytes - std::min(deviceTable_[local].usedBytes, deviceTable_[local].totalBytes);
+                for (int d = 0; d < device_count_; ++d) {
+                    size_t free = deviceTable_[d].totalBytes - std::min(deviceTable_[d].usedBytes, deviceTable_[d].totalBytes);
+                    if (free > mostFree) {
+                        mostFree = free;
+                        device = d;
+                    }
+                }
+            }
+            break;
+        default:
+            break;
+    }
+
+    // Regions are rounded to the granularity of the requester's device.
+    if (num_bytes % deviceTable_[device].minGranularity != 0) {
+        device = local;
+    }
+    return device;
+
+}
+
+
+void MemMapManager::AccountDevice(CUdevice device, int numaNode, int64_t bytes) {
+
+    std::lock_guard<std::mutex> lock(placementMutex_);
+    deviceTable_[device].usedBytes += bytes;
+    if (numaNode >= 0 && options_.backend == M3_BACKEND_HOST) {
+        nodeUsedBytes_[numaNode] += bytes;
+    }
+
+}
+
+
+int MemMapManager::RegionNumaNode(CUdevice device, uint32_t flags) const {
+
+    int node = M3_FLAG_NUMA_NODE_OF(flags);
+    if (node < 0) {
+        return deviceTable_[device].numaNode;
+    }
+    return node;
+
+}
+
+
+int MemMapManager::DeviceNumaNode(CUdevice device) {
+
+    char busId[64];
+    if (cuDeviceGetPCIBusId(busId, sizeof(busId), device) != CUDA_SUCCESS) {
+        return -1;
+    }
+    // The driver reports the bus id in upper case, sysfs names it in lower case.
+    for (char *c = busId; *c; ++c) {
+        *c = tolower(*c);
+    }
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/numa_node", busId);
+    FILE *f = fopen(path, "r");
+    if (f == nullptr) {
+        return -1;
+    }
+    int node = -1;
+    if (fscanf(f, "%d", &node) != 1 || node >= M3_MAX_NUMA_NODES) {
+        node = -1;
+    }
+    fclose(f);
+    return node;
+
+}
+
+
+void MemMapManager::RecycleChunk(const MemoryRegion &chunk) {
+
+    // Pooled chunks must sit on the node of their device, where the pool is expected to place them.
+    if (!options_.poolEnabled || chunk.numaNode != deviceTable_[chunk.device].numaNode ||
+        !pool_.Put(chunk.device, chunk.size, chunk.shareableHandle)) {
+        close((int)chunk.shareableHandle);
+    }
+
+}
+
+
+M3InternalErrorType MemMapManager::CreateChunks(CUdevice device, int numaNode, size_t alignment, size_t chunkSize, std::vector<shareable_handle_t> &shHandles) {
+
+    M3InternalErrorType m3Err;
+    std::vector<shareable_handle_t> created;
+    size_t numPooled = 0;
+
+    bool pooled = options_.poolEnabled && numaNode == deviceTable_[device].numaNode;
+    if (pooled) {
+        while (numPooled < shHandles.size() && pool_.Get(device, chunkSize, &shHandles[numPooled])) {
+            ++numPooled;
+        }
+        pool_.hits += numPooled;
+        pool_.misses += shHandles.size() - numPooled;
+    }
+    if (numPooled == shHandles.size()) {
+        return M3INTERNAL_OK;
+    }
+
+    ProcessInfo owner(device);
+    created.resize(shHandles.size() - numPooled);
+    m3Err = Allocate(owner, numaNode, alignment, created.size() * chunkSize, created);
+    if (m3Err != M3INTERNAL_OK) {
+        // Chunks taken from the pool go back there.
+        for (size_t i = 0; i < numPooled; ++i) {
+            if (!pool_.Put(device, chunkSize, shHandles[i])) {
+                close((int)shHandles[i]);
+            }
+        }
+        return m3Err;
+    }
+    std::copy(created.begin(), created.end(), shHandles.begin() + numPooled);
+
+    // A miss is likely to be followed by other requests of the same size: refill the pool ahead of them.
+    // The refill is queued as a job without connection, so that it runs after the reply is sent.
+    // Workers being stopped take no new jobs.
+    if (pooled && options_.poolRefillChunks > 1 && !workers_.empty() && !workersStopping_) {
+        MemMapJob refill;
+        refill.req.src = ProcessInfo(device);
+        refill.req.size = chunkSize;
+        refill.req.memId[0] = '\0';
+        Dispatch(refill);
+    }
+    return M3INTERNAL_OK;
+
+}
+
+
+void MemMapManager::FillPool(CUdevice device, size_t chunkSize, int count) {
+
+    std::vector<shareable_handle_t> created;
+    ProcessInfo owner(device);
+
+    // Never create more than the pool accepts.
+    size_t room = options_.poolMaxIdleBytes > pool_.IdleBytes() ? options_.poolMaxIdleBytes - pool_.IdleBytes() : 0;
+    count = std::min<size_t>(count, room / chunkSize);
+    if (count <= 0) {
+        return;
+    }
+
+    created.resize(count);
+    if (Allocate(owner, deviceTable_[device].numaNode, 0, count * chunkSize, created) != M3INTERNAL_OK) {
+        return;
+    }
+    for (auto& sh : created) {
+        if (!pool_.Put(device, chunkSize, sh)) {
+            close((int)sh);
+        }
+    }
+
+}
+
+
+MemMapSlabAllocator::~MemMapSlabAllocator() {
+
+    for (auto& cls : classes_) {
+        for (auto& page : cls.second.pages) {
+            close((int)page->shareableHandle);
+        }
+    }
+
+}
+
+
+size_t MemMapSlabAllocator::SizeClass(size_t size) {
+
+    size_t slotSize = M3_SLAB_MIN_SLOT;
+    while (slotSize < size) {
+        slotSize <<= 1;
+    }
+    return slotSize;
+
+}
+
+
+bool MemMapSlabAllocator::Allocate(CUdevice device, size_t slotSize, MemMapSlot *slot) {
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    SizeClassPages &cls = classes_[std::make_pair(device, slotSize)];
+    if (cls.partial.empty()) {
+        return false;
+    }
+    Page *page = cls.partial.back();
+    uint32_t index = page->freeSlots.back();
+    page->freeSlots.pop_back();
+    if (page->freeSlots.empty()) {
+        cls.partial.pop_back();
+    }
+
+    slot->pageId = page->pageId;
+    slot->shareableHandle = page->shareableHandle;
+    slot->offset = (size_t)index * slotSize;
+    slot->size = slotSize;
+    return true;
+
+}
+
+
+void MemMapSlabAllocator::AddPage(CUdevice device, size_t slotSize, shareable_handle_t shHandle, size_t pageSize) {
+
+    std::unique_ptr<Page> page(new Page);
+    page->pageId = 0;
+    page->shareableHandle = shHandle;
+    page->slotSize = slotSize;
+    page->pageSize = pageSize;
+    // Slots are handed out from the beginning of the page.
+    for (uint32_t i = pageSize / slotSize; i > 0; --i) {
+        page->freeSlots.push_back(i - 1);
+    }
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    page->pageId = nextPageId_++;
+    pagesById_[page->pageId] = page.get();
+    SizeClassPages &cls = classes_[std::make_pair(device, slotSize)];
+    cls.partial.push_back(page.get());
+    cls.pages.push_back(std::move(page));
+    numPages_++;
+
+}
+
+
+bool MemMapSlabAllocator::Free(CUdevice device, const MemMapSlot &slot, MemMapSlot *released) {
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = pagesById_.find(slot.pageId);
+    if (it == pagesById_.end()) {
+        return false;
+    }
+    Page *page = it->second;
+    SizeClassPages &cls = classes_[std::make_pair(device, page->slotSize)];
+    if (page->freeSlots.empty()) {
+        cls.partial.push_back(page);
+    }
+    page->freeSlots.push_back(slot.offset / page->slotSize);
+    if (page->freeSlots.size() < page->pageSize / page->slotSize) {
+        return false;
+    }
+
+    // The page is empty: drop it. Its id is never reused, so that clients never mistake another page for it.
+    released->pageId = page->pageId;
+    released->shareableHandle = page->shareableHandle;
+    released->offset = 0;
+    released->size = page->pageSize;
+    pagesById_.erase(it);
+    cls.partial.erase(std::find(cls.partial.begin(), cls.partial.end(), page));
+    cls.pages.erase(std::find_if(cls.pages.begin(), cls.pages.end(),
+        [page](const std::unique_ptr<Page> &p) { return p.get() == page; }));
+    numPages_--;
+    return true;
+
+}
+
+
+void MemMapSlabAllocator::Save(MemMapHandoverState &state) {
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    state.Put<uint64_t>(nextPageId_);
+    state.Put<uint64_t>(numPages_);
+    for (auto& cls : classes_) {
+        for (auto& page : cls.second.pages) {
+            state.Put<int32_t>(cls.first.first);
+            state.Put<uint64_t>(page->slotSize);
+            state.Put<uint64_t>(page->pageSize);
+            state.Put<uint64_t>(page->pageId);
+            state.PutFd(page->shareableHandle);
+            state.Put<uint32_t>(page->freeSlots.size());
+            for (auto index : page->freeSlots) {
+                state.Put<uint32_t>(index);
+            }
+        }
+    }
+
+}
+
+
+bool MemMapSlabAllocator::Load(MemMapHandoverState &state) {
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    uint64_t nextPageId, numPages;
+    if (!state.Get(&nextPageId) || !state.Get(&numPages)) {
+        return false;
+    }
+    for (uint64_t p = 0; p < numPages; ++p) {
+        std::unique_ptr<Page> page(new Page);
+        int32_t device;
+        uint64_t slotSize, pageSize;
+        uint32_t numFree;
+        if (!state.Get(&device) || !state.Get(&slotSize) || !state.Get(&pageSize) || !state.Get(&page->pageId) ||
+            !state.GetFd(&page->shareableHandle) || !state.Get(&numFree) || slotSize == 0 || pageSize < slotSize) {
+            return false;
+        }
+        page->slotSize = slotSize;
+        page->pageSize = pageSize;
+        page->freeSlots.resize(numFree);
+        for (auto& index : page->freeSlots) {
+            if (!state.Get(&index)) {
+                return false;
+            }
+        }
+        pagesById_[page->pageId] = page.get();
+        SizeClassPages &cls = classes_[std::make_pair((CUdevice)device, (size_t)slotSize)];
+        if (!page->freeSlots.empty()) {
+            cls.partial.push_back(page.get());
+        }
+        cls.pages.push_back(std::move(page));
+        numPages_++;
+    }
+    nextPageId_ = std::max(nextPageId_, nextPageId);
+    return true;
+
+}
+
+
+size_t MemMapSlabAllocator::NumPages(void) {
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    return numPages_;
+
+}
+
+
+MemMapPool::~MemMapPool() {
+
+    for (auto& cls : idle_) {
+        for (auto& sh : cls.second) {
+            close((int)sh);
+        }
+    }
+
+}
+
+
+bool MemMapPool::Get(CUdevice device, size_t size, shareable_handle_t *shHandle) {
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = idle_.find(std::make_pair(device, size));
+    if (it == idle_.end() || it->second.empty()) {
+        return false;
+    }
+    *shHandle = it->second.back();
+    it->second.pop_back();
+    idleBytes_ -= size;
+    return true;
+
+}
+
+
+bool MemMapPool::Put(CUdevice device, size_t size, shareable_handle_t shHandle) {
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (idleBytes_ + size > maxIdleBytes_) {
+        return false;
+    }
+    idle_[std::make_pair(device, size)].push_back(shHandle);
+    idleBytes_ += size;
+    return true;
+
+}
+
+
+void MemMapPool::SetMaxIdleBytes(size_t maxIdleBytes) {
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    maxIdleBytes_ = maxIdleBytes;
+
+}
+
+
+size_t MemMapPool::IdleBytes(void) {
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    return idleBytes_;
+
+}
+
+
+size_t MemMapPool::IdleChunks(void) {
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    size_t n = 0;
+    for (auto& cls : idle_) {
+        n += cls.second.size();
+    }
+    return n;
+
+}
+
+
+void MemMapManager::AllocateBatch(MemMapJob &job) {
+
+    MemMapRequest &req = job.req;
+    MemMapResponse res;
+    std::vector<shareable_handle_t> shHandles;
+    std::vector<MemoryRegion> chunks;
+    std::unordered_map<std::string, uint32_t> firstIndex;
+
+    res.dst = req.src;
+    res.status = STATUSCODE_ACK;
+    res.serverGeneration = generation_.load();
+    res.backend = options_.backend;
+
+    uint32_t count = std::min<size_t>(req.size, M3_MAX_BATCH);
+    std::vector<MemMapBatchEntry> entries(count);
+    const char *p = job.payload.data();
+    const char *end = p + job.payload.size();
+    uint32_t decoded = 0;
+    for (size_t entrySize; decoded < count && (entrySize = MemMapWire::DecodeBatchEntry(p, end - p, &entries[decoded])) > 0; ++decoded) {
+        p += entrySize;
+    }
+    if (req.size > M3_MAX_BATCH || decoded != count || p != end) {
+        res.status = STATUSCODE_INVALID;
+        count = 0;
+    }
+    std::vector<MemMapBatchResult> results(count);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        results[i].roundedSize = GetRoundedAllocationSize(entries[i].size, ServingDevice(req.src), req.flags);
+        results[i].numShareableHandles = 0;
+        results[i].duplicateOf = i;
+        results[i].device = 0;
+        results[i].token = 0;
+        results[i].offset = 0;
+        results[i].backingId = 0;
+        results[i].backingSize = 0;
+        // Small entries are sub-allocated, like CMD_ALLOCATE would, and keyed by their size.
+        bool small = SubAllocatable(entries[i].size, req.flags);
+
+        // Entries naming the same region share the handles of the first one.
+        std::string key(entries[i].memId, strnlen(entries[i].memId, MAX_MEMID_LEN));
+        key.append(1, '\0').append(std::to_string(small ? entries[i].size : results[i].roundedSize));
+        auto it = firstIndex.find(key);
+        if (it != firstIndex.end()) {
+            results[i] = results[it->second];
+            results[i].numShareableHandles = 0;
+            continue;
+        }
+        firstIndex[key] = i;
+
+        if (small) {
+            MemoryRegion chunk;
+            M3InternalErrorType m3Err = SubAllocateRegion(req.src, entries[i].memId, entries[i].size, req.flags, &chunk, &results[i].token);
+            if (m3Err != M3INTERNAL_OK) {
+                results[i].status = AllocationStatus(m3Err);
+                continue;
+            }
+            results[i].status = STATUSCODE_ACK;
+            results[i].roundedSize = chunk.size;
+            results[i].offset = chunk.offset;
+            results[i].backingId = chunk.pageId;
+            results[i].backingSize = deviceTable_[chunk.device].minGranularity;
+            results[i].device = chunk.device;
+            results[i].numShareableHandles = 1;
+            shHandles.push_back(chunk.shareableHandle);
+            continue;
+        }
+        M3InternalErrorType m3Err = AllocateRegion(req.src, entries[i].memId, entries[i].alignment, results[i].roundedSize, req.flags & ~M3_FLAG_SPARSE, chunks, &results[i].token, &results[i].roundedSize);
+        if (m3Err != M3INTERNAL_OK) {
+            results[i].status = AllocationStatus(m3Err);
+            continue;
+        }
+        if (chunks[0].sparse) {
+            // Batches map whole regions: sparse ones are refused, and the reference just taken is dropped.
+            MemMapRequest release(CMD_DEALLOCATE);
+            release.src = req.src;
+            release.token = results[i].token;
+            DeAllocate(release);
+            results[i].status = STATUSCODE_INVALID;
+            results[i].token = 0;
+            continue;
+        }
+        results[i].status = STATUSCODE_ACK;
+        results[i].numShareableHandles = chunks.size();
+        results[i].device = chunks[0].device;
+        for (auto& chunk : chunks) {
+            shHandles.push_back(chunk.shareableHandle);
+        }
+    }
+
+    // Backing pages go once per connection, as for CMD_ALLOCATE: which ones the client lacks is only known
+    // with the send lock held, up to the reply.
+    std::lock_guard<std::mutex> lock(job.conn->sendMutex);
+    size_t kept = 0, next = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (results[i].duplicateOf != i) {
+            continue;
+        }
+        if (results[i].backingId != 0 && !job.conn->backingsSent.insert(results[i].backingId).second) {
+            results[i].numShareableHandles = 0;
+            ++next;
+            continue;
+        }
+        for (uint32_t h = 0; h < results[i].numShareableHandles; ++h) {
+            shHandles[kept++] = shHandles[next++];
+        }
+    }
+    shHandles.resize(kept);
+
+    std::vector<char> payload(count * M3_WIRE_MAX_BATCH_RESULT_SIZE);
+    size_t payloadSize = 0;
+    for (auto& result : results) {
+        payloadSize += MemMapWire::EncodeBatchResult(result, payload.data() + payloadSize);
+    }
+
+    res.numShareableHandles = shHandles.size();
+    ReplyLocked(req, res, shHandles, *job.conn, payload.data(), payloadSize);
+
+}
+
+
+void MemMapManager::Reply(MemMapRequest &req, MemMapResponse &res, std::vector<shareable_handle_t> &shHandles, MemMapConnection &conn, const void *payload, size_t payloadSize) {
+
+    std::lock_guard<std::mutex> lock(conn.sendMutex);
+    ReplyLocked(req, res, shHandles, conn, payload, payloadSize);
+
+}
+
+
+void MemMapManager::ReplyLocked(MemMapRequest &req, MemMapResponse &res, std::vector<shareable_handle_t> &shHandles, MemMapConnection &conn, const void *payload, size_t payloadSize) {
+
+    char header[M3_WIRE_MAX_SIZE];
+    struct msghdr msg = {0};
+    struct iovec iov[2];
+    iov[0].iov_base = (void *)header;
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = payloadSize;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = payloadSize ? 2 : 1;
+
+    // A client going away must not take the server down, so send failures are only reported.
+    // The event loop notices the hangup and closes the connection.
+    if (res.backingId != 0 && !conn.backingsSent.insert(res.backingId).second) {
+        // The client already holds this backing page.
+        shHandles.clear();
+        res.numShareableHandles = 0;
+    }
+    iov[0].iov_len = MemMapWire::EncodeResponse(res, header);
+    if (sendmsg(conn.sock_fd, &msg, MSG_NOSIGNAL) < 0) {
+        perror("MemMapManager::Reply: failed to send IPC message");
+        return;
+    }
+    txMessages_++;
+    txBytes_ += iov[0].iov_len + payloadSize;
+
+    // Every handle of a region goes in a single message, up to IPC_SCM_MAX_FD of them.
+    if (ipcSendShareableHandles(conn.sock_fd, shHandles) < 0) {
+        perror("MemMapManager::Reply: failed to send shareable handles");
+    }
+
+}
+
+
+bool MemMapManager::HandOver(MemMapRequest &req, MemMapConnection &conn) {
+
+    MemMapResponse res;
+    std::vector<shareable_handle_t> shHandles;
+    res.dst = req.src;
+    // Nothing is sent to a successor which could not load it.
+    if (req.size != M3_HANDOVER_VERSION || req.flags != (uint32_t)options_.backend || req.alignment != (size_t)device_count_) {
+        printf("MemMapManager::HandOver: refused a handover of version %zu, backend %u, %zu devices\n", req.size, req.flags, req.alignment);
+        res.status = STATUSCODE_INVALID;
+        Reply(req, res, shHandles, conn);
+        return false;
+    }
+
+    MemMapHandoverState state;
+    SaveState(state, conn);
+    res.status = STATUSCODE_ACK;
+    res.roundedSize = state.data.size();
+    res.numShareableHandles = state.fds.size();
+    res.serverGeneration = generation_.load();
+    Reply(req, res, shHandles, conn);
+
+    for (size_t sent = 0; sent < state.data.size(); sent += M3_HANDOVER_CHUNK) {
+        size_t len = std::min<size_t>(M3_HANDOVER_CHUNK, state.data.size() - sent);
+        if (send(conn.sock_fd, state.data.data() + sent, len, MSG_NOSIGNAL) != (ssize_t)len) {
+            perror("MemMapManager::HandOver: failed to send the state");
+            return false;
+        }
+    }
+    if (ipcSendShareableHandles(conn.sock_fd, state.fds) < 0) {
+        perror("MemMapManager::HandOver: failed to send file descriptors");
+        return false;
+    }
+
+    // The server only goes once the successor confirms it loaded the state, with a CMD_HANDOVER of the size of the state.
+    // Otherwise the connection of the successor is shut down, and the server keeps serving.
+    char buf[M3_WIRE_MAX_SIZE];
+    MemMapRequest confirm;
+    struct pollfd pfd = { conn.sock_fd, POLLIN, 0 };
+    ssize_t n;
+    if (poll(&pfd, 1, M3_HANDOVER_TIMEOUT_MS) <= 0 || (n = recv(conn.sock_fd, buf, sizeof(buf), 0)) <= 0 ||
+        MemMapWire::DecodeRequest(buf, n, &confirm) == 0 || confirm.cmd != CMD_HANDOVER || confirm.size != state.data.size()) {
+        printf("MemMapManager::HandOver: the successor did not confirm the handover, keeping on serving\n");
+        shutdown(conn.sock_fd, SHUT_RDWR);
+        return false;
+    }
+    Reply(confirm, res, shHandles, conn);
+    printf("M3Server: handed %zu regions and %zu connections over to process %d\n",
+        regions_.Size(), connections_.size() - 1, conn.pid);
+    return true;
+
+}
+
+
+void MemMapManager::TakeOver() {
+
+    MemMapRequest req(CMD_HANDOVER);
+    MemMapResponse res;
+    MemMapHandoverState state;
+
+    int sock_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock_fd < 0 || connect(sock_fd, (struct sockaddr *)&server_addr, SUN_LEN(&server_addr)) < 0) {
+        if (sock_fd >= 0) {
+            close(sock_fd);
+        }
+        printf("M3Server: no server to take over, starting afresh\n");
+        unlink(MemMapManager::endpointName);
+        RemoveStaleEndpoints();
+        ipc_sock_fd_ = ipcListen(&server_addr);
+        printf("M3Server: Listening on %s\n", MemMapManager::endpointName);
+        return;
+    }
+
+    req.src.pid = getpid();
+    req.size = M3_HANDOVER_VERSION;
+    // Regions of another backend, or on other devices, could not be served.
+    req.flags = options_.backend;
+    req.alignment = device_count_;
+    if (!SendRequest(sock_fd, req) || !RecvResponse(sock_fd, &res)) {
+        panic("MemMapManager::TakeOver: the running server did not answer");
+    }
+    if (res.status != STATUSCODE_ACK) {
+        panic("MemMapManager::TakeOver: the running server refused to hand over");
+    }
+    state.data.resize(res.roundedSize);
+    for (size_t received = 0; received < state.data.size(); ) {
+        ssize_t n = recv(sock_fd, state.data.data() + received, std::min<size_t>(M3_HANDOVER_CHUNK, state.data.size() - received), 0);
+        if (n <= 0) {
+            panic("MemMapManager::TakeOver: failed to receive the state");
+        }
+        received += n;
+    }
+    if (ipcRecvShareableHandles(sock_fd, state.fds, res.numShareableHandles) < 0) {
+        panic("MemMapManager::TakeOver: failed to receive file descriptors");
+    }
+
+    // Until the running server acknowledges the confirmation, it still owns the endpoint:
+    // failing up to then leaves it serving, with everything it handed over.
+    if (!LoadState(state)) {
+        panic("MemMapManager::TakeOver: malformed state");
+    }
+    MemMapRequest confirm(CMD_HANDOVER);
+    confirm.src.pid = getpid();
+    confirm.size = state.data.size();
+    if (!SendRequest(sock_fd, confirm) || !RecvResponse(sock_fd, &res) || res.status != STATUSCODE_ACK) {
+        panic("MemMapManager::TakeOver: the running server did not acknowledge the handover");
+    }
+    close(sock_fd);
+    printf("M3Server: took %zu regions and %zu connections over on %s\n",
+        regions_.Size(), connections_.size(), MemMapManager::endpointName);
+
+}
+
+
+void MemMapManager::SaveState(MemMapHandoverState &state, MemMapConnection &conn) {
+
+    state.Put<uint32_t>(M3_HANDOVER_VERSION);
+    state.Put<uint64_t>(generation_.load());
+    state.PutFd(ipc_sock_fd_);
+    {
+        std::lock_guard<std::mutex> lock(placementMutex_);
+        state.Put<int32_t>(device_count_);
+        for (int d = 0; d < device_count_; ++d) {
+            state.Put<uint64_t>(deviceTable_[d].usedBytes);
+        }
+        for (int node = 0; node < M3_MAX_NUMA_NODES; ++node) {
+            state.Put<uint64_t>(nodeUsedBytes_[node]);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(regionsMutex_);
+        regions_.Save(state);
+    }
+    slabs_.Save(state);
+
+    state.Put<uint32_t>(connections_.size() - connections_.count(conn.sock_fd));
+    for (auto& it : connections_) {
+        MemMapConnection &other = *it.second;
+        if (&other == &conn) {
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(other.sendMutex);
+        state.PutFd(other.sock_fd);
+        state.Put<uint32_t>(other.backingsSent.size());
+        for (auto backingId : other.backingsSent) {
+            state.Put<uint64_t>(backingId);
+        }
+    }
+    // Processes without connection left may still hold references.
+    state.Put<uint32_t>(clients_.size() - clients_.count(conn.pid));
+    for (auto& client : clients_) {
+        if (client.first != conn.pid) {
+            state.Put<int32_t>(client.first);
+        }
+    }
+
+}
+
+
+bool MemMapManager::LoadState(MemMapHandoverState &state) {
+
+    uint32_t version, numConnections, numClients;
+    uint64_t generation;
+    int32_t numDevices;
+    shareable_handle_t listen_fd;
+    if (!state.Get(&version) || version != M3_HANDOVER_VERSION || !state.Get(&generation) ||
+        !state.GetFd(&listen_fd) || !state.Get(&numDevices) || numDevices != device_count_) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(placementMutex_);
+        for (int d = 0; d < device_count_; ++d) {
+            if (!state.Get(&deviceTable_[d].usedBytes)) {
+                return false;
+            }
+        }
+        for (int node = 0; node < M3_MAX_NUMA_NODES; ++node) {
+            if (!state.Get(&nodeUsedBytes_[node])) {
+                return false;
+            }
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(regionsMutex_);
+        if (!regions_.Load(state)) {
+            return false;
+        }
+    }
+    if (!slabs_.Load(state)) {
+        return false;
+    }
+    // Same generation: clients keep their cached imports.
+    generation_ = generation;
+    ipc_sock_fd_ = (int)listen_fd;
+
+    if (!state.Get(&numConnections)) {
+        return false;
+    }
+    for (uint32_t c = 0; c < numConnections; ++c) {
+        shareable_handle_t sock_fd;
+        uint32_t numBackings;
+        if (!state.GetFd(&sock_fd) || !state.Get(&numBackings)) {
+            return false;
+        }
+        std::shared_ptr<MemMapConnection> conn = AddConnection((int)sock_fd);
+        for (uint32_t b = 0; b < numBackings; ++b) {
+            uint64_t backingId;
+            if (!state.Get(&backingId)) {
+                return false;
+            }
+            if (conn) {
+                conn->backingsSent.insert(backingId);
+            }
+        }
+    }
+    if (!state.Get(&numClients)) {
+        return false;
+    }
+    for (uint32_t c = 0; c < numClients; ++c) {
+        int32_t pid;
+        if (!state.Get(&pid)) {
+            return false;
+        }
+        WatchClient(pid);
+        // Gone before the handover, with its last connection.
+        if (clients_[pid].pidfd < 0 && clients_[pid].numConnections == 0) {
+            ReapClient(pid);
+        }
+    }
+    return true;
+
+}
+
+
+MemMapConnection::~MemMapConnection() {
+
+    if (ring) {
+        ring->segment->closed.store(1);
+        futexWake(&ring->segment->requests.head);
+        ring->thread.join();
+        ring->segment->~MemMapRingSegment();
+        sharedMemoryClose(&ring->shm);
+    }
+    close(sock_fd);
+
+}
+
+
+MemMapBurst::MemMapBurst(int _size) : size(_size), recvBuf((size_t)_size * M3_MAX_MESSAGE_SIZE), recvIov(_size), recvMsgs(_size),
+    numReplies(0), replyBytes(0), reqs(_size), ress(_size), replyBuf((size_t)_size * M3_WIRE_MAX_SIZE), replyIov(_size), replyMsgs(_size) {
+
+    for (int i = 0; i < size; ++i) {
+        recvIov[i].iov_base = recvBuf.data() + (size_t)i * M3_MAX_MESSAGE_SIZE;
+        recvIov[i].iov_len = M3_MAX_MESSAGE_SIZE;
+        bzero(&recvMsgs[i], sizeof(recvMsgs[i]));
+        recvMsgs[i].msg_hdr.msg_iov = &recvIov[i];
+        recvMsgs[i].msg_hdr.msg_iovlen = 1;
+
+        replyIov[i].iov_base = replyBuf.data() + (size_t)i * M3_WIRE_MAX_SIZE;
+        bzero(&replyMsgs[i], sizeof(replyMsgs[i]));
+        replyMsgs[i].msg_hdr.msg_iov = &replyIov[i];
+        replyMsgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+}
+
+
+bool MemMapManager::IsLookup(MemMapCmd cmd) {
+    switch (cmd) {
+        case CMD_ECHO:
+        case CMD_GETROUNDEDALLOCATIONSIZE:
+        case CMD_VALIDATE:
+        case CMD_STAT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+void MemMapManager::ServeInline(MemMapBurst &burst, MemMapRequest &req) {
+
+    int i = burst.numReplies;
+    MemMapResponse &res = burst.ress[i];
+    burst.reqs[i] = req;
+
+    int same = -1;
+    if (IsLookup(req.cmd)) {
+        for (int j = 0; j < i && same < 0; ++j) {
+            const MemMapRequest &other = burst.reqs[j];
+            if (other.cmd == req.cmd && other.src.device == req.src.device && other.size == req.size &&
+                other.flags == req.flags && other.token == req.token && other.generation == req.generation &&
+                !strncmp(other.memId, req.memId, MAX_MEMID_LEN)) {
+                same = j;
+            }
+        }
+    }
+    if (same >= 0) {
+        res = burst.ress[same];
+    } else {
+        std::vector<shareable_handle_t> shHandles;
+        HandleRequest(req, res, shHandles);
+        // Inline commands never pass shareable handles.
+        assert(shHandles.empty());
+    }
+
+    burst.replyIov[i].iov_len = MemMapWire::EncodeResponse(res, (char *)burst.replyIov[i].iov_base);
+    burst.replyBytes += burst.replyIov[i].iov_len;
+    burst.numReplies++;
+
+}
+
+
+void MemMapManager::FlushReplies(MemMapBurst &burst, MemMapConnection &conn) {
+
+    if (burst.numReplies == 0) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(conn.sendMutex);
+        for (int sent = 0; sent < burst.numReplies; ) {
+            int n = sendmmsg(conn.sock_fd, &burst.replyMsgs[sent], burst.numReplies - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                // The event loop notices the hangup and closes the connection.
+                perror("MemMapManager::FlushReplies: failed to send IPC messages");
+                break;
+            }
+            sent += n;
+        }
+    }
+    txMessages_ += burst.numReplies;
+    txBytes_ += burst.replyBytes;
+    burst.numReplies = 0;
+    burst.replyBytes = 0;
+
+}
+
+
+void MemMapManager::SendStats(MemMapRequest &req, MemMapConnection &conn) {
+
+    MemMapResponse res;
+    MemMapStats stats;
+    std::vector<shareable_handle_t> shHandles;
+
+    res.dst = req.src;
+    res.status = STATUSCODE_ACK;
+    res.numShareableHandles = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(regionsMutex_);
+        stats.numRegions = regions_.Size();
+    }
+    stats.poolHits = pool_.hits.load();
+    stats.poolMisses = pool_.misses.load();
+    stats.poolIdleChunks = pool_.IdleChunks();
+    stats.poolIdleBytes = pool_.IdleBytes();
+    stats.slabPages = slabs_.NumPages();
+    stats.reclaimPendingBytes = reclaimPendingBytes_.load();
+    stats.reclaimedBytes = reclaimedBytes_.load();
+    stats.liveClients = clients_.size();
+    stats.reapedClients = reapedClients_;
+    stats.rxBursts = rxBursts_;
+    stats.rxMessages = rxMessages_;
+    stats.rxBytes = rxBytes_;
+    stats.txMessages = txMessages_.load();
+    stats.txBytes = txBytes_.load();
+    for (int c = 0; c < M3_PRIORITY_COUNT; ++c) {
+        stats.queueDepth[c] = stats.queueServed[c] = stats.queueWaitNs[c] = stats.queueMaxWaitNs[c] = 0;
+    }
+    for (auto worker : workers_) {
+        std::lock_guard<std::mutex> lock(worker->mtx);
+        for (int c = 0; c < M3_PRIORITY_COUNT; ++c) {
+            stats.queueDepth[c] += worker->jobs.Depth((MemMapPriority)c);
+            stats.queueServed[c] += worker->jobs.served[c];
+            stats.queueWaitNs[c] += worker->jobs.waitNs[c];
+            stats.queueMaxWaitNs[c] = std::max(stats.queueMaxWaitNs[c], worker->jobs.maxWaitNs[c]);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(placementMutex_);
+        stats.numDevices = std::min(device_count_, M3_MAX_DEVICES);
+        for (uint64_t d = 0; d < stats.numDevices; ++d) {
+            stats.deviceUsedBytes[d] = deviceTable_[d].usedBytes;
+            stats.deviceNumaNode[d] = deviceTable_[d].numaNode;
+        }
+        std::copy(nodeUsedBytes_, nodeUsedBytes_ + M3_MAX_NUMA_NODES, stats.nodeUsedBytes);
+    }
+    // Node ids may have holes: nodes without a meminfo file report nothing.
+    stats.numNodes = 0;
+    for (int node = 0; node < M3_MAX_NUMA_NODES; ++node) {
+        char path[64], line[128];
+        unsigned long long kb;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/meminfo", node);
+        stats.nodeTotalBytes[node] = stats.nodeFreeBytes[node] = 0;
+        FILE *f = fopen(path, "r");
+        if (f == nullptr) {
+            continue;
+        }
+        while (fgets(line, sizeof(line), f) != nullptr) {
+            if (sscanf(line, "Node %*d MemTotal: %llu kB", &kb) == 1) {
+                stats.nodeTotalBytes[node] = kb << 10;
+            } else if (sscanf(line, "Node %*d MemFree: %llu kB", &kb) == 1) {
+                stats.nodeFreeBytes[node] = kb << 10;
+            }
+        }
+        fclose(f);
+        stats.numNodes = node + 1;
+    }
+
+    Reply(req, res, shHandles, conn, &stats, sizeof(stats));
+
+}
+
+
+void MemMapManager::OpenRing(MemMapRequest &req, MemMapConnection &conn) {
+
+    MemMapResponse res;
+    std::vector<shareable_handle_t> shHandles;
+    char shmName[128];
+
+    res.dst = req.src;
+    res.status = STATUSCODE_ACK;
+    res.numShareableHandles = 0;
+
+    if (conn.ring) {
+        // Only one ring pair per connection.
+        res.status = STATUSCODE_DUPLICATE_REGISTER;
+        Reply(req, res, shHandles, conn);
+        return;
+    }
+
+    std::unique_ptr<MemMapRingServer> ring(new MemMapRingServer);
+    sprintf(shmName, "/%s_Ring_%d_%d", MemMapManager::name, getpid(), conn.sock_fd);
+    if (sharedMemoryCreate(shmName, sizeof(MemMapRingSegment), &ring->shm) != 0) {
+        perror("MemMapManager::OpenRing: failed to create shared memory");
+        res.status = STATUSCODE_UNKNOWN_ERR;
+        Reply(req, res, shHandles, conn);
+        return;
+    }
+    // The segment lives on through the file descriptors and mappings only.
+    shm_unlink(shmName);
+    ring->segment = new (ring->shm.addr) MemMapRingSegment;
+
+    res.numShareableHandles = 1;
+    shHandles.push_back((shareable_handle_t)ring->shm.shmFd);
+    Reply(req, res, shHandles, conn);
+
+    ring->thread = std::thread(&MemMapManager::RingServer, this, ring.get());
+    conn.ring = std::move(ring);
+
+}
+
+
+void MemMapManager::RingServer(MemMapRingServer *ring) {
+
+    CUUTIL_ERRCHK(cuCtxSetCurrent(ctx_));
+
+    MemMapRingSegment *segment = ring->segment;
+    MemMapRequest req;
+    MemMapResponse res;
+    std::vector<shareable_handle_t> shHandles;
+    uint32_t spinLimit = M3_RING_MIN_SPIN;
+    // Ring threads are started by the server loop: keep them off its CPU when it busy polls.
+    if (options_.busyPollCpu >= 0) {
+        pthread_setaffinity_np(pthread_self(), sizeof(otherCpus_), &otherCpus_);
+    }
+
+    while (ringPop(&segment->requests, &req, spinLimit, &segment->closed)) {
+        if (IsInlineCommand(req.cmd) && req.cmd != CMD_HALT && req.cmd != CMD_OPENRING) {
+            shHandles.clear();
+            HandleRequest(req, res, shHandles);
+        } else {
+            res.dst = req.src;
+            res.status = STATUSCODE_NYI;
+        }
+        while (!ringPush(&segment->responses, res)) {
+            cpuRelax();
+        }
+    }
+
+}
+
+
+void MemMapManager::StartWorkers() {
+
+    workersStopping_ = false;
+    int numWorkersPerDevice = std::max(1, options_.numWorkersPerDevice);
+    for (int d = 0; d < device_count_; ++d) {
+        for (int i = 0; i < numWorkersPerDevice; ++i) {
+            MemMapWorker *worker = new MemMapWorker;
+            worker->device = devices_[d];
+            worker->halt = false;
+            worker->jobs.SetWeights(options_.priorityWeights);
+            workers_.push_back(worker);
+        }
+    }
+    for (auto worker : workers_) {
+        worker->thread = std::thread(&MemMapManager::Worker, this, worker);
+    }
+
+}
+
+
+void MemMapManager::StopWorkers() {
+
+    workersStopping_ = true;
+    for (auto worker : workers_) {
+        {
+            std::lock_guard<std::mutex> lock(worker->mtx);
+            worker->halt = true;
+        }
+        worker->cv.notify_one();
+    }
+    // A worker draining its queue may still dispatch to the others: none is deleted before every one has stopped.
+    for (auto worker : workers_) {
+        worker->thread.join();
+    }
+    for (auto worker : workers_) {
+        delete worker;
+    }
+    workers_.clear();
+
+}
+
+
+void MemMapManager::StartReclaimer() {
+
+    reclaimHalt_ = false;
+    reclaimer_ = std::thread(&MemMapManager::Reclaimer, this);
+
+}
+
+
+void MemMapManager::StopReclaimer() {
+
+    if (!reclaimer_.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(reclaimMutex_);
+        reclaimHalt_ = true;
+    }
+    reclaimCv_.notify_one();
+    reclaimer_.join();
+
+}
+
+
+void MemMapManager::Reclaimer() {
+
+    CUUTIL_ERRCHK(cuCtxSetCurrent(ctx_));
+
+    size_t batchSize = std::max(1, options_.reclaimBatch);
+    std::vector<MemMapReclaim> batch;
+    std::unique_lock<std::mutex> lock(reclaimMutex_);
+
+    while (true) {
+        reclaimCv_.wait(lock, [this]() { return reclaimHalt_ || !reclaimQueue_.empty(); });
+        if (reclaimQueue_.empty()) {
+            break;
+        }
+        // Let more regions join the batch, unless it is already full.
+        reclaimCv_.wait_for(lock, std::chrono::milliseconds(options_.reclaimDelayMs),
+            [this, batchSize]() { return reclaimHalt_ || reclaimQueue_.size() >= batchSize; });
+
+        size_t n = std::min(reclaimQueue_.size(), batchSize);
+        batch.assign(std::make_move_iterator(reclaimQueue_.begin()), std::make_move_iterator(reclaimQueue_.begin() + n));
+        reclaimQueue_.erase(reclaimQueue_.begin(), reclaimQueue_.begin() + n);
+        lock.unlock();
+        for (auto& reclaim : batch) {
+            Reclaim(reclaim);
+        }
+        batch.clear();
+        lock.lock();
+    }
+
+}
+
+
+void MemMapManager::QueueReclaim(MemMapReclaim &reclaim) {
+
+    // Chunks are not handed out again right away, but in batches by the reclaimer thread.
+    for (auto& chunk : reclaim.chunks) {
+        reclaimPendingBytes_ += chunk.size;
+    }
+    {
+        std::lock_guard<std::mutex> lock(reclaimMutex_);
+        reclaimQueue_.push_back(std::move(reclaim));
+    }
+    reclaimCv_.notify_one();
+
+}
+
+
+void MemMapManager::Reclaim(MemMapReclaim &reclaim) {
+
+    for (auto& chunk : reclaim.chunks) {
+        if (chunk.pageId != 0) {
+            MemMapSlot slot;
+            slot.pageId = chunk.pageId;
+            slot.shareableHandle = chunk.shareableHandle;
+            slot.offset = chunk.offset;
+            slot.size = chunk.size;
+            FreeSlot(chunk.device, slot);
+        } else {
+            RecycleChunk(chunk);
+            AccountDevice(chunk.device, chunk.numaNode, -(int64_t)chunk.size);
+        }
+        reclaimPendingBytes_ -= chunk.size;
+        reclaimedBytes_ += chunk.size;
+    }
+
+}
+
+
+MemMapJobQueue::MemMapJobQueue() : vtime_(0), seq_(0), size_(0) {
+
+    for (int c = 0; c < M3_PRIORITY_COUNT; ++c) {
+        stride_[c] = M3_WFQ_STRIDE;
+        start_[c] = 0;
+        served[c] = 0;
+        waitNs[c] = 0;
+        maxWaitNs[c] = 0;
+    }
+
+}
+
+
+void MemMapJobQueue::SetWeights(const int *weights) {
+
+    for (int c = 0; c < M3_PRIORITY_COUNT; ++c) {
+        stride_[c] = M3_WFQ_STRIDE / std::max(1, weights[c]);
+    }
+
+}
+
+
+void MemMapJobQueue::Push(const MemMapJob &job) {
+
+    std::deque<MemMapJob> &queue = queues_[job.priority];
+    if (queue.empty()) {
+        start_[job.priority] = std::max(start_[job.priority], vtime_);
+    }
+    queue.push_back(job);
+    queue.back().seq = seq_++;
+    queue.back().queued = std::chrono::steady_clock::now();
+    size_++;
+
+}
+
+
+bool MemMapJobQueue::Pop(MemMapJob *job) {
+
+    int next = -1;
+    bool barrier = false;
+    for (int c = 0; c < M3_PRIORITY_COUNT; ++c) {
+        if (!queues_[c].empty() && queues_[c].front().barrier) {
+            barrier = true;
+        }
+    }
+    for (int c = 0; c < M3_PRIORITY_COUNT; ++c) {
+        if (queues_[c].empty()) {
+            continue;
+        }
+        if (next < 0 || (barrier ? queues_[c].front().seq < queues_[next].front().seq : start_[c] < start_[next])) {
+            next = c;
+        }
+    }
+    if (next < 0) {
+        return false;
+    }
+
+    *job = std::move(queues_[next].front());
+    queues_[next].pop_front();
+    size_--;
+    vtime_ = std::max(vtime_, start_[next]);
+    start_[next] += stride_[next];
+
+    uint64_t wait = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - job->queued).count();
+    served[next]++;
+    waitNs[next] += wait;
+    maxWaitNs[next] = std::max(maxWaitNs[next], wait);
+    return true;
+
+}
+
+
+void MemMapManager::Dispatch(MemMapJob &job) {
+
+    int numWorkersPerDevice = workers_.size() / device_count_;
+    int device = ServingDevice(job.req.src);
+    // Requests are sharded by connection, whether they name their region by memId or by token,
+    // so that the requests of a connection are served in order. Pool refills go by chunk size.
+    size_t shard = job.conn ? std::hash<int>()(job.conn->sock_fd) : std::hash<size_t>()(job.req.size);
+    MemMapWorker *worker = workers_[device * numWorkersPerDevice + shard % numWorkersPerDevice];
+    // Pool refills are background work.
+    job.priority = job.conn ? job.req.priority : M3_PRIORITY_BULK;
+
+    {
+        std::lock_guard<std::mutex> lock(worker->mtx);
+        worker->jobs.Push(job);
+    }
+    worker->cv.notify_one();
+
+}
+
+
+void MemMapManager::Worker(MemMapWorker *worker) {
+
+    // Every worker shares the server context, so that handles are valid in every thread.
+    CUUTIL_ERRCHK(cuCtxSetCurrent(ctx_));
+
+    MemMapJob job;
+    MemMapResponse res;
+    std::vector<shareable_handle_t> shHandles;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(worker->mtx);
+            worker->cv.wait(lock, [worker]() { return worker->halt || !worker->jobs.Empty(); });
+            if (!worker->jobs.Pop(&job)) {
+                break;
+            }
+        }
+        if (!job.conn && job.barrier) {
+            // Release of a dead client queued by ReapClient().
+            if (--*job.barrier == 0) {
+                ReleaseClient(job.req.src.pid);
+            }
+        } else if (!job.conn) {
+            // Pool refill queued by CreateChunks().
+            FillPool(job.req.src.device, job.req.size, options_.poolRefillChunks - 1);
+        } else if (job.req.cmd == CMD_ALLOCATE_BATCH) {
+            AllocateBatch(job);
+        } else if (job.req.cmd == CMD_COMMIT) {
+            Commit(job);
+        } else {
+            shHandles.clear();
+            HandleRequest(job.req, res, shHandles);
+            Reply(job.req, res, shHandles, *job.conn);
+        }
+        job.conn.reset();
+        job.barrier.reset();
+    }
+
+}
+
+
+MemMapManager::~MemMapManager() {
+    close(ipc_sock_fd_);
+    if (!handedOver_) {
+        unlink(MemMapManager::endpointName);
+    }
+
+}
+
+
+MemMapResponse MemMapManager::RequestRegister(ProcessInfo &pInfo, int sock_fd) {
+
+    MemMapRequest req;
+    req.src = pInfo;
+    req.cmd = CMD_REGISTER;
+    MemMapResponse res = MemMapManager::Request(sock_fd, req);
+    return res;
+
+}
+
+M3InternalErrorType MemMapManager::Register(ProcessInfo &pInfo) {
+
+    std::lock_guard<std::mutex> lock(subscribersMutex_);
+
+    auto processIterator = std::find(subscribers_.begin(), subscribers_.end(), pInfo);
+    if (processIterator != subscribers_.end()) {
+        // Process is already subscribing memory server. Ignored.
+        return M3INTERNAL_DUPLICATE_REGISTER;
+    }
+
+    for(auto subscriber : subscribers_) {
+        int a2b, b2a;
+        CUUTIL_ERRCHK(cuDeviceCanAccessPeer(&a2b, pInfo.device, subscriber.device));
+        CUUTIL_ERRCHK(cuDeviceCanAccessPeer(&b2a, subscriber.device, pInfo.device));
+            
+        if (a2b && b2a) {
+            cuCtxSetCurrent(pInfo.ctx);
+            cuCtxEnablePeerAccess(subscriber.ctx, 0);
+            cuCtxSetCurrent(subscriber.ctx);
+            cuCtxEnablePeerAccess(pInfo.ctx, 0);
+        }
+    }
+
+    subscribers_.push_back(pInfo);
+    return M3INTERNAL_OK;
+}
+
+MemMapResponse MemMapManager::RequestAllocate(ProcessInfo &pInfo, int sock_fd, char * memId, size_t alignment, size_t num_bytes, uint32_t flags, size_t max_bytes) {
+
+    if (max_bytes > num_bytes) {
+        flags |= M3_FLAG_RESIZABLE;
+    }
+    MemMapRequest req;
+    req.src = pInfo;
+    req.cmd = CMD_ALLOCATE;
+    req.alignment = 1024;
+    req.size = num_bytes;
+    req.flags = flags;
+    if (memId == nullptr) {
+        // Default name should be unique and unreachable.
+        strncpy(req.memId, "DEFAULT_MEMID", MAX_MEMID_LEN);
+    } else {
+        strncpy(req.memId, memId, MAX_MEMID_LEN);
+    }
+
+    MemMapResponse res;
+    res.status = STATUSCODE_ACK;
+
+    // Named regions already imported by this process are served from the import cache.
+    std::string importKey;
+    if (memId != nullptr) {
+        importKey.assign(req.memId, strnlen(req.memId, MAX_MEMID_LEN));
+        importKey.append(1, '\0').append(std::to_string(num_bytes));
+        importKey.append(1, '/').append(std::to_string(flags));
+        importKey.append(1, '/').append(std::to_string(pInfo.device));
+        if (LookupImport(pInfo, sock_fd, importKey, &res)) {
+            return res;
+        }
+    }
+
+    return Import(pInfo, sock_fd, req, alignment, importKey, max_bytes);
+
+}
+
+MemMapResponse MemMapManager::RequestImport(ProcessInfo &pInfo, int sock_fd, uint64_t token, size_t alignment, size_t max_bytes) {
+
+    MemMapRequest req(CMD_ALLOCATE);
+    req.src = pInfo;
+    req.token = token;
+    return Import(pInfo, sock_fd, req, alignment, std::string(), max_bytes);
+
+}
+
+MemMapResponse MemMapManager::RequestResize(ProcessInfo &pInfo, int sock_fd, CUdeviceptr d_ptr, size_t num_bytes) {
+
+    MemMapRequest req(CMD_RESIZE);
+    req.src = pInfo;
+    req.size = num_bytes;
+    {
+        std::lock_guard<std::mutex> lock(clientMutex_);
+        ClientStateLocked();
+        auto it = clientMappings_.find(d_ptr);
+        if (it == clientMappings_.end() || it->second.backingId != 0) {
+            return MemMapResponse(STATUSCODE_INVALID);
+        }
+        req.token = it->second.token;
+        req.offset = it->second.size;
+        req.limit = it->second.reserved;
+    }
+
+    MemMapResponse res;
+    std::vector<shareable_handle_t> shHandles;
+    if (!SendRequest(sock_fd, req)) {
+        perror("Request send() call failure");
+        res.status = STATUSCODE_SOCKERR;
+        return res;
+    }
+    if (!RecvResponse(sock_fd, &res)) {
+        perror("MemMapManager::RequestResize failed to receive RequestResize result");
+        res.status = STATUSCODE_SOCKERR;
+        return res;
+    }
+    if (res.status != STATUSCODE_ACK) {
+        return res;
+    }
+    if (res.numShareableHandles > 0 && ipcRecvShareableHandles(sock_fd, shHandles, res.numShareableHandles) < 0) {
+        perror("MemMapManager::RequestResize failed to receive shareable handles");
+        res.status = STATUSCODE_SOCKERR;
+        return res;
+    }
+
+    // The chunks the mapping lacks go right behind it, as long as they fit in its reserved range.
+    std::lock_guard<std::mutex> lock(clientMutex_);
+    ClientStateLocked();
+    auto it = clientMappings_.find(d_ptr);
+    if (it == clientMappings_.end()) {
+        // Unmapped meanwhile.
+        for (auto &sh : shHandles) close(sh);
+        return MemMapResponse(STATUSCODE_INVALID);
+    }
+    MemMapClientMapping &mapping = it->second;
+    const MemMapBackend &backend = MemMapBackend::Get(mapping.backend);
+    size_t mapped = mapping.size;
+    if (!shHandles.empty()) {
+        size_t chunkSize = (res.roundedSize - res.offset) / shHandles.size();
+        for (size_t i = 0; i < shHandles.size(); ++i) {
+            size_t chunkOffset = res.offset + i * chunkSize;
+            if (chunkOffset == mapped && chunkOffset + chunkSize <= mapping.reserved) {
+                CUUTIL_ERRCHK(backend.Map(d_ptr + chunkOffset, chunkSize, shHandles[i]));
+                mapped += chunkSize;
+            }
+            close(shHandles[i]);
+        }
+    }
+    if (mapped > mapping.size) {
+        CUUTIL_ERRCHK(backend.SetAccess(d_ptr, mapped, pInfo.device, true));
+        mapping.size = mapped;
+        auto cached = clientImports_.find(mapping.importKey);
+        if (!mapping.importKey.empty() && cached != clientImports_.end()) {
+            cached->second.res.roundedSize = mapped;
+        }
+    }
+
+    res.d_ptr = d_ptr;
+    res.roundedSize = mapping.size;
+    res.offset = 0;
+    res.numShareableHandles = 0;
+    if (mapping.size < num_bytes) {
+        res.status = STATUSCODE_INVALID;
+    }
+    return res;
+
+}
+
+MemMapResponse MemMapManager::RequestCommit(ProcessInfo &pInfo, int sock_fd, CUdeviceptr d_ptr, size_t offset, size_t num_bytes) {
+
+    MemMapRequest req(CMD_COMMIT);
+    req.src = pInfo;
+    size_t end;
+    {
+        std::lock_guard<std::mutex> lock(clientMutex_);
+        ClientStateLocked();
+        auto it = clientMappings_.find(d_ptr);
+        if (it == clientMappings_.end() || it->second.commitSize == 0 || offset >= it->second.size) {
+            return MemMapResponse(STATUSCODE_INVALID);
+        }
+        req.token = it->second.token;
+        end = num_bytes ? std::min(it->second.size, offset + std::min(num_bytes, it->second.size)) : it->second.size;
+    }
+
+    // The server lists up to M3_MAX_COMMIT_PAGES pages per response, and where to ask for the next ones.
+    MemMapResponse res(STATUSCODE_ACK);
+    std::vector<shareable_handle_t> shHandles;
+    std::vector<char> payload;
+    std::vector<uint64_t> pages;
+    size_t cursor = offset;
+    while (cursor < end) {
+        req.offset = cursor;
+        req.size = num_bytes ? end - cursor : 0;
+        if (!SendRequest(sock_fd, req)) {
+            perror("Request send() call failure");
+            return MemMapResponse(STATUSCODE_SOCKERR);
+        }
+        if (!RecvResponse(sock_fd, &res, &payload)) {
+            perror("MemMapManager::RequestCommit failed to receive RequestCommit result");
+            return MemMapResponse(STATUSCODE_SOCKERR);
+        }
+        if (res.status != STATUSCODE_ACK) {
+            return res;
+        }
+        shHandles.clear();
+        if (res.numShareableHandles > 0 && ipcRecvShareableHandles(sock_fd, shHandles, res.numShareableHandles) < 0) {
+            perror("MemMapManager::RequestCommit failed to receive shareable handles");
+            return MemMapResponse(STATUSCODE_SOCKERR);
+        }
+        bool valid = MemMapWire::DecodeCommitPages(payload.data(), payload.size(), shHandles.size(), &pages) == payload.size();
+
+        // Pages this process already maps are skipped.
+        std::lock_guard<std::mutex> lock(clientMutex_);
+        ClientStateLocked();
+        auto it = clientMappings_.find(d_ptr);
+        for (size_t i = 0; i < shHandles.size(); ++i) {
+            if (valid && it != clientMappings_.end() && pages[i] < it->second.committed.size() && !it->second.committed[pages[i]]) {
+                MemMapClientMapping &mapping = it->second;
+                const MemMapBackend &backend = MemMapBackend::Get(mapping.backend);
+                CUdeviceptr page = d_ptr + pages[i] * mapping.commitSize;
+                CUUTIL_ERRCHK(backend.Map(page, mapping.commitSize, shHandles[i]));
+                CUUTIL_ERRCHK(backend.SetAccess(page, mapping.commitSize, pInfo.device, false));
+                mapping.committed[pages[i]] = true;
+            }
+            close(shHandles[i]);
+        }
+        if (it == clientMappings_.end() || !valid) {
+            // Unmapped meanwhile, or garbled.
+            return MemMapResponse(it == clientMappings_.end() ? STATUSCODE_INVALID : STATUSCODE_SOCKERR);
+        }
+        if (res.offset <= cursor) {
+            break;
+        }
+        cursor = res.offset;
+    }
+
+    std::lock_guard<std::mutex> lock(clientMutex_);
+    auto it = clientMappings_.find(d_ptr);
+    if (it == clientMappings_.end()) {
+        return MemMapResponse(STATUSCODE_INVALID);
+    }
+    res.d_ptr = d_ptr;
+    res.roundedSize = std::count(it->second.committed.begin(), it->second.committed.end(), true) * it->second.commitSize;
+    res.offset = 0;
+    res.numShareableHandles = 0;
+    return res;
+
+}
+
+MemMapResponse MemMapManager::RequestStat(ProcessInfo &pInfo, int sock_fd, uint64_t token) {
+
+    MemMapRequest req(CMD_STAT);
+    req.src = pInfo;
+    req.token = token;
+    return Request(sock_fd, req);
+
+}
+
+MemMapResponse MemMapManager::Import(ProcessInfo &pInfo, int sock_fd, MemMapRequest &req, size_t alignment, const std::string &importKey, size_t reserve) {
+
+    MemMapResponse res;
+    std::vector<shareable_handle_t> shHandles;
+
+    // First, send CMD_ALLOCATE request to server.
+    if (!SendRequest(sock_fd, req)) {
+        perror("Request send() call failure");
+        res.status = STATUSCODE_SOCKERR;
+        return res;
+    }
+    // Server tells the number of shareable handles to send using res.numShareableHandles.
+    if (!RecvResponse(sock_fd, &res)) {
+        perror("MemMapManager::RequestAllocate failed to receive RequestAllocate result");
+        res.status = STATUSCODE_SOCKERR;
+        return res;
+    }
+    if (res.status != STATUSCODE_ACK) {
+        return res;
+    }
+    // The server does not send back what the client already knows.
+    memcpy(res.memId, req.memId, MAX_MEMID_LEN);
+    if (res.backingId != 0) {
+        MapBacking(pInfo, sock_fd, res, importKey);
+        return res;
+    }
+
+    // Receive every shareable handle of the region at once.
+    if (ipcRecvShareableHandles(sock_fd, shHandles, res.numShareableHandles) < 0 || shHandles.empty()) {
+        perror("MemMapManager::RequestAllocate failed to receive shareable handles");
+        res.status = STATUSCODE_SOCKERR;
+        return res;
+    }
+    res.shareableHandle = shHandles[0];
+
+    // Import and MemMap shareable handlers into local Virtual Memory.
+    // The range reserved for a resizable region is a whole number of its chunks.
+    assert(res.numShareableHandles > 0);
+    size_t chunkSize = res.roundedSize / res.numShareableHandles;
+    size_t reserved = std::max(res.roundedSize, (reserve + chunkSize - 1) / chunkSize * chunkSize);
+    std::lock_guard<std::mutex> lock(clientMutex_);
+    ClientStateLocked();
+    res.d_ptr = clientArenas_[res.backend].Allocate(reserved, alignment);
+
+    if (res.commitSize != 0) {
+        // A sparse region comes with its first page: RequestCommit() maps the others.
+        const MemMapBackend &backend = MemMapBackend::Get(res.backend);
+        CUUTIL_ERRCHK(backend.Map(res.d_ptr, res.commitSize, shHandles[0]));
+        CUUTIL_ERRCHK(backend.SetAccess(res.d_ptr, res.commitSize, pInfo.device, false));
+    } else {
+        MapChunks(pInfo, res, res.d_ptr, shHandles.data());
+    }
+    for(auto &sh : shHandles) close(sh);
+
+    AddMappingLocked(res, importKey);
+    clientMappings_[res.d_ptr].reserved = reserved;
+    return res;
+
+}
+
+bool MemMapManager::LookupImport(ProcessInfo &pInfo, int sock_fd, const std::string &key, MemMapResponse *res) {
+
+    MemMapImport cached;
+    {
+        std::lock_guard<std::mutex> lock(clientMutex_);
+        ClientStateLocked();
+        auto it = clientImports_.find(key);
+        if (it == clientImports_.end()) {
+            return false;
+        }
+        if (it->second.serverGeneration == clientServerGeneration_) {
+            // Nothing was removed from the server since the import was last validated.
+            clientMappings_[it->second.res.d_ptr].refs++;
+            *res = it->second.res;
+            return true;
+        }
+        cached = it->second;
+    }
+
+    MemMapRequest req(CMD_VALIDATE);
+    req.src = pInfo;
+    req.token = cached.res.token;
+    req.generation = cached.res.generation;
+    MemMapResponse validation = Request(sock_fd, req);
+
+    std::lock_guard<std::mutex> lock(clientMutex_);
+    clientServerGeneration_ = std::max(clientServerGeneration_, validation.serverGeneration);
+    auto it = clientImports_.find(key);
+    if (it == clientImports_.end()) {
+        // Unmapped meanwhile.
+        return false;
+    }
+    if (validation.status == STATUSCODE_ACK) {
+        it->second.serverGeneration = validation.serverGeneration;
+        clientMappings_[it->second.res.d_ptr].refs++;
+        *res = it->second.res;
+        return true;
+    }
+    // The region is gone or was replaced: the stale mapping lives on until its last Unmap(), uncached.
+    clientMappings_[it->second.res.d_ptr].importKey.clear();
+    clientImports_.erase(it);
+    return false;
+
+}
+
+void MemMapManager::SeenServerGeneration(uint64_t serverGeneration) {
+
+    std::lock_guard<std::mutex> lock(clientMutex_);
+    ClientStateLocked();
+    clientServerGeneration_ = std::max(clientServerGeneration_, serverGeneration);
+
+}
+
+void MemMapManager::AddMappingLocked(MemMapResponse &res, const std::string &importKey, bool serverRef) {
+
+    clientServerGeneration_ = std::max(clientServerGeneration_, res.serverGeneration);
+
+    auto it = clientMappings_.find(res.d_ptr);
+    if (it != clientMappings_.end()) {
+        it->second.refs++;
+    } else {
+        MemMapClientMapping mapping;
+        mapping.size = res.roundedSize;
+        mapping.reserved = res.roundedSize;
+        mapping.backend = res.backend;
+        mapping.commitSize = res.commitSize;
+        if (res.commitSize != 0) {
+            mapping.committed.assign(res.roundedSize / res.commitSize, false);
+            mapping.committed[0] = true;
+        }
+        mapping.backingId = res.backingId;
+        mapping.refs = 1;
+        mapping.memId.assign(res.memId, strnlen(res.memId, MAX_MEMID_LEN));
+        mapping.token = res.token;
+        mapping.serverRefs = 0;
+        it = clientMappings_.insert(std::make_pair(res.d_ptr, mapping)).first;
+    }
+    if (serverRef) {
+        it->second.serverRefs++;
+    }
+    if (!importKey.empty() && it->second.importKey.empty() && clientImports_.find(importKey) == clientImports_.end()) {
+        MemMapImport cached;
+        cached.res = res;
+        cached.serverGeneration = res.serverGeneration;
+        clientImports_[importKey] = cached;
+        it->second.importKey = importKey;
+    }
+
+}
+
+int MemMapManager::ReleaseMappingLocked(CUdeviceptr d_ptr, MemMapClientMapping *released) {
+
+    auto it = clientMappings_.find(d_ptr);
+    if (it == clientMappings_.end()) {
+        return -1;
+    }
+    if (--it->second.refs > 0) {
+        return 0;
+    }
+    if (!it->second.importKey.empty()) {
+        clientImports_.erase(it->second.importKey);
+    }
+    if (it->second.backingId == 0) {
+        const MemMapBackend &backend = MemMapBackend::Get(it->second.backend);
+        if (it->second.commitSize != 0) {
+            // Only the committed pages of a sparse region are mapped.
+            for (size_t page = 0; page < it->second.committed.size(); ++page) {
+                if (it->second.committed[page]) {
+                    CUUTIL_ERRCHK(backend.Unmap(d_ptr + page * it->second.commitSize, it->second.commitSize));
+                }
+            }
+        } else {
+            CUUTIL_ERRCHK(backend.Unmap(d_ptr, it->second.size));
+        }
+        clientArenas_[it->second.backend].Free(d_ptr, it->second.reserved);
+    }
+    *released = it->second;
+    clientMappings_.erase(it);
+    return 1;
+
+}
+
+MemMapStatusCode MemMapManager::Unmap(CUdeviceptr d_ptr) {
+
+    MemMapClientMapping released;
+    std::lock_guard<std::mutex> lock(clientMutex_);
+    ClientStateLocked();
+    return ReleaseMappingLocked(d_ptr, &released) < 0 ? STATUSCODE_INVALID : STATUSCODE_ACK;
+
+}
+
+void MemMapManager::SetClientArenaSize(size_t arenaSize) {
+
+    std::lock_guard<std::mutex> lock(clientMutex_);
+    for (auto &arena : clientArenas_) {
+        arena.SetArenaSize(arenaSize);
+    }
+
+}
+
+void MemMapManager::SetClientBusyPoll(bool busyPoll) {
+
+    clientBusyPoll_ = busyPoll;
+
+}
+
+void MemMapManager::SetClientPriority(MemMapPriority priority) {
+
+    clientPriority_ = priority;
+
+}
+
+MemMapRequest MemMapManager::WithClientPriority(const MemMapRequest &req) {
+
+    MemMapRequest prioritized = req;
+    if (prioritized.priority == M3_PRIORITY_NORMAL) {
+        prioritized.priority = clientPriority_;
+    }
+    return prioritized;
+
+}
+
+void MemMapManager::ClientStateLocked(void) {
+
+    if (clientPid_ != getpid()) {
+        clientBackings_.clear();
+        clientMappings_.clear();
+        clientImports_.clear();
+        clientServerGeneration_ = 0;
+        for (auto &arena : clientArenas_) {
+            arena.Reset();
+        }
+        clientPid_ = getpid();
+    }
+
+}
+
+CUdeviceptr MemMapVAArena::Allocate(size_t size, size_t alignment) {
+
+    const MemMapBackend &backend = MemMapBackend::Get(backend_);
+    CUdeviceptr ptr = (CUdeviceptr)nullptr;
+    alignment = std::max<size_t>(alignment, 1);
+
+    if (arenaSize_ == 0) {
+        CUUTIL_ERRCHK(backend.Reserve(&ptr, size, alignment));
+        numReservations_++;
+        return ptr;
+    }
+
+    // Reuse a freed range of the same size first.
+    auto it = freeLists_.find(size);
+    if (it != freeLists_.end()) {
+        std::vector<CUdeviceptr> &ranges = it->second;
+        for (size_t i = ranges.size(); i > 0; --i) {
+            if (ranges[i - 1] % alignment == 0) {
+                ptr = ranges[i - 1];
+                ranges[i - 1] = ranges.back();
+                ranges.pop_back();
+                return ptr;
+            }
+        }
+    }
+
+    CUdeviceptr aligned = (next_ + alignment - 1) / alignment * alignment;
+    if (next_ == 0 || aligned + size > end_) {
+        // The tail of the current arena is given up.
+        size_t arenaSize = std::max(arenaSize_, size + alignment);
+        CUUTIL_ERRCHK(backend.Reserve(&next_, arenaSize, 0));
+        end_ = next_ + arenaSize;
+        numReservations_++;
+        aligned = (next_ + alignment - 1) / alignment * alignment;
+    }
+    next_ = aligned + size;
+    return aligned;
+
+}
+
+void MemMapVAArena::Free(CUdeviceptr ptr, size_t size) {
+
+    if (arenaSize_ == 0) {
+        CUUTIL_ERRCHK(MemMapBackend::Get(backend_).Free(ptr, size));
+        return;
+    }
+    freeLists_[size].push_back(ptr);
+
+}
+
+void MemMapVAArena::Reset(void) {
+
+    next_ = end_ = 0;
+    freeLists_.clear();
+    numReservations_ = 0;
+
+}
+
+const MemMapBackend &MemMapBackend::Get(MemMapBackendKind kind) {
+
+    static MemMapCudaBackend cuda;
+    static MemMapHostBackend host;
+    return kind == M3_BACKEND_HOST ? (const MemMapBackend &)host : (const MemMapBackend &)cuda;
+
+}
+
+CUresult MemMapCudaBackend::GetGranularity(CUdevice device, bool recommended, size_t *granularity) const {
+
+    CUmemAllocationProp prop = {};
+    prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+    prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+    prop.location.id = device;
+    prop.requestedHandleTypes = CU_MEM_HANDLE_TYPE_POSIX_FILE_DESCRIPTOR;
+    return cuMemGetAllocationGranularity(granularity, &prop,
+        recommended ? CU_MEM_ALLOC_GRANULARITY_RECOMMENDED : CU_MEM_ALLOC_GRANULARITY_MINIMUM);
+
+}
+
+CUresult MemMapCudaBackend::GetTotalMem(CUdevice device, size_t *bytes) const {
+
+    return cuDeviceTotalMem(bytes, device);
+
+}
+
+CUresult MemMapCudaBackend::Create(CUdevice device, int numaNode, size_t size, shareable_handle_t *shHandle) const {
+
+    CUmemAllocationProp prop = {};
+    prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+    prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+    prop.location.id = device;
+    prop.requestedHandleTypes = CU_MEM_HANDLE_TYPE_POSIX_FILE_DESCRIPTOR;
+
+    CUmemGenericAllocationHandle allocHandle;
+    CUresult err = cuMemCreate(&allocHandle, size, &prop, 0);
+    if (err != CUDA_SUCCESS) {
+        return err;
+    }
+    err = cuMemExportToShareableHandle((void *)shHandle, allocHandle, CU_MEM_HANDLE_TYPE_POSIX_FILE_DESCRIPTOR, 0);
+    // The exported fd keeps the physical memory alive, we do not need the handle anymore.
+    cuMemRelease(allocHandle);
+    return err;
+
+}
+
+CUresult MemMapCudaBackend::Reserve(CUdeviceptr *ptr, size_t size, size_t alignment) const {
+
+    return cuMemAddressReserve(ptr, size, alignment, 0, 0);
+
+}
+
+CUresult MemMapCudaBackend::Free(CUdeviceptr ptr, size_t size) const {
+
+    return cuMemAddressFree(ptr, size);
+
+}
+
+CUresult MemMapCudaBackend::Map(CUdeviceptr ptr, size_t size, shareable_handle_t shHandle) const {
+
+    CUmemGenericAllocationHandle allocHandle;
+    CUresult err = cuMemImportFromShareableHandle(&allocHandle, (void *)shHandle, CU_MEM_HANDLE_TYPE_POSIX_FILE_DESCRIPTOR);
+    if (err != CUDA_SUCCESS) {
+        return err;
+    }
+    err = cuMemMap(ptr, size, 0, allocHandle, 0);
+    cuMemRelease(allocHandle);
+    return err;
+
+}
+
+CUresult MemMapCudaBackend::SetAccess(CUdeviceptr ptr, size_t size, CUdevice device, bool allDevices) const {
+
+    // cuMemSetAccess may not work well on physical memory regions in heterogeneous GPUs.
+    // Check out cuDeviceCanAccessPeer().
+    int numDevices = 1;
+    if (allDevices) {
+        CUresult err = cuDeviceGetCount(&numDevices);
+        if (err != CUDA_SUCCESS) {
+            return err;
+        }
+    }
+    std::vector<CUmemAccessDesc> accessDescriptors(numDevices);
+    for (int d = 0; d < numDevices; ++d) {
+        accessDescriptors[d].location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+        accessDescriptors[d].location.id = allDevices ? d : device;
+        accessDescriptors[d].flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+    }
+    return cuMemSetAccess(ptr, size, accessDescriptors.data(), accessDescriptors.size());
+
+}
+
+CUresult MemMapCudaBackend::Unmap(CUdeviceptr ptr, size_t size) const {
+
+    return cuMemUnmap(ptr, size);
+
+}
+
+CUresult MemMapHostBackend::GetGranularity(CUdevice device, bool recommended, size_t *granularity) const {
+
+    *granularity = M3_HOST_PAGE_SIZE;
+    return CUDA_SUCCESS;
+
+}
+
+CUresult MemMapHostBackend::GetTotalMem(CUdevice device, size_t *bytes) const {
+
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || pageSize <= 0) {
+        return CUDA_ERROR_UNKNOWN;
+    }
+    *bytes = (size_t)pages * pageSize;
+    return CUDA_SUCCESS;
+
+}
+
+CUresult MemMapHostBackend::Create(CUdevice device, int numaNode, size_t size, shareable_handle_t *shHandle) const {
+
+    if (size == 0 || size % M3_HOST_PAGE_SIZE != 0 || numaNode >= M3_MAX_NUMA_NODES) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    unsigned long nodeMask = numaNode >= 0 ? 1UL << numaNode : 0;
+    unsigned long maxNode = sizeof(nodeMask) * 8 + 1;
+
+    if (hugePages_.load(std::memory_order_relaxed)) {
+        // hugetlbfs files must be populated up front: a page missing at fault time would kill the client.
+        // The pages are allocated by this thread, under its policy.
+        if (numaNode >= 0 && syscall(SYS_set_mempolicy, M3_MPOL_PREFERRED, &nodeMask, maxNode) != 0) {
+            return CUDA_ERROR_INVALID_VALUE;
+        }
+        int fd = (int)syscall(SYS_memfd_create, "m3-host", M3_MFD_CLOEXEC | M3_MFD_HUGETLB);
+        bool populated = fd >= 0 && ftruncate(fd, size) == 0 && fallocate(fd, 0, 0, size) == 0;
+        if (numaNode >= 0) {
+            syscall(SYS_set_mempolicy, M3_MPOL_DEFAULT, NULL, 0);
+        }
+        if (populated) {
+            *shHandle = (shareable_handle_t)fd;
+            return CUDA_SUCCESS;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        hugePages_.store(false, std::memory_order_relaxed);
+    }
+    int fd = (int)syscall(SYS_memfd_create, "m3-host", M3_MFD_CLOEXEC);
+    if (fd < 0) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+    if (numaNode >= 0) {
+        // The policy set on a shared mapping sticks to the file, for the pages faulted later through any mapping.
+        void *p = mmap(NULL, size, PROT_NONE, MAP_SHARED, fd, 0);
+        bool placed = p != MAP_FAILED && syscall(SYS_mbind, p, size, M3_MPOL_PREFERRED, &nodeMask, maxNode, 0) == 0;
+        if (p != MAP_FAILED) {
+            munmap(p, size);
+        }
+        if (!placed) {
+            close(fd);
+            return CUDA_ERROR_INVALID_VALUE;
+        }
+    }
+    *shHandle = (shareable_handle_t)fd;
+    return CUDA_SUCCESS;
+
+}
+
+CUresult MemMapHostBackend::Reserve(CUdeviceptr *ptr, size_t size, size_t alignment) const {
+
+    // Over-reserve, then trim the range to the alignment: hugetlbfs mappings must be aligned to huge pages.
+    alignment = std::max<size_t>(alignment, M3_HOST_PAGE_SIZE);
+    size_t reserved = size + alignment;
+    void *p = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        return CUDA_ERROR_OUT_OF_MEMORY;
+    }
+    uintptr_t start = (uintptr_t)p;
+    uintptr_t aligned = (start + alignment - 1) / alignment * alignment;
+    if (aligned > start) {
+        munmap(p, aligned - start);
+    }
+    if (start + reserved > aligned + size) {
+        munmap((void *)(aligned + size), start + reserved - aligned - size);
+    }
+    *ptr = (CUdeviceptr)aligned;
+    return CUDA_SUCCESS;
+
+}
+
+CUresult MemMapHostBackend::Free(CUdeviceptr ptr, size_t size) const {
+
+    return munmap((void *)(uintptr_t)ptr, size) == 0 ? CUDA_SUCCESS : CUDA_ERROR_INVALID_VALUE;
+
+}
+
+CUresult MemMapHostBackend::Map(CUdeviceptr ptr, size_t size, shareable_handle_t shHandle) const {
+
+    void *p = mmap((void *)(uintptr_t)ptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, (int)shHandle, 0);
+    if (p == MAP_FAILED) {
+        return CUDA_ERROR_INVALID_VALUE;
+    }
+    // Regular memfds may still get transparent huge pages (shmem_enabled = advise); hugetlbfs ignores the hint.
+    madvise(p, size, MADV_HUGEPAGE);
+    return CUDA_SUCCESS;
+
+}
+
+CUresult MemMapHostBackend::SetAccess(CUdeviceptr ptr, size_t size, CUdevice device, bool allDevices) const {
+
+    // Host memory is mapped readable and writable, by the CPU.
+    return CUDA_SUCCESS;
+
+}
+
+CUresult MemMapHostBackend::Unmap(CUdeviceptr ptr, size_t size) const {
+
+    void *p = mmap((void *)(uintptr_t)ptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    return p == MAP_FAILED ? CUDA_ERROR_INVALID_VALUE : CUDA_SUCCESS;
+
+}
+
+void MemMapManager::MapChunks(const ProcessInfo &pInfo, const MemMapResponse &res, CUdeviceptr d_ptr, const shareable_handle_t *shHandles) {
+
+    const MemMapBackend &backend = MemMapBackend::Get(res.backend);
+    size_t chunkSize = res.roundedSize / res.numShareableHandles;
+    for (uint32_t i = 0; i < res.numShareableHandles; ++i) {
+        CUUTIL_ERRCHK(backend.Map(d_ptr + i * chunkSize, chunkSize, shHandles[i]));
+    }
+    CUUTIL_ERRCHK(backend.SetAccess(d_ptr, res.roundedSize, pInfo.device, res.numShareableHandles > 1));
+
+}
+
+void MemMapManager::MapBacking(ProcessInfo &pInfo, int sock_fd, MemMapResponse &res, const std::string &importKey) {
+
+    shareable_handle_t shHandle = 0;
+    if (res.numShareableHandles > 0 && ipcRecvShareableHandle(sock_fd, &shHandle) < 0) {
+        perror("MemMapManager::MapBacking failed to receive shareable handle");
+        res.status = STATUSCODE_SOCKERR;
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(clientMutex_);
+    ClientStateLocked();
+    MapBackingLocked(pInfo, res, res.numShareableHandles > 0 ? &shHandle : nullptr, importKey);
+    if (res.numShareableHandles > 0) {
+        close((int)shHandle);
+    }
+
+}
+
+void MemMapManager::MapBackingLocked(ProcessInfo &pInfo, MemMapResponse &res, const shareable_handle_t *shHandle, const std::string &importKey) {
+
+    auto it = clientBackings_.find(res.backingId);
+    if (it != clientBackings_.end()) {
+        res.d_ptr = it->second + res.offset;
+        AddMappingLocked(res, importKey);
+        return;
+    }
+    if (shHandle == nullptr) {
+        // The page was sent through this connection, but to another process.
+        res.status = STATUSCODE_UNKNOWN_ERR;
+        return;
+    }
+
+    const MemMapBackend &backend = MemMapBackend::Get(res.backend);
+    CUdeviceptr base = clientArenas_[res.backend].Allocate(res.backingSize, 0);
+    CUUTIL_ERRCHK(backend.Map(base, res.backingSize, *shHandle));
+    CUUTIL_ERRCHK(backend.SetAccess(base, res.backingSize, pInfo.device, false));
+
+    clientBackings_[res.backingId] = base;
+    res.d_ptr = base + res.offset;
+    AddMappingLocked(res, importKey);
+
+}
+
+std::vector<MemMapResponse> MemMapManager::RequestAllocateBatch(ProcessInfo &pInfo, int sock_fd, std::vector<MemMapBatchEntry> &entries, uint32_t flags) {
+
+    std::vector<MemMapResponse> responses;
+    std::vector<char> sendBuf(M3_MAX_BATCH * M3_WIRE_MAX_BATCH_ENTRY_SIZE);
+    std::vector<char> recvBuf;
+    std::vector<MemMapBatchResult> results(M3_MAX_BATCH);
+
+    for (size_t first = 0; first < entries.size(); first += M3_MAX_BATCH) {
+        uint32_t count = std::min<size_t>(M3_MAX_BATCH, entries.size() - first);
+
+        MemMapRequest req(CMD_ALLOCATE_BATCH);
+        req.src = pInfo;
+        req.size = count;
+        req.flags = flags;
+        req.memId[0] = '\0';
+
+        size_t sendSize = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            sendSize += MemMapWire::EncodeBatchEntry(entries[first + i], sendBuf.data() + sendSize);
+        }
+
+        MemMapResponse res;
+        res.status = STATUSCODE_SOCKERR;
+        if (!SendRequest(sock_fd, req, sendBuf.data(), sendSize)) {
+            perror("MemMapManager::RequestAllocateBatch: sendmsg() call failure");
+            responses.resize(entries.size(), res);
+            return responses;
+        }
+        bool received = RecvResponse(sock_fd, &res, &recvBuf);
+        const char *p = recvBuf.data();
+        const char *end = p + recvBuf.size();
+        for (uint32_t i = 0; received && i < count; ++i) {
+            size_t resultSize = MemMapWire::DecodeBatchResult(p, end - p, &results[i]);
+            // Copies of a region must name an earlier entry of the batch.
+            received = (resultSize > 0 && results[i].duplicateOf <= i);
+            p += resultSize;
+        }
+        if (!received || p != end) {
+            perror("MemMapManager::RequestAllocateBatch failed to receive results");
+            res.status = STATUSCODE_SOCKERR;
+            responses.resize(entries.size(), res);
+            return responses;
+        }
+
+        std::vector<shareable_handle_t> shHandles;
+        if (ipcRecvShareableHandles(sock_fd, shHandles, res.numShareableHandles) < 0) {
+            perror("MemMapManager::RequestAllocateBatch failed to receive shareable handles");
+            res.status = STATUSCODE_SOCKERR;
+            responses.resize(entries.size(), res);
+            return responses;
+        }
+
+        // Every region gets its own range of the arena, so that it can be unmapped on its own.
+        std::lock_guard<std::mutex> lock(clientMutex_);
+        ClientStateLocked();
+
+        size_t nextHandle = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            MemMapResponse entryRes = res;
+            entryRes.status = results[i].status;
+            entryRes.roundedSize = results[i].roundedSize;
+            entryRes.numShareableHandles = results[i].numShareableHandles;
+            entryRes.device = results[i].device;
+            entryRes.token = results[i].token;
+            entryRes.offset = results[i].offset;
+            entryRes.backingId = results[i].backingId;
+            entryRes.backingSize = results[i].backingSize;
+            entryRes.d_ptr = (CUdeviceptr)nullptr;
+            strncpy(entryRes.memId, entries[first + i].memId, MAX_MEMID_LEN);
+
+            if (results[i].duplicateOf != i) {
+                entryRes.d_ptr = responses[first + results[i].duplicateOf].d_ptr;
+                if (entryRes.d_ptr) {
+                    // The server took a single reference for every copy of the region in the batch.
+                    AddMappingLocked(entryRes, std::string(), false);
+                } else {
+                    entryRes.status = responses[first + results[i].duplicateOf].status;
+                }
+            } else if (results[i].status == STATUSCODE_ACK && nextHandle + results[i].numShareableHandles > shHandles.size()) {
+                // The results claim more handles than the response carried: the region cannot be mapped.
+                entryRes.status = STATUSCODE_SOCKERR;
+            } else if (results[i].status == STATUSCODE_ACK && results[i].backingId != 0) {
+                MapBackingLocked(pInfo, entryRes, results[i].numShareableHandles > 0 ? &shHandles[nextHandle] : nullptr, std::string());
+            } else if (results[i].status == STATUSCODE_ACK) {
+                entryRes.d_ptr = clientArenas_[entryRes.backend].Allocate(results[i].roundedSize, entries[first + i].alignment);
+                MapChunks(pInfo, entryRes, entryRes.d_ptr, &shHandles[nextHandle]);
+                AddMappingLocked(entryRes, std::string());
+            }
+            nextHandle += results[i].numShareableHandles;
+            responses.push_back(entryRes);
+        }
+
+        for(auto &sh : shHandles) close(sh);
+    }
+
+    return responses;
+
+}
+
+MemMapRing * MemMapManager::RequestRing(ProcessInfo &pInfo, int sock_fd) {
+
+    MemMapRequest req(CMD_OPENRING);
+    req.src = pInfo;
+    MemMapResponse res = Request(sock_fd, req);
+    if (res.status != STATUSCODE_ACK) {
+        return nullptr;
+    }
+
+    shareable_handle_t shmFd = 0;
+    if (ipcRecvShareableHandle(sock_fd, &shmFd) < 0) {
+        perror("MemMapManager::RequestRing failed to receive ring segment");
+        return nullptr;
+    }
+
+    void *addr = mmap(NULL, sizeof(MemMapRingSegment), PROT_READ | PROT_WRITE, MAP_SHARED, (int)shmFd, 0);
+    close((int)shmFd);
+    if (addr == MAP_FAILED) {
+        perror("MemMapManager::RequestRing failed to map ring segment");
+        return nullptr;
+    }
+
+    MemMapRing *ring = new MemMapRing;
+    ring->segment = (MemMapRingSegment *)addr;
+    ring->size = sizeof(MemMapRingSegment);
+    ring->spinLimit = M3_RING_MIN_SPIN;
+    return ring;
+
+}
+
+MemMapResponse MemMapManager::Request(MemMapRing *ring, MemMapRequest req) {
+
+    MemMapResponse res;
+    if (!ringPush(&ring->segment->requests, req) ||
+        !ringPop(&ring->segment->responses, &res, ring->spinLimit, &ring->segment->closed)) {
+        res.status = STATUSCODE_SOCKERR;
+        return res;
+    }
+    SeenServerGeneration(res.serverGeneration);
+    return res;
+
+}
+
+void MemMapManager::CloseRing(MemMapRing *ring) {
+
+    ring->segment->closed.store(1);
+    futexWake(&ring->segment->requests.head);
+    munmap(ring->segment, ring->size);
+    delete ring;
+
+}
+
+MemMapResponse MemMapManager::RequestStats(ProcessInfo &pInfo, int sock_fd, MemMapStats *stats) {
+
+    MemMapRequest req(CMD_GETSTATS);
+    req.src = pInfo;
+    MemMapResponse res;
+    std::vector<char> payload;
+
+    if (!SendRequest(sock_fd, req)) {
+        perror("MemMapManager::RequestStats send() call failure");
+        res.status = STATUSCODE_SOCKERR;
+        return res;
+    }
+    if (!RecvResponse(sock_fd, &res, &payload) || payload.size() != sizeof(*stats)) {
+        perror("MemMapManager::RequestStats failed to receive stats");
+        res.status = STATUSCODE_SOCKERR;
+        return res;
+    }
+    memcpy((void *)stats, payload.data(), sizeof(*stats));
+    return res;
+
+}
+
+int MemMapManager::CurrentNumaNode(void) {
+
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        return -1;
+    }
+    return (int)node;
+
+}
+
+MemMapResponse MemMapManager::RequestRoundedAllocationSize(ProcessInfo &pInfo, int sock_fd, size_t num_bytes, uint32_t flags) {
+
+    MemMapRequest req;
+    req.src = pInfo;
+    req.cmd = CMD_GETROUNDEDALLOCATIONSIZE;
+    req.size = num_bytes;
+    req.flags = flags;
+    MemMapResponse res = MemMapManager::Request(sock_fd, req);
+    return res;
+
+}
+
+size_t MemMapManager::GetRoundedAllocationSize(size_t num_bytes, CUdevice device, uint32_t flags) {
+
+    const MemMapDevice &dev = deviceTable_[device];
+    size_t granularity = (flags & M3_FLAG_RECOMMENDED_GRANULARITY) ? dev.recommendedGranularity : dev.minGranularity;
+    // Every stripe is a whole number of pages.
+    granularity *= std::max<uint32_t>(1, M3_FLAG_STRIPES_OF(flags));
+
+    if (num_bytes == 0) {
+        num_bytes = granularity;
+    }
+    if (num_bytes % granularity) {
+       num_bytes += (granularity - (num_bytes % granularity));
+    }
+
+    return num_bytes;
+
+}
+
+
+CUdevice MemMapManager::ServingDevice(CUdevice device) const {
 
-    // Now run the server loop.                                                                           
-    Server();
-    
-}
+    if (device < 0 || device >= device_count_) {
+        return 0;
+    }
+    return device;
 
+}
 
-void MemMapManager::Server() {
 
-    M3InternalErrorType m3Err;
-    std::vector<CUmemGenericAllocationHandle> allocHandles;
-    std::vector<shareable_handle_t> shHandles;
-    uint32_t numShareableHandles;
-    bool shHandleAlreadyExists;
+M3InternalErrorType MemMapManager::Allocate(ProcessInfo &pInfo, int numaNode, size_t alignment, size_t num_bytes, std::vector<shareable_handle_t>& shHandle) {
 
-    MemMapRequest req;
-    MemMapResponse res;
-    struct sockaddr_un client_addr;
-    socklen_t client_addr_len = sizeof(struct sockaddr_un);
-    std::string memIdStr;
+    const MemMapBackend &backend = MemMapBackend::Get(options_.backend);
+    uint32_t num_handles = shHandle.size();
+    size_t chunk_size = GetRoundedAllocationSize(num_bytes / num_handles, ServingDevice(pInfo));
+    assert(num_bytes % chunk_size == 0);
 
-    for(bool halt = false; !halt; ) {
-        
-        // Receive a message from client.
-        bzero(&client_addr, client_addr_len);
-        if (recvfrom(ipc_sock_fd_, (void *)&req, sizeof(req), 0, (struct sockaddr *)&client_addr, &client_addr_len) < 0) {
-            panic("MemMapManager::MemMapManager: failed to receive IPC message");
+    // Use GPU 0 as Memory server device, for now.
+    // Since I don't have NVLINK-supported environment now,
+    // I'll just set pInfo.device = 0 in child process.
+    for(int i = 0; i < num_handles; ++i) {
+        CUresult err = backend.Create(pInfo.device, numaNode, chunk_size, &shHandle[i]);
+        if (err != CUDA_SUCCESS) {
+            printf("MemMapManager::Allocate: %s backend failed to create %zu bytes: %s\n",
+                backend.Name(), chunk_size, getCuDrvErrorString(err));
+            for (int j = 0; j < i; ++j) {
+                close((int)shHandle[j]);
+            }
+            return M3INTERNAL_ALLOC_FAILED;
         }
+    }
+    return M3INTERNAL_OK;
 
-        res.dst = req.src;
-        res.status = STATUSCODE_ACK;
+}
 
-        switch (req.cmd) {
-            case CMD_ECHO:
-                break;
-            case CMD_HALT:
-                halt = true;
-                break;
-            case CMD_REGISTER:
-                m3Err = Register(res.dst);
-                if (m3Err != M3INTERNAL_DUPLICATE_REGISTER) {
-                    res.status = STATUSCODE_DUPLICATE_REGISTER;
-                } else if (m3Err != M3INTERNAL_OK) {
-                    res.status = STATUSCODE_UNKNOWN_ERR;
-                }
-                break;
-            case CMD_ALLOCATE:
-                shHandles.clear();
-                shHandleAlreadyExists = false;
-                memIdStr = std::string(req.memId);
-                for (auto& it : memIdToMemoryRegion_) {
-                    if(it.first == memIdStr && it.second.size == req.size) {
-                        if (!shHandleAlreadyExists) {
-                            shHandleAlreadyExists = true;
-                            res.numShareableHandles = 1;
-                        } else {
-                            res.numShareableHandles++;
-                        }
-                        shHandles.push_back(it.second.shareableHandle);
-                    }
-                }
+MemMapResponse MemMapManager::RequestDeAllocate(ProcessInfo &pInfo, int sock_fd, CUdeviceptr d_ptr) {
 
-                if (!shHandleAlreadyExists) {
-                    // MEM_POOL_NUM_ENTRY should be defined in memory pool class definition.
-                    // uint32_t numShareableHandles = (req.size + MEM_POOL_NUM_ENTRY - 1) / MEM_POOL_NUM_ENTRY;
-                    // For now, we just cut the region into half.
-                    numShareableHandles = 1;
-                    res.numShareableHandles = numShareableHandles;
-                    shHandles.resize(numShareableHandles);
-                    m3Err = Allocate(req.src, req.alignment, req.size, shHandles, allocHandles);
-                    std::string memIdStr(req.memId);
-                    if (m3Err != M3INTERNAL_OK) {
-                        printf("M3 Internal Error Code %d\n", m3Err);
-                        panic("Server failed to Allocate()");
-                    }
-                    for(auto& sh : shHandles) {
-                        memIdToMemoryRegion_.insert(std::make_pair(memIdStr, MemoryRegionInitializer));
-                        memIdToMemoryRegion_[memIdStr].shareableHandle = sh;
-                        memIdToMemoryRegion_[memIdStr].size = req.size;
-                        shHandletoMemId_[sh] = memIdStr;
-                    }
-                    for(auto& ah : allocHandles) {
-                        CUUTIL_ERRCHK(cuMemRelease(ah));
-                    }
-                }
-                break;
-            case CMD_GETROUNDEDALLOCATIONSIZE:
-                res.status = STATUSCODE_ACK;
-                res.roundedSize = GetRoundedAllocationSize(req.size);
-                break;
-            default:
-                res.status = STATUSCODE_NYI;
-                break;
+    MemMapClientMapping released;
+    {
+        std::lock_guard<std::mutex> lock(clientMutex_);
+        ClientStateLocked();
+        int unmapped = ReleaseMappingLocked(d_ptr, &released);
+        if (unmapped < 0) {
+            return MemMapResponse(STATUSCODE_INVALID);
         }
-        
-        if (sendto(ipc_sock_fd_, (const void *)&res, sizeof(res), 0, (struct sockaddr *)&client_addr, sizeof(client_addr)) < 0) {
-            panic("MemMapManager::MemMapManager: failed to send IPC message");
+        if (unmapped == 0) {
+            // Still in use by this process.
+            return MemMapResponse(STATUSCODE_ACK);
         }
+    }
 
-        if (req.cmd == CMD_ALLOCATE) {
-            strncpy(res.memId, req.memId, MAX_MEMID_LEN);
-            for(auto sh : shHandles) {
-                res.shareableHandle = sh;
-                if (ipcSendShareableHandle(ipc_sock_fd_, &client_addr, res.shareableHandle) < 0) {
-                    panic("MemMapManager::MemMapManager: failed to send res.shsareableHandle");
-                }
-            }
+    // Give back every reference this process took on the region.
+    MemMapRequest req(CMD_DEALLOCATE);
+    req.src = pInfo;
+    req.token = released.token;
+    MemMapResponse res(STATUSCODE_ACK);
+    for (uint32_t i = 0; i < released.serverRefs && res.status == STATUSCODE_ACK; ++i) {
+        res = Request(sock_fd, req);
+    }
+    return res;
+
+}
+
+M3InternalErrorType MemMapManager::DeAllocate(MemMapRequest &req) {
+
+    MemMapReclaim reclaim;
+    {
+        std::lock_guard<std::mutex> lock(regionsMutex_);
+        uint64_t token;
+        if (FindRegionLocked(req, &token, nullptr) == nullptr) {
+            return M3INTERNAL_ENTRY_NOT_FOUND;
         }
-        
+        int released = regions_.Release(token, req.src.pid, &reclaim.chunks);
+        if (released < 0) {
+            return M3INTERNAL_ENTRY_NOT_FOUND;
+        }
+        if (released == 0) {
+            return M3INTERNAL_OK;
+        }
+        // Cached imports of the region are stale from now on.
+        generation_++;
     }
 
+    QueueReclaim(reclaim);
+    return M3INTERNAL_OK;
+
 }
 
 
-MemMapManager::~MemMapManager() {
-    char barrierToRemove[128] = "/dev/shm/sem.";
-    strcat(barrierToRemove, MemMapManager::barrierName);
-    unlink(barrierToRemove);
 
-    close(ipc_sock_fd_);
-    unlink(MemMapManager::endpointName);
+std::string MemMapManager::DebugString() const {
+
+    std::string dbg;
+    dbg.append("name: ");
+    dbg.append(MemMapManager::name);
+    dbg.append(", ipc_name: ");
+    dbg.append(MemMapManager::endpointName);
+    dbg.append(", ipc_sock_fd: ");
+    dbg.append(std::to_string(ipc_sock_fd_));
+
+    return dbg;
 
 }
 
 
-MemMapResponse MemMapManager::RequestRegister(ProcessInfo &pInfo, int sock_fd) {
+MemMapResponse MemMapManager::Request(int sock_fd, MemMapRequest req) {
 
-    MemMapRequest req;
-    req.src = pInfo;
-    req.cmd = CMD_REGISTER;
-    MemMapResponse res = MemMapManager::Request(sock_fd, req, &server_addr);
+    MemMapResponse res;
+    res.status = STATUSCODE_ACK;
+
+    if (!SendRequest(sock_fd, req)) {
+        perror("Request send() call failure");
+        res.status = STATUSCODE_SOCKERR;
+        return res;
+    }
+
+    if (!RecvResponse(sock_fd, &res)) {
+        perror("MemMapManager::Request failed to receive result");
+        res.status = STATUSCODE_SOCKERR;
+        return res;
+    }
+
+    SeenServerGeneration(res.serverGeneration);
     return res;
 
 }
 
-M3InternalErrorType MemMapManager::Register(ProcessInfo &pInfo) {
+std::vector<MemMapResponse> MemMapManager::RequestBurst(int sock_fd, std::vector<MemMapRequest> &reqs) {
 
-    auto processIterator = std::find(subscribers_.begin(), subscribers_.end(), pInfo);
-    if (processIterator != subscribers_.end()) {
-        // Process is already subscribing memory server. Ignored.
-        return M3INTERNAL_DUPLICATE_REGISTER;
+    std::vector<MemMapResponse> responses(reqs.size(), MemMapResponse(STATUSCODE_SOCKERR));
+    char sendBuf[M3_BURST_WINDOW][M3_WIRE_MAX_SIZE];
+    char recvBuf[M3_BURST_WINDOW][M3_WIRE_MAX_SIZE];
+    struct iovec sendIov[M3_BURST_WINDOW], recvIov[M3_BURST_WINDOW];
+    struct mmsghdr sendMsgs[M3_BURST_WINDOW], recvMsgs[M3_BURST_WINDOW];
+    uint64_t serverGeneration = 0;
+
+    bzero(sendMsgs, sizeof(sendMsgs));
+    bzero(recvMsgs, sizeof(recvMsgs));
+    for (int i = 0; i < M3_BURST_WINDOW; ++i) {
+        sendIov[i].iov_base = sendBuf[i];
+        sendMsgs[i].msg_hdr.msg_iov = &sendIov[i];
+        sendMsgs[i].msg_hdr.msg_iovlen = 1;
+        recvIov[i].iov_base = recvBuf[i];
+        recvIov[i].iov_len = M3_WIRE_MAX_SIZE;
+        recvMsgs[i].msg_hdr.msg_iov = &recvIov[i];
+        recvMsgs[i].msg_hdr.msg_iovlen = 1;
     }
 
-    for(auto subscriber : subscribers_) {
-        int a2b, b2a;
-        CUUTIL_ERRCHK(cuDeviceCanAccessPeer(&a2b, pInfo.device, subscriber.device));
-        CUUTIL_ERRCHK(cuDeviceCanAccessPeer(&b2a, subscriber.device, pInfo.device));
-            
-        if (a2b && b2a) {
-            cuCtxSetCurrent(pInfo.ctx);
-            cuCtxEnablePeerAccess(subscriber.ctx, 0);
-            cuCtxSetCurrent(subscriber.ctx);
-            cuCtxEnablePeerAccess(pInfo.ctx, 0);
+    for (size_t first = 0; first < reqs.size(); first += M3_BURST_WINDOW) {
+        int count = std::min<size_t>(M3_BURST_WINDOW, reqs.size() - first);
+        for (int i = 0; i < count; ++i) {
+            sendIov[i].iov_len = MemMapWire::EncodeRequest(WithClientPriority(reqs[first + i]), sendBuf[i]);
+        }
+        for (int sent = 0; sent < count; ) {
+            int n = sendmmsg(sock_fd, &sendMsgs[sent], count - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                perror("MemMapManager::RequestBurst: sendmmsg() call failure");
+                return responses;
+            }
+            sent += n;
+        }
+        for (int received = 0; received < count; ) {
+            int n = recvmmsg(sock_fd, &recvMsgs[received], count - received, MSG_WAITFORONE, NULL);
+            if (n <= 0) {
+                perror("MemMapManager::RequestBurst failed to receive results");
+                return responses;
+            }
+            for (int i = received; i < received + n; ++i) {
+                MemMapResponse &res = responses[first + i];
+                if (MemMapWire::DecodeResponse(recvBuf[i], recvMsgs[i].msg_len, &res) == 0) {
+                    res.status = STATUSCODE_SOCKERR;
+                }
+                serverGeneration = std::max(serverGeneration, res.serverGeneration);
+            }
+            received += n;
         }
     }
 
-    subscribers_.push_back(pInfo);
-    return M3INTERNAL_OK;
+    SeenServerGeneration(serverGeneration);
+    return responses;
+
 }
 
-MemMapResponse MemMapManager::RequestAllocate(ProcessInfo &pInfo, int sock_fd, char * memId, size_t alignment, size_t num_bytes) {
+bool MemMapManager::SendRequest(int sock_fd, const MemMapRequest &req, const void *payload, size_t payloadSize) {
 
-    MemMapRequest req;
-    req.src = pInfo;
-    req.cmd = CMD_ALLOCATE;
-    req.alignment = 1024;
-    req.size = num_bytes;
-    if (memId == nullptr) {
-        // Default name should be unique and unreachable.
-        strncpy(req.memId, "DEFAULT_MEMID", MAX_MEMID_LEN);
+    char header[M3_WIRE_MAX_SIZE];
+    struct msghdr msg = {0};
+    struct iovec iov[2];
+    iov[0].iov_base = (void *)header;
+    iov[0].iov_len = MemMapWire::EncodeRequest(WithClientPriority(req), header);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = payloadSize;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = payloadSize ? 2 : 1;
+    return sendmsg(sock_fd, &msg, MSG_NOSIGNAL) >= 0;
+
+}
+
+bool MemMapManager::RecvResponse(int sock_fd, MemMapResponse *res, std::vector<char> *payload) {
+
+    // Responses without payload are small: keep them off the heap.
+    char smallBuf[M3_WIRE_MAX_SIZE];
+    std::vector<char> largeBuf;
+    char *buf = smallBuf;
+    size_t bufSize = sizeof(smallBuf);
+    if (payload != nullptr) {
+        largeBuf.resize(M3_MAX_MESSAGE_SIZE);
+        buf = largeBuf.data();
+        bufSize = largeBuf.size();
+    }
+
+    ssize_t n;
+    if (clientBusyPoll_.load(std::memory_order_relaxed)) {
+        uint32_t pause = 0;
+        while ((n = recv(sock_fd, buf, bufSize, MSG_DONTWAIT)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            busyPollBackoff(pause);
+        }
     } else {
-        strncpy(req.memId, memId, MAX_MEMID_LEN);
+        n = recv(sock_fd, buf, bufSize, 0);
+    }
+    if (n <= 0) {
+        return false;
     }
+    size_t headerSize = MemMapWire::DecodeResponse(buf, n, res);
+    if (headerSize == 0) {
+        errno = EPROTO;
+        return false;
+    }
+    if (payload != nullptr) {
+        payload->assign(buf + headerSize, buf + n);
+    }
+    return true;
 
-    MemMapResponse res;
-    res.status = STATUSCODE_ACK;
+}
 
-    int shHandleCount = 0;
-    std::vector<shareable_handle_t> shHandles;
 
-    ipcLock();
+size_t MemMapWire::EncodeRequest(const MemMapRequest &req, char *buf) {
 
-    socklen_t server_addr_len = SUN_LEN(&server_addr);
+    const uint64_t fields[] = {
+        (uint32_t)req.src.pid, (uint32_t)req.src.device, req.size, req.alignment, req.flags, req.generation, req.token,
+        (uint64_t)req.priority, req.offset, req.limit
+    };
+    const int numFields = sizeof(fields) / sizeof(fields[0]);
+    size_t memIdLen = strnlen(req.memId, MAX_MEMID_LEN);
+    uint16_t mask = 0;
 
-    // First, send CMD_ALLOCATE request to server.
-    if (sendto(sock_fd, (const void *)&req, sizeof(req), 0, (struct sockaddr *)&server_addr, server_addr_len) < 0) {
-        perror("Request sendto() call failure");
-        res.status = STATUSCODE_SOCKERR;
+    char *p = buf + M3_WIRE_HEADER_SIZE;
+    for (int f = 0; f < numFields; ++f) {
+        if (fields[f] != 0) {
+            mask |= 1 << f;
+            p = PutVarint(p, fields[f]);
+        }
     }
-    // Server tells the number of shareable handles to send using res.numShareableHandles.
-    if (recvfrom(sock_fd, (void *)&res, sizeof(res), 0, (struct sockaddr *)&server_addr, &server_addr_len) < 0) {
-        perror("MemMapManager::RequestRegister failed to receive RequestRegister result");
-        res.status = STATUSCODE_SOCKERR;
+    if (memIdLen > 0) {
+        mask |= 1 << numFields;
+        p = PutMemId(p, req.memId, memIdLen);
     }
 
-    // Receive multiple shareable handles.
-    do {
-        if (ipcRecvShareableHandle(sock_fd, &res.shareableHandle) < 0) {
-            perror("MemMapManager::RequestRegister failed to receive RequestAllocate result");
-            res.status = STATUSCODE_SOCKERR;    
-        }
-        shHandles.push_back(res.shareableHandle);
-    } while(++shHandleCount < res.numShareableHandles);
-
-    ipcUnlock();
-    
-    // Import and MemMap shareable handlers into local Virtual Memory.
-    CUmemAccessDesc accessDescriptor;
-    accessDescriptor.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
-    accessDescriptor.location.id = pInfo.device;
-    accessDescriptor.flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+    buf[0] = M3_WIRE_VERSION;
+    buf[1] = (char)req.cmd;
+    buf[2] = (char)(mask & 0xff);
+    buf[3] = (char)(mask >> 8);
+    return p - buf;
 
-    res.d_ptr = (CUdeviceptr)nullptr;
-    CUUTIL_ERRCHK(cuMemAddressReserve(&res.d_ptr, req.size, alignment, 0, 0));
+}
 
-    assert(res.numShareableHandles > 0);
-    size_t chunkSize = req.size / res.numShareableHandles;
+size_t MemMapWire::DecodeRequest(const char *buf, size_t len, MemMapRequest *req) {
 
-    std::vector<CUmemGenericAllocationHandle> allocHandles(res.numShareableHandles);
+    const int numFields = 10;
+    uint64_t fields[numFields] = {0};
+    const char *p = buf + M3_WIRE_HEADER_SIZE;
+    const char *end = buf + len;
 
-    for(int i = 0; i < res.numShareableHandles; ++i) {
-        CUUTIL_ERRCHK(cuMemImportFromShareableHandle(
-            &allocHandles[i], (void *)(uintptr_t)shHandles[i], CU_MEM_HANDLE_TYPE_POSIX_FILE_DESCRIPTOR));
-        CUUTIL_ERRCHK(cuMemMap(res.d_ptr + i * chunkSize, chunkSize, 0, allocHandles[i], 0));
+    if (len < M3_WIRE_HEADER_SIZE || (uint8_t)buf[0] != M3_WIRE_VERSION || (uint8_t)buf[1] >= CMD_COUNT) {
+        return 0;
+    }
+    uint16_t mask = (uint8_t)buf[2] | ((uint16_t)(uint8_t)buf[3] << 8);
+    if (mask >> (numFields + 1)) {
+        return 0;
+    }
+    for (int f = 0; f < numFields; ++f) {
+        if ((mask & (1 << f)) && (p = GetVarint(p, end, &fields[f])) == nullptr) {
+            return 0;
+        }
+    }
+    if (fields[0] > INT32_MAX || fields[1] > INT32_MAX || fields[4] > UINT32_MAX || fields[7] >= M3_PRIORITY_COUNT) {
+        return 0;
+    }
+    req->memId[0] = '\0';
+    if ((mask & (1 << numFields)) && (p = GetMemId(p, end, req->memId)) == nullptr) {
+        return 0;
     }
 
-    for(auto &sh : shHandles) close(sh);
-    for(auto &ah : allocHandles) CUUTIL_ERRCHK(cuMemRelease(ah));
+    req->cmd = (MemMapCmd)(uint8_t)buf[1];
+    req->src.pid = (pid_t)fields[0];
+    req->src.device = (CUdevice)fields[1];
+    req->src.device_ordinal = req->src.device;
+    req->src.ctx = nullptr;
+    req->size = fields[2];
+    req->alignment = fields[3];
+    req->flags = (uint32_t)fields[4];
+    req->generation = fields[5];
+    req->token = fields[6];
+    req->priority = (MemMapPriority)fields[7];
+    req->offset = fields[8];
+    req->limit = fields[9];
+    return p - buf;
 
-    // cuMemSetAccess may not work well on physical memory regions in heterogeneous GPUs.
-    // Check out cuDeviceCanAccessPeer().
-    CUUTIL_ERRCHK(cuMemSetAccess(res.d_ptr, req.size, &accessDescriptor, 1));
+}
 
-    return res;
+size_t MemMapWire::EncodeResponse(const MemMapResponse &res, char *buf) {
 
-}
+    const uint64_t fields[] = {
+        res.roundedSize, res.numShareableHandles, res.offset, res.backingId, res.backingSize,
+        res.generation, res.serverGeneration, (uint32_t)res.device, res.token, (uint64_t)res.backend, res.commitSize
+    };
+    const int numFields = sizeof(fields) / sizeof(fields[0]);
+    size_t memIdLen = strnlen(res.memId, MAX_MEMID_LEN);
+    uint16_t mask = 0;
 
-MemMapResponse MemMapManager::RequestRoundedAllocationSize(ProcessInfo &pInfo, int sock_fd, size_t num_bytes) {
+    char *p = buf + M3_WIRE_HEADER_SIZE;
+    for (int f = 0; f < numFields; ++f) {
+        if (fields[f] != 0) {
+            mask |= 1 << f;
+            p = PutVarint(p, fields[f]);
+        }
+    }
+    if (memIdLen > 0) {
+        mask |= 1 << numFields;
+        p = PutMemId(p, res.memId, memIdLen);
+    }
 
-    MemMapRequest req;
-    req.src = pInfo;
-    req.cmd = CMD_GETROUNDEDALLOCATIONSIZE;
-    req.size = num_bytes;
-    MemMapResponse res = MemMapManager::Request(sock_fd, req, &server_addr);
-    return res;
+    buf[0] = M3_WIRE_VERSION;
+    buf[1] = (char)res.status;
+    buf[2] = (char)(mask & 0xff);
+    buf[3] = (char)(mask >> 8);
+    return p - buf;
 
 }
 
-size_t MemMapManager::GetRoundedAllocationSize(size_t num_bytes) {
+size_t MemMapWire::DecodeResponse(const char *buf, size_t len, MemMapResponse *res) {
 
-    CUmemAllocationProp prop = {};
-    prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
-    prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
-    // Use GPU 0 as Memory server device, for now.
-    prop.location.id = devices_[0];
-    prop.requestedHandleTypes = CU_MEM_HANDLE_TYPE_POSIX_FILE_DESCRIPTOR;
-    size_t granularity = 0;
-    CUUTIL_ERRCHK(cuMemGetAllocationGranularity(
-        &granularity, &prop, CU_MEM_ALLOC_GRANULARITY_MINIMUM));
-
-    assert( granularity > 0);
+    const int numFields = 11;
+    uint64_t fields[numFields] = {0};
+    const char *p = buf + M3_WIRE_HEADER_SIZE;
+    const char *end = buf + len;
 
-    if (num_bytes % granularity) {
-       num_bytes += (granularity - (num_bytes % granularity));
+    if (len < M3_WIRE_HEADER_SIZE || (uint8_t)buf[0] != M3_WIRE_VERSION || (uint8_t)buf[1] >= STATUSCODE_COUNT) {
+        return 0;
+    }
+    uint16_t mask = (uint8_t)buf[2] | ((uint16_t)(uint8_t)buf[3] << 8);
+    if (mask >> (numFields + 1)) {
+        return 0;
+    }
+    for (int f = 0; f < numFields; ++f) {
+        if ((mask & (1 << f)) && (p = GetVarint(p, end, &fields[f])) == nullptr) {
+            return 0;
+        }
+    }
+    if (fields[1] > UINT32_MAX || fields[7] > INT32_MAX || fields[9] >= M3_BACKEND_COUNT) {
+        return 0;
+    }
+    res->memId[0] = '\0';
+    if ((mask & (1 << numFields)) && (p = GetMemId(p, end, res->memId)) == nullptr) {
+        return 0;
     }
 
-    return num_bytes;
+    res->status = (MemMapStatusCode)(uint8_t)buf[1];
+    res->roundedSize = fields[0];
+    res->numShareableHandles = (uint32_t)fields[1];
+    res->offset = fields[2];
+    res->backingId = fields[3];
+    res->backingSize = fields[4];
+    res->generation = fields[5];
+    res->serverGeneration = fields[6];
+    res->device = (CUdevice)fields[7];
+    res->token = fields[8];
+    res->backend = (MemMapBackendKind)fields[9];
+    res->commitSize = fields[10];
+    res->shareableHandle = (shareable_handle_t)nullptr;
+    res->d_ptr = (CUdeviceptr)nullptr;
+    return p - buf;
 
 }
 
+size_t MemMapWire::EncodeBatchEntry(const MemMapBatchEntry &entry, char *buf) {
 
-M3InternalErrorType MemMapManager::Allocate(ProcessInfo &pInfo, size_t alignment, size_t num_bytes, std::vector<shareable_handle_t>& shHandle, std::vector<CUmemGenericAllocationHandle>& allocHandle) {
+    char *p = PutMemId(buf, entry.memId, strnlen(entry.memId, MAX_MEMID_LEN));
+    p = PutVarint(p, entry.size);
+    p = PutVarint(p, entry.alignment);
+    return p - buf;
 
-    CUmemAllocationProp prop = {};
-    prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
-    prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
-    // Use GPU 0 as Memory server device, for now.
-    // Since I don't have NVLINK-supported environment now,
-    // I'll just set pInfo.device = 0 in child process.
-    prop.location.id = pInfo.device;
-    prop.requestedHandleTypes = CU_MEM_HANDLE_TYPE_POSIX_FILE_DESCRIPTOR;
+}
 
-    uint32_t num_handles = shHandle.size();
-    allocHandle.resize(num_handles);
-    size_t chunk_size = GetRoundedAllocationSize(num_bytes / num_handles);
-    assert(num_bytes % chunk_size == 0);
+size_t MemMapWire::DecodeBatchEntry(const char *buf, size_t len, MemMapBatchEntry *entry) {
 
-    for(int i = 0; i < num_handles; ++i) {
-        CUUTIL_ERRCHK( cuMemCreate(&allocHandle[i], chunk_size, &prop, 0) );
-        CUUTIL_ERRCHK( cuMemExportToShareableHandle((void *)&shHandle[i], allocHandle[i], CU_MEM_HANDLE_TYPE_POSIX_FILE_DESCRIPTOR, 0) );
+    const char *end = buf + len;
+    const char *p = GetMemId(buf, end, entry->memId);
+    uint64_t size, alignment;
+    if (p == nullptr || (p = GetVarint(p, end, &size)) == nullptr || (p = GetVarint(p, end, &alignment)) == nullptr) {
+        return 0;
     }
-    return M3INTERNAL_OK;
+    entry->size = size;
+    entry->alignment = alignment;
+    return p - buf;
 
 }
 
-MemMapResponse MemMapManager::RequestDeAllocate(ProcessInfo &pInfo, int sock_fd, shareable_handle_t shHandle) {
-    MemMapRequest req;
-    req.src = pInfo;
-    req.cmd = CMD_DEALLOCATE;
-    req.shareableHandle = shHandle;
-    MemMapResponse res;
-    res = Request(sock_fd, req, &server_addr);
-    return res;
-}
+size_t MemMapWire::EncodeBatchResult(const MemMapBatchResult &result, char *buf) {
+
+    char *p = PutVarint(buf, (uint32_t)result.status);
+    p = PutVarint(p, result.roundedSize);
+    p = PutVarint(p, result.numShareableHandles);
+    p = PutVarint(p, result.duplicateOf);
+    p = PutVarint(p, (uint32_t)result.device);
+    p = PutVarint(p, result.token);
+    p = PutVarint(p, result.offset);
+    p = PutVarint(p, result.backingId);
+    p = PutVarint(p, result.backingSize);
+    return p - buf;
 
-M3InternalErrorType MemMapManager::DeAllocate(ProcessInfo &pInfo, shareable_handle_t shHandle) {
-    return M3INTERNAL_NYI;
 }
 
+size_t MemMapWire::DecodeBatchResult(const char *buf, size_t len, MemMapBatchResult *result) {
 
+    uint64_t fields[9];
+    const char *p = buf;
+    const char *end = buf + len;
+    for (int f = 0; f < 9; ++f) {
+        if ((p = GetVarint(p, end, &fields[f])) == nullptr) {
+            return 0;
+        }
+    }
+    if (fields[0] >= STATUSCODE_COUNT || fields[2] > UINT32_MAX || fields[3] > UINT32_MAX || fields[4] > INT32_MAX) {
+        return 0;
+    }
+    result->status = (MemMapStatusCode)fields[0];
+    result->roundedSize = fields[1];
+    result->numShareableHandles = (uint32_t)fields[2];
+    result->duplicateOf = (uint32_t)fields[3];
+    result->device = (CUdevice)fields[4];
+    result->token = fields[5];
+    result->offset = fields[6];
+    result->backingId = fields[7];
+    result->backingSize = fields[8];
+    return p - buf;
 
-std::string MemMapManager::DebugString() const {
+}
 
-    std::string dbg;
-    dbg.append("name: ");
-    dbg.append(MemMapManager::name);
-    dbg.append(", ipc_name: ");
-    dbg.append(MemMapManager::endpointName);
-    dbg.append(", ipc_sock_fd: ");
-    dbg.append(std::to_string(ipc_sock_fd_));
+size_t MemMapWire::EncodeCommitPages(const std::vector<uint64_t> &pages, char *buf) {
 
-    return dbg;
+    char *p = buf;
+    uint64_t previous = 0;
+    for (uint64_t page : pages) {
+        p = PutVarint(p, page - previous);
+        previous = page;
+    }
+    return p - buf;
 
 }
 
+size_t MemMapWire::DecodeCommitPages(const char *buf, size_t len, uint32_t count, std::vector<uint64_t> *pages) {
 
-MemMapResponse MemMapManager::Request(int sock_fd, MemMapRequest req, struct sockaddr_un * remote_addr) {
-
-    ipcLock();
+    const char *p = buf;
+    const char *end = buf + len;
+    uint64_t page = 0;
+    pages->clear();
+    for (uint32_t i = 0; i < count; ++i) {
+        uint64_t distance;
+        if ((p = GetVarint(p, end, &distance)) == nullptr || (i > 0 && distance == 0) || page + distance < page) {
+            return 0;
+        }
+        page += distance;
+        pages->push_back(page);
+    }
+    return p - buf;
 
-    MemMapResponse res;
-    res.status = STATUSCODE_ACK;
+}
 
-    uint32_t shHandleCnt = 0;
-    std::vector<shareable_handle_t> shHandles;
+char *MemMapWire::PutVarint(char *p, uint64_t v) {
 
-    socklen_t remote_addr_len = SUN_LEN(remote_addr);
-    if (sendto(sock_fd, (const void *)&req, sizeof(req), 0, (struct sockaddr *)remote_addr, remote_addr_len) < 0) {
-        perror("Request sendto() call failure");
-        printf("tried to open %s\n", remote_addr->sun_path);
-        res.status = STATUSCODE_SOCKERR;
+    while (v >= 0x80) {
+        *p++ = (char)(v | 0x80);
+        v >>= 7;
     }
+    *p++ = (char)v;
+    return p;
 
-    if (recvfrom(sock_fd, (void *)&res, sizeof(res), 0, (struct sockaddr *)remote_addr, &remote_addr_len) < 0) {
-        perror("MemMapManager::RequestRegister failed to receive RequestRegister result");
-        res.status = STATUSCODE_SOCKERR;
+}
+
+const char *MemMapWire::GetVarint(const char *p, const char *end, uint64_t *v) {
+
+    uint64_t x = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t b = (uint8_t)*p++;
+        // The 10th byte only has room for the top bit.
+        if (shift == 63 && b > 1) {
+            return nullptr;
+        }
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = x;
+            return p;
+        }
     }
+    return nullptr;
 
-    ipcUnlock();
+}
 
-    return res;
+char *MemMapWire::PutMemId(char *p, const char *memId, size_t len) {
+
+    p = PutVarint(p, len);
+    memcpy(p, memId, len);
+    return p + len;
+
+}
+
+const char *MemMapWire::GetMemId(const char *p, const char *end, char *memId) {
+
+    uint64_t len;
+    if ((p = GetVarint(p, end, &len)) == nullptr || len > MAX_MEMID_LEN || len > (uint64_t)(end - p)) {
+        return nullptr;
+    }
+    memcpy(memId, p, len);
+    if (len < MAX_MEMID_LEN) {
+        memId[len] = '\0';
+    }
+    return p + len;
 
 }
 
@@ -413,9 +4393,9 @@ void panic(const char * msg) {
 
 }
 
-int ipcSendShareableHandle(int sock_fd, struct sockaddr_un * client_addr, shareable_handle_t shHandle) {
+int ipcSendShareableHandle(int sock_fd, shareable_handle_t shHandle) {
 
-    struct msghdr msg;
+    struct msghdr msg = {0};
     struct iovec iov[1];
 
     union {
@@ -424,8 +4404,7 @@ int ipcSendShareableHandle(int sock_fd, struct sockaddr_un * client_addr, sharea
     } control_un;
 
     struct cmsghdr *cmptr;
-    ssize_t readResult;
-    socklen_t len = sizeof(*client_addr);
+    int fd = (int)shHandle;
 
     msg.msg_control = control_un.control;
     msg.msg_controllen = sizeof(control_un.control);
@@ -435,17 +4414,14 @@ int ipcSendShareableHandle(int sock_fd, struct sockaddr_un * client_addr, sharea
     cmptr->cmsg_level = SOL_SOCKET;
     cmptr->cmsg_type = SCM_RIGHTS;
 
-    memmove(CMSG_DATA(cmptr), &shHandle, sizeof(shHandle));
-
-    msg.msg_name = (void *)client_addr;
-    msg.msg_namelen = sizeof(struct sockaddr_un);
+    memmove(CMSG_DATA(cmptr), &fd, sizeof(fd));
 
     iov[0].iov_base = (void *)"";
     iov[0].iov_len = 1;
     msg.msg_iov = iov;
     msg.msg_iovlen = 1;
 
-    ssize_t sendResult = sendmsg(sock_fd, &msg, 0);
+    ssize_t sendResult = sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
     if (sendResult <= 0) {
         perror("IPC failure: Sending data over socket failed");
         return -1;
@@ -454,6 +4430,25 @@ int ipcSendShareableHandle(int sock_fd, struct sockaddr_un * client_addr, sharea
 
 }
 
+int ipcSendShareableHandles(int sock_fd, const std::vector<shareable_handle_t> &shHandles) {
+
+    std::vector<int> fds(shHandles.begin(), shHandles.end());
+    return ipcSendFds(sock_fd, fds.data(), fds.size(), NULL);
+
+}
+
+int ipcRecvShareableHandles(int sock_fd, std::vector<shareable_handle_t> &shHandles, uint32_t count) {
+
+    std::vector<int> fds(count);
+    shHandles.clear();
+    if (ipcRecvFds(sock_fd, fds.data(), count) < 0) {
+        return -1;
+    }
+    shHandles.assign(fds.begin(), fds.end());
+    return 0;
+
+}
+
 int ipcRecvShareableHandle(int sock_fd, shareable_handle_t *shHandle) {
     struct msghdr msg = {0};
     struct iovec iov[1];
@@ -492,7 +4487,7 @@ int ipcRecvShareableHandle(int sock_fd, shareable_handle_t *shHandle) {
     }
 
     memmove(&receivedfd, CMSG_DATA(cmptr), sizeof(receivedfd));
-    *(int *)shHandle = receivedfd;
+    *shHandle = (shareable_handle_t)receivedfd;
     } else {
     return -1;
     }
@@ -501,9 +4496,9 @@ int ipcRecvShareableHandle(int sock_fd, shareable_handle_t *shHandle) {
 }
 
 
-int ipcOpenAndBindSocket(struct sockaddr_un * local_addr) {
+int ipcListen(struct sockaddr_un * local_addr) {
     int sock_fd;
-    if((sock_fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1) {
+    if((sock_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) == -1) {
         panic("MemMapManager: Failed to open server socket");
     }
 
@@ -512,47 +4507,42 @@ int ipcOpenAndBindSocket(struct sockaddr_un * local_addr) {
         panic("");
     }
 
+    if (listen(sock_fd, SOMAXCONN) < 0) {
+        panic("MemMapManager: Failed to listen on server socket");
+    }
+
     return sock_fd;
 }
 
 
-int ipcLockGeneric(int initialValue) {
-    sem_t * sem = sem_open(MemMapManager::barrierName, O_CREAT, S_IRUSR|S_IWUSR, initialValue);
-    if (sem == SEM_FAILED) {
-        std::cout << "MemMapManager: Failed to open semaphore" << MemMapManager::barrierName << std::endl;
+int ipcConnect(struct sockaddr_un * remote_addr) {
+    int sock_fd;
+    if((sock_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1) {
+        perror("MemMapManager: Failed to open client socket");
         return -1;
     }
-    sem_wait(sem);
-    sem_close(sem); 
-    return 0;
-}
 
-int ipcLock() {
-    return ipcLockGeneric(0);
-}
+    // The server may still be booting. Retry for about 10 seconds.
+    for (int retry = 0; connect(sock_fd, (struct sockaddr *)remote_addr, SUN_LEN(remote_addr)) < 0; ++retry) {
+        if ((errno != ENOENT && errno != ECONNREFUSED && errno != EAGAIN) || retry == 10000) {
+            printf("[PID = %d] Failed to connect to %s\n", getpid(), remote_addr->sun_path);
+            perror("MemMapManager: connect");
+            close(sock_fd);
+            return -1;
+        }
+        usleep(1000);
+    }
 
-int ipcLockPrivileged() {
-    return ipcLockGeneric(1);
+    return sock_fd;
 }
 
 
-int ipcUnlock(void) {
-    sem_t * sem = sem_open(MemMapManager::barrierName, O_CREAT, S_IRUSR|S_IWUSR, 0);
-    if (sem == SEM_FAILED) {
-        std::cout << "MemMapManager: Failed to open semaphore" << MemMapManager::barrierName << std::endl;
-        return -1;
-    }
-    sem_post(sem);
-    sem_close(sem); 
-    return 0;
-}
-
 void ipcHaltM3Server(int sock_fd, ProcessInfo pInfo) {
     MemMapRequest req;
     MemMapResponse res;
     req.src = pInfo;
     req.cmd = CMD_HALT;
-    res = MemMapManager::Request(sock_fd, req, &server_addr);
+    res = MemMapManager::Request(sock_fd, req);
     if (res.status != STATUSCODE_ACK) {
         std::cout << "halt status code = " << res.status << std::endl;
         std::cout << res.DebugString() << std::endl;
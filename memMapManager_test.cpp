@@ -4,8 +4,36 @@ void test_MultiGPUAllocate(char * unit, size_t factor);
 void test_singleton(void);
 void test_Allocate(void);
 void test_Echo(int rep);
+void test_ServerThroughput(int numClients, int rep);
+void test_EchoScaling(int rep);
+void test_RingLatency(int rep);
+void test_AllocateBatch(int numRegions);
+void test_RegionIndexLookup(int numLookups);
+void test_AllocateRounding(int numRegions);
+void test_AllocatePool(int numRegions);
+void test_SubAllocate(int numRegions);
+void test_VAArena(int rep);
+void test_ImportCache(int rep);
+void test_DeAllocate(int numRegions);
+void test_ClientReap(int numRegions);
+void test_FdPassing(int rep);
+void test_Placement(int numRegions);
+void test_Striping(int rep);
+void test_WireFormat(int rep);
+void test_RegionToken(int numRegions);
+void test_Burst(int numClients, int rep);
+void test_BusyPoll(int rep);
+void test_Priority(int numBulkClients, int rep);
+void test_Handover(int numRegions);
+void test_HostBackend(int numRegions);
+void test_NumaPlacement(size_t size, int rep);
+void test_Resize(int numPages);
+void test_Sparse(int numPages);
 
+// Tests can also be selected at build time with -DM3_TEST_SELECTED -DTEST_<NAME>.
+#ifndef M3_TEST_SELECTED
 #define TEST_ECHO
+#endif
 
 int main(int argc, char *argv[]) {
 
@@ -17,6 +45,106 @@ int main(int argc, char *argv[]) {
     test_Allocate();
 #endif /* TEST_GPUALLOCATE */
 
+#ifdef TEST_SERVERTHROUGHPUT
+    test_ServerThroughput(16, 2000);
+#endif /* TEST_SERVERTHROUGHPUT */
+
+#ifdef TEST_ECHOSCALING
+    test_EchoScaling(20000);
+#endif /* TEST_ECHOSCALING */
+
+#ifdef TEST_RINGLATENCY
+    test_RingLatency(100000);
+#endif /* TEST_RINGLATENCY */
+
+#ifdef TEST_ALLOCATEBATCH
+    test_AllocateBatch(200);
+#endif /* TEST_ALLOCATEBATCH */
+
+#ifdef TEST_REGIONINDEXLOOKUP
+    test_RegionIndexLookup(1000000);
+#endif /* TEST_REGIONINDEXLOOKUP */
+
+#ifdef TEST_ALLOCATEROUNDING
+    test_AllocateRounding(500);
+#endif /* TEST_ALLOCATEROUNDING */
+
+#ifdef TEST_ALLOCATEPOOL
+    test_AllocatePool(2000);
+#endif /* TEST_ALLOCATEPOOL */
+
+#ifdef TEST_SUBALLOCATE
+    test_SubAllocate(5000);
+#endif /* TEST_SUBALLOCATE */
+
+#ifdef TEST_VAARENA
+    test_VAArena(5000);
+#endif /* TEST_VAARENA */
+
+#ifdef TEST_IMPORTCACHE
+    test_ImportCache(100000);
+#endif /* TEST_IMPORTCACHE */
+
+#ifdef TEST_DEALLOCATE
+    test_DeAllocate(2000);
+#endif /* TEST_DEALLOCATE */
+
+#ifdef TEST_CLIENTREAP
+    test_ClientReap(500);
+#endif /* TEST_CLIENTREAP */
+
+#ifdef TEST_FDPASSING
+    test_FdPassing(2000);
+#endif /* TEST_FDPASSING */
+
+#ifdef TEST_PLACEMENT
+    test_Placement(64);
+#endif /* TEST_PLACEMENT */
+
+#ifdef TEST_STRIPING
+    test_Striping(20);
+#endif /* TEST_STRIPING */
+
+#ifdef TEST_WIREFORMAT
+    test_WireFormat(20000);
+#endif /* TEST_WIREFORMAT */
+
+#ifdef TEST_REGIONTOKEN
+    test_RegionToken(200);
+#endif /* TEST_REGIONTOKEN */
+
+#ifdef TEST_BURST
+    test_Burst(16, 3200);
+#endif /* TEST_BURST */
+
+#ifdef TEST_BUSYPOLL
+    test_BusyPoll(100000);
+#endif /* TEST_BUSYPOLL */
+
+#ifdef TEST_PRIORITY
+    test_Priority(4, 1000);
+#endif /* TEST_PRIORITY */
+
+#ifdef TEST_HANDOVER
+    test_Handover(1000);
+#endif /* TEST_HANDOVER */
+
+#ifdef TEST_HOSTBACKEND
+    test_HostBackend(500);
+#endif /* TEST_HOSTBACKEND */
+
+#ifdef TEST_NUMAPLACEMENT
+    test_NumaPlacement((size_t)64 << 20, 8);
+#endif /* TEST_NUMAPLACEMENT */
+
+#ifdef TEST_RESIZE
+    test_Resize(16);
+#endif /* TEST_RESIZE */
+
+#ifdef TEST_SPARSE
+    test_Sparse(320);
+#endif /* TEST_SPARSE */
+
 #ifdef TEST_ECHO
     if (argc != 2) {
         printf("Usage: [%s] <Number of repetition> \n", argv[0]);
@@ -66,15 +194,8 @@ void test_MultiGPUAllocate(char * unit, size_t factor) {
         std::cout << pInfo.DebugString() << std::endl;
 
         int sock_fd = 0;
-        struct sockaddr_un client_addr;
-        if ((sock_fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1) {
-            panic("MemMapManager::RequestRegister failed to open socket");
-        }
-        bzero(&client_addr, sizeof(client_addr));
-        client_addr.sun_family = AF_UNIX;
-        strcpy(client_addr.sun_path, pInfo.AddressString().c_str());
-        if (bind(sock_fd, (struct sockaddr *)&client_addr, SUN_LEN(&client_addr)) < 0) {
-            panic("MemMapManager::RequestRegister failed to bind client socket");
+        if ((sock_fd = ipcConnect(&server_addr)) == -1) {
+            panic("MemMapManager::RequestRegister failed to connect to server");
         }
         
         MemMapRequest req;
@@ -100,7 +221,7 @@ void test_MultiGPUAllocate(char * unit, size_t factor) {
 
         req.src = pInfo;
         req.cmd = CMD_HALT;
-        res = MemMapManager::Request(sock_fd, req, &server_addr);
+        res = MemMapManager::Request(sock_fd, req);
         if (res.status != STATUSCODE_ACK) {
             std::cout << res.DebugString() << std::endl;
             while(true);
@@ -108,7 +229,7 @@ void test_MultiGPUAllocate(char * unit, size_t factor) {
 
             // panic("Failed to halt M3 instance");
         }
-        unlink(pInfo.AddressString().c_str());
+        close(sock_fd);
 
     } else {
         CUUTIL_ERRCHK(cuInit(0));
@@ -122,8 +243,7 @@ void test_singleton(void) {
     pid_t pid = fork();
     if (pid == 0) {
         sleep(1);
-        struct sockaddr_un client_addr;
-        int sock_fd = ipcOpenAndBindSocket(&client_addr);
+        int sock_fd = ipcConnect(&server_addr);
         ProcessInfo pInfo;
         ipcHaltM3Server(sock_fd, pInfo);
     } else {
@@ -150,9 +270,8 @@ void test_Allocate(void) {
         CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, device));
         pInfo.SetContext(ctx);
 
-        // Open and bind socket to client's unique IPC file.
-        struct sockaddr_un client_addr;
-        int sock_fd = ipcOpenAndBindSocket(&client_addr);
+        // Connect to the server.
+        int sock_fd = ipcConnect(&server_addr);
         
         MemMapResponse res;
         res = MemMapManager::RequestRegister(pInfo, sock_fd);
@@ -197,8 +316,8 @@ void test_Allocate(void) {
         }
         
 
-        
-        unlink(pInfo.AddressString().c_str());
+
+        close(sock_fd);
     } else {
         // parent process as a demo server.
         MemMapManager *m3 = MemMapManager::Instance();
@@ -219,19 +338,14 @@ void test_Echo(int rep) {
         ProcessInfo pInfo;
         pInfo.SetContext(ctx);
 
-        int sock_fd = 0;
-        struct sockaddr_un client_addr;
-        bzero(&client_addr, sizeof(client_addr));
-        client_addr.sun_family = AF_UNIX;
-        strcpy(client_addr.sun_path, pInfo.AddressString().c_str());
-        sock_fd = ipcOpenAndBindSocket(&client_addr);
+        int sock_fd = ipcConnect(&server_addr);
 
         MemMapRequest req;
         req.src = pInfo;
         req.cmd = CMD_ECHO;
         MemMapResponse res;
 
-        res = MemMapManager::Request(sock_fd, req, &server_addr);
+        res = MemMapManager::Request(sock_fd, req);
         if (res.status != STATUSCODE_ACK) {
             printf("Failed to Echo\n");
         } else {
@@ -246,3 +360,2404 @@ void test_Echo(int rep) {
         wait(&wStat);
     }
 }
+
+
+// spawnServer() boots an M3 server in a child process and waits until it accepts connections.
+static pid_t spawnServer(const MemMapServerOptions &options = MemMapServerOptions()) {
+    unlink(MemMapManager::endpointName);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        MemMapManager::SetServerOptions(options);
+        MemMapManager::Instance();
+        exit(EXIT_SUCCESS);
+    }
+    close(ipcConnect(&server_addr));
+    return pid;
+}
+
+// haltServer() stops the server spawned by spawnServer() and reaps it.
+static void haltServer(pid_t serverPid) {
+    ProcessInfo pInfo;
+    int sock_fd = ipcConnect(&server_addr);
+    ipcHaltM3Server(sock_fd, pInfo);
+    close(sock_fd);
+    waitpid(serverPid, nullptr, 0);
+}
+
+static double elapsedSeconds(struct timespec &begin, struct timespec &end) {
+    return (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) * 1e-9;
+}
+
+// percentile() returns the p-th percentile of latencies, which gets sorted.
+static double percentile(std::vector<double> &latencies, double p) {
+    std::sort(latencies.begin(), latencies.end());
+    return latencies[(size_t)(p / 100.0 * (latencies.size() - 1))];
+}
+
+// test_ServerThroughput() measures aggregate request throughput of numClients concurrent clients.
+// Every client allocates a region of its own, then alternates CMD_ECHO and CMD_GETROUNDEDALLOCATIONSIZE.
+// Build with -DM3_HOST_STUB to run it without any GPU.
+void test_ServerThroughput(int numClients, int rep) {
+    pid_t serverPid = spawnServer();
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    std::vector<pid_t> clients;
+    fflush(stdout);
+    for (int c = 0; c < numClients; ++c) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            CUUTIL_ERRCHK(cuInit(0));
+            CUcontext ctx;
+            CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, 0));
+            ProcessInfo pInfo;
+            pInfo.SetContext(ctx);
+
+            int sock_fd = ipcConnect(&server_addr);
+
+            bool pass = true;
+            char memId[MAX_MEMID_LEN];
+            sprintf(memId, "throughput_%d", c);
+            MemMapResponse res = MemMapManager::RequestRoundedAllocationSize(pInfo, sock_fd, 4096);
+            res = MemMapManager::RequestAllocate(pInfo, sock_fd, memId, 1024, res.roundedSize);
+            pass = pass && (res.status == STATUSCODE_ACK);
+
+            MemMapRequest req;
+            req.src = pInfo;
+            for (int i = 0; i < rep; ++i) {
+                req.cmd = (i % 2) ? CMD_GETROUNDEDALLOCATIONSIZE : CMD_ECHO;
+                req.size = 4096;
+                res = MemMapManager::Request(sock_fd, req);
+                pass = pass && (res.status == STATUSCODE_ACK);
+            }
+
+            close(sock_fd);
+            exit(pass ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        clients.push_back(pid);
+    }
+
+    bool pass = true;
+    for (auto pid : clients) {
+        int wStat;
+        waitpid(pid, &wStat, 0);
+        pass = pass && WIFEXITED(wStat) && WEXITSTATUS(wStat) == EXIT_SUCCESS;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = elapsedSeconds(begin, end);
+    long numRequests = (long)numClients * (rep + 2);
+    printf("SERVER THROUGHPUT: %d clients, %ld requests in %.3f s (%.0f requests/s)\n",
+        numClients, numRequests, seconds, numRequests / seconds);
+
+    haltServer(serverPid);
+
+    if (pass) {
+        std::cout << "SERVER THROUGHPUT TEST PASSED" << std::endl;
+    } else {
+        std::cout << "SERVER THROUGHPUT TEST FAILED" << std::endl;
+    }
+}
+
+// test_EchoScaling() measures aggregate CMD_ECHO throughput at 1, 8 and 64 concurrent clients.
+// Each client sends rep / numClients echoes, so that every round sends the same number of requests.
+void test_EchoScaling(int rep) {
+    pid_t serverPid = spawnServer();
+    bool pass = true;
+
+    int numClientsList[] = {1, 8, 64};
+    for (int numClients : numClientsList) {
+        int repPerClient = rep / numClients;
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+
+        std::vector<pid_t> clients;
+        fflush(stdout);
+        for (int c = 0; c < numClients; ++c) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                ProcessInfo pInfo;
+                int sock_fd = ipcConnect(&server_addr);
+                MemMapRequest req(CMD_ECHO);
+                req.src = pInfo;
+                bool pass = true;
+                for (int i = 0; i < repPerClient; ++i) {
+                    pass = pass && (MemMapManager::Request(sock_fd, req).status == STATUSCODE_ACK);
+                }
+                close(sock_fd);
+                exit(pass ? EXIT_SUCCESS : EXIT_FAILURE);
+            }
+            clients.push_back(pid);
+        }
+        for (auto pid : clients) {
+            int wStat;
+            waitpid(pid, &wStat, 0);
+            pass = pass && WIFEXITED(wStat) && WEXITSTATUS(wStat) == EXIT_SUCCESS;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double seconds = elapsedSeconds(begin, end);
+        long numRequests = (long)numClients * repPerClient;
+        printf("ECHO SCALING: %2d clients, %.0f echo/s\n", numClients, numRequests / seconds);
+    }
+
+    haltServer(serverPid);
+
+    if (pass) {
+        std::cout << "ECHO SCALING TEST PASSED" << std::endl;
+    } else {
+        std::cout << "ECHO SCALING TEST FAILED" << std::endl;
+    }
+}
+
+// test_RingLatency() compares CMD_GETROUNDEDALLOCATIONSIZE round trips through the socket and the shared-memory ring.
+void test_RingLatency(int rep) {
+    pid_t serverPid = spawnServer();
+    bool pass = true;
+
+    ProcessInfo pInfo;
+    int sock_fd = ipcConnect(&server_addr);
+    MemMapRing *ring = MemMapManager::RequestRing(pInfo, sock_fd);
+    pass = pass && (ring != nullptr);
+
+    MemMapRequest req(CMD_GETROUNDEDALLOCATIONSIZE);
+    req.src = pInfo;
+    req.size = 4096;
+    std::vector<double> latencies(rep);
+    struct timespec begin, end;
+    MemMapResponse res;
+
+    for (int transport = 0; transport < 2 && pass; ++transport) {
+        for (int i = 0; i < rep; ++i) {
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            res = transport ? MemMapManager::Request(ring, req) : MemMapManager::Request(sock_fd, req);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            latencies[i] = elapsedSeconds(begin, end) * 1e9;
+            pass = pass && (res.status == STATUSCODE_ACK) && (res.roundedSize >= req.size);
+        }
+        double p50 = percentile(latencies, 50), p99 = percentile(latencies, 99);
+        printf("RING LATENCY: %s p50 = %.0f ns, p99 = %.0f ns\n", transport ? "ring  " : "socket", p50, p99);
+    }
+
+    if (ring) {
+        MemMapManager::CloseRing(ring);
+    }
+    close(sock_fd);
+    haltServer(serverPid);
+
+    if (pass) {
+        std::cout << "RING LATENCY TEST PASSED" << std::endl;
+    } else {
+        std::cout << "RING LATENCY TEST FAILED" << std::endl;
+    }
+}
+
+// test_AllocateBatch() compares the startup of a worker allocating numRegions regions one by one
+// (RequestRoundedAllocationSize + RequestAllocate each) and with a single RequestAllocateBatch().
+// It then checks that a second batch naming the same regions sees the data written through the first one,
+// and that small entries are the regions a single RequestAllocate() of the same memId and size gets.
+void test_AllocateBatch(int numRegions) {
+    pid_t serverPid = spawnServer();
+    bool pass = true;
+
+    CUUTIL_ERRCHK(cuInit(0));
+    CUcontext ctx;
+    CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, 0));
+    ProcessInfo pInfo;
+    pInfo.SetContext(ctx);
+    int sock_fd = ipcConnect(&server_addr);
+
+    struct timespec begin, end;
+    char memId[MAX_MEMID_LEN];
+    MemMapResponse res;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i = 0; i < numRegions; ++i) {
+        sprintf(memId, "single_%d", i);
+        res = MemMapManager::RequestRoundedAllocationSize(pInfo, sock_fd, 4096 * (i + 1));
+        res = MemMapManager::RequestAllocate(pInfo, sock_fd, memId, 1024, res.roundedSize);
+        pass = pass && (res.status == STATUSCODE_ACK);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double singleSeconds = elapsedSeconds(begin, end);
+
+    std::vector<MemMapBatchEntry> entries(numRegions + 1);
+    for (int i = 0; i < numRegions; ++i) {
+        sprintf(entries[i].memId, "batch_%d", i);
+        entries[i].size = 4096 * (i + 1);
+        entries[i].alignment = 1024;
+    }
+    // The last entry names the same region as the first one.
+    entries[numRegions] = entries[0];
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    std::vector<MemMapResponse> responses = MemMapManager::RequestAllocateBatch(pInfo, sock_fd, entries);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double batchSeconds = elapsedSeconds(begin, end);
+
+    pass = pass && (responses.size() == entries.size());
+    pass = pass && (responses[0].d_ptr == responses[numRegions].d_ptr);
+    for (int i = 0; i < numRegions && pass; ++i) {
+        pass = pass && (responses[i].status == STATUSCODE_ACK) && (responses[i].roundedSize >= entries[i].size);
+        sprintf(memId, "batch_%d", i);
+        CUUTIL_ERRCHK(cuMemcpyHtoD(responses[i].d_ptr + responses[i].roundedSize - MAX_MEMID_LEN, memId, MAX_MEMID_LEN));
+    }
+
+    std::vector<MemMapResponse> again = MemMapManager::RequestAllocateBatch(pInfo, sock_fd, entries);
+    for (int i = 0; i < numRegions && pass; ++i) {
+        char recvId[MAX_MEMID_LEN];
+        CUUTIL_ERRCHK(cuMemcpyDtoH(recvId, again[i].d_ptr + again[i].roundedSize - MAX_MEMID_LEN, MAX_MEMID_LEN));
+        // Backing pages of small regions are mapped once per process: those keep their address.
+        pass = pass && ((again[i].backingId != 0) == (again[i].d_ptr == responses[i].d_ptr)) && !strcmp(recvId, entries[i].memId);
+    }
+
+    // A small region allocated by a batch is found by a single allocation, and vice versa.
+    res = MemMapManager::RequestAllocate(pInfo, sock_fd, entries[0].memId, entries[0].alignment, entries[0].size);
+    pass = pass && (res.status == STATUSCODE_ACK) && (responses[0].backingId != 0) &&
+        (res.token == responses[0].token) && (res.d_ptr == responses[0].d_ptr);
+    sprintf(memId, "single_small");
+    res = MemMapManager::RequestAllocate(pInfo, sock_fd, memId, 0, 1000);
+    std::vector<MemMapBatchEntry> smallEntries(1);
+    strcpy(smallEntries[0].memId, memId);
+    smallEntries[0].size = 1000;
+    smallEntries[0].alignment = 0;
+    std::vector<MemMapResponse> small = MemMapManager::RequestAllocateBatch(pInfo, sock_fd, smallEntries);
+    pass = pass && (res.status == STATUSCODE_ACK) && (small[0].status == STATUSCODE_ACK) && (small[0].token == res.token);
+
+    printf("ALLOCATE BATCH: %d regions, one by one %.3f ms, batched %.3f ms\n",
+        numRegions, singleSeconds * 1e3, batchSeconds * 1e3);
+
+    close(sock_fd);
+    haltServer(serverPid);
+
+    if (pass) {
+        std::cout << "ALLOCATE BATCH TEST PASSED" << std::endl;
+    } else {
+        std::cout << "ALLOCATE BATCH TEST FAILED" << std::endl;
+    }
+}
+
+// test_RegionIndexLookup() measures the cost of a region lookup with 10 to 1M registered regions.
+// The cost should stay flat, whatever the number of regions.
+void test_RegionIndexLookup(int numLookups) {
+    bool pass = true;
+    int numRegionsList[] = {10, 1000, 100000, 1000000};
+    const int numProbes = 4096;
+
+    for (int numRegions : numRegionsList) {
+        MemoryRegionIndex index;
+        char memId[MAX_MEMID_LEN];
+        for (int i = 0; i < numRegions; ++i) {
+            sprintf(memId, "region_%d", i);
+            MemoryRegion chunk = {(shareable_handle_t)(i + 1), 0, (size_t)2 << 20};
+            index.Insert(memId, (size_t)2 << 20, 0, std::vector<MemoryRegion>(1, chunk));
+        }
+
+        // Probe random regions, prepared beforehand so that only lookups are timed.
+        std::vector<std::string> probes(numProbes);
+        std::vector<uint64_t> tokens(numProbes);
+        std::vector<int> expected(numProbes);
+        srand(numRegions);
+        for (int i = 0; i < numProbes; ++i) {
+            expected[i] = rand() % numRegions;
+            probes[i] = "region_" + std::to_string(expected[i]);
+            index.Find(probes[i].c_str(), (size_t)2 << 20, 0, &tokens[i]);
+        }
+
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        for (int i = 0; i < numLookups; ++i) {
+            const std::vector<MemoryRegion> *chunks = index.Find(probes[i % numProbes].c_str(), (size_t)2 << 20, 0);
+            pass = pass && chunks != nullptr && (*chunks)[0].shareableHandle == (shareable_handle_t)(expected[i % numProbes] + 1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double nsByMemId = elapsedSeconds(begin, end) * 1e9 / numLookups;
+
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        for (int i = 0; i < numLookups; ++i) {
+            const std::vector<MemoryRegion> *chunks = index.Find(tokens[i % numProbes]);
+            pass = pass && chunks != nullptr && (*chunks)[0].shareableHandle == (shareable_handle_t)(expected[i % numProbes] + 1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double nsByToken = elapsedSeconds(begin, end) * 1e9 / numLookups;
+
+        pass = pass && index.Size() == (size_t)numRegions;
+        pass = pass && index.Find("region_missing", (size_t)2 << 20, 0) == nullptr;
+        pass = pass && index.Find("region_0", (size_t)4 << 20, 0) == nullptr;
+
+        // The token of a removed region never resolves again, even once its slot is reused.
+        std::vector<MemoryRegion> removed;
+        pass = pass && index.AddRef(tokens[0], 1) && (index.Release(tokens[0], 1, &removed) == 1);
+        pass = pass && (index.Find(tokens[0]) == nullptr) && (index.Release(tokens[0], 1, &removed) == -1);
+        uint64_t token = 0;
+        pass = pass && index.Insert(probes[0].c_str(), (size_t)2 << 20, 0, removed, &token);
+        pass = pass && (token != tokens[0]) && ((uint32_t)token == (uint32_t)tokens[0]) && (index.Find(tokens[0]) == nullptr);
+        pass = pass && (index.Find(token) != nullptr) && (index.FindByShareableHandle(removed[0].shareableHandle) == token);
+
+        printf("REGION INDEX LOOKUP: %7d regions, %.1f ns/lookup by memId, %.1f ns/lookup by token\n", numRegions, nsByMemId, nsByToken);
+    }
+
+    if (pass) {
+        std::cout << "REGION INDEX LOOKUP TEST PASSED" << std::endl;
+    } else {
+        std::cout << "REGION INDEX LOOKUP TEST FAILED" << std::endl;
+    }
+}
+
+
+// test_AllocateRounding() compares allocating numRegions unrounded sizes
+// with an explicit RequestRoundedAllocationSize() round trip before each RequestAllocate(),
+// and with RequestAllocate() alone, letting the server round the size.
+// It also checks that M3_FLAG_RECOMMENDED_GRANULARITY rounds to the recommended granularity.
+void test_AllocateRounding(int numRegions) {
+    pid_t serverPid = spawnServer();
+    bool pass = true;
+
+    CUUTIL_ERRCHK(cuInit(0));
+    CUcontext ctx;
+    CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, 0));
+    ProcessInfo pInfo;
+    pInfo.SetContext(ctx);
+    int sock_fd = ipcConnect(&server_addr);
+
+    CUmemAllocationProp prop = {};
+    prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+    prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+    prop.location.id = pInfo.device;
+    prop.requestedHandleTypes = CU_MEM_HANDLE_TYPE_POSIX_FILE_DESCRIPTOR;
+    size_t minGranularity, recommendedGranularity;
+    CUUTIL_ERRCHK(cuMemGetAllocationGranularity(&minGranularity, &prop, CU_MEM_ALLOC_GRANULARITY_MINIMUM));
+    CUUTIL_ERRCHK(cuMemGetAllocationGranularity(&recommendedGranularity, &prop, CU_MEM_ALLOC_GRANULARITY_RECOMMENDED));
+
+    struct timespec begin, end;
+    char memId[MAX_MEMID_LEN];
+    MemMapResponse res;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i = 0; i < numRegions; ++i) {
+        sprintf(memId, "explicit_%d", i);
+        res = MemMapManager::RequestRoundedAllocationSize(pInfo, sock_fd, 100000 + i);
+        res = MemMapManager::RequestAllocate(pInfo, sock_fd, memId, 1024, res.roundedSize);
+        pass = pass && (res.status == STATUSCODE_ACK);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double explicitSeconds = elapsedSeconds(begin, end);
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i = 0; i < numRegions; ++i) {
+        sprintf(memId, "implicit_%d", i);
+        res = MemMapManager::RequestAllocate(pInfo, sock_fd, memId, 1024, 100000 + i);
+        pass = pass && (res.status == STATUSCODE_ACK) && (res.roundedSize == minGranularity);
+        // The whole rounded size must be mapped.
+        CUUTIL_ERRCHK(cuMemcpyHtoD(res.d_ptr + res.roundedSize - MAX_MEMID_LEN, memId, MAX_MEMID_LEN));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double implicitSeconds = elapsedSeconds(begin, end);
+
+    res = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"recommended", 1024, minGranularity + 1, M3_FLAG_RECOMMENDED_GRANULARITY);
+    pass = pass && (res.status == STATUSCODE_ACK)
+        && (res.roundedSize % recommendedGranularity == 0) && (res.roundedSize > minGranularity);
+
+    printf("ALLOCATE ROUNDING: %d regions, explicit rounding %.1f us/alloc, server-side rounding %.1f us/alloc\n",
+        numRegions, explicitSeconds * 1e6 / numRegions, implicitSeconds * 1e6 / numRegions);
+
+    close(sock_fd);
+    haltServer(serverPid);
+
+    if (pass) {
+        std::cout << "ALLOCATE ROUNDING TEST PASSED" << std::endl;
+    } else {
+        std::cout << "ALLOCATE ROUNDING TEST FAILED" << std::endl;
+    }
+}
+
+
+// test_AllocatePool() measures p50/p99 latency of allocating numRegions new regions
+// of 1 to 4 granularity pages, with and without the physical memory pool of the server.
+void test_AllocatePool(int numRegions) {
+    bool pass = true;
+
+    CUUTIL_ERRCHK(cuInit(0));
+    CUcontext ctx;
+    CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, 0));
+    ProcessInfo pInfo;
+    pInfo.SetContext(ctx);
+
+    for (int withPool = 0; withPool < 2; ++withPool) {
+        MemMapServerOptions options;
+        options.poolEnabled = withPool;
+        pid_t serverPid = spawnServer(options);
+        int sock_fd = ipcConnect(&server_addr);
+
+        struct timespec begin, end;
+        char memId[MAX_MEMID_LEN];
+        std::vector<double> latencies;
+        MemMapResponse res;
+        size_t granularity = MemMapManager::RequestRoundedAllocationSize(pInfo, sock_fd, 1).roundedSize;
+
+        for (int i = 0; i < numRegions; ++i) {
+            sprintf(memId, "pool_%d_%d", withPool, i);
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            res = MemMapManager::RequestAllocate(pInfo, sock_fd, memId, 1024, granularity * (1 + i % 4));
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            latencies.push_back(elapsedSeconds(begin, end) * 1e6);
+            pass = pass && (res.status == STATUSCODE_ACK);
+        }
+
+        MemMapStats stats;
+        res = MemMapManager::RequestStats(pInfo, sock_fd, &stats);
+        pass = pass && (res.status == STATUSCODE_ACK) && (stats.numRegions >= (uint64_t)numRegions);
+        if (withPool) {
+            pass = pass && (stats.poolHits > 0) && (stats.poolHits + stats.poolMisses == (uint64_t)numRegions);
+        } else {
+            pass = pass && (stats.poolHits == 0) && (stats.poolIdleChunks == 0);
+        }
+
+        printf("ALLOCATE POOL: %-7s p50 = %.1f us, p99 = %.1f us, hits = %lu, misses = %lu\n",
+            withPool ? "pool" : "no pool", percentile(latencies, 50), percentile(latencies, 99),
+            (unsigned long)stats.poolHits, (unsigned long)stats.poolMisses);
+
+        close(sock_fd);
+        haltServer(serverPid);
+    }
+
+    if (pass) {
+        std::cout << "ALLOCATE POOL TEST PASSED" << std::endl;
+    } else {
+        std::cout << "ALLOCATE POOL TEST FAILED" << std::endl;
+    }
+}
+
+
+// test_SubAllocate() allocates numRegions small regions, which the server packs into shared backing pages.
+// Another process then allocates the same regions and checks that it sees the data written by the first one.
+// Once every region is freed, the backing pages and the memory they held must be given back.
+void test_SubAllocate(int numRegions) {
+    pid_t serverPid = spawnServer();
+    bool pass = true;
+
+    CUUTIL_ERRCHK(cuInit(0));
+    CUcontext ctx;
+    CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, 0));
+    ProcessInfo pInfo;
+    pInfo.SetContext(ctx);
+    int sock_fd = ipcConnect(&server_addr);
+
+    struct timespec begin, end;
+    char memId[MAX_MEMID_LEN];
+    MemMapResponse res;
+    size_t requestedBytes = 0;
+    std::vector<CUdeviceptr> regions;
+    MemMapStats baseline;
+    MemMapManager::RequestStats(pInfo, sock_fd, &baseline);
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i = 0; i < numRegions; ++i) {
+        sprintf(memId, "small_%d", i);
+        size_t size = 64 + (i * 37) % 8000;
+        res = MemMapManager::RequestAllocate(pInfo, sock_fd, memId, 1024, size);
+        pass = pass && (res.status == STATUSCODE_ACK) && (res.backingId != 0) && (res.roundedSize >= size);
+        if (!pass) {
+            break;
+        }
+        regions.push_back(res.d_ptr);
+        requestedBytes += size;
+        CUUTIL_ERRCHK(cuMemcpyHtoD(res.d_ptr, memId, strlen(memId) + 1));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = elapsedSeconds(begin, end);
+
+    MemMapStats stats;
+    res = MemMapManager::RequestStats(pInfo, sock_fd, &stats);
+    size_t pageSize = MemMapManager::RequestRoundedAllocationSize(pInfo, sock_fd, 1).roundedSize;
+    pass = pass && (res.status == STATUSCODE_ACK) && (stats.slabPages > 0) && (stats.slabPages < (uint64_t)numRegions / 10);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        ProcessInfo childInfo;
+        childInfo.SetContext(ctx);
+        int child_fd = ipcConnect(&server_addr);
+        bool childPass = true;
+        for (int i = 0; i < numRegions && childPass; ++i) {
+            char recvId[MAX_MEMID_LEN];
+            sprintf(memId, "small_%d", i);
+            res = MemMapManager::RequestAllocate(childInfo, child_fd, memId, 1024, 64 + (i * 37) % 8000);
+            childPass = (res.status == STATUSCODE_ACK);
+            if (childPass) {
+                CUUTIL_ERRCHK(cuMemcpyDtoH(recvId, res.d_ptr, strlen(memId) + 1));
+                childPass = !strcmp(recvId, memId);
+            }
+        }
+        close(child_fd);
+        exit(childPass ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    int wStat;
+    waitpid(pid, &wStat, 0);
+    pass = pass && WIFEXITED(wStat) && WEXITSTATUS(wStat) == EXIT_SUCCESS;
+
+    printf("SUB ALLOCATE: %d regions (%.1f MiB requested) in %lu backing pages (%.1f MiB), "
+        "%lu MiB with a page per region, %.1f us/alloc\n",
+        numRegions, requestedBytes / 1048576.0, (unsigned long)stats.slabPages,
+        stats.slabPages * pageSize / 1048576.0, (unsigned long)(numRegions * pageSize >> 20), seconds * 1e6 / numRegions);
+
+    // The child is gone: freeing the regions of the parent empties every backing page.
+    for (auto d_ptr : regions) {
+        pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, d_ptr).status == STATUSCODE_ACK);
+    }
+    for (int i = 0; i < 100; ++i) {
+        MemMapManager::RequestStats(pInfo, sock_fd, &stats);
+        if (stats.numRegions == 0 && stats.reclaimPendingBytes == 0) {
+            break;
+        }
+        usleep(10000);
+    }
+    pass = pass && (stats.numRegions == 0) && (stats.slabPages == baseline.slabPages);
+    for (uint64_t d = 0; d < stats.numDevices; ++d) {
+        pass = pass && (stats.deviceUsedBytes[d] == baseline.deviceUsedBytes[d]);
+    }
+
+    close(sock_fd);
+    haltServer(serverPid);
+
+    if (pass) {
+        std::cout << "SUB ALLOCATE TEST PASSED" << std::endl;
+    } else {
+        std::cout << "SUB ALLOCATE TEST FAILED" << std::endl;
+    }
+}
+
+
+// test_VAArena() measures imports/s of a worker which maps and unmaps rep regions during its lifetime,
+// with a virtual address reservation per region and with the client arena.
+void test_VAArena(int rep) {
+    pid_t serverPid = spawnServer();
+    bool pass = true;
+    const int numMemIds = 64;
+
+    CUUTIL_ERRCHK(cuInit(0));
+    CUcontext ctx;
+    CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, 0));
+    ProcessInfo pInfo;
+    pInfo.SetContext(ctx);
+    int sock_fd = ipcConnect(&server_addr);
+
+    char memId[MAX_MEMID_LEN];
+    MemMapResponse res;
+    size_t granularity = MemMapManager::RequestRoundedAllocationSize(pInfo, sock_fd, 1).roundedSize;
+
+    // Create the regions beforehand, so that both runs only import.
+    for (int i = 0; i < numMemIds; ++i) {
+        sprintf(memId, "arena_%d", i);
+        res = MemMapManager::RequestAllocate(pInfo, sock_fd, memId, 1024, granularity * (1 + i % 4));
+        pass = pass && (res.status == STATUSCODE_ACK);
+        CUUTIL_ERRCHK(cuMemcpyHtoD(res.d_ptr, memId, MAX_MEMID_LEN));
+        pass = pass && (MemMapManager::Unmap(res.d_ptr) == STATUSCODE_ACK);
+    }
+
+    size_t arenaSizes[] = {0, M3_DEFAULT_ARENA_SIZE};
+    for (size_t arenaSize : arenaSizes) {
+        MemMapManager::SetClientArenaSize(arenaSize);
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        for (int i = 0; i < rep && pass; ++i) {
+            char recvId[MAX_MEMID_LEN];
+            sprintf(memId, "arena_%d", i % numMemIds);
+            res = MemMapManager::RequestAllocate(pInfo, sock_fd, memId, 1024, granularity * (1 + (i % numMemIds) % 4));
+            pass = pass && (res.status == STATUSCODE_ACK);
+            CUUTIL_ERRCHK(cuMemcpyDtoH(recvId, res.d_ptr, MAX_MEMID_LEN));
+            pass = pass && !strcmp(recvId, memId);
+            pass = pass && (MemMapManager::Unmap(res.d_ptr) == STATUSCODE_ACK);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("VA ARENA: %-16s %.0f imports/s\n", arenaSize ? "arena" : "reserve per map",
+            rep / elapsedSeconds(begin, end));
+    }
+    pass = pass && (MemMapManager::Unmap(res.d_ptr) == STATUSCODE_INVALID);
+
+    close(sock_fd);
+    haltServer(serverPid);
+
+    if (pass) {
+        std::cout << "VA ARENA TEST PASSED" << std::endl;
+    } else {
+        std::cout << "VA ARENA TEST FAILED" << std::endl;
+    }
+}
+
+
+// countOpenFds() returns the number of file descriptors open in this process.
+static int countOpenFds(void) {
+    int n = 0;
+    for (int fd = 0; fd < 4096; ++fd) {
+        if (fcntl(fd, F_GETFD) != -1) {
+            n++;
+        }
+    }
+    return n;
+}
+
+// test_ImportCache() allocates the same regions rep times, which must be served by the import cache
+// of the process: same d_ptr, no new file descriptor, no round trip.
+// It then restarts the server, and checks that cached imports are revalidated once a newer server generation is seen.
+void test_ImportCache(int rep) {
+    pid_t serverPid = spawnServer();
+    bool pass = true;
+
+    CUUTIL_ERRCHK(cuInit(0));
+    CUcontext ctx;
+    CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, 0));
+    ProcessInfo pInfo;
+    pInfo.SetContext(ctx);
+    int sock_fd = ipcConnect(&server_addr);
+
+    size_t granularity = MemMapManager::RequestRoundedAllocationSize(pInfo, sock_fd, 1).roundedSize;
+    MemMapResponse big = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"cache_big", 1024, 2 * granularity);
+    MemMapResponse small = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"cache_small", 1024, 1000);
+    pass = pass && (big.status == STATUSCODE_ACK) && (small.status == STATUSCODE_ACK);
+
+    struct timespec begin, end;
+    MemMapResponse res;
+    int fdsBefore = countOpenFds();
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i = 0; i < rep && pass; ++i) {
+        res = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"cache_big", 1024, 2 * granularity);
+        pass = pass && (res.status == STATUSCODE_ACK) && (res.d_ptr == big.d_ptr);
+        res = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"cache_small", 1024, 1000);
+        pass = pass && (res.status == STATUSCODE_ACK) && (res.d_ptr == small.d_ptr);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double hitSeconds = elapsedSeconds(begin, end) / (2.0 * rep);
+    pass = pass && (countOpenFds() == fdsBefore);
+
+    // A full import of a region, for reference.
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i = 0; i < 1000 && pass; ++i) {
+        res = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"cache_uncached", 1024, 2 * granularity);
+        pass = pass && (res.status == STATUSCODE_ACK) && (MemMapManager::Unmap(res.d_ptr) == STATUSCODE_ACK);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double importSeconds = elapsedSeconds(begin, end) / 1000;
+
+    // Every hit holds a reference.
+    for (int i = 0; i < rep && pass; ++i) {
+        pass = pass && (MemMapManager::Unmap(big.d_ptr) == STATUSCODE_ACK);
+        pass = pass && (MemMapManager::Unmap(small.d_ptr) == STATUSCODE_ACK);
+    }
+
+    // Restart the server: cached imports refer to regions which do not exist anymore.
+    close(sock_fd);
+    haltServer(serverPid);
+    serverPid = spawnServer();
+    sock_fd = ipcConnect(&server_addr);
+    // Any response of the new server carries a newer generation...
+    res = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"cache_other", 1024, granularity);
+    pass = pass && (res.status == STATUSCODE_ACK);
+    // ...so that the next lookup revalidates, and imports the new region.
+    res = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"cache_big", 1024, 2 * granularity);
+    pass = pass && (res.status == STATUSCODE_ACK) && (res.d_ptr != big.d_ptr);
+    pass = pass && (MemMapManager::Unmap(big.d_ptr) == STATUSCODE_ACK) && (MemMapManager::Unmap(big.d_ptr) == STATUSCODE_INVALID);
+    pass = pass && (MemMapManager::Unmap(res.d_ptr) == STATUSCODE_ACK);
+
+    printf("IMPORT CACHE: hit %.0f ns, full import + unmap %.1f us\n", hitSeconds * 1e9, importSeconds * 1e6);
+
+    close(sock_fd);
+    haltServer(serverPid);
+
+    if (pass) {
+        std::cout << "IMPORT CACHE TEST PASSED" << std::endl;
+    } else {
+        std::cout << "IMPORT CACHE TEST FAILED" << std::endl;
+    }
+}
+
+
+// test_DeAllocate() releases regions, and checks that they are reclaimed in the background,
+// only once every process holding them has released them.
+void test_DeAllocate(int numRegions) {
+    MemMapServerOptions options;
+    options.reclaimDelayMs = 5;
+    pid_t serverPid = spawnServer(options);
+    bool pass = true;
+
+    CUUTIL_ERRCHK(cuInit(0));
+    CUcontext ctx;
+    CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, 0));
+    ProcessInfo pInfo;
+    pInfo.SetContext(ctx);
+    int sock_fd = ipcConnect(&server_addr);
+
+    struct timespec begin, end;
+    char memId[MAX_MEMID_LEN];
+    std::vector<double> latencies;
+    std::vector<MemMapResponse> regions;
+    MemMapResponse res;
+    MemMapStats before, stats;
+    size_t granularity = MemMapManager::RequestRoundedAllocationSize(pInfo, sock_fd, 1).roundedSize;
+    size_t totalBytes = 0;
+
+    for (int i = 0; i < numRegions; ++i) {
+        // Every fourth region is small enough to be sub-allocated.
+        sprintf(memId, "dealloc_%d", i);
+        res = MemMapManager::RequestAllocate(pInfo, sock_fd, memId, 1024, i % 4 ? granularity * (i % 4) : 1000);
+        pass = pass && (res.status == STATUSCODE_ACK);
+        regions.push_back(res);
+        totalBytes += res.roundedSize;
+    }
+    // References taken through the import cache are released locally.
+    res = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"dealloc_1", 1024, granularity);
+    pass = pass && (res.status == STATUSCODE_ACK) && (res.d_ptr == regions[1].d_ptr);
+    pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, res.d_ptr).status == STATUSCODE_ACK);
+    MemMapManager::RequestStats(pInfo, sock_fd, &before);
+    pass = pass && (before.numRegions == (uint64_t)numRegions) && (before.reclaimPendingBytes == 0);
+
+    // Another process holds dealloc_0 as well: it outlives the release of this one.
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        ProcessInfo childInfo;
+        childInfo.SetContext(ctx);
+        int child_fd = ipcConnect(&server_addr);
+        res = MemMapManager::RequestAllocate(childInfo, child_fd, (char *)"dealloc_0", 1024, 1000);
+        bool childPass = (res.status == STATUSCODE_ACK);
+        childPass = childPass && (MemMapManager::RequestDeAllocate(childInfo, child_fd, res.d_ptr).status == STATUSCODE_ACK);
+        close(child_fd);
+        exit(childPass ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    int wStat;
+    waitpid(pid, &wStat, 0);
+    pass = pass && WIFEXITED(wStat) && WEXITSTATUS(wStat) == EXIT_SUCCESS;
+    MemMapManager::RequestStats(pInfo, sock_fd, &stats);
+    pass = pass && (stats.numRegions == (uint64_t)numRegions) && (stats.reclaimPendingBytes == 0);
+
+    for (auto& region : regions) {
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        res = MemMapManager::RequestDeAllocate(pInfo, sock_fd, region.d_ptr);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        latencies.push_back(elapsedSeconds(begin, end) * 1e6);
+        pass = pass && (res.status == STATUSCODE_ACK);
+    }
+    MemMapManager::RequestStats(pInfo, sock_fd, &stats);
+    pass = pass && (stats.numRegions == 0);
+    pass = pass && (stats.reclaimPendingBytes + stats.reclaimedBytes == totalBytes);
+    uint64_t pendingBytes = stats.reclaimPendingBytes;
+    // A region is released once.
+    pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, regions[0].d_ptr).status == STATUSCODE_INVALID);
+
+    // Wait for the reclaimer, then allocate again from the reclaimed chunks.
+    for (int i = 0; i < 100 && stats.reclaimPendingBytes > 0; ++i) {
+        usleep(10000);
+        MemMapManager::RequestStats(pInfo, sock_fd, &stats);
+    }
+    pass = pass && (stats.reclaimPendingBytes == 0) && (stats.reclaimedBytes == totalBytes);
+    pass = pass && (stats.poolIdleChunks > before.poolIdleChunks);
+    res = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"dealloc_1", 1024, granularity);
+    pass = pass && (res.status == STATUSCODE_ACK);
+    MemMapManager::RequestStats(pInfo, sock_fd, &before);
+    pass = pass && (before.poolHits == stats.poolHits + 1) && (before.slabPages == stats.slabPages);
+    pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, res.d_ptr).status == STATUSCODE_ACK);
+
+    printf("DEALLOCATE: %d regions (%.1f MiB), p50 = %.1f us, p99 = %.1f us, %.1f MiB pending after the last release\n",
+        numRegions, totalBytes / 1048576.0, percentile(latencies, 50), percentile(latencies, 99), pendingBytes / 1048576.0);
+
+    close(sock_fd);
+    haltServer(serverPid);
+
+    if (pass) {
+        std::cout << "DEALLOCATE TEST PASSED" << std::endl;
+    } else {
+        std::cout << "DEALLOCATE TEST FAILED" << std::endl;
+    }
+}
+
+
+// bindEndpoint() leaves a pid_<pid> endpoint file behind, as a crashed client would.
+static void bindEndpoint(pid_t pid) {
+    struct sockaddr_un addr;
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    sprintf(addr.sun_path, "pid_%d", pid);
+    unlink(addr.sun_path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    close(fd);
+}
+
+static bool endpointExists(pid_t pid) {
+    char name[64];
+    sprintf(name, "pid_%d", pid);
+    return access(name, F_OK) == 0;
+}
+
+// test_ClientReap() kills clients holding regions, and checks that the server releases their references,
+// and removes their endpoint files.
+void test_ClientReap(int numRegions) {
+    bool pass = true;
+
+    // Endpoint of a process which is gone before the server starts.
+    pid_t deadPid = fork();
+    if (deadPid == 0) {
+        _exit(EXIT_SUCCESS);
+    }
+    waitpid(deadPid, NULL, 0);
+    bindEndpoint(deadPid);
+
+    MemMapServerOptions options;
+    options.reclaimDelayMs = 1;
+    pid_t serverPid = spawnServer(options);
+
+    CUUTIL_ERRCHK(cuInit(0));
+    CUcontext ctx;
+    CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, 0));
+    ProcessInfo pInfo;
+    pInfo.SetContext(ctx);
+    int sock_fd = ipcConnect(&server_addr);
+    size_t granularity = MemMapManager::RequestRoundedAllocationSize(pInfo, sock_fd, 1).roundedSize;
+    pass = pass && !endpointExists(deadPid);
+
+    // Both this process and the clients hold reap_shared.
+    MemMapResponse shared = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"reap_shared", 1024, granularity);
+    pass = pass && (shared.status == STATUSCODE_ACK);
+
+    struct timespec begin, end;
+    double maxReapSeconds = 0;
+    for (int round = 0; round < 3 && pass; ++round) {
+        // The client tells when it is done allocating, then waits to be killed.
+        int fds[2];
+        pass = pass && (pipe(fds) == 0);
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            ProcessInfo childInfo;
+            childInfo.SetContext(ctx);
+            int child_fd = ipcConnect(&server_addr);
+            char memId[MAX_MEMID_LEN];
+            char ok = 1;
+            for (int i = 0; i < numRegions; ++i) {
+                sprintf(memId, "reap_%d_%d", round, i);
+                MemMapResponse res = MemMapManager::RequestAllocate(childInfo, child_fd, memId, 1024, i % 2 ? granularity : 1000);
+                ok = ok && (res.status == STATUSCODE_ACK);
+            }
+            ok = ok && (MemMapManager::RequestAllocate(childInfo, child_fd, (char *)"reap_shared", 1024, granularity).status == STATUSCODE_ACK);
+            bindEndpoint(getpid());
+            write(fds[1], &ok, 1);
+            pause();
+            _exit(EXIT_SUCCESS);
+        }
+        close(fds[1]);
+        char ok = 0;
+        pass = pass && (read(fds[0], &ok, 1) == 1) && ok;
+        close(fds[0]);
+
+        MemMapStats stats;
+        MemMapManager::RequestStats(pInfo, sock_fd, &stats);
+        pass = pass && (stats.numRegions == (uint64_t)numRegions + 1) && (stats.liveClients == 2);
+        pass = pass && endpointExists(pid);
+
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        for (int i = 0; i < 1000 && (stats.numRegions > 1 || stats.reclaimPendingBytes > 0); ++i) {
+            usleep(1000);
+            MemMapManager::RequestStats(pInfo, sock_fd, &stats);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        maxReapSeconds = std::max(maxReapSeconds, elapsedSeconds(begin, end));
+        pass = pass && (stats.numRegions == 1) && (stats.reclaimPendingBytes == 0);
+        pass = pass && (stats.reapedClients == (uint64_t)round + 1) && (stats.liveClients == 1);
+        pass = pass && !endpointExists(pid);
+    }
+
+    // reap_shared is still held by this process, until it releases it.
+    pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, shared.d_ptr).status == STATUSCODE_ACK);
+    MemMapStats stats;
+    MemMapManager::RequestStats(pInfo, sock_fd, &stats);
+    pass = pass && (stats.numRegions == 0);
+
+    printf("CLIENT REAP: %d regions of a killed client released within %.1f ms\n", numRegions, maxReapSeconds * 1e3);
+
+    close(sock_fd);
+    haltServer(serverPid);
+
+    if (pass) {
+        std::cout << "CLIENT REAP TEST PASSED" << std::endl;
+    } else {
+        std::cout << "CLIENT REAP TEST FAILED" << std::endl;
+    }
+}
+
+
+// test_FdPassing() measures the throughput of shareable handles passed over a socket,
+// one per message (ipcSendShareableHandle()) and packed in a single message (ipcSendShareableHandles()),
+// for 1, 16 and IPC_SCM_MAX_FD handles per region. A message carrying more handles than expected must be refused without leaking them.
+void test_FdPassing(int rep) {
+    bool pass = true;
+    int sv[2];
+    pass = pass && (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+
+    const uint32_t counts[] = {1, 16, IPC_SCM_MAX_FD};
+    for (uint32_t count : counts) {
+        std::vector<shareable_handle_t> shHandles;
+        for (uint32_t i = 0; i < count; ++i) {
+            shHandles.push_back((shareable_handle_t)memfd_create("fd_passing", MFD_CLOEXEC));
+        }
+        struct stat expected;
+        fstat((int)shHandles[count - 1], &expected);
+
+        double handlesPerSecond[2];
+        for (int packed = 0; packed < 2 && pass; ++packed) {
+            int iterations = std::max(1, rep * 16 / (int)count);
+            bool receiverPass = true;
+            std::thread receiver([&]() {
+                std::vector<shareable_handle_t> received;
+                struct stat st;
+                for (int r = 0; r < iterations && receiverPass; ++r) {
+                    if (packed) {
+                        receiverPass = (ipcRecvShareableHandles(sv[1], received, count) == 0) && (received.size() == count);
+                    } else {
+                        received.resize(count);
+                        for (uint32_t i = 0; i < count && receiverPass; ++i) {
+                            receiverPass = (ipcRecvShareableHandle(sv[1], &received[i]) == 0);
+                        }
+                    }
+                    receiverPass = receiverPass && (fstat((int)received[count - 1], &st) == 0) && (st.st_ino == expected.st_ino);
+                    for (auto sh : received) {
+                        close((int)sh);
+                    }
+                }
+            });
+
+            struct timespec begin, end;
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            for (int r = 0; r < iterations && pass; ++r) {
+                if (packed) {
+                    pass = (ipcSendShareableHandles(sv[0], shHandles) == 0);
+                } else {
+                    for (uint32_t i = 0; i < count && pass; ++i) {
+                        pass = (ipcSendShareableHandle(sv[0], shHandles[i]) == 0);
+                    }
+                }
+            }
+            receiver.join();
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            pass = pass && receiverPass;
+            handlesPerSecond[packed] = (double)iterations * count / elapsedSeconds(begin, end);
+        }
+        if (pass) {
+            printf("FD PASSING: %3u handles/region, one per message %8.0f handles/s, packed %8.0f handles/s (x%.1f)\n",
+                count, handlesPerSecond[0], handlesPerSecond[1], handlesPerSecond[1] / handlesPerSecond[0]);
+        }
+
+        for (auto sh : shHandles) {
+            close((int)sh);
+        }
+    }
+
+    // More handles than asked for are refused, and none of them stays open.
+    std::vector<shareable_handle_t> shHandles, received;
+    for (int i = 0; i < 16; ++i) {
+        shHandles.push_back((shareable_handle_t)memfd_create("fd_passing", MFD_CLOEXEC));
+    }
+    int fdsBefore = countOpenFds();
+    pass = pass && (ipcSendShareableHandles(sv[0], shHandles) == 0);
+    pass = pass && (ipcRecvShareableHandles(sv[1], received, 8) < 0) && received.empty();
+    pass = pass && (countOpenFds() == fdsBefore);
+    for (auto sh : shHandles) {
+        close((int)sh);
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+
+    if (pass) {
+        std::cout << "FD PASSING TEST PASSED" << std::endl;
+    } else {
+        std::cout << "FD PASSING TEST FAILED" << std::endl;
+    }
+}
+
+
+// test_Placement() allocates regions of various sizes on 4 emulated devices with every placement policy,
+// and reports the memory used per device.
+void test_Placement(int numRegions) {
+    bool pass = true;
+    const int numDevices = 4;
+    setenv("CUHOSTSTUB_DEVICE_COUNT", "4", 1);
+
+    CUUTIL_ERRCHK(cuInit(0));
+    CUcontext ctx;
+    CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, 0));
+    ProcessInfo pInfo;
+    pInfo.SetContext(ctx);
+
+    const MemMapPlacement policies[] = {M3_PLACEMENT_LOCAL, M3_PLACEMENT_ROUND_ROBIN, M3_PLACEMENT_LEAST_USED};
+    const char *names[] = {"local", "round-robin", "least-used"};
+    for (int p = 0; p < 3; ++p) {
+        MemMapServerOptions options;
+        options.placement = policies[p];
+        options.reclaimDelayMs = 1;
+        pid_t serverPid = spawnServer(options);
+        int sock_fd = ipcConnect(&server_addr);
+        size_t granularity = MemMapManager::RequestRoundedAllocationSize(pInfo, sock_fd, 1).roundedSize;
+
+        char memId[MAX_MEMID_LEN];
+        std::vector<MemMapResponse> regions;
+        for (int i = 0; i < numRegions; ++i) {
+            sprintf(memId, "place_%d", i);
+            MemMapResponse res = MemMapManager::RequestAllocate(pInfo, sock_fd, memId, 1024, granularity * (1 + (i * 7) % 5));
+            pass = pass && (res.status == STATUSCODE_ACK);
+            if (policies[p] == M3_PLACEMENT_LOCAL) {
+                pass = pass && (res.device == pInfo.device);
+            } else if (policies[p] == M3_PLACEMENT_ROUND_ROBIN) {
+                pass = pass && (res.device == i % numDevices);
+            }
+            regions.push_back(res);
+        }
+        // An explicit device overrides the policy of the server.
+        MemMapResponse res = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"place_explicit", 1024, granularity, M3_FLAG_DEVICE(3));
+        pass = pass && (res.status == STATUSCODE_ACK) && (res.device == 3);
+        regions.push_back(res);
+
+        MemMapStats stats;
+        MemMapManager::RequestStats(pInfo, sock_fd, &stats);
+        pass = pass && (stats.numDevices == (uint64_t)numDevices);
+        uint64_t minUsed = stats.deviceUsedBytes[0], maxUsed = stats.deviceUsedBytes[0];
+        printf("PLACEMENT: %-11s used MiB per device:", names[p]);
+        for (int d = 0; d < numDevices; ++d) {
+            minUsed = std::min(minUsed, stats.deviceUsedBytes[d]);
+            maxUsed = std::max(maxUsed, stats.deviceUsedBytes[d]);
+            printf(" %6.0f", stats.deviceUsedBytes[d] / 1048576.0);
+        }
+        printf("\n");
+        if (policies[p] == M3_PLACEMENT_LEAST_USED) {
+            pass = pass && (maxUsed - minUsed <= 5 * granularity);
+        }
+
+        // Released regions are given back to their device.
+        for (auto& region : regions) {
+            pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, region.d_ptr).status == STATUSCODE_ACK);
+        }
+        for (int i = 0; i < 100 && (stats.reclaimPendingBytes > 0 || stats.numRegions > 0); ++i) {
+            usleep(1000);
+            MemMapManager::RequestStats(pInfo, sock_fd, &stats);
+        }
+        for (int d = 0; d < numDevices; ++d) {
+            pass = pass && (stats.deviceUsedBytes[d] == 0);
+        }
+
+        close(sock_fd);
+        haltServer(serverPid);
+    }
+    unsetenv("CUHOSTSTUB_DEVICE_COUNT");
+
+    if (pass) {
+        std::cout << "PLACEMENT TEST PASSED" << std::endl;
+    } else {
+        std::cout << "PLACEMENT TEST FAILED" << std::endl;
+    }
+}
+
+
+// readBandwidth() reads a region with one thread per stripe, rep times, and returns bytes/s.
+static double readBandwidth(CUdeviceptr d_ptr, size_t size, int numStripes, int rep) {
+    size_t stripeSize = size / numStripes;
+    std::vector<std::vector<char>> buffers(numStripes, std::vector<char>(stripeSize));
+    std::vector<std::thread> readers;
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int s = 0; s < numStripes; ++s) {
+        readers.push_back(std::thread([&, s]() {
+            for (int r = 0; r < rep; ++r) {
+                CUUTIL_ERRCHK(cuMemcpyDtoH(buffers[s].data(), d_ptr + s * stripeSize, stripeSize));
+            }
+        }));
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double)size * rep / elapsedSeconds(begin, end);
+}
+
+// test_Striping() stripes a region over 4 emulated devices, checks that it is mapped contiguously
+// in every process, and compares its read bandwidth with a region on a single device.
+void test_Striping(int rep) {
+    bool pass = true;
+    const int numDevices = 4;
+    setenv("CUHOSTSTUB_DEVICE_COUNT", "4", 1);
+    pid_t serverPid = spawnServer();
+
+    CUUTIL_ERRCHK(cuInit(0));
+    CUcontext ctx;
+    CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, 0));
+    ProcessInfo pInfo;
+    pInfo.SetContext(ctx);
+    int sock_fd = ipcConnect(&server_addr);
+
+    size_t size = (size_t)64 << 20;
+    MemMapResponse striped = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"stripe_table", 1024, size, M3_FLAG_STRIPES(numDevices));
+    MemMapResponse single = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"single_table", 1024, size);
+    pass = pass && (striped.status == STATUSCODE_ACK) && (single.status == STATUSCODE_ACK);
+    pass = pass && (striped.numShareableHandles == (uint32_t)numDevices) && (striped.roundedSize == size);
+
+    MemMapStats stats;
+    MemMapManager::RequestStats(pInfo, sock_fd, &stats);
+    pass = pass && (stats.deviceUsedBytes[0] == size + size / numDevices);
+    for (int d = 1; d < numDevices; ++d) {
+        pass = pass && (stats.deviceUsedBytes[d] == size / numDevices);
+    }
+
+    // The stripes form a single contiguous range, in every process.
+    std::vector<uint32_t> pattern(size / sizeof(uint32_t));
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        pattern[i] = (uint32_t)(i * 2654435761u);
+    }
+    if (pass) {
+        CUUTIL_ERRCHK(cuMemcpyHtoD(striped.d_ptr, pattern.data(), size));
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        ProcessInfo childInfo;
+        childInfo.SetContext(ctx);
+        int child_fd = ipcConnect(&server_addr);
+        MemMapResponse res = MemMapManager::RequestAllocate(childInfo, child_fd, (char *)"stripe_table", 1024, size, M3_FLAG_STRIPES(numDevices));
+        std::vector<uint32_t> readBack(pattern.size());
+        bool childPass = (res.status == STATUSCODE_ACK);
+        if (childPass) {
+            CUUTIL_ERRCHK(cuMemcpyDtoH(readBack.data(), res.d_ptr, size));
+            childPass = (readBack == pattern);
+        }
+        close(child_fd);
+        exit(childPass ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    int wStat;
+    waitpid(pid, &wStat, 0);
+    pass = pass && WIFEXITED(wStat) && WEXITSTATUS(wStat) == EXIT_SUCCESS;
+
+    if (pass) {
+        double singleBandwidth = readBandwidth(single.d_ptr, size, numDevices, rep);
+        double stripedBandwidth = readBandwidth(striped.d_ptr, size, numDevices, rep);
+        printf("STRIPING: %zu MiB region, read %.2f GB/s on a single device, %.2f GB/s striped over %d devices\n",
+            size >> 20, singleBandwidth / 1e9, stripedBandwidth / 1e9, numDevices);
+    }
+
+    pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, striped.d_ptr).status == STATUSCODE_ACK);
+    pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, single.d_ptr).status == STATUSCODE_ACK);
+
+    close(sock_fd);
+    haltServer(serverPid);
+    unsetenv("CUHOSTSTUB_DEVICE_COUNT");
+
+    if (pass) {
+        std::cout << "STRIPING TEST PASSED" << std::endl;
+    } else {
+        std::cout << "STRIPING TEST FAILED" << std::endl;
+    }
+}
+
+
+// randomValue() returns 0 a quarter of the time, and a random value of random magnitude otherwise.
+static uint64_t randomValue(void) {
+    if (rand() % 4 == 0) {
+        return 0;
+    }
+    uint64_t v = ((uint64_t)rand() << 33) ^ ((uint64_t)rand() << 11) ^ (uint64_t)rand();
+    return v >> (rand() % 64);
+}
+
+// randomMemId() fills memId with a name of random length, possibly empty or without terminator.
+static void randomMemId(char *memId) {
+    int len = (rand() % 4 == 0) ? 0 : rand() % (MAX_MEMID_LEN + 1);
+    for (int i = 0; i < len; ++i) {
+        memId[i] = (char)(1 + rand() % 255);
+    }
+    if (len < MAX_MEMID_LEN) {
+        memId[len] = '\0';
+    }
+}
+
+// test_WireFormat() round-trips random messages through MemMapWire, checks that cut, corrupted and random
+// messages are rejected or decoded within bounds, and that the server drops malformed requests.
+// It then reports the bytes per message of CMD_ECHO and CMD_ALLOCATE.
+void test_WireFormat(int rep) {
+    bool pass = true;
+    char buf[M3_MAX_MESSAGE_SIZE];
+    srand(rep);
+
+    for (int r = 0; r < rep && pass; ++r) {
+        MemMapRequest req((MemMapCmd)(rand() % CMD_COUNT)), decodedReq;
+        req.src.pid = (pid_t)(randomValue() & INT32_MAX);
+        req.src.device = (CUdevice)(randomValue() & INT32_MAX);
+        req.size = randomValue();
+        req.alignment = randomValue();
+        req.flags = (uint32_t)randomValue();
+        req.generation = randomValue();
+        req.offset = randomValue();
+        req.limit = randomValue();
+        randomMemId(req.memId);
+        size_t len = MemMapWire::EncodeRequest(req, buf);
+        pass = pass && (len <= M3_WIRE_MAX_SIZE) && (MemMapWire::DecodeRequest(buf, len, &decodedReq) == len);
+        pass = pass && (decodedReq.cmd == req.cmd) && (decodedReq.src.pid == req.src.pid) &&
+            (decodedReq.src.device == req.src.device) && (decodedReq.size == req.size) &&
+            (decodedReq.alignment == req.alignment) && (decodedReq.flags == req.flags) &&
+            (decodedReq.generation == req.generation) && (decodedReq.offset == req.offset) &&
+            (decodedReq.limit == req.limit) && (strncmp(decodedReq.memId, req.memId, MAX_MEMID_LEN) == 0);
+        for (size_t cut = 0; cut < len && pass; ++cut) {
+            pass = (MemMapWire::DecodeRequest(buf, cut, &decodedReq) == 0);
+        }
+
+        MemMapResponse res((MemMapStatusCode)(rand() % STATUSCODE_COUNT)), decodedRes;
+        res.roundedSize = randomValue();
+        res.numShareableHandles = (uint32_t)randomValue();
+        res.offset = randomValue();
+        res.backingId = randomValue();
+        res.backingSize = randomValue();
+        res.generation = randomValue();
+        res.serverGeneration = randomValue();
+        res.device = (CUdevice)(randomValue() & INT32_MAX);
+        randomMemId(res.memId);
+        len = MemMapWire::EncodeResponse(res, buf);
+        pass = pass && (len <= M3_WIRE_MAX_SIZE) && (MemMapWire::DecodeResponse(buf, len, &decodedRes) == len);
+        pass = pass && (decodedRes.status == res.status) && (decodedRes.roundedSize == res.roundedSize) &&
+            (decodedRes.numShareableHandles == res.numShareableHandles) && (decodedRes.offset == res.offset) &&
+            (decodedRes.backingId == res.backingId) && (decodedRes.backingSize == res.backingSize) &&
+            (decodedRes.generation == res.generation) && (decodedRes.serverGeneration == res.serverGeneration) &&
+            (decodedRes.device == res.device) && (strncmp(decodedRes.memId, res.memId, MAX_MEMID_LEN) == 0);
+        for (size_t cut = 0; cut < len && pass; ++cut) {
+            pass = (MemMapWire::DecodeResponse(buf, cut, &decodedRes) == 0);
+        }
+
+        // Corrupted responses are either rejected or decoded within bounds.
+        for (int flip = 0; flip < 8 && pass; ++flip) {
+            buf[rand() % len] ^= (char)(1 << (rand() % 8));
+            size_t decodedLen = MemMapWire::DecodeResponse(buf, len, &decodedRes);
+            pass = (decodedLen == 0) || (decodedLen <= len && decodedRes.status < STATUSCODE_COUNT);
+        }
+
+        MemMapBatchEntry entry, decodedEntry;
+        randomMemId(entry.memId);
+        entry.size = randomValue();
+        entry.alignment = randomValue();
+        len = MemMapWire::EncodeBatchEntry(entry, buf);
+        pass = pass && (len <= M3_WIRE_MAX_BATCH_ENTRY_SIZE) && (MemMapWire::DecodeBatchEntry(buf, len, &decodedEntry) == len);
+        pass = pass && (decodedEntry.size == entry.size) && (decodedEntry.alignment == entry.alignment) &&
+            (strncmp(decodedEntry.memId, entry.memId, MAX_MEMID_LEN) == 0);
+        for (size_t cut = 0; cut < len && pass; ++cut) {
+            pass = (MemMapWire::DecodeBatchEntry(buf, cut, &decodedEntry) == 0);
+        }
+
+        MemMapBatchResult result, decodedResult;
+        result.status = (MemMapStatusCode)(rand() % STATUSCODE_COUNT);
+        result.roundedSize = randomValue();
+        result.numShareableHandles = (uint32_t)randomValue();
+        result.duplicateOf = (uint32_t)randomValue();
+        result.device = (CUdevice)(randomValue() & INT32_MAX);
+        result.token = randomValue();
+        result.offset = randomValue();
+        result.backingId = randomValue();
+        result.backingSize = randomValue();
+        len = MemMapWire::EncodeBatchResult(result, buf);
+        pass = pass && (len <= M3_WIRE_MAX_BATCH_RESULT_SIZE) && (MemMapWire::DecodeBatchResult(buf, len, &decodedResult) == len);
+        pass = pass && (decodedResult.status == result.status) && (decodedResult.roundedSize == result.roundedSize) &&
+            (decodedResult.numShareableHandles == result.numShareableHandles) &&
+            (decodedResult.duplicateOf == result.duplicateOf) && (decodedResult.device == result.device) &&
+            (decodedResult.token == result.token) && (decodedResult.offset == result.offset) &&
+            (decodedResult.backingId == result.backingId) && (decodedResult.backingSize == result.backingSize);
+
+        // Random bytes are either rejected or decoded within bounds.
+        len = rand() % M3_WIRE_MAX_SIZE;
+        for (size_t i = 0; i < len; ++i) {
+            buf[i] = (char)rand();
+        }
+        if (r % 2) {
+            buf[0] = M3_WIRE_VERSION;
+        }
+        size_t decodedLen = MemMapWire::DecodeRequest(buf, len, &decodedReq);
+        pass = pass && ((decodedLen == 0) || (decodedLen <= len && decodedReq.cmd < CMD_COUNT));
+    }
+
+    pid_t serverPid = spawnServer();
+    ProcessInfo pInfo;
+    int sock_fd = ipcConnect(&server_addr);
+
+    // Cut requests and requests of another version are dropped, and the connection keeps working.
+    MemMapRequest req(CMD_ECHO);
+    req.src = pInfo;
+    strcpy(req.memId, "wire_format");
+    size_t len = MemMapWire::EncodeRequest(req, buf);
+    // An empty message reads as a hangup, so cuts start at one byte.
+    for (size_t cut = 1; cut < len; ++cut) {
+        send(sock_fd, buf, cut, MSG_NOSIGNAL);
+    }
+    buf[0] = M3_WIRE_VERSION + 1;
+    send(sock_fd, buf, len, MSG_NOSIGNAL);
+    pass = pass && (MemMapManager::Request(sock_fd, req).status == STATUSCODE_ACK);
+
+    MemMapStats before, after;
+    MemMapManager::RequestStats(pInfo, sock_fd, &before);
+    req.memId[0] = '\0';
+    for (int r = 0; r < rep && pass; ++r) {
+        pass = (MemMapManager::Request(sock_fd, req).status == STATUSCODE_ACK);
+    }
+    MemMapManager::RequestStats(pInfo, sock_fd, &after);
+    double echoRx = (double)(after.rxBytes - before.rxBytes) / (after.rxMessages - before.rxMessages);
+    double echoTx = (double)(after.txBytes - before.txBytes) / (after.txMessages - before.txMessages);
+
+    int numRegions = 200;
+    before = after;
+    for (int r = 0; r < numRegions && pass; ++r) {
+        char memId[MAX_MEMID_LEN];
+        sprintf(memId, "wire_format_%d", r);
+        MemMapResponse res = MemMapManager::RequestAllocate(pInfo, sock_fd, memId, 0, 2 << 20);
+        pass = (res.status == STATUSCODE_ACK);
+    }
+    MemMapManager::RequestStats(pInfo, sock_fd, &after);
+    double allocateRx = (double)(after.rxBytes - before.rxBytes) / (after.rxMessages - before.rxMessages);
+    double allocateTx = (double)(after.txBytes - before.txBytes) / (after.txMessages - before.txMessages);
+
+    printf("WIRE FORMAT: echo     %5.1f bytes/request, %5.1f bytes/response\n", echoRx, echoTx);
+    printf("WIRE FORMAT: allocate %5.1f bytes/request, %5.1f bytes/response (fixed layout: %zu / %zu)\n",
+        allocateRx, allocateTx, sizeof(MemMapRequest), sizeof(MemMapResponse));
+    pass = pass && (allocateRx < sizeof(MemMapRequest)) && (allocateTx < sizeof(MemMapResponse));
+
+    close(sock_fd);
+    haltServer(serverPid);
+
+    if (pass) {
+        std::cout << "WIRE FORMAT TEST PASSED" << std::endl;
+    } else {
+        std::cout << "WIRE FORMAT TEST FAILED" << std::endl;
+    }
+}
+
+
+// test_RegionToken() allocates regions by memId, then stats, imports from another process and deallocates them
+// by token. It compares CMD_STAT by memId and by token, and checks that tokens of removed regions go stale.
+void test_RegionToken(int numRegions) {
+    pid_t serverPid = spawnServer();
+    bool pass = true;
+
+    CUUTIL_ERRCHK(cuInit(0));
+    CUcontext ctx;
+    CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, 0));
+    ProcessInfo pInfo;
+    pInfo.SetContext(ctx);
+    int sock_fd = ipcConnect(&server_addr);
+
+    char memId[MAX_MEMID_LEN];
+    std::vector<MemMapResponse> regions;
+    std::unordered_set<uint64_t> tokens;
+    size_t granularity = MemMapManager::RequestRoundedAllocationSize(pInfo, sock_fd, 1).roundedSize;
+    for (int i = 0; i < numRegions; ++i) {
+        // Every other region is small enough to be sub-allocated.
+        sprintf(memId, "token_%d", i);
+        MemMapResponse res = MemMapManager::RequestAllocate(pInfo, sock_fd, memId, 0, i % 2 ? granularity : 1000);
+        pass = pass && (res.status == STATUSCODE_ACK) && (res.token != 0) && tokens.insert(res.token).second;
+        regions.push_back(res);
+    }
+
+    // CMD_STAT by (memId, size) and by token.
+    struct timespec begin, end;
+    double usByName = 0, usByToken = 0;
+    MemMapRequest req(CMD_STAT);
+    req.src = pInfo;
+    for (int round = 0; round < 2; ++round) {
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        for (int i = 0; i < numRegions; ++i) {
+            sprintf(req.memId, "token_%d", i);
+            req.size = regions[i].roundedSize;
+            req.token = round ? regions[i].token : 0;
+            if (round) {
+                req.memId[0] = '\0';
+                req.size = 0;
+            }
+            MemMapResponse res = MemMapManager::Request(sock_fd, req);
+            pass = pass && (res.status == STATUSCODE_ACK) && (res.token == regions[i].token) &&
+                (res.roundedSize == regions[i].roundedSize) && (res.generation == regions[i].generation);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        (round ? usByToken : usByName) = elapsedSeconds(begin, end) * 1e6 / numRegions;
+    }
+
+    // Another process imports every region by token, and writes to it.
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        ProcessInfo childInfo;
+        childInfo.SetContext(ctx);
+        int child_fd = ipcConnect(&server_addr);
+        bool childPass = true;
+        for (int i = 0; i < numRegions && childPass; ++i) {
+            MemMapResponse res = MemMapManager::RequestImport(childInfo, child_fd, regions[i].token);
+            childPass = (res.status == STATUSCODE_ACK) && (res.roundedSize == regions[i].roundedSize) && (res.token == regions[i].token);
+            int value = i;
+            childPass = childPass && (cuMemcpyHtoD(res.d_ptr, &value, sizeof(value)) == CUDA_SUCCESS);
+            childPass = childPass && (MemMapManager::RequestDeAllocate(childInfo, child_fd, res.d_ptr).status == STATUSCODE_ACK);
+        }
+        close(child_fd);
+        exit(childPass ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    int wStat;
+    waitpid(pid, &wStat, 0);
+    pass = pass && WIFEXITED(wStat) && WEXITSTATUS(wStat) == EXIT_SUCCESS;
+
+    MemMapStats before, after;
+    MemMapManager::RequestStats(pInfo, sock_fd, &before);
+    for (int i = 0; i < numRegions; ++i) {
+        int value = -1;
+        pass = pass && (cuMemcpyDtoH(&value, regions[i].d_ptr, sizeof(value)) == CUDA_SUCCESS) && (value == i);
+        pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, regions[i].d_ptr).status == STATUSCODE_ACK);
+    }
+    MemMapManager::RequestStats(pInfo, sock_fd, &after);
+    pass = pass && (after.numRegions == 0);
+    // One CMD_GETSTATS is counted along with the releases.
+    double deallocateBytes = (double)(after.rxBytes - before.rxBytes) / (after.rxMessages - before.rxMessages);
+
+    // Tokens of removed regions go stale, and are not handed out again.
+    pass = pass && (MemMapManager::RequestStat(pInfo, sock_fd, regions[0].token).status == STATUSCODE_STALE);
+    pass = pass && (MemMapManager::RequestImport(pInfo, sock_fd, regions[1].token).status == STATUSCODE_STALE);
+    MemMapResponse res = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"token_0", 0, 1000);
+    pass = pass && (res.status == STATUSCODE_ACK) && (tokens.count(res.token) == 0);
+    pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, res.d_ptr).status == STATUSCODE_ACK);
+
+    printf("REGION TOKEN: %d regions, stat by memId %.1f us, by token %.1f us, %.1f bytes per CMD_DEALLOCATE\n",
+        numRegions, usByName, usByToken, deallocateBytes);
+
+    close(sock_fd);
+    haltServer(serverPid);
+
+    if (pass) {
+        std::cout << "REGION TOKEN TEST PASSED" << std::endl;
+    } else {
+        std::cout << "REGION TOKEN TEST FAILED" << std::endl;
+    }
+}
+
+
+// test_Burst() fires CMD_ECHO and CMD_GETROUNDEDALLOCATIONSIZE from numClients concurrent clients at once,
+// rep requests each, one by one or in bursts of M3_BURST_WINDOW, against a server receiving one request
+// or a burst per system call. It reports requests/s and the p99 latency of a round trip.
+void test_Burst(int numClients, int rep) {
+    bool pass = true;
+    int repPerBurst = M3_BURST_WINDOW;
+    size_t samplesPerClient = rep;
+    double *latencies = (double *)mmap(NULL, numClients * samplesPerClient * sizeof(double),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    int maxBursts[] = {1, 32};
+    for (int maxBurst : maxBursts) {
+        MemMapServerOptions options;
+        options.maxBurst = maxBurst;
+        pid_t serverPid = spawnServer(options);
+        ProcessInfo pInfo;
+        int sock_fd = ipcConnect(&server_addr);
+        size_t granularity = MemMapManager::RequestRoundedAllocationSize(pInfo, sock_fd, 1).roundedSize;
+
+        for (int bursts = 0; bursts < 2; ++bursts) {
+            MemMapStats before, after;
+            MemMapManager::RequestStats(pInfo, sock_fd, &before);
+
+            // Clients connect first and start together when the parent closes the start pipe.
+            int startPipe[2];
+            pipe(startPipe);
+            std::vector<pid_t> clients;
+            fflush(stdout);
+            for (int c = 0; c < numClients; ++c) {
+                pid_t pid = fork();
+                if (pid == 0) {
+                    close(startPipe[1]);
+                    int client_fd = ipcConnect(&server_addr);
+                    char go;
+                    read(startPipe[0], &go, 1);
+                    std::vector<MemMapRequest> reqs(repPerBurst);
+                    for (int i = 0; i < repPerBurst; ++i) {
+                        reqs[i].cmd = (i % 2) ? CMD_GETROUNDEDALLOCATIONSIZE : CMD_ECHO;
+                        reqs[i].src = pInfo;
+                        reqs[i].size = 4096;
+                    }
+                    double *samples = latencies + c * samplesPerClient;
+                    bool clientPass = true;
+                    struct timespec t0, t1;
+                    for (int i = 0; i < rep; i += repPerBurst) {
+                        clock_gettime(CLOCK_MONOTONIC, &t0);
+                        std::vector<MemMapResponse> responses;
+                        if (bursts) {
+                            responses = MemMapManager::RequestBurst(client_fd, reqs);
+                        } else {
+                            for (auto& req : reqs) {
+                                responses.push_back(MemMapManager::Request(client_fd, req));
+                            }
+                        }
+                        clock_gettime(CLOCK_MONOTONIC, &t1);
+                        for (int j = 0; j < repPerBurst; ++j) {
+                            clientPass = clientPass && (responses[j].status == STATUSCODE_ACK);
+                            clientPass = clientPass && (reqs[j].cmd == CMD_ECHO || responses[j].roundedSize == granularity);
+                            samples[i + j] = elapsedSeconds(t0, t1) * 1e6;
+                        }
+                    }
+                    close(client_fd);
+                    exit(clientPass ? EXIT_SUCCESS : EXIT_FAILURE);
+                }
+                clients.push_back(pid);
+            }
+            close(startPipe[0]);
+            usleep(100000);
+            struct timespec begin, end;
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            close(startPipe[1]);
+            for (auto pid : clients) {
+                int wStat;
+                waitpid(pid, &wStat, 0);
+                pass = pass && WIFEXITED(wStat) && WEXITSTATUS(wStat) == EXIT_SUCCESS;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            MemMapManager::RequestStats(pInfo, sock_fd, &after);
+
+            // Every request of a burst waits for the whole burst: p99 is the latency of M3_BURST_WINDOW requests.
+            std::vector<double> samples(latencies, latencies + numClients * samplesPerClient);
+            double seconds = elapsedSeconds(begin, end);
+            printf("BURST: server burst %2d, client %-10s %8.0f requests/s, p99 = %7.1f us per %d requests, %.2f requests per receive\n",
+                maxBurst, bursts ? "bursts" : "one by one", (double)numClients * rep / seconds, percentile(samples, 99), repPerBurst,
+                (double)(after.rxMessages - before.rxMessages) / (after.rxBursts - before.rxBursts));
+        }
+
+        close(sock_fd);
+        haltServer(serverPid);
+    }
+    munmap(latencies, numClients * samplesPerClient * sizeof(double));
+
+    if (pass) {
+        std::cout << "BURST TEST PASSED" << std::endl;
+    } else {
+        std::cout << "BURST TEST FAILED" << std::endl;
+    }
+}
+
+// test_BusyPoll() compares the latency of CMD_GETROUNDEDALLOCATIONSIZE through the socket
+// with a blocking server and client, and with both of them busy polling.
+void test_BusyPoll(int rep) {
+    bool pass = true;
+    std::vector<double> latencies(rep);
+    double p50[2], p99[2];
+
+    for (int busyPoll = 0; busyPoll < 2; ++busyPoll) {
+        MemMapServerOptions options;
+        options.busyPollCpu = busyPoll ? 0 : -1;
+        pid_t serverPid = spawnServer(options);
+        MemMapManager::SetClientBusyPoll(busyPoll);
+
+        ProcessInfo pInfo;
+        int sock_fd = ipcConnect(&server_addr);
+        MemMapRequest req(CMD_GETROUNDEDALLOCATIONSIZE);
+        req.src = pInfo;
+        req.size = 4096;
+        struct timespec begin, end;
+        for (int i = 0; i < rep; ++i) {
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            MemMapResponse res = MemMapManager::Request(sock_fd, req);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            latencies[i] = elapsedSeconds(begin, end) * 1e9;
+            pass = pass && (res.status == STATUSCODE_ACK) && (res.roundedSize >= req.size);
+        }
+        p50[busyPoll] = percentile(latencies, 50);
+        p99[busyPoll] = percentile(latencies, 99);
+        printf("BUSY POLL: %s p50 = %.0f ns, p99 = %.0f ns\n", busyPoll ? "busy poll" : "blocking ", p50[busyPoll], p99[busyPoll]);
+
+        close(sock_fd);
+        MemMapManager::SetClientBusyPoll(false);
+        haltServer(serverPid);
+    }
+    printf("BUSY POLL: p50 x%.2f, p99 x%.2f\n", p50[0] / p50[1], p99[0] / p99[1]);
+
+    if (pass) {
+        std::cout << "BUSY POLL TEST PASSED" << std::endl;
+    } else {
+        std::cout << "BUSY POLL TEST FAILED" << std::endl;
+    }
+}
+
+// test_Priority() measures the latency of small allocations while numBulkClients clients keep a single worker busy
+// with batches of fresh regions (M3_PRIORITY_BULK), the small allocations being in the bulk class too (FIFO)
+// or in M3_PRIORITY_HIGH. It reports the queue depth and wait time per class.
+void test_Priority(int numBulkClients, int rep) {
+    bool pass = true;
+    const int batchSize = 32;
+    const char *classNames[M3_PRIORITY_COUNT] = {"normal", "high", "bulk"};
+    std::atomic<int> *stop = (std::atomic<int> *)mmap(NULL, sizeof(std::atomic<int>),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    CUUTIL_ERRCHK(cuInit(0));
+    CUcontext ctx;
+    CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, 0));
+    ProcessInfo pInfo;
+    pInfo.SetContext(ctx);
+
+    MemMapPriority classes[] = {M3_PRIORITY_BULK, M3_PRIORITY_HIGH};
+    for (MemMapPriority priority : classes) {
+        MemMapServerOptions options;
+        options.numWorkersPerDevice = 1;
+        options.poolEnabled = false;
+        options.subAllocMaxSize = 0;
+        options.reclaimDelayMs = 1;
+        pid_t serverPid = spawnServer(options);
+        stop->store(0);
+
+        std::vector<pid_t> clients;
+        fflush(stdout);
+        for (int c = 0; c < numBulkClients; ++c) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                CUUTIL_ERRCHK(cuInit(0));
+                CUcontext childCtx;
+                CUUTIL_ERRCHK(cuCtxCreate(&childCtx, 0, 0));
+                ProcessInfo childInfo;
+                childInfo.SetContext(childCtx);
+                MemMapManager::SetClientPriority(M3_PRIORITY_BULK);
+                int sock_fd = ipcConnect(&server_addr);
+                bool clientPass = true;
+                std::vector<MemMapBatchEntry> entries(batchSize);
+                for (int iter = 0; !stop->load(); ++iter) {
+                    for (int i = 0; i < batchSize; ++i) {
+                        sprintf(entries[i].memId, "bulk_%d_%d_%d", c, iter, i);
+                        entries[i].size = 2 << 20;
+                        entries[i].alignment = 0;
+                    }
+                    std::vector<MemMapResponse> results = MemMapManager::RequestAllocateBatch(childInfo, sock_fd, entries);
+                    for (auto& res : results) {
+                        clientPass = clientPass && (res.status == STATUSCODE_ACK);
+                        MemMapManager::RequestDeAllocate(childInfo, sock_fd, res.d_ptr);
+                    }
+                }
+                close(sock_fd);
+                exit(clientPass ? EXIT_SUCCESS : EXIT_FAILURE);
+            }
+            clients.push_back(pid);
+        }
+
+        MemMapManager::SetClientPriority(priority);
+        int sock_fd = ipcConnect(&server_addr);
+        std::vector<double> latencies(rep);
+        struct timespec begin, end;
+        char memId[MAX_MEMID_LEN];
+        // Let the bulk clients fill the queue first.
+        usleep(100000);
+        for (int i = 0; i < rep; ++i) {
+            sprintf(memId, "small_%d", i);
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            MemMapResponse res = MemMapManager::RequestAllocate(pInfo, sock_fd, memId, 0, 4096);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            latencies[i] = elapsedSeconds(begin, end) * 1e6;
+            pass = pass && (res.status == STATUSCODE_ACK);
+            MemMapManager::RequestDeAllocate(pInfo, sock_fd, res.d_ptr);
+        }
+        MemMapManager::SetClientPriority(M3_PRIORITY_NORMAL);
+
+        MemMapStats stats;
+        pass = pass && (MemMapManager::RequestStats(pInfo, sock_fd, &stats).status == STATUSCODE_ACK);
+        printf("PRIORITY: small allocations in class %-6s p50 = %8.1f us, p99 = %8.1f us\n",
+            classNames[priority], percentile(latencies, 50), percentile(latencies, 99));
+        for (int c = 0; c < M3_PRIORITY_COUNT; ++c) {
+            if (stats.queueServed[c] == 0) {
+                continue;
+            }
+            printf("PRIORITY:   class %-6s served %6lu, depth %3lu, wait avg %8.1f us, max %8.1f us\n",
+                classNames[c], (unsigned long)stats.queueServed[c], (unsigned long)stats.queueDepth[c],
+                stats.queueWaitNs[c] * 1e-3 / stats.queueServed[c], stats.queueMaxWaitNs[c] * 1e-3);
+        }
+        // Every small allocation and deallocation went through the queue of its class.
+        pass = pass && (stats.queueServed[priority] >= (uint64_t)rep * 2) && (stats.queueServed[M3_PRIORITY_BULK] > 0);
+
+        stop->store(1);
+        for (auto pid : clients) {
+            int wStat;
+            waitpid(pid, &wStat, 0);
+            pass = pass && WIFEXITED(wStat) && WEXITSTATUS(wStat) == EXIT_SUCCESS;
+        }
+        close(sock_fd);
+        haltServer(serverPid);
+    }
+    munmap(stop, sizeof(std::atomic<int>));
+
+    if (pass) {
+        std::cout << "PRIORITY TEST PASSED" << std::endl;
+    } else {
+        std::cout << "PRIORITY TEST FAILED" << std::endl;
+    }
+}
+
+// test_Handover() allocates numRegions regions, half of them sub-allocated, and writes to them.
+// Servers not accepting handovers refuse CMD_HANDOVER. Handovers the running server cannot complete must leave it serving:
+// one for another number of devices is refused, and one whose successor takes the state but never confirms it is dropped.
+// A new server then takes the running one over: the client keeps its connection, mappings and tokens,
+// and another process imports every region by token and sees the data. It reports the time of the handover.
+void test_Handover(int numRegions) {
+    MemMapServerOptions options;
+    MemMapRequest handover(CMD_HANDOVER);
+    handover.src.pid = getpid();
+    handover.size = M3_HANDOVER_VERSION;
+    handover.flags = options.backend;
+    pid_t serverPid = spawnServer(options);
+    int probe_fd = ipcConnect(&server_addr);
+    MemMapStats before, after;
+    MemMapManager::RequestStats(handover.src, probe_fd, &before);
+    handover.alignment = before.numDevices;
+    bool pass = (MemMapManager::Request(probe_fd, handover).status == STATUSCODE_INVALID);
+    close(probe_fd);
+    haltServer(serverPid);
+    options.acceptHandover = true;
+    serverPid = spawnServer(options);
+
+    CUUTIL_ERRCHK(cuInit(0));
+    CUcontext ctx;
+    CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, 0));
+    ProcessInfo pInfo;
+    pInfo.SetContext(ctx);
+    int sock_fd = ipcConnect(&server_addr);
+
+    char memId[MAX_MEMID_LEN];
+    std::vector<MemMapResponse> regions;
+    size_t granularity = MemMapManager::RequestRoundedAllocationSize(pInfo, sock_fd, 1).roundedSize;
+    for (int i = 0; i < numRegions; ++i) {
+        sprintf(memId, "handover_%d", i);
+        MemMapResponse res = MemMapManager::RequestAllocate(pInfo, sock_fd, memId, 0, i % 2 ? granularity : 1000);
+        pass = pass && (res.status == STATUSCODE_ACK);
+        pass = pass && (cuMemcpyHtoD(res.d_ptr, &i, sizeof(i)) == CUDA_SUCCESS);
+        regions.push_back(res);
+    }
+    // The token of a removed region must stay stale.
+    MemMapResponse removed = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"handover_removed", 0, granularity);
+    pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, removed.d_ptr).status == STATUSCODE_ACK);
+    MemMapManager::RequestStats(pInfo, sock_fd, &before);
+
+    probe_fd = ipcConnect(&server_addr);
+    handover.src = pInfo;
+    handover.alignment = before.numDevices + 1;
+    pass = pass && (MemMapManager::Request(probe_fd, handover).status == STATUSCODE_INVALID);
+    handover.alignment = before.numDevices;
+    MemMapResponse state = MemMapManager::Request(probe_fd, handover);
+    pass = pass && (state.status == STATUSCODE_ACK);
+    std::vector<char> stateData(state.roundedSize);
+    for (size_t received = 0; pass && received < stateData.size(); ) {
+        ssize_t n = recv(probe_fd, stateData.data() + received, stateData.size() - received, 0);
+        pass = (n > 0);
+        received += pass ? n : 0;
+    }
+    std::vector<int> stateFds(state.numShareableHandles);
+    pass = pass && (ipcRecvFds(probe_fd, stateFds.data(), stateFds.size()) == 0);
+    for (int fd : stateFds) {
+        close(fd);
+    }
+    close(probe_fd);
+    MemMapRequest echo(CMD_ECHO);
+    echo.src = pInfo;
+    pass = pass && (MemMapManager::Request(sock_fd, echo).status == STATUSCODE_ACK);
+    MemMapManager::RequestStats(pInfo, sock_fd, &after);
+    pass = pass && (after.numRegions == before.numRegions);
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    fflush(stdout);
+    pid_t successorPid = fork();
+    if (successorPid == 0) {
+        options.handover = true;
+        MemMapManager::SetServerOptions(options);
+        MemMapManager::Instance();
+        exit(EXIT_SUCCESS);
+    }
+    // The running server exits once it handed its state over.
+    int wStat;
+    waitpid(serverPid, &wStat, 0);
+    pass = pass && WIFEXITED(wStat) && WEXITSTATUS(wStat) == EXIT_SUCCESS;
+    pass = pass && (MemMapManager::Request(sock_fd, echo).status == STATUSCODE_ACK);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    MemMapManager::RequestStats(pInfo, sock_fd, &after);
+    pass = pass && (after.numRegions == before.numRegions) && (after.slabPages == before.slabPages);
+    // The running server finished reclaiming the removed region before handing over.
+    uint64_t usedBefore = 0, usedAfter = 0;
+    for (uint64_t d = 0; d < after.numDevices; ++d) {
+        usedBefore += before.deviceUsedBytes[d];
+        usedAfter += after.deviceUsedBytes[d];
+    }
+    pass = pass && (usedAfter == usedBefore - before.reclaimPendingBytes);
+    pass = pass && (MemMapManager::RequestStat(pInfo, sock_fd, removed.token).status == STATUSCODE_STALE);
+
+    // Another process imports every region by token through a new connection, and writes to it.
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        ProcessInfo childInfo;
+        childInfo.SetContext(ctx);
+        int child_fd = ipcConnect(&server_addr);
+        bool childPass = true;
+        for (int i = 0; i < numRegions && childPass; ++i) {
+            MemMapResponse res = MemMapManager::RequestImport(childInfo, child_fd, regions[i].token);
+            childPass = (res.status == STATUSCODE_ACK) && (res.roundedSize == regions[i].roundedSize);
+            int value = -1;
+            childPass = childPass && (cuMemcpyDtoH(&value, res.d_ptr, sizeof(value)) == CUDA_SUCCESS) && (value == i);
+            value = i + 1;
+            childPass = childPass && (cuMemcpyHtoD(res.d_ptr, &value, sizeof(value)) == CUDA_SUCCESS);
+            childPass = childPass && (MemMapManager::RequestDeAllocate(childInfo, child_fd, res.d_ptr).status == STATUSCODE_ACK);
+        }
+        // New small regions go to the backing pages taken over, next to the old ones.
+        MemMapResponse res = MemMapManager::RequestAllocate(childInfo, child_fd, (char *)"handover_new", 0, 1000);
+        childPass = childPass && (res.status == STATUSCODE_ACK);
+        childPass = childPass && (MemMapManager::RequestDeAllocate(childInfo, child_fd, res.d_ptr).status == STATUSCODE_ACK);
+        close(child_fd);
+        exit(childPass ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    waitpid(pid, &wStat, 0);
+    pass = pass && WIFEXITED(wStat) && WEXITSTATUS(wStat) == EXIT_SUCCESS;
+
+    for (int i = 0; i < numRegions; ++i) {
+        int value = -1;
+        pass = pass && (cuMemcpyDtoH(&value, regions[i].d_ptr, sizeof(value)) == CUDA_SUCCESS) && (value == i + 1);
+        pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, regions[i].d_ptr).status == STATUSCODE_ACK);
+    }
+    MemMapManager::RequestStats(pInfo, sock_fd, &after);
+    pass = pass && (after.numRegions == 0);
+
+    printf("HANDOVER: %d regions (%lu backing pages) handed over in %.1f ms\n",
+        numRegions, (unsigned long)before.slabPages, elapsedSeconds(begin, end) * 1e3);
+
+    close(sock_fd);
+    haltServer(successorPid);
+
+    if (pass) {
+        std::cout << "HANDOVER TEST PASSED" << std::endl;
+    } else {
+        std::cout << "HANDOVER TEST FAILED" << std::endl;
+    }
+}
+
+// test_HostBackend() allocates numRegions regions of 1 to 4 pages, and numRegions sub-allocated ones,
+// from a server of each backend, and reports the time to allocate and map them.
+// Host regions are written through their pointers, and another process reads them through its own mapping.
+// A successor of another backend must not take the server over.
+void test_HostBackend(int numRegions) {
+    const MemMapBackendKind backends[] = {M3_BACKEND_CUDA, M3_BACKEND_HOST};
+    bool pass = true;
+
+    CUUTIL_ERRCHK(cuInit(0));
+    CUcontext ctx;
+    CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, 0));
+    ProcessInfo pInfo;
+    pInfo.SetContext(ctx);
+
+    for (auto backend : backends) {
+        MemMapServerOptions options;
+        options.backend = backend;
+        pid_t serverPid = spawnServer(options);
+        int sock_fd = ipcConnect(&server_addr);
+
+        char memId[MAX_MEMID_LEN];
+        std::vector<MemMapResponse> regions;
+        size_t granularity = MemMapManager::RequestRoundedAllocationSize(pInfo, sock_fd, 1).roundedSize;
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        for (int i = 0; i < 2 * numRegions; ++i) {
+            sprintf(memId, "backend_%d", i);
+            MemMapResponse res = MemMapManager::RequestAllocate(pInfo, sock_fd, memId, 0, i % 2 ? granularity * (1 + i / 2 % 4) : 1000);
+            pass = pass && (res.status == STATUSCODE_ACK) && (res.backend == backend);
+            regions.push_back(res);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double allocSeconds = elapsedSeconds(begin, end);
+        for (int i = 0; i < 2 * numRegions && pass; ++i) {
+            if (backend == M3_BACKEND_HOST) {
+                *(int *)(uintptr_t)regions[i].d_ptr = i;
+                ((char *)(uintptr_t)regions[i].d_ptr)[regions[i].roundedSize - 1] = (char)i;
+            } else {
+                pass = (cuMemcpyHtoD(regions[i].d_ptr, &i, sizeof(i)) == CUDA_SUCCESS);
+            }
+        }
+
+        if (backend == M3_BACKEND_HOST) {
+            // Another process sees the writes through its own mapping, without any copy.
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == 0) {
+                ProcessInfo childInfo;
+                childInfo.SetContext(ctx);
+                int child_fd = ipcConnect(&server_addr);
+                bool childPass = true;
+                for (int i = 0; i < 2 * numRegions && childPass; ++i) {
+                    MemMapResponse res = MemMapManager::RequestImport(childInfo, child_fd, regions[i].token);
+                    childPass = (res.status == STATUSCODE_ACK) && (res.backend == M3_BACKEND_HOST);
+                    childPass = childPass && (*(int *)(uintptr_t)res.d_ptr == i);
+                    childPass = childPass && (((char *)(uintptr_t)res.d_ptr)[res.roundedSize - 1] == (char)i);
+                    childPass = childPass && (MemMapManager::RequestDeAllocate(childInfo, child_fd, res.d_ptr).status == STATUSCODE_ACK);
+                }
+                close(child_fd);
+                exit(childPass ? EXIT_SUCCESS : EXIT_FAILURE);
+            }
+            int wStat;
+            waitpid(pid, &wStat, 0);
+            pass = pass && WIFEXITED(wStat) && WEXITSTATUS(wStat) == EXIT_SUCCESS;
+        } else {
+            // The server of the other backend is refused, and the running one keeps serving.
+            fflush(stdout);
+            pid_t successorPid = fork();
+            if (successorPid == 0) {
+                MemMapServerOptions successorOptions;
+                successorOptions.handover = true;
+                successorOptions.backend = M3_BACKEND_HOST;
+                MemMapManager::SetServerOptions(successorOptions);
+                MemMapManager::Instance();
+                exit(EXIT_SUCCESS);
+            }
+            int wStat;
+            waitpid(successorPid, &wStat, 0);
+            pass = pass && !(WIFEXITED(wStat) && WEXITSTATUS(wStat) == EXIT_SUCCESS);
+            MemMapRequest echo(CMD_ECHO);
+            echo.src = pInfo;
+            pass = pass && (MemMapManager::Request(sock_fd, echo).status == STATUSCODE_ACK);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        for (auto &res : regions) {
+            pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, res.d_ptr).status == STATUSCODE_ACK);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("HOSTBACKEND: %-4s %d regions allocated and mapped in %.1f us each, unmapped in %.1f us each\n",
+            MemMapBackend::Get(backend).Name(), 2 * numRegions,
+            allocSeconds * 1e6 / (2 * numRegions), elapsedSeconds(begin, end) * 1e6 / (2 * numRegions));
+
+        close(sock_fd);
+        haltServer(serverPid);
+    }
+
+    if (pass) {
+        std::cout << "HOSTBACKEND TEST PASSED" << std::endl;
+    } else {
+        std::cout << "HOSTBACKEND TEST FAILED" << std::endl;
+    }
+}
+
+// test_NumaPlacement() places a host region of size bytes on every NUMA node, checks where its pages went,
+// and measures the write and read bandwidth of the calling thread over rep passes, from its own node (local)
+// and from the other nodes (remote). It also checks the node occupancy reported by the server,
+// and that a request for a node without memory fails.
+void test_NumaPlacement(size_t size, int rep) {
+    MemMapServerOptions options;
+    options.backend = M3_BACKEND_HOST;
+    pid_t serverPid = spawnServer(options);
+    bool pass = true;
+
+    CUUTIL_ERRCHK(cuInit(0));
+    CUcontext ctx;
+    CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, 0));
+    ProcessInfo pInfo;
+    pInfo.SetContext(ctx);
+    int sock_fd = ipcConnect(&server_addr);
+
+    // Stay on one CPU, so that local and remote keep their meaning.
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(sched_getcpu(), &cpus);
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+    int local = MemMapManager::CurrentNumaNode();
+
+    MemMapStats stats;
+    MemMapManager::RequestStats(pInfo, sock_fd, &stats);
+    for (uint64_t d = 0; d < stats.numDevices; ++d) {
+        printf("NUMAPLACEMENT: device %lu on node %ld\n", (unsigned long)d, (long)stats.deviceNumaNode[d]);
+    }
+    std::vector<int> nodes;
+    int missing = -1;
+    for (int node = 0; node < M3_MAX_NUMA_NODES; ++node) {
+        if (node < (int)stats.numNodes && stats.nodeTotalBytes[node] > 0) {
+            nodes.push_back(node);
+        } else if (missing < 0) {
+            missing = node;
+        }
+    }
+    pass = pass && (local >= 0) && !nodes.empty();
+
+    std::vector<double> writeLocal, readLocal, writeRemote, readRemote;
+    for (int node : nodes) {
+        char memId[MAX_MEMID_LEN];
+        sprintf(memId, "numa_%d", node);
+        MemMapResponse res = MemMapManager::RequestAllocate(pInfo, sock_fd, memId, 0, size, M3_FLAG_NUMA_NODE(node));
+        pass = pass && (res.status == STATUSCODE_ACK);
+        if (res.status != STATUSCODE_ACK) {
+            continue;
+        }
+        char *p = (char *)(uintptr_t)res.d_ptr;
+        memset(p, 1, size);
+
+        // Every page checked must sit on the node asked for.
+        for (size_t offset = 0; offset < size; offset += size / 8) {
+            int pageNode = -1;
+            pass = pass && (syscall(SYS_get_mempolicy, &pageNode, NULL, 0, p + offset, M3_MPOL_F_NODE | M3_MPOL_F_ADDR) == 0);
+            pass = pass && (pageNode == node);
+        }
+        MemMapManager::RequestStats(pInfo, sock_fd, &stats);
+        pass = pass && (stats.nodeUsedBytes[node] >= size);
+        printf("NUMAPLACEMENT: node %d: %lu MiB used by M3, %lu of %lu MiB free\n", node,
+            (unsigned long)(stats.nodeUsedBytes[node] >> 20), (unsigned long)(stats.nodeFreeBytes[node] >> 20),
+            (unsigned long)(stats.nodeTotalBytes[node] >> 20));
+
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        for (int r = 0; r < rep; ++r) {
+            memset(p, r, size);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double writeBandwidth = (double)size * rep / elapsedSeconds(begin, end) / 1e9;
+        volatile uint64_t sum = 0;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        for (int r = 0; r < rep; ++r) {
+            const uint64_t *words = (const uint64_t *)p;
+            uint64_t partial = 0;
+            for (size_t i = 0; i < size / sizeof(uint64_t); ++i) {
+                partial += words[i];
+            }
+            sum += partial;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double readBandwidth = (double)size * rep / elapsedSeconds(begin, end) / 1e9;
+        (node == local ? writeLocal : writeRemote).push_back(writeBandwidth);
+        (node == local ? readLocal : readRemote).push_back(readBandwidth);
+
+        pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, res.d_ptr).status == STATUSCODE_ACK);
+    }
+
+    for (auto &placement : {std::make_pair("local", std::make_pair(&writeLocal, &readLocal)),
+                            std::make_pair("remote", std::make_pair(&writeRemote, &readRemote))}) {
+        if (placement.second.first->empty()) {
+            printf("NUMAPLACEMENT: %-6s no such node\n", placement.first);
+            continue;
+        }
+        double write = 0, read = 0;
+        for (size_t i = 0; i < placement.second.first->size(); ++i) {
+            write += (*placement.second.first)[i];
+            read += (*placement.second.second)[i];
+        }
+        printf("NUMAPLACEMENT: %-6s write %.2f GB/s, read %.2f GB/s\n", placement.first,
+            write / placement.second.first->size(), read / placement.second.first->size());
+    }
+
+    // A node without memory is refused, a node out of range is an invalid request, and the server keeps serving.
+    if (missing >= 0) {
+        MemMapResponse res = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"numa_missing", 0, size, M3_FLAG_NUMA_NODE(missing));
+        pass = pass && (res.status == STATUSCODE_ALLOC_FAILED);
+    }
+    MemMapResponse res = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"numa_missing", 0, size, M3_FLAG_NUMA_NODE(M3_MAX_NUMA_NODES));
+    pass = pass && (res.status == STATUSCODE_INVALID);
+
+    // Reclamation gives the node its memory back.
+    for (int i = 0; i < 100; ++i) {
+        MemMapManager::RequestStats(pInfo, sock_fd, &stats);
+        if (stats.reclaimPendingBytes == 0) {
+            break;
+        }
+        usleep(10000);
+    }
+    for (int node : nodes) {
+        pass = pass && (stats.nodeUsedBytes[node] == 0);
+    }
+
+    close(sock_fd);
+    haltServer(serverPid);
+
+    if (pass) {
+        std::cout << "NUMAPLACEMENT TEST PASSED" << std::endl;
+    } else {
+        std::cout << "NUMAPLACEMENT TEST FAILED" << std::endl;
+    }
+}
+
+// test_Resize() grows a host region of one page to numPages pages, a page at a time, then to 2 * numPages pages at once,
+// and checks that it stays at the same address with its contents. Growth is compared with a copy to a new region.
+// Another process imports the region by the size it was created with, grows it further, and the first one catches up with the growth.
+// Growth beyond the reserved address space must be refused without creating memory, and growth of regions not created resizable,
+// sub-allocated ones included, must fail.
+void test_Resize(int numPages) {
+    MemMapServerOptions options;
+    options.backend = M3_BACKEND_HOST;
+    pid_t serverPid = spawnServer(options);
+    bool pass = true;
+
+    CUUTIL_ERRCHK(cuInit(0));
+    CUcontext ctx;
+    CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, 0));
+    ProcessInfo pInfo;
+    pInfo.SetContext(ctx);
+    int sock_fd = ipcConnect(&server_addr);
+
+    size_t page = MemMapManager::RequestRoundedAllocationSize(pInfo, sock_fd, 1).roundedSize;
+    size_t maxBytes = 4 * numPages * page;
+    MemMapResponse region = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"resize", 0, page, 0, maxBytes);
+    pass = pass && (region.status == STATUSCODE_ACK) && (region.roundedSize == page) && (region.backingId == 0);
+    if (!pass) {
+        std::cout << "RESIZE TEST FAILED" << std::endl;
+        close(sock_fd);
+        haltServer(serverPid);
+        return;
+    }
+    uint64_t *words = (uint64_t *)(uintptr_t)region.d_ptr;
+    const size_t wordsPerPage = page / sizeof(uint64_t);
+    // fillPages() writes the first and last words of pages [begin, end), and checkPages() checks them.
+    auto fillPages = [&](size_t begin, size_t end) {
+        for (size_t p = begin; p < end; ++p) {
+            words[p * wordsPerPage] = p + 1;
+            words[(p + 1) * wordsPerPage - 1] = p + 1;
+        }
+    };
+    auto checkPages = [&](size_t begin, size_t end) {
+        bool ok = true;
+        for (size_t p = begin; p < end; ++p) {
+            ok = ok && (words[p * wordsPerPage] == p + 1) && (words[(p + 1) * wordsPerPage - 1] == p + 1);
+        }
+        return ok;
+    };
+    fillPages(0, 1);
+
+    // A page at a time: the region stays in place, and keeps its contents.
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int p = 1; p < numPages; ++p) {
+        MemMapResponse res = MemMapManager::RequestResize(pInfo, sock_fd, region.d_ptr, (p + 1) * page);
+        pass = pass && (res.status == STATUSCODE_ACK) && (res.d_ptr == region.d_ptr) && (res.roundedSize == (p + 1) * page);
+        fillPages(p, p + 1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double pageSeconds = elapsedSeconds(begin, end) / (numPages - 1);
+    pass = pass && checkPages(0, numPages);
+
+    // All at once: the time goes with the bytes added, not with the bytes already there.
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    MemMapResponse res = MemMapManager::RequestResize(pInfo, sock_fd, region.d_ptr, 2 * numPages * page);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double growSeconds = elapsedSeconds(begin, end);
+    pass = pass && (res.status == STATUSCODE_ACK) && (res.d_ptr == region.d_ptr) && (res.roundedSize == 2 * numPages * page);
+    pass = pass && checkPages(0, numPages);
+    fillPages(numPages, 2 * numPages);
+
+    // The copy a reallocation would make instead.
+    MemMapResponse copy = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"resize_copy", 0, 2 * numPages * page);
+    pass = pass && (copy.status == STATUSCODE_ACK);
+    memset((void *)(uintptr_t)copy.d_ptr, 0, 2 * numPages * page);
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    memcpy((void *)(uintptr_t)copy.d_ptr, words, numPages * page);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double copySeconds = elapsedSeconds(begin, end);
+    pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, copy.d_ptr).status == STATUSCODE_ACK);
+
+    printf("RESIZE: grown a page (%lu KiB) at a time in %.1f us each, by %d pages at once in %.1f us (%.1f us per page)\n",
+        (unsigned long)(page >> 10), pageSeconds * 1e6, numPages, growSeconds * 1e6, growSeconds * 1e6 / numPages);
+    printf("RESIZE: copying the %d pages to a new region takes %.1f us\n", numPages, copySeconds * 1e6);
+
+    // The region is still found by the size it was created with, and another process grows it through its own mapping.
+    // A region created without max_bytes is not resizable, even through a mapping reserving room for it.
+    pass = pass && (MemMapManager::RequestStat(pInfo, sock_fd, region.token).roundedSize == 2 * numPages * page);
+    MemMapResponse fixed = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"resize_fixed", 0, 2 * page);
+    pass = pass && (fixed.status == STATUSCODE_ACK);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        ProcessInfo childInfo;
+        childInfo.SetContext(ctx);
+        int child_fd = ipcConnect(&server_addr);
+        MemMapResponse imported = MemMapManager::RequestAllocate(childInfo, child_fd, (char *)"resize", 0, page, 0, maxBytes);
+        bool childPass = (imported.status == STATUSCODE_ACK) && (imported.token == region.token) &&
+            (imported.roundedSize == 2 * numPages * page);
+        if (childPass) {
+            words = (uint64_t *)(uintptr_t)imported.d_ptr;
+            childPass = checkPages(0, 2 * numPages);
+            MemMapResponse grown = MemMapManager::RequestResize(childInfo, child_fd, imported.d_ptr, 3 * numPages * page);
+            childPass = childPass && (grown.status == STATUSCODE_ACK) && (grown.roundedSize == 3 * numPages * page);
+            fillPages(2 * numPages, 3 * numPages);
+        }
+        childPass = childPass && (MemMapManager::RequestDeAllocate(childInfo, child_fd, imported.d_ptr).status == STATUSCODE_ACK);
+        MemMapResponse fixedImport = MemMapManager::RequestAllocate(childInfo, child_fd, (char *)"resize_fixed", 0, 2 * page, 0, maxBytes);
+        childPass = childPass && (fixedImport.status == STATUSCODE_ACK) && (fixedImport.token == fixed.token);
+        childPass = childPass && (MemMapManager::RequestResize(childInfo, child_fd, fixedImport.d_ptr, 4 * page).status == STATUSCODE_INVALID);
+        childPass = childPass && (MemMapManager::RequestDeAllocate(childInfo, child_fd, fixedImport.d_ptr).status == STATUSCODE_ACK);
+        close(child_fd);
+        exit(childPass ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    int wStat;
+    waitpid(pid, &wStat, 0);
+    pass = pass && WIFEXITED(wStat) && WEXITSTATUS(wStat) == EXIT_SUCCESS;
+    pass = pass && (MemMapManager::RequestStat(pInfo, sock_fd, fixed.token).roundedSize == 2 * page);
+    pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, fixed.d_ptr).status == STATUSCODE_ACK);
+    res = MemMapManager::RequestResize(pInfo, sock_fd, region.d_ptr, 0);
+    pass = pass && (res.status == STATUSCODE_ACK) && (res.roundedSize == 3 * numPages * page);
+    pass = pass && checkPages(0, 3 * numPages);
+
+    // The region cannot outgrow the reservation of the mapping: the server refuses, and creates nothing.
+    MemMapStats before, after;
+    MemMapManager::RequestStats(pInfo, sock_fd, &before);
+    res = MemMapManager::RequestResize(pInfo, sock_fd, region.d_ptr, maxBytes + page);
+    pass = pass && (res.status == STATUSCODE_INVALID);
+    MemMapManager::RequestStats(pInfo, sock_fd, &after);
+    pass = pass && (after.deviceUsedBytes[region.device] == before.deviceUsedBytes[region.device]);
+    pass = pass && (MemMapManager::RequestStat(pInfo, sock_fd, region.token).roundedSize == 3 * numPages * page);
+    res = MemMapManager::RequestResize(pInfo, sock_fd, region.d_ptr, maxBytes);
+    pass = pass && (res.status == STATUSCODE_ACK) && (res.roundedSize == maxBytes);
+    pass = pass && checkPages(0, 3 * numPages);
+
+    // Nor can sub-allocated regions.
+    MemMapResponse small = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"resize_small", 0, 1000);
+    pass = pass && (small.status == STATUSCODE_ACK) && (small.backingId != 0);
+    pass = pass && (MemMapManager::RequestResize(pInfo, sock_fd, small.d_ptr, 2 * page).status == STATUSCODE_INVALID);
+    pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, small.d_ptr).status == STATUSCODE_ACK);
+
+    pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, region.d_ptr).status == STATUSCODE_ACK);
+    pass = pass && (MemMapManager::RequestResize(pInfo, sock_fd, region.d_ptr, 0).status == STATUSCODE_INVALID);
+
+    close(sock_fd);
+    haltServer(serverPid);
+
+    if (pass) {
+        std::cout << "RESIZE TEST PASSED" << std::endl;
+    } else {
+        std::cout << "RESIZE TEST FAILED" << std::endl;
+    }
+}
+
+// test_Sparse() declares a host region of 16 * numPages pages, and commits numPages scattered pages of it one at a time,
+// then a range overlapping committed pages. The server must only hold the committed pages.
+// Another process imports the region, maps every committed page (more than a response lists) and commits one more,
+// which the first process then maps. Dense regions, ranges beyond the region, growth and batches are refused.
+void test_Sparse(int numPages) {
+    MemMapServerOptions options;
+    options.backend = M3_BACKEND_HOST;
+    pid_t serverPid = spawnServer(options);
+    bool pass = true;
+
+    CUUTIL_ERRCHK(cuInit(0));
+    CUcontext ctx;
+    CUUTIL_ERRCHK(cuCtxCreate(&ctx, 0, 0));
+    ProcessInfo pInfo;
+    pInfo.SetContext(ctx);
+    int sock_fd = ipcConnect(&server_addr);
+
+    // usedBytes() waits for reclamation, and returns the memory held by the server.
+    MemMapStats stats;
+    auto usedBytes = [&]() {
+        for (int i = 0; i < 100; ++i) {
+            MemMapManager::RequestStats(pInfo, sock_fd, &stats);
+            if (stats.reclaimPendingBytes == 0) {
+                break;
+            }
+            usleep(10000);
+        }
+        return stats.deviceUsedBytes[0];
+    };
+    size_t usedBefore = usedBytes();
+
+    size_t page = MemMapManager::RequestRoundedAllocationSize(pInfo, sock_fd, 1).roundedSize;
+    size_t numDeclared = 16 * numPages;
+    MemMapResponse region = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"sparse", 0, numDeclared * page, M3_FLAG_SPARSE);
+    pass = pass && (region.status == STATUSCODE_ACK) && (region.roundedSize == numDeclared * page) && (region.commitSize == page);
+    if (!pass) {
+        std::cout << "SPARSE TEST FAILED" << std::endl;
+        close(sock_fd);
+        haltServer(serverPid);
+        return;
+    }
+    pass = pass && (usedBytes() == usedBefore + page);
+    uint64_t *words = (uint64_t *)(uintptr_t)region.d_ptr;
+    const size_t wordsPerPage = page / sizeof(uint64_t);
+    words[0] = 1;
+
+    // A page at a time, from a few bytes inside it.
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int i = 0; i < numPages; ++i) {
+        size_t p = 16 * i + 5;
+        MemMapResponse res = MemMapManager::RequestCommit(pInfo, sock_fd, region.d_ptr, p * page + 100, 10);
+        pass = pass && (res.status == STATUSCODE_ACK) && (res.roundedSize == (i + 2) * page);
+        words[p * wordsPerPage] = p + 1;
+        words[(p + 1) * wordsPerPage - 1] = p + 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double commitSeconds = elapsedSeconds(begin, end) / numPages;
+    pass = pass && (usedBytes() == usedBefore + (numPages + 1) * page);
+
+    // A range over committed pages only commits the missing ones.
+    MemMapResponse res = MemMapManager::RequestCommit(pInfo, sock_fd, region.d_ptr, 0, 8 * page);
+    pass = pass && (res.status == STATUSCODE_ACK) && (res.roundedSize == (numPages + 7) * page);
+    pass = pass && (words[0] == 1) && (words[5 * wordsPerPage] == 6);
+    pass = pass && (usedBytes() == usedBefore + (numPages + 7) * page);
+
+    // Another process maps every committed page, and commits the last page of the region.
+    double syncSeconds = 0;
+    int syncPipe[2];
+    pass = pass && (pipe(syncPipe) == 0);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        ProcessInfo childInfo;
+        childInfo.SetContext(ctx);
+        int child_fd = ipcConnect(&server_addr);
+        MemMapResponse imported = MemMapManager::RequestImport(childInfo, child_fd, region.token);
+        bool childPass = (imported.status == STATUSCODE_ACK) && (imported.commitSize == page);
+        if (childPass) {
+            uint64_t *childWords = (uint64_t *)(uintptr_t)imported.d_ptr;
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            MemMapResponse synced = MemMapManager::RequestCommit(childInfo, child_fd, imported.d_ptr, 0, 0);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double seconds = elapsedSeconds(begin, end);
+            childPass = (synced.status == STATUSCODE_ACK) && (synced.roundedSize == (numPages + 7) * page);
+            for (int i = 0; i < numPages && childPass; ++i) {
+                size_t p = 16 * i + 5;
+                childPass = (childWords[p * wordsPerPage] == p + 1) && (childWords[(p + 1) * wordsPerPage - 1] == p + 1);
+            }
+            MemMapResponse last = MemMapManager::RequestCommit(childInfo, child_fd, imported.d_ptr, (numDeclared - 1) * page, page);
+            childPass = childPass && (last.status == STATUSCODE_ACK) && (last.roundedSize == (numPages + 8) * page);
+            childWords[(numDeclared - 1) * wordsPerPage] = 42;
+            childPass = childPass && (write(syncPipe[1], &seconds, sizeof(seconds)) == sizeof(seconds));
+        }
+        childPass = childPass && (MemMapManager::RequestDeAllocate(childInfo, child_fd, imported.d_ptr).status == STATUSCODE_ACK);
+        close(child_fd);
+        exit(childPass ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    int wStat;
+    waitpid(pid, &wStat, 0);
+    pass = pass && WIFEXITED(wStat) && WEXITSTATUS(wStat) == EXIT_SUCCESS;
+    pass = pass && (read(syncPipe[0], &syncSeconds, sizeof(syncSeconds)) == sizeof(syncSeconds));
+    close(syncPipe[0]);
+    close(syncPipe[1]);
+    res = MemMapManager::RequestCommit(pInfo, sock_fd, region.d_ptr, numPages * page, 0);
+    pass = pass && (res.status == STATUSCODE_ACK) && (res.roundedSize == (numPages + 8) * page);
+    pass = pass && (words[(numDeclared - 1) * wordsPerPage] == 42);
+
+    printf("SPARSE: %lu MiB declared, %lu MiB committed; a page committed and mapped in %.1f us\n",
+        (unsigned long)(numDeclared * page >> 20), (unsigned long)((usedBytes() - usedBefore) >> 20), commitSeconds * 1e6);
+    printf("SPARSE: an importer maps %d committed pages in %.1f us\n", numPages + 7, syncSeconds * 1e6);
+
+    // Dense regions have nothing to commit, and sparse ones neither grow nor get batched.
+    MemMapResponse dense = MemMapManager::RequestAllocate(pInfo, sock_fd, (char *)"sparse_dense", 0, page);
+    pass = pass && (dense.status == STATUSCODE_ACK) && (dense.commitSize == 0);
+    pass = pass && (MemMapManager::RequestCommit(pInfo, sock_fd, dense.d_ptr, 0, page).status == STATUSCODE_INVALID);
+    pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, dense.d_ptr).status == STATUSCODE_ACK);
+    pass = pass && (MemMapManager::RequestCommit(pInfo, sock_fd, region.d_ptr, numDeclared * page, page).status == STATUSCODE_INVALID);
+    pass = pass && (MemMapManager::RequestResize(pInfo, sock_fd, region.d_ptr, (numDeclared + 1) * page).status == STATUSCODE_INVALID);
+    std::vector<MemMapBatchEntry> entries(1);
+    strncpy(entries[0].memId, "sparse", MAX_MEMID_LEN);
+    entries[0].size = numDeclared * page;
+    entries[0].alignment = 0;
+    std::vector<MemMapResponse> batch = MemMapManager::RequestAllocateBatch(pInfo, sock_fd, entries);
+    pass = pass && (batch.size() == 1) && (batch[0].status != STATUSCODE_ACK);
+
+    // Every committed page goes back to the server.
+    pass = pass && (MemMapManager::RequestDeAllocate(pInfo, sock_fd, region.d_ptr).status == STATUSCODE_ACK);
+    pass = pass && (usedBytes() == usedBefore);
+
+    close(sock_fd);
+    haltServer(serverPid);
+
+    if (pass) {
+        std::cout << "SPARSE TEST PASSED" << std::endl;
+    } else {
+        std::cout << "SPARSE TEST FAILED" << std::endl;
+    }
+}